@@ -0,0 +1,86 @@
+/*
+Adaptive passes (parameter isAdaptivePasses.)
+
+The fixed schedule of passes.h repeats (a prefix of) the target whether or not its points can be bettered.
+Instead, each pass after the first revisits only the target points that got a new source in the previous pass.
+
+synthesize() marks, in a bitmap over the target (changedMap), each point it gives a new source.
+Before each pass after the first, the refiner keeps (in the pass order) only the marked points, and clears the map.
+Passes stop when no point is marked (converged), as well as on terminateFraction or the time budget.
+
+A point is in its own patch (the first of the sorted offsets), so these are the points whose patch changed most.
+A point that kept its source usually keeps it, even when its neighbors change.
+Also marking the neighbors of changed points (squares of radius 1 to sqrt(patchSize)) revisited nearly every point
+in every pass, more work than the fixed schedule, for no better result.
+
+  Copyright (C) 2010, 2011  Lloyd Konneker
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Mark a point given a new source, to revisit it next pass
+static inline void
+markChanged(
+  Coordinates position,
+  Map *changedMap
+  )
+{
+  guint32 bit;
+  guint32 *word = bitmap_index(changedMap, position, &bit);
+  
+#ifdef SYNTH_THREADED
+  // Relaxed: the map is only read after all threads finish the pass
+  __atomic_fetch_or(word, bit, __ATOMIC_RELAXED);
+#else
+  *word |= bit;
+#endif
+}
+
+
+/*
+Target points of the next adaptive pass: those of passPoints marked in changedMap, in the same order.
+Clears changedMap for the next pass to mark.
+Caller must free the result.
+*/
+static pointVector
+changedPassPoints(
+  pointVector passPoints,
+  Map *changedMap
+  )
+{
+  pointVector result = g_array_sized_new(FALSE, TRUE, sizeof(Coordinates), passPoints->len);
+  guint wordCount = (changedMap->width * changedMap->height + 31) / 32;
+  guint i;
+  
+  for (i=0; i<passPoints->len; i++)
+  {
+    Coordinates point = g_array_index(passPoints, Coordinates, i);
+    guint32 bit;
+    
+    if (*bitmap_index(changedMap, point, &bit) & bit)
+      g_array_append_val(result, point);
+  }
+  for (i=0; i<wordCount; i++)
+    g_array_index(changedMap->data, guint32, i) = 0;
+  return result;
+}
+
+
+// Whether the time budget (a deadline in g_get_monotonic_time() microseconds, or 0 for none) is spent
+static inline gboolean
+isPastDeadline(gint64 deadline)
+{
+  return deadline && g_get_monotonic_time() >= deadline;
+}
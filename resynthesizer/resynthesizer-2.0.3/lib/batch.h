@@ -0,0 +1,422 @@
+/*
+Batch healing: many small, separate targets in one call, e.g. removing dust and spots.
+
+Healing hundreds of spots by one engine call per spot (or one call for all of them)
+costs for each call the engine's maps of the whole images (hasValueMap, sourceOfMap, recentProberMap)
+and the preparation of the whole corpus: the time is the image size times the count of calls.
+
+Here the target is split into regions: the connected sets of target points (8-connected.)
+Each region is synthesized by the usual engine (engineLevels()) on small windows, as a tile is (see tiles.h):
+- the target window: the region's bounding box and a band (IMAGE_SYNTH_TILE_BAND) of context around it
+- the corpus window: around the region, grown until it has as many corpus points as the region has target points
+Only the region's own target points are copied back into the target image.
+So the time is about the healed area (and the bands), plus one scan of the target image to find the regions.
+
+Regions are merged into one region when the target window of one overlaps the bounds of the other
+(the other's target points would be holes in its context, changing as the other is synthesized.)
+Windows are grown equally on all sides, so then also the other way round.
+Then no target window holds the target points of another region.
+So regions are independent: their windows are copied from the target image
+and their results are pasted into disjoint pixels of it.
+With threads (SYNTH_THREADED), regions are synthesized concurrently by a worker pool (see workerPool.h),
+each by one thread (the engine of a small region has too few target points to divide among threads.)
+Largest regions first, so the last regions done are small.
+
+Each region's random streams differ (seed plus the region's index, in a deterministic order of regions),
+else regions of similar surroundings would repeat each other.
+Results do not depend on the count of threads: each region's engine orders its target points
+by its own GRand (with glibProxy too, see glibProxy.h) and synthesizes in its own thread.
+Except a batch merged into one region: then the engine's threads synthesize it, as without batching.
+
+Progress is reported between rounds of regions, by the calling thread.
+With threads, parameters.stats and the pass stats callback are not used: regions are not passes of one engine.
+
+Included in engine.c, not compiled separately.
+
+  Copyright (C) 2010, 2011  Lloyd Konneker
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+// Regions per thread per round: between rounds, progress and cancel
+#define BATCH_REGIONS_PER_ROUND 8
+
+typedef struct batchRegionStruct {
+  TTileRect bounds;   // Of its target points
+  guint count;        // Of its target points
+} TBatchRegion;
+
+
+static gboolean
+isRectIntersecting(
+  const TTileRect *a,
+  const TTileRect *b
+  )
+{
+  return a->x < b->x + (gint) b->width && b->x < a->x + (gint) a->width
+    && a->y < b->y + (gint) b->height && b->y < a->y + (gint) a->height;
+}
+
+
+// Smallest rect holding both
+static TTileRect
+unionRect(
+  const TTileRect *a,
+  const TTileRect *b
+  )
+{
+  TTileRect rect;
+  gint right = MAX(a->x + (gint) a->width, b->x + (gint) b->width);
+  gint bottom = MAX(a->y + (gint) a->height, b->y + (gint) b->height);
+
+  rect.x = MIN(a->x, b->x);
+  rect.y = MIN(a->y, b->y);
+  rect.width = right - rect.x;
+  rect.height = bottom - rect.y;
+  return rect;
+}
+
+
+/*
+Connected sets of target points, by flood fill (breadth first.)
+Returns a vector of TBatchRegion, unmerged.
+The queue is not emptied between sets: it grows to the count of target points, as the engine's vector of them does.
+Both vectors are reserved for the count of target points (each region has at least one):
+glibProxy's arrays do not grow.
+*/
+static GArray *
+findTargetComponents(Map *targetMap)
+{
+  GArray *regions;
+  pointVector queue;
+  guint head = 0;
+  guint size = 0;
+  Map visitedMap;
+  guint x;
+  guint y;
+
+  /* Count selected pixels in the image, for sizing vectors */
+  for (y=0; y<targetMap->height; y++)
+    for (x=0; x<targetMap->width; x++)
+    {
+      Coordinates coords = {x, y};
+      if (isSelectedTarget(coords, targetMap))
+        size++;
+    }
+  regions = g_array_sized_new(FALSE, TRUE, sizeof(TBatchRegion), size);
+  queue = g_array_sized_new(FALSE, TRUE, sizeof(Coordinates), size);
+
+  new_pixmap(&visitedMap, targetMap->width, targetMap->height, 1);
+  for (y=0; y<targetMap->height; y++)
+    for (x=0; x<targetMap->width; x++)
+    {
+      Coordinates coords = {x, y};
+      *pixmap_index(&visitedMap, coords) = FALSE;
+    }
+
+  for (y=0; y<targetMap->height; y++)
+    for (x=0; x<targetMap->width; x++)
+    {
+      Coordinates seed = {x, y};
+      gint minX = x;
+      gint minY = y;
+      gint maxX = x;
+      gint maxY = y;
+      TBatchRegion region;
+
+      if ( *pixmap_index(&visitedMap, seed) || ! isSelectedTarget(seed, targetMap) ) continue;
+
+      region.count = 0;
+      *pixmap_index(&visitedMap, seed) = TRUE;
+      g_array_append_val(queue, seed);
+      while (head < queue->len)
+      {
+        Coordinates point = g_array_index(queue, Coordinates, head);
+        gint dx;
+        gint dy;
+
+        head++;
+        region.count++;
+        minX = MIN(minX, point.x);
+        minY = MIN(minY, point.y);
+        maxX = MAX(maxX, point.x);
+        maxY = MAX(maxY, point.y);
+        for (dy=-1; dy<=1; dy++)
+          for (dx=-1; dx<=1; dx++)
+          {
+            Coordinates neighbor = {point.x + dx, point.y + dy};
+
+            if ( neighbor.x < 0 || neighbor.y < 0
+              || neighbor.x >= (gint) targetMap->width || neighbor.y >= (gint) targetMap->height )
+              continue;
+            if ( *pixmap_index(&visitedMap, neighbor) || ! isSelectedTarget(neighbor, targetMap) ) continue;
+            *pixmap_index(&visitedMap, neighbor) = TRUE;
+            g_array_append_val(queue, neighbor);
+          }
+      }
+      region.bounds.x = minX;
+      region.bounds.y = minY;
+      region.bounds.width = maxX - minX + 1;
+      region.bounds.height = maxY - minY + 1;
+      g_array_append_val(regions, region);
+    }
+
+  free_map(&visitedMap);
+  g_array_free(queue, TRUE);
+  return regions;
+}
+
+
+/*
+Merge regions when the target window of one overlaps the bounds of the other, until none do.
+Merging grows a bounding box, which can then overlap another region: so repeat.
+A region merged into another is left with count 0.
+Returns count of regions left.
+Quadratic in the count of regions, small beside synthesis for the hundreds of a batch.
+*/
+static guint
+mergeOverlappingRegions(
+  Map *targetMap,
+  GArray *regions
+  )
+{
+  guint regionCount = regions->len;
+  gboolean isMerged = TRUE;
+
+  while (isMerged)
+  {
+    guint i;
+
+    isMerged = FALSE;
+    for (i=0; i<regions->len; i++)
+    {
+      TBatchRegion *region = &g_array_index(regions, TBatchRegion, i);
+      TTileRect window;
+      guint j;
+
+      if ( ! region->count ) continue;
+      window = growTileRect(&region->bounds, IMAGE_SYNTH_TILE_BAND, targetMap);
+      for (j=i+1; j<regions->len; j++)
+      {
+        TBatchRegion *other = &g_array_index(regions, TBatchRegion, j);
+
+        if ( ! other->count ) continue;
+        if (isRectIntersecting(&window, &other->bounds))
+        {
+          region->bounds = unionRect(&region->bounds, &other->bounds);
+          region->count += other->count;
+          other->count = 0;
+          window = growTileRect(&region->bounds, IMAGE_SYNTH_TILE_BAND, targetMap);
+          regionCount--;
+          isMerged = TRUE;
+        }
+      }
+    }
+  }
+  return regionCount;
+}
+
+
+// Largest first (so merged regions, of count 0, last), then in row major order of their bounds: deterministic
+static gint
+compareRegions(
+  const void *a,
+  const void *b
+  )
+{
+  const TBatchRegion *ra = (const TBatchRegion *) a;
+  const TBatchRegion *rb = (const TBatchRegion *) b;
+
+  if (ra->count != rb->count) return (ra->count > rb->count) ? -1 : 1;
+  if (ra->bounds.y != rb->bounds.y) return (ra->bounds.y < rb->bounds.y) ? -1 : 1;
+  if (ra->bounds.x != rb->bounds.x) return (ra->bounds.x < rb->bounds.x) ? -1 : 1;
+  return 0;
+}
+
+
+// Progress of one region's engine is not reported, only of the batch, between rounds
+static void
+batchRegionProgress(
+  int percent,
+  void *contextInfo
+  )
+{
+}
+
+
+// What synthesis of any region needs
+typedef struct batchArgsStruct {
+  TImageSynthParameters parameters;
+  TFormatIndices* indices;
+  Map* targetMap;
+  Map* corpusMap;
+  GArray *regions;
+  guint startRegion;  // Of this round
+  int *errors;        // Per region
+  gint64 deadline;
+  int *cancelFlag;
+} TBatchArgs;
+
+
+/*
+Synthesize one region in its windows, and paste its target points into the target image.
+Returns error.
+*/
+static int
+synthesizeRegion(
+  TBatchArgs *args,
+  guint regionIndex
+  )
+{
+  TBatchRegion *region = &g_array_index(args->regions, TBatchRegion, regionIndex);
+  TImageSynthParameters regionParameters = args->parameters;
+  TTileRect targetWindow = growTileRect(&region->bounds, IMAGE_SYNTH_TILE_BAND, args->targetMap);
+  TTileRect corpusWindow;
+  Map regionTargetMap;
+  Map regionCorpusMap;
+  int error;
+
+  if ( ! prepareTileCorpusWindow(args->indices, args->targetMap, args->corpusMap,
+    MAX(region->bounds.width, region->bounds.height), &region->bounds, region->count, &corpusWindow) )
+    return IMAGE_SYNTH_ERROR_EMPTY_CORPUS;
+  copyPixmapWindow(args->targetMap, &targetWindow, &regionTargetMap);
+  copyPixmapWindow(args->corpusMap, &corpusWindow, &regionCorpusMap);
+
+  regionParameters.seed = args->parameters.seed + regionIndex;
+  error = engineLevels(regionParameters, args->indices, &regionTargetMap, &regionCorpusMap, NULL, NULL, NULL,
+    args->deadline, batchRegionProgress, NULL, args->cancelFlag);
+  if ( ! error )
+    pasteTileTarget(args->indices, args->targetMap, &region->bounds, &regionTargetMap, &targetWindow);
+  free_map(&regionTargetMap);
+  free_map(&regionCorpusMap);
+  // Canceled while preparing the region: not an error, as when canceled between regions
+  return (error == IMAGE_SYNTH_ERROR_CANCELED) ? 0 : error;
+}
+
+
+#ifdef SYNTH_THREADED
+// Job of the worker pool: regions [start, end) of the round, one per chunk
+static gulong
+synthesizeRegions(
+  void *uncastArgs,
+  guint threadIndex,
+  guint start,
+  guint end
+  )
+{
+  TBatchArgs *args = (TBatchArgs *) uncastArgs;
+  guint i;
+
+  for (i=args->startRegion + start; i<args->startRegion + end; i++)
+    args->errors[i] = synthesizeRegion(args, i);
+  return 0;
+}
+#endif
+
+
+static int
+engineBatchRegions(
+  TImageSynthParameters parameters,
+  TFormatIndices* indices,
+  Map* targetMap,
+  Map* corpusMap,
+  void (*progressCallback)(int, void*),
+  void *contextInfo,
+  int *cancelFlag
+  )
+{
+  TBatchArgs args;
+  GArray *regions;
+  guint regionCount;
+  guint64 countTarget = 0;
+  guint64 countDone = 0;
+  guint roundSize = BATCH_REGIONS_PER_ROUND;
+  guint i;
+  int error = 0;
+#ifdef SYNTH_THREADED
+  TWorkerPool pool;
+  guint threadCount = 0;
+#endif
+
+  resetEngineStats(parameters.stats);
+  regions = findTargetComponents(targetMap);
+  if ( ! regions->len )
+  {
+    g_array_free(regions, TRUE);
+    return IMAGE_SYNTH_ERROR_EMPTY_TARGET;
+  }
+  {
+  TTileRect wholeCorpus = {0, 0, corpusMap->width, corpusMap->height};
+  if ( ! countCorpusPointsIn(indices, corpusMap, &wholeCorpus) )
+  {
+    g_array_free(regions, TRUE);
+    return IMAGE_SYNTH_ERROR_EMPTY_CORPUS;
+  }
+  }
+  regionCount = mergeOverlappingRegions(targetMap, regions);
+  g_array_sort(regions, compareRegions);
+  for (i=0; i<regionCount; i++)
+    countTarget += g_array_index(regions, TBatchRegion, i).count;
+
+  args.parameters = parameters;
+  args.indices = indices;
+  args.targetMap = targetMap;
+  args.corpusMap = corpusMap;
+  args.regions = regions;
+  args.errors = g_new0(int, regionCount);
+  args.deadline = parameters.timeBudget ? g_get_monotonic_time() + (gint64) parameters.timeBudget * 1000 : 0;
+  args.cancelFlag = cancelFlag;
+
+#ifdef SYNTH_THREADED
+  if (regionCount > 1)
+  {
+    threadCount = newWorkerPool(&pool, workerPoolThreadCount(parameters.threadCount, regionCount, 1));
+    roundSize = MAX(threadCount, 1) * BATCH_REGIONS_PER_ROUND;
+    // Threads are for regions, not within a region
+    args.parameters.threadCount = 1;
+    args.parameters.stats = NULL;
+    args.parameters.passStatsCallback = NULL;
+  }
+#endif
+
+  for (args.startRegion=0; args.startRegion<regionCount && ! isCanceled(cancelFlag); args.startRegion+=roundSize)
+  {
+    guint endRegion = MIN(args.startRegion + roundSize, regionCount);
+
+#ifdef SYNTH_THREADED
+    if (threadCount)
+      runWorkerPool(&pool, synthesizeRegions, &args, endRegion - args.startRegion, 1);
+    else
+#endif
+    for (i=args.startRegion; i<endRegion; i++)
+      args.errors[i] = synthesizeRegion(&args, i);
+
+    for (i=args.startRegion; i<endRegion; i++)
+    {
+      if ( ! error ) error = args.errors[i];
+      countDone += g_array_index(regions, TBatchRegion, i).count;
+    }
+    if (error) break;
+    progressCallback((int) (countDone * 100 / countTarget), contextInfo);
+  }
+
+#ifdef SYNTH_THREADED
+  if (threadCount) freeWorkerPool(&pool);
+#endif
+  g_free(args.errors);
+  g_array_free(regions, TRUE);
+  return error;
+}
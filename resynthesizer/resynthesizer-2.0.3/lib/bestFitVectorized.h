@@ -0,0 +1,506 @@
+/*
+SIMD kernels for the innermost loop of resynthesizer: the patch difference in computeBestFit().
+
+The scalar loop sums table lookups one pixelel at a time, one neighbor at a time.
+These kernels score several neighbors of a candidate corpus point per instruction:
+4 neighbors (SSE4.1) or 8 neighbors (AVX2.)
+Which kernel is used is decided at runtime (CPU feature detection) in prepareBestFitKernel(),
+so the engine can be built for a generic x86 target and still use AVX2 where present.
+
+The metric is still the quantized table metric (see matchWeighting.h).
+Only the order of summation changes, and integer addition is exact,
+so the sum is bit-identical to the scalar sum.
+
+Early out:
+The scalar loop quits when a partial sum reaches bestPatchDiff.
+Here we test the partial sum after each group of neighbors.
+Since every term is non-negative, the partial sum never decreases,
+so a candidate rejected by the scalar loop is rejected here, and vice versa.
+Results do not change, only the granularity of the early out.
+
+The kernels need:
+- the patch repacked as vectors (TNeighborVectors), prepared once per target point
+  and used for every probe of that target point (typically hundreds of probes.)
+- a copy of corpusTargetMetric widened to 32-bit, so AVX2 can gather from it.
+- a few bytes of padding after the corpus pixmap, since a gather reads four bytes
+  at a time, possibly past the last pixelel (see IMAGE_SYNTH_PIXMAP_PAD in mapOps.h.)
+
+Where no SIMD kernel applies (not x86, or an old CPU), a portable kernel (bestFitSumPlanar)
+reads a planar copy of the corpus (see corpusPlanes.h) and the same repacked patch:
+contiguous offsets and values per neighbor, and one aligned word per neighbor for mask and colors,
+instead of clipping and indexing the interleaved pixmap twice per neighbor.
+The SIMD kernels keep reading the interleaved pixmap: a gather already fetches mask and colors at once.
+
+Included in synthesize.h, not compiled separately.
+
+  Copyright (C) 2010, 2011  Lloyd Konneker
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#if defined(SYNTH_SIMD_KERNELS) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define SYNTH_SIMD_KERNELS_X86
+  #include <immintrin.h>
+#endif
+
+#include "corpusPlanes.h"
+#include "corpusBounds.h"
+
+// Width of the widest kernel, in neighbors.  Vectors are padded to a multiple of this.
+#define BEST_FIT_VECTOR_LANES 8
+
+/*
+Patch (neighbors) as a structure of arrays, for the kernels.
+Padding lanes (index >= count) have active == 0 and contribute nothing to the sum.
+*/
+typedef struct neighborVectorsStruct {
+  gint offsetX[IMAGE_SYNTH_MAX_NEIGHBORS] __attribute__((aligned(32)));
+  gint offsetY[IMAGE_SYNTH_MAX_NEIGHBORS] __attribute__((aligned(32)));
+  // Offset in bytes from the corpus pixel at the patch center to the corpus pixel under this neighbor
+  gint byteOffset[IMAGE_SYNTH_MAX_NEIGHBORS] __attribute__((aligned(32)));
+  // Same, in the corpus planes (pixelels, rows of stride)
+  gint planeOffset[IMAGE_SYNTH_MAX_NEIGHBORS] __attribute__((aligned(32)));
+  gint active[IMAGE_SYNTH_MAX_NEIGHBORS] __attribute__((aligned(32)));      // -1 if a neighbor, 0 if padding
+  gint colorActive[IMAGE_SYNTH_MAX_NEIGHBORS] __attribute__((aligned(32))); // -1 if color is matched (not the 0th neighbor)
+  // LIMIT_DOMAIN plus the target pixelel, so that value minus corpus pixelel indexes a metric table
+  gint value[MAX_IMAGE_SYNTH_BPP][IMAGE_SYNTH_MAX_NEIGHBORS] __attribute__((aligned(32)));
+  guint paddedCount;
+  guint count;
+  // Bounding box of the offsets
+  Coordinates minOffset;
+  Coordinates maxOffset;
+  TPatchBound bound;    // For every kernel, and computeBestFit()
+} TNeighborVectors;
+
+struct bestFitKernelStruct;
+
+/*
+Returns the patch difference, or any value not less than bestPatchDiff if the candidate is rejected early.
+When rejected, rejectedAt is the index of the neighbor whose difference made the sum reach bestPatchDiff,
+as for the scalar loop, for TSynthCounters.
+(The AVX2 and SSE4.1 kernels compare a block of 8 or 4 neighbors, then find it in the block that reached it.)
+*/
+typedef guint (*TBestFitSumFunc)(
+  const struct bestFitKernelStruct *kernel,
+  const TNeighborVectors *neighborVectors,
+  const TFormatIndices *indices,
+  const Map *corpusMap,
+  Coordinates point,
+  guint bestPatchDiff,
+  guint *rejectedAt     // OUT
+  );
+
+/*
+Kernel selected at runtime, and its tables.
+Prepared once per engine() call, read-only afterwards, shared by threads.
+*/
+typedef struct bestFitKernelStruct {
+  TBestFitSumFunc sum;   // NULL means use the scalar computeBestFit()
+  guint corpusTargetMetric[2*LIMIT_DOMAIN] __attribute__((aligned(32)));  // Widened copy of TPixelelMetricFunc
+  const guint *mapsMetric;
+  guint penalty;         // Weighted difference for a neighbor that is clipped or masked in the corpus
+  TCorpusPlanes planes;  // Only for the planar kernel
+  TCorpusBounds bounds;  // For every kernel, and computeBestFit()
+} TBestFitKernel;
+
+
+#ifdef SYNTH_SIMD_KERNELS_X86
+
+// Horizontal sum of eight 32-bit lanes
+__attribute__((target("avx2")))
+static inline guint
+horizontalSumAVX2(__m256i v)
+{
+  __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1,0,3,2)));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2,3,0,1)));
+  return (guint) _mm_cvtsi128_si32(s);
+}
+
+/*
+Eight neighbors per iteration.
+Corpus pixels and metric values are fetched by masked gathers,
+so lanes for neighbors outside the corpus never touch memory.
+*/
+__attribute__((target("avx2")))
+static guint
+bestFitSumAVX2(
+  const TBestFitKernel *kernel,
+  const TNeighborVectors *neighborVectors,
+  const TFormatIndices *indices,
+  const Map *corpusMap,
+  Coordinates point,
+  guint bestPatchDiff,
+  guint *rejectedAt     // OUT
+  )
+{
+  const int *corpusData = (const int *) corpusMap->data->data;
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i minusOne = _mm256_set1_epi32(-1);
+  const __m256i lowByte = _mm256_set1_epi32(0xFF);
+  const __m256i selected = _mm256_set1_epi32(MASK_TOTALLY_SELECTED);
+  const __m256i penalty = _mm256_set1_epi32((int) kernel->penalty);
+  const __m256i width = _mm256_set1_epi32((int) corpusMap->width);
+  const __m256i height = _mm256_set1_epi32((int) corpusMap->height);
+  const __m256i pointX = _mm256_set1_epi32(point.x);
+  const __m256i pointY = _mm256_set1_epi32(point.y);
+  const __m256i pointByte = _mm256_set1_epi32((point.x + point.y * (gint) corpusMap->width) * (gint) corpusMap->depth);
+  guint sum = 0;
+  guint i;
+
+  for (i=0; i<neighborVectors->paddedCount; i+=8)
+  {
+    __m256i x = _mm256_add_epi32(pointX, _mm256_load_si256((const __m256i*) &neighborVectors->offsetX[i]));
+    __m256i y = _mm256_add_epi32(pointY, _mm256_load_si256((const __m256i*) &neighborVectors->offsetY[i]));
+    __m256i active = _mm256_load_si256((const __m256i*) &neighborVectors->active[i]);
+    __m256i address = _mm256_add_epi32(pointByte, _mm256_load_si256((const __m256i*) &neighborVectors->byteOffset[i]));
+    __m256i inCorpus, valid, lanes, accumulator, pixelLow, pixelHigh;
+    TPixelelIndex j;
+
+    // Not clipped: 0 <= x < width and 0 <= y < height
+    inCorpus = _mm256_and_si256(
+      _mm256_and_si256(_mm256_cmpgt_epi32(x, minusOne), _mm256_cmpgt_epi32(width, x)),
+      _mm256_and_si256(_mm256_cmpgt_epi32(y, minusOne), _mm256_cmpgt_epi32(height, y)));
+    inCorpus = _mm256_and_si256(inCorpus, active);
+
+    /*
+    Gather whole pixels, four pixelels per lane: mask and usually all color pixelels.
+    A second gather only if map pixelels lie beyond the first four.
+    */
+    pixelLow = _mm256_mask_i32gather_epi32(zero, corpusData, address, inCorpus, 1);
+    if (indices->map_end_bip > 4)
+      pixelHigh = _mm256_mask_i32gather_epi32(zero, corpusData, _mm256_add_epi32(address, _mm256_set1_epi32(4)), inCorpus, 1);
+    else
+      pixelHigh = zero;
+
+    // Not masked: the mask pixelel is totally selected
+    valid = _mm256_and_si256(_mm256_cmpeq_epi32(_mm256_and_si256(pixelLow, lowByte), selected), inCorpus);
+
+    // Clipped or masked neighbors get the maximum weighted difference
+    accumulator = _mm256_and_si256(_mm256_andnot_si256(valid, active), penalty);
+
+    lanes = _mm256_and_si256(valid, _mm256_load_si256((const __m256i*) &neighborVectors->colorActive[i]));
+    for (j=FIRST_PIXELEL_INDEX; j<indices->colorEndBip; j++)
+    {
+      __m256i corpusPixelel = _mm256_and_si256(
+        _mm256_srl_epi32((j < 4 ? pixelLow : pixelHigh), _mm_cvtsi32_si128(8 * (j & 3))),
+        lowByte);
+      __m256i metricIndex = _mm256_sub_epi32(_mm256_load_si256((const __m256i*) &neighborVectors->value[j][i]), corpusPixelel);
+      accumulator = _mm256_add_epi32(accumulator,
+        _mm256_mask_i32gather_epi32(zero, (const int *) kernel->corpusTargetMetric, metricIndex, lanes, 4));
+    }
+    for (j=indices->map_start_bip; j<indices->map_end_bip; j++)
+    {
+      __m256i corpusPixelel = _mm256_and_si256(
+        _mm256_srl_epi32((j < 4 ? pixelLow : pixelHigh), _mm_cvtsi32_si128(8 * (j & 3))),
+        lowByte);
+      __m256i metricIndex = _mm256_sub_epi32(_mm256_load_si256((const __m256i*) &neighborVectors->value[j][i]), corpusPixelel);
+      accumulator = _mm256_add_epi32(accumulator,
+        _mm256_mask_i32gather_epi32(zero, (const int *) kernel->mapsMetric, metricIndex, valid, 4));
+    }
+
+    if (sum + horizontalSumAVX2(accumulator) >= bestPatchDiff)  // Short circuit for neighbors
+    {
+      // Rare: find the lane where the running sum reaches bestPatchDiff (padding lanes are zero)
+      guint laneDiff[8] __attribute__((aligned(32)));
+      guint lane = 0;
+
+      _mm256_store_si256((__m256i*) laneDiff, accumulator);
+      for (;;)
+      {
+        sum += laneDiff[lane];
+        if (sum >= bestPatchDiff || lane == 7) break;
+        lane++;
+      }
+      *rejectedAt = i + lane;
+      return sum;
+    }
+    sum += horizontalSumAVX2(accumulator);
+  }
+  return sum;
+}
+
+
+/*
+Four neighbors per iteration.
+SSE4.1 has no gather, so coordinates, clipping and masking are vectorized
+but the table lookups are done lane by lane.
+*/
+__attribute__((target("sse4.1")))
+static guint
+bestFitSumSSE41(
+  const TBestFitKernel *kernel,
+  const TNeighborVectors *neighborVectors,
+  const TFormatIndices *indices,
+  const Map *corpusMap,
+  Coordinates point,
+  guint bestPatchDiff,
+  guint *rejectedAt     // OUT
+  )
+{
+  const Pixelel *corpusData = (const Pixelel *) corpusMap->data->data;
+  const __m128i minusOne = _mm_set1_epi32(-1);
+  const __m128i width = _mm_set1_epi32((int) corpusMap->width);
+  const __m128i height = _mm_set1_epi32((int) corpusMap->height);
+  const __m128i pointX = _mm_set1_epi32(point.x);
+  const __m128i pointY = _mm_set1_epi32(point.y);
+  const __m128i pointByte = _mm_set1_epi32((point.x + point.y * (gint) corpusMap->width) * (gint) corpusMap->depth);
+  guint sum = 0;
+  guint i;
+
+  for (i=0; i<neighborVectors->paddedCount; i+=4)
+  {
+    __m128i x = _mm_add_epi32(pointX, _mm_load_si128((const __m128i*) &neighborVectors->offsetX[i]));
+    __m128i y = _mm_add_epi32(pointY, _mm_load_si128((const __m128i*) &neighborVectors->offsetY[i]));
+    __m128i inCorpus = _mm_and_si128(
+      _mm_and_si128(_mm_cmpgt_epi32(x, minusOne), _mm_cmpgt_epi32(width, x)),
+      _mm_and_si128(_mm_cmpgt_epi32(y, minusOne), _mm_cmpgt_epi32(height, y)));
+    __m128i address = _mm_add_epi32(pointByte, _mm_load_si128((const __m128i*) &neighborVectors->byteOffset[i]));
+    gint inCorpusLanes[4] __attribute__((aligned(16)));
+    gint addressLanes[4] __attribute__((aligned(16)));
+    guint sumBefore[4];   // Running sum before each lane, to find the neighbor that reached bestPatchDiff
+    guint lane;
+
+    _mm_store_si128((__m128i*) inCorpusLanes, _mm_and_si128(inCorpus, _mm_load_si128((const __m128i*) &neighborVectors->active[i])));
+    _mm_store_si128((__m128i*) addressLanes, address);
+
+    for (lane=0; lane<4; lane++)
+    {
+      guint n = i + lane;
+      const Pixelel *corpusPixel;
+      TPixelelIndex j;
+
+      sumBefore[lane] = sum;
+      if ( ! neighborVectors->active[n]) continue;  // Padding
+      if ( ! inCorpusLanes[lane]
+        || corpusData[addressLanes[lane] + MASK_PIXELEL_INDEX] != MASK_TOTALLY_SELECTED)
+      {
+        sum += kernel->penalty;
+        continue;
+      }
+      corpusPixel = &corpusData[addressLanes[lane]];
+      if (neighborVectors->colorActive[n])
+        for (j=FIRST_PIXELEL_INDEX; j<indices->colorEndBip; j++)
+          sum += kernel->corpusTargetMetric[neighborVectors->value[j][n] - corpusPixel[j]];
+      for (j=indices->map_start_bip; j<indices->map_end_bip; j++)
+        sum += kernel->mapsMetric[neighborVectors->value[j][n] - corpusPixel[j]];
+    }
+    if (sum >= bestPatchDiff)  // Short circuit for neighbors
+    {
+      // The last lane whose running sum before it was still less
+      lane = 3;
+      while (lane > 0 && sumBefore[lane] >= bestPatchDiff)
+        lane--;
+      *rejectedAt = i + lane;
+      return sum;
+    }
+  }
+  return sum;
+}
+
+#endif /* SYNTH_SIMD_KERNELS_X86 */
+
+
+#ifdef SYNTH_PLANAR_CORPUS
+/*
+One neighbor at a time, as the scalar loop, but from the corpus planes and the repacked patch.
+Most probes (after the first pass, when patches are compact) are not near the corpus edge:
+then no neighbor needs clipping.
+*/
+static guint
+bestFitSumPlanar(
+  const TBestFitKernel *kernel,
+  const TNeighborVectors *neighborVectors,
+  const TFormatIndices *indices,
+  const Map *corpusMap,
+  Coordinates point,
+  guint bestPatchDiff,
+  guint *rejectedAt     // OUT
+  )
+{
+  const guint32 *pixels = kernel->planes.pixels;
+  const gint pointAddress = point.x + point.y * (gint) kernel->planes.stride;
+  // Whether the whole patch lies in the corpus: then no neighbor is clipped
+  const gboolean isInterior =
+       point.x + neighborVectors->minOffset.x >= 0
+    && point.y + neighborVectors->minOffset.y >= 0
+    && point.x + neighborVectors->maxOffset.x < (gint) corpusMap->width
+    && point.y + neighborVectors->maxOffset.y < (gint) corpusMap->height;
+  guint sum = 0;
+  guint i;
+
+  for (i=0; i<neighborVectors->count; i++)
+  {
+    gint address = pointAddress + neighborVectors->planeOffset[i];
+    guint32 pixel;
+    TPixelelIndex j;
+
+    if ( ! isInterior )
+    {
+      // Unsigned compare: negative coordinates are large, so clipped too
+      guint x = (guint) (point.x + neighborVectors->offsetX[i]);
+      guint y = (guint) (point.y + neighborVectors->offsetY[i]);
+      if (x >= corpusMap->width || y >= corpusMap->height)
+      {
+        sum += kernel->penalty;
+        if (sum >= bestPatchDiff)
+        {
+          *rejectedAt = i;
+          return sum;
+        }
+        continue;
+      }
+    }
+    pixel = pixels[address];
+    if ((pixel & 0xFF) != MASK_TOTALLY_SELECTED)
+      sum += kernel->penalty;
+    else
+    {
+      if (neighborVectors->colorActive[i])
+        for (j=FIRST_PIXELEL_INDEX; j<indices->colorEndBip; j++)
+          sum += kernel->corpusTargetMetric[neighborVectors->value[j][i] - ((pixel >> (8 * j)) & 0xFF)];
+      for (j=indices->map_start_bip; j<indices->map_end_bip; j++)
+        sum += kernel->mapsMetric[neighborVectors->value[j][i] - kernel->planes.maps[j - indices->map_start_bip][address]];
+    }
+    if (sum >= bestPatchDiff)  // Short circuit for neighbors
+    {
+      *rejectedAt = i;
+      return sum;
+    }
+  }
+  return sum;
+}
+#endif
+
+
+/*
+Choose a kernel for this CPU and prepare its tables.
+Leaves kernel->sum NULL (use scalar computeBestFit) when no kernel applies:
+the alternative SYMMETRIC_METRIC_TABLE layout, or a corpus too large for 32-bit offsets,
+or neither a SIMD kernel for this CPU nor SYNTH_PLANAR_CORPUS.
+Caller must freeBestFitKernel().
+*/
+static void
+prepareBestFitKernel(
+  TBestFitKernel *kernel,
+  const TFormatIndices *indices,
+  const Map *corpusMap,
+  const TPixelelMetricFunc corpusTargetMetric,
+  const TMapPixelelMetricFunc mapsMetric
+  )
+{
+  kernel->sum = NULL;
+  kernel->planes.stride = 0;
+  kernel->planes.block = NULL;
+  kernel->bounds.levelCount = 0;
+  kernel->bounds.block = NULL;
+#ifdef SYNTH_CORPUS_BOUNDS
+  prepareCorpusBounds(&kernel->bounds, indices, corpusMap, corpusTargetMetric, mapsMetric);
+#endif
+
+#if (defined(SYNTH_SIMD_KERNELS_X86) || defined(SYNTH_PLANAR_CORPUS)) && ! defined(SYMMETRIC_METRIC_TABLE)
+  {
+  guint i;
+
+  if ((gdouble) (corpusMap->width + CORPUS_PLANE_ALIGN) * corpusMap->height * corpusMap->depth >= (gdouble) G_MAXINT)
+    return;
+
+  for (i=0; i<2*LIMIT_DOMAIN; i++)
+    kernel->corpusTargetMetric[i] = corpusTargetMetric[i];
+  kernel->mapsMetric = mapsMetric;
+  kernel->penalty = MAX_WEIGHT*indices->img_match_bpp + mapsMetric[0]*indices->map_match_bpp;
+
+  #ifdef SYNTH_SIMD_KERNELS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    kernel->sum = bestFitSumAVX2;
+  else if (__builtin_cpu_supports("sse4.1"))
+    kernel->sum = bestFitSumSSE41;
+  #endif
+  #ifdef SYNTH_PLANAR_CORPUS
+  if ( ! kernel->sum )
+  {
+    prepareCorpusPlanes(&kernel->planes, indices, corpusMap);
+    kernel->sum = bestFitSumPlanar;
+  }
+  #endif
+  }
+#endif
+}
+
+
+static void
+freeBestFitKernel(TBestFitKernel *kernel)
+{
+  if (kernel->planes.block) freeCorpusPlanes(&kernel->planes);
+  if (kernel->bounds.block) freeCorpusBounds(&kernel->bounds);
+}
+
+
+/*
+Repack the patch for the kernels.
+Called once per target point, after prepare_neighbors().
+*/
+static inline void
+prepareNeighborVectors(
+  const TNeighbor neighbors[],
+  guint countNeighbors,
+  const TFormatIndices *indices,
+  const Map *corpusMap,
+  const TBestFitKernel *kernel,
+  TNeighborVectors *neighborVectors
+  )
+{
+  guint i;
+  TPixelelIndex j;
+
+  neighborVectors->paddedCount =
+    (countNeighbors + BEST_FIT_VECTOR_LANES - 1) / BEST_FIT_VECTOR_LANES * BEST_FIT_VECTOR_LANES;
+  neighborVectors->count = countNeighbors;
+  neighborVectors->minOffset.x = neighborVectors->minOffset.y = 0;
+  neighborVectors->maxOffset.x = neighborVectors->maxOffset.y = 0;
+
+  for (i=0; i<neighborVectors->paddedCount; i++)
+  {
+    if (i < countNeighbors)
+    {
+      Coordinates offset = neighbors[i].offset;
+      neighborVectors->offsetX[i] = offset.x;
+      neighborVectors->offsetY[i] = offset.y;
+      neighborVectors->byteOffset[i] = (offset.x + offset.y * (gint) corpusMap->width) * (gint) corpusMap->depth;
+      neighborVectors->planeOffset[i] = offset.x + offset.y * (gint) kernel->planes.stride;
+      neighborVectors->minOffset.x = MIN(neighborVectors->minOffset.x, offset.x);
+      neighborVectors->minOffset.y = MIN(neighborVectors->minOffset.y, offset.y);
+      neighborVectors->maxOffset.x = MAX(neighborVectors->maxOffset.x, offset.x);
+      neighborVectors->maxOffset.y = MAX(neighborVectors->maxOffset.y, offset.y);
+      neighborVectors->active[i] = -1;
+      // The target point, its own 0th neighbor, has no meaningful color to match.  See computeBestFit().
+      neighborVectors->colorActive[i] = (i ? -1 : 0);
+      for (j=0; j<indices->total_bpp; j++)
+        neighborVectors->value[j][i] = LIMIT_DOMAIN + neighbors[i].pixel[j];
+    }
+    else
+    {
+      neighborVectors->offsetX[i] = 0;
+      neighborVectors->offsetY[i] = 0;
+      neighborVectors->byteOffset[i] = 0;
+      neighborVectors->planeOffset[i] = 0;
+      neighborVectors->active[i] = 0;
+      neighborVectors->colorActive[i] = 0;
+      for (j=0; j<indices->total_bpp; j++)
+        neighborVectors->value[j][i] = LIMIT_DOMAIN;
+    }
+  }
+}
@@ -64,6 +64,34 @@ then run >automake from the top directory.
 // #define SYMMETRIC_METRIC_TABLE
 // #define VECTORIZED
 
+/*
+SSE4.1 and AVX2 kernels for computeBestFit(), chosen at runtime by CPU feature detection.
+See bestFitVectorized.h.  Falls back to the scalar loop on other CPUs.
+Results are the same as the scalar loop.
+Moot unless gcc (or compatible) on x86.
+*/
+#define SYNTH_SIMD_KERNELS
+
+/*
+Where no SIMD kernel applies, a portable kernel reading a planar copy of the corpus.
+See corpusPlanes.h.  Results are the same as the scalar loop.
+*/
+#define SYNTH_PLANAR_CORPUS
+
+/*
+Whether recentProberMap (heuristic 2 of synthesize()) holds a 16-bit tag of a target index, not the index.
+Half the memory per corpus pixel, but results differ slightly.  See prepareRecentProber() in engine.c.
+*/
+// #define SYNTH_COMPACT_PROBER
+
+/*
+Reject a candidate corpus point by a lower bound of its patch difference, from ranges of the corpus.
+See corpusBounds.h.  Results are the same, at two bytes per pixelel per cell of 4x4 corpus pixels per window radius.
+Faster when the corpus has regions unlike the target (e.g. heal ufo-input by map, 10.6s to 8.9s),
+slower for a corpus of one texture (e.g. grass-input, 0.66s to 0.92s), so off by default.
+*/
+// #define SYNTH_CORPUS_BOUNDS
+
 /*
 Threading.
 Requires file refinerThreaded.h
@@ -78,12 +106,11 @@ The latter has not been tested.
 // If not defined, uses POSIX threads.  Moot unless SYNTH_THREADED
 #define SYNTH_USE_GLIB_THREADS
 
-// Count threads to start.
+// Most threads to start.
 #ifdef SYNTH_THREADED
-  // A reasonable guess that most current processors have no more than 8 cores.
-  // More threads than cores does not seem to hurt performance.
-  // glib doesn't seem to support knowing the count of cores
-  #define THREAD_LIMIT    8
+  // The count of threads is parameters.threadCount, or if zero, the count of online processors.
+  // This only limits it, e.g. against a wild parameter.
+  #define THREAD_LIMIT    256
 #else
   // This MUST be defined to 1 if not threaded, it affects how synthesize() iterates over target
   #define THREAD_LIMIT 1
@@ -0,0 +1,387 @@
+/*
+Lower bounds of the patch difference, to reject a candidate corpus point without comparing its patch.
+
+The patch difference (see computeBestFit()) sums, for each neighbor and matched pixelel,
+a metric of the difference of the target pixelel and the corpus pixelel under the neighbor.
+Both metrics (the Cauchy metric on colors and the square on maps, see matchWeighting.h)
+are symmetric and do not decrease as the absolute difference grows.
+
+So if all the corpus pixelels under a patch are in a range [lo, hi],
+and all the target pixelels of the patch are in a range [patchLo, patchHi],
+every difference is at least the gap between the two ranges,
+and the patch difference is at least (count of neighbors) * metric(gap), summed over pixelels.
+A neighbor clipped or masked in the corpus costs the maximum of the metric (kernel->penalty), not less.
+If the bound is not less than bestPatchDiff, the comparison would reject the candidate anyway:
+rejecting it first does not change results.
+
+The corpus ranges are of square windows centered on each corpus point,
+of a few radii (CORPUS_BOUNDS_RADIUS << level), prepared once per engine() call.
+They are kept for cells of (1 << CORPUS_BOUNDS_CELL_SHIFT) pixels square: the range of a cell is of the windows of all its points.
+Looser, but a sixteenth the memory, so the ranges stay in cache, unlike the corpus pixels under a random probe.
+A patch uses the smallest window holding all its offsets (the bounding box of TNeighborVectors.)
+Patches wider than the largest window, e.g. shotgun patches in the first pass, are not bounded.
+Pixels clipped or masked in the corpus are not in the ranges (they cost the maximum anyway.)
+
+The bound costs two bytes per pixelel of the candidate, in cache, instead of a pixel per neighbor.
+It rejects candidates whose surroundings have no colors near those of the patch,
+e.g. sky probed for a patch of grass.  In a corpus of one texture, most windows span the colors of most patches,
+and the bound rarely rejects: then it only costs, since the comparison would have rejected most candidates
+after a few neighbors anyway.
+So only the random probes of synthesize() are bounded (other candidates are near good matches),
+and for each target point, only if the bound rejects at least three quarters of its first CORPUS_BOUNDS_TRIAL probes.
+
+Included in bestFitVectorized.h, not compiled separately.
+
+  Copyright (C) 2010, 2011  Lloyd Konneker
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Window radii are CORPUS_BOUNDS_RADIUS, twice that, ...
+#define CORPUS_BOUNDS_RADIUS 2
+#define CORPUS_BOUNDS_LEVELS 3
+// Cells are 1 << CORPUS_BOUNDS_CELL_SHIFT pixels square
+#define CORPUS_BOUNDS_CELL_SHIFT 2
+// Probes of a target point bounded before deciding whether to bound the rest, see isBoundRejected()
+#define CORPUS_BOUNDS_TRIAL 16
+
+typedef struct corpusBoundsStruct {
+  guint levelCount;       // 0 if no bounds
+  guint cellsWide;        // Cells in a row
+  guint pixelelCount;     // Bounded pixelels: colors, then maps
+  TPixelelIndex pixelel[MAX_IMAGE_SYNTH_BPP];  // Their indices in a pixel
+  gboolean isMap[MAX_IMAGE_SYNTH_BPP];
+  // Metric of each bounded pixelel, by absolute difference
+  guint metric[MAX_IMAGE_SYNTH_BPP][LIMIT_DOMAIN];
+  // Per level, per cell: lo and hi of each bounded pixelel
+  Pixelel *ranges[CORPUS_BOUNDS_LEVELS];
+  Pixelel *block;
+} TCorpusBounds;
+
+/*
+Bound of one patch, prepared once per target point.
+level is CORPUS_BOUNDS_LEVELS if the patch is not bounded.
+*/
+typedef struct patchBoundStruct {
+  guint level;
+  Pixelel lo[MAX_IMAGE_SYNTH_BPP];
+  Pixelel hi[MAX_IMAGE_SYNTH_BPP];
+  guint count[MAX_IMAGE_SYNTH_BPP];   // Neighbors matching the pixelel: all for maps, less the 0th for colors
+} TPatchBound;
+
+
+#ifdef SYNTH_CORPUS_BOUNDS
+/*
+One step of widening windows, along rows (shift in x) or columns (shift in y), from planes in to planes out:
+each range becomes the union of the ranges shift before and after it (and itself if isCenter.)
+From windows of radius r, a shift of r gives windows of radius 2r.
+From single pixels (radius 0), a shift of 1 with isCenter gives windows of radius 1.
+Ranges off the plane are empty.
+*/
+static void
+widenBoundsWindows(
+  const Pixelel *inLo,
+  const Pixelel *inHi,
+  Pixelel *outLo,
+  Pixelel *outHi,
+  guint width,
+  guint height,
+  guint shift,
+  gboolean isColumn,
+  gboolean isCenter
+  )
+{
+  guint x;
+  guint y;
+
+  for (y=0; y<height; y++)
+  {
+    gsize row = (gsize) y * width;
+
+    for (x=0; x<width; x++)
+    {
+      gsize here = row + x;
+      Pixelel lo = 255;
+      Pixelel hi = 0;
+
+      if (isColumn ? (y >= shift) : (x >= shift))
+      {
+        gsize before = here - (isColumn ? (gsize) shift * width : shift);
+        lo = MIN(lo, inLo[before]);
+        hi = MAX(hi, inHi[before]);
+      }
+      if (isColumn ? (y + shift < height) : (x + shift < width))
+      {
+        gsize after = here + (isColumn ? (gsize) shift * width : shift);
+        lo = MIN(lo, inLo[after]);
+        hi = MAX(hi, inHi[after]);
+      }
+      if (isCenter)
+      {
+        lo = MIN(lo, inLo[here]);
+        hi = MAX(hi, inHi[here]);
+      }
+      outLo[here] = lo;
+      outHi[here] = hi;
+    }
+  }
+}
+
+
+/*
+Prepare the ranges of the corpus windows.
+Leaves bounds->levelCount 0 (no bounds) for the alternative SYMMETRIC_METRIC_TABLE layout.
+Caller must freeCorpusBounds().
+*/
+static void
+prepareCorpusBounds(
+  TCorpusBounds *bounds,    // OUT
+  const TFormatIndices *indices,
+  const Map *corpusMap,
+  const TPixelelMetricFunc corpusTargetMetric,
+  const TMapPixelelMetricFunc mapsMetric
+  )
+{
+  guint width = corpusMap->width;
+  guint height = corpusMap->height;
+  gsize pixelCount = (gsize) width * height;
+  guint cellsHigh = (height + (1 << CORPUS_BOUNDS_CELL_SHIFT) - 1) >> CORPUS_BOUNDS_CELL_SHIFT;
+  gsize cellCount;
+  Pixelel *lo;      // Ranges of the windows of every pixel
+  Pixelel *hi;
+  Pixelel *wideLo;  // Scratch, of the windows widened along rows
+  Pixelel *wideHi;
+  guint level;
+  guint x;
+  guint y;
+  guint j;
+  guint d;
+  gsize i;
+
+  bounds->levelCount = 0;
+  bounds->block = NULL;
+#ifndef SYMMETRIC_METRIC_TABLE
+  bounds->cellsWide = (width + (1 << CORPUS_BOUNDS_CELL_SHIFT) - 1) >> CORPUS_BOUNDS_CELL_SHIFT;
+  cellCount = (gsize) bounds->cellsWide * cellsHigh;
+  bounds->pixelelCount = 0;
+  for (j=FIRST_PIXELEL_INDEX; j<indices->colorEndBip; j++)
+  {
+    bounds->isMap[bounds->pixelelCount] = FALSE;
+    bounds->pixelel[bounds->pixelelCount++] = j;
+  }
+  for (j=indices->map_start_bip; j<indices->map_end_bip; j++)
+  {
+    bounds->isMap[bounds->pixelelCount] = TRUE;
+    bounds->pixelel[bounds->pixelelCount++] = j;
+  }
+  if ( ! bounds->pixelelCount || ! pixelCount ) return;
+
+  for (j=0; j<bounds->pixelelCount; j++)
+    for (d=0; d<LIMIT_DOMAIN; d++)
+      bounds->metric[j][d] = bounds->isMap[j] ? mapsMetric[LIMIT_DOMAIN + d] : corpusTargetMetric[LIMIT_DOMAIN + d];
+
+  bounds->block = g_new(Pixelel, CORPUS_BOUNDS_LEVELS * cellCount * 2 * bounds->pixelelCount);
+  for (level=0; level<CORPUS_BOUNDS_LEVELS; level++)
+    bounds->ranges[level] = bounds->block + level * cellCount * 2 * bounds->pixelelCount;
+  for (i=0; i<CORPUS_BOUNDS_LEVELS * cellCount * bounds->pixelelCount; i++)
+  {
+    bounds->block[2*i] = 255;   // Empty
+    bounds->block[2*i+1] = 0;
+  }
+  lo = g_new(Pixelel, 4 * pixelCount);
+  hi = lo + pixelCount;
+  wideLo = hi + pixelCount;
+  wideHi = wideLo + pixelCount;
+
+  for (j=0; j<bounds->pixelelCount; j++)
+  {
+    guint radius = 0;
+
+    // Pixels clipped or masked in the corpus are not in any range
+    for (y=0; y<height; y++)
+      for (x=0; x<width; x++)
+      {
+        Coordinates point = {x, y};
+
+        i = (gsize) y * width + x;
+        if (isSelectedCorpus(point, corpusMap))
+          lo[i] = hi[i] = pixmap_index(corpusMap, point)[bounds->pixelel[j]];
+        else
+        {
+          lo[i] = 255;
+          hi[i] = 0;
+        }
+      }
+    for (level=0; level<CORPUS_BOUNDS_LEVELS; level++)
+    {
+      // Widen to radius 1, then double the radius up to that of the level
+      while (radius < (CORPUS_BOUNDS_RADIUS << level))
+      {
+        guint shift = radius ? radius : 1;
+
+        widenBoundsWindows(lo, hi, wideLo, wideHi, width, height, shift, FALSE, ! radius);
+        widenBoundsWindows(wideLo, wideHi, lo, hi, width, height, shift, TRUE, ! radius);
+        radius = radius ? 2 * radius : 1;
+      }
+      // The range of a cell is the union of the windows of its pixels
+      for (y=0; y<height; y++)
+        for (x=0; x<width; x++)
+        {
+          gsize cell = (x >> CORPUS_BOUNDS_CELL_SHIFT) + (y >> CORPUS_BOUNDS_CELL_SHIFT) * bounds->cellsWide;
+          Pixelel *range = &bounds->ranges[level][(cell * bounds->pixelelCount + j) * 2];
+
+          i = (gsize) y * width + x;
+          range[0] = MIN(range[0], lo[i]);
+          range[1] = MAX(range[1], hi[i]);
+        }
+    }
+  }
+  g_free(lo);
+  bounds->levelCount = CORPUS_BOUNDS_LEVELS;
+#endif
+}
+#endif /* SYNTH_CORPUS_BOUNDS */
+
+
+static void
+freeCorpusBounds(TCorpusBounds *bounds)
+{
+  g_free(bounds->block);
+  bounds->block = NULL;
+  bounds->levelCount = 0;
+}
+
+
+/*
+Prepare the bound of a patch: the smallest window holding its offsets, and its ranges.
+Called once per target point, after prepare_neighbors().
+*/
+static inline void
+preparePatchBound(
+  const TCorpusBounds *bounds,
+  const TNeighbor neighbors[],
+  guint countNeighbors,
+  TPatchBound *patchBound   // OUT
+  )
+{
+  gint extent = 0;
+  guint i;
+  guint j;
+
+  patchBound->level = CORPUS_BOUNDS_LEVELS;
+  if ( ! bounds->levelCount ) return;
+
+  for (i=0; i<countNeighbors; i++)
+  {
+    extent = MAX(extent, ABS(neighbors[i].offset.x));
+    extent = MAX(extent, ABS(neighbors[i].offset.y));
+  }
+  for (patchBound->level=0; patchBound->level<bounds->levelCount; patchBound->level++)
+    if (extent <= (CORPUS_BOUNDS_RADIUS << patchBound->level)) break;
+  if (patchBound->level >= bounds->levelCount) return;
+
+  for (j=0; j<bounds->pixelelCount; j++)
+  {
+    // The target point, its own 0th neighbor, has no meaningful color to match.  See computeBestFit().
+    guint first = bounds->isMap[j] ? 0 : 1;
+
+    patchBound->lo[j] = 255;
+    patchBound->hi[j] = 0;
+    patchBound->count[j] = (countNeighbors > first) ? countNeighbors - first : 0;
+    for (i=first; i<countNeighbors; i++)
+    {
+      Pixelel value = neighbors[i].pixel[bounds->pixelel[j]];
+
+      patchBound->lo[j] = MIN(patchBound->lo[j], value);
+      patchBound->hi[j] = MAX(patchBound->hi[j], value);
+    }
+  }
+}
+
+
+/*
+Lower bound of the patch difference at a candidate corpus point, not clipped or masked.
+Zero if the patch is not bounded.
+*/
+static inline guint
+patchLowerBound(
+  const TCorpusBounds *bounds,
+  const TPatchBound *patchBound,
+  Coordinates point
+  )
+{
+  const Pixelel *range;
+  guint sum = 0;
+  guint j;
+
+  if (patchBound->level >= CORPUS_BOUNDS_LEVELS) return 0;
+
+  range = bounds->ranges[patchBound->level]
+    + ((gsize) (point.x >> CORPUS_BOUNDS_CELL_SHIFT) + (gsize) (point.y >> CORPUS_BOUNDS_CELL_SHIFT) * bounds->cellsWide)
+      * 2 * bounds->pixelelCount;
+  for (j=0; j<bounds->pixelelCount; j++)
+  {
+    gint gap = MAX((gint) range[2*j] - (gint) patchBound->hi[j], (gint) patchBound->lo[j] - (gint) range[2*j+1]);
+
+    // Branchless: metric[0] is 0
+    sum += patchBound->count[j] * bounds->metric[j][MAX(gap, 0)];
+  }
+  return sum;
+}
+
+
+// Whether the bound is still tried for the random probes of a target point
+typedef struct boundTrialStruct {
+  gboolean isBounding;
+  guint tries;
+  guint rejects;
+} TBoundTrial;
+
+
+static inline void
+startBoundTrial(
+  const TPatchBound *patchBound,
+  TBoundTrial *trial    // OUT
+  )
+{
+  trial->isBounding = (patchBound->level < CORPUS_BOUNDS_LEVELS);
+  trial->tries = 0;
+  trial->rejects = 0;
+}
+
+
+/*
+Whether a candidate is rejected by the bound of the patch.
+After CORPUS_BOUNDS_TRIAL tries, stops bounding unless at least three quarters were rejected.
+*/
+static inline gboolean
+isBoundRejected(
+  const TCorpusBounds *bounds,
+  const TPatchBound *patchBound,
+  Coordinates point,
+  guint bestPatchDiff,
+  TBoundTrial *trial    // IN/OUT
+  )
+{
+  gboolean isRejected;
+
+  if ( ! trial->isBounding ) return FALSE;
+
+  isRejected = (patchLowerBound(bounds, patchBound, point) >= bestPatchDiff);
+  trial->rejects += isRejected;
+  if (++trial->tries == CORPUS_BOUNDS_TRIAL)
+    trial->isBounding = (4 * trial->rejects >= 3 * CORPUS_BOUNDS_TRIAL);
+  return isRejected;
+}
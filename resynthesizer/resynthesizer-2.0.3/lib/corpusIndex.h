@@ -0,0 +1,698 @@
+/*
+Approximate nearest neighbor index of corpus patches.
+
+On the first pass, synthesize() probes maxProbeCount random corpus points per target point.
+On a large corpus, few random probes land near a good match.
+Here, each corpus point has a compact descriptor of the patch around it,
+and the first pass probes only the corpus points whose descriptors are nearest
+the descriptor of the target point's patch.
+The probes are still exact (computeBestFit or a SIMD kernel): the index only proposes candidates.
+Passes after the first continue as before (refining from the sources found by the first pass.)
+
+Descriptor:
+The colors of a small square window around a point (excluding the point itself,
+since on the first pass a target point has no color yet), projected onto the
+first few principal components of corpus windows, quantized to signed bytes.
+Principal components are computed from a sample of corpus windows (covariance and power iteration.)
+Window pixels that are missing (outside the corpus, or target neighbors without values yet)
+are taken as the mean, i.e. contribute nothing, and the projection is scaled up by the missing fraction.
+
+Index:
+A kd-tree over the descriptors, implicit (split at the median index, so a node's range is computed
+while descending, only split dimension and value stored.)
+Queries visit a bounded count of leaves (approximate search.)
+
+The index depends only on the corpus, not the target or parameters,
+so a caller healing many targets from the same corpus can build it once (newCorpusIndex())
+and pass it to engineWithCorpusIndex().
+It remembers a hash of the corpus and is ignored if the corpus differs.
+Build time and memory are reported by corpusIndexStats().
+
+  Copyright (C) 2010, 2011  Lloyd Konneker
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>   // clock()
+
+#define CORPUS_INDEX_WINDOW_WIDTH (2*IMAGE_SYNTH_INDEX_RADIUS + 1)
+#define CORPUS_INDEX_WINDOW_PIXELS (CORPUS_INDEX_WINDOW_WIDTH * CORPUS_INDEX_WINDOW_WIDTH)
+// Colors only: at most 3 color pixelels (RGB)
+#define CORPUS_INDEX_MAX_WINDOW (CORPUS_INDEX_WINDOW_PIXELS * 3)
+
+
+// Element of the index: descriptor and the corpus point it describes
+typedef struct IndexEntryStruct {
+  gint8 descriptor[IMAGE_SYNTH_INDEX_DIMENSIONS];
+  guint32 point;  // x + y*width in corpus
+} TIndexEntry;
+
+// Internal node of the implicit kd-tree
+typedef struct IndexNodeStruct {
+  guint8 splitDimension;
+  gint8 splitValue;
+} TIndexNode;
+
+struct CorpusIndexStruct {
+  // Identity of the indexed corpus
+  guint width;
+  guint height;
+  TPixelelIndex colorEndBip;
+  guint64 corpusHash;
+
+  // Principal components
+  guint windowLength;   // pixels times colors
+  gfloat mean[CORPUS_INDEX_MAX_WINDOW];
+  gfloat basis[CORPUS_INDEX_MAX_WINDOW][IMAGE_SYNTH_INDEX_DIMENSIONS];  // Transposed: components of a window pixelel are contiguous
+  gfloat scale;         // to quantize projections
+
+  // kd-tree
+  guint count;
+  TIndexEntry *entries;
+  guint depth;          // levels of internal nodes
+  TIndexNode *nodes;    // 2^depth - 1 internal nodes, children of i are 2i+1, 2i+2
+
+  // Report
+  gdouble buildSeconds;
+  gsize bytes;
+};
+
+// Window of one point, before projection
+typedef struct IndexWindowStruct {
+  gfloat value[CORPUS_INDEX_MAX_WINDOW];
+  gboolean isPresent[CORPUS_INDEX_WINDOW_PIXELS];
+  guint countPresent;
+} TIndexWindow;
+
+
+/*
+Hash of the corpus: dimensions, and pixelels from the mask up to endBip
+(colorEndBip: mask and colors, or map_end_bip: also maps.)
+FNV-1a, 64-bit.
+*/
+static guint64
+hashCorpus(
+  Map* corpusMap,
+  TPixelelIndex endBip
+  )
+{
+  guint64 hash = 0xCBF29CE484222325ULL;
+  guint size = corpusMap->width * corpusMap->height;
+  const Pixelel *data = &g_array_index(corpusMap->data, Pixelel, 0);
+  guint i;
+
+  hash = (hash ^ corpusMap->width) * 0x100000001B3ULL;
+  hash = (hash ^ corpusMap->height) * 0x100000001B3ULL;
+  for (i=0; i<size; i++)
+  {
+    const Pixelel *pixel = &data[i * corpusMap->depth];
+    TPixelelIndex k;
+    for (k=MASK_PIXELEL_INDEX; k<endBip; k++)
+      hash = (hash ^ pixel[k]) * 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+
+static inline guint
+windowSlot(Coordinates offset)
+{
+  return (offset.y + IMAGE_SYNTH_INDEX_RADIUS) * CORPUS_INDEX_WINDOW_WIDTH + (offset.x + IMAGE_SYNTH_INDEX_RADIUS);
+}
+
+static inline gboolean
+isInWindow(Coordinates offset)
+{
+  return ABS(offset.x) <= IMAGE_SYNTH_INDEX_RADIUS && ABS(offset.y) <= IMAGE_SYNTH_INDEX_RADIUS
+    && (offset.x || offset.y);  // Not the center
+}
+
+static inline void
+setWindowPixel(
+  TIndexWindow *window,
+  Coordinates offset,
+  const Pixelel *pixel,
+  TFormatIndices* indices
+  )
+{
+  guint slot = windowSlot(offset);
+  guint colorCount = indices->colorEndBip - FIRST_PIXELEL_INDEX;
+  TPixelelIndex k;
+
+  if (window->isPresent[slot]) return;
+  window->isPresent[slot] = TRUE;
+  window->countPresent++;
+  for (k=0; k<colorCount; k++)
+    window->value[slot*colorCount + k] = pixel[FIRST_PIXELEL_INDEX + k];
+}
+
+
+static void
+corpusWindow(
+  TFormatIndices* indices,
+  Map* corpusMap,
+  Coordinates point,
+  TIndexWindow *window  // OUT
+  )
+{
+  Coordinates offset;
+
+  memset(window->isPresent, 0, sizeof(window->isPresent));
+  window->countPresent = 0;
+  for (offset.y=-IMAGE_SYNTH_INDEX_RADIUS; offset.y<=IMAGE_SYNTH_INDEX_RADIUS; offset.y++)
+    for (offset.x=-IMAGE_SYNTH_INDEX_RADIUS; offset.x<=IMAGE_SYNTH_INDEX_RADIUS; offset.x++)
+    {
+      Coordinates windowPoint = add_points(point, offset);
+      if ( ! isInWindow(offset) || clippedOrMaskedCorpus(windowPoint, corpusMap)) continue;
+      setWindowPixel(window, offset, pixmap_index(corpusMap, windowPoint), indices);
+    }
+}
+
+
+/*
+Project a window onto the principal components and quantize.
+Returns FALSE if the window is empty.
+*/
+static gboolean
+describeWindow(
+  const TCorpusIndex *index,
+  guint colorCount,
+  const TIndexWindow *window,
+  gint8 descriptor[]  // OUT
+  )
+{
+  gfloat centered[CORPUS_INDEX_MAX_WINDOW];
+  gfloat projection[IMAGE_SYNTH_INDEX_DIMENSIONS] = {0};
+  gfloat fill;
+  guint slot;
+  guint i;
+  guint d;
+
+  if ( ! window->countPresent) return FALSE;
+  for (slot=0; slot<CORPUS_INDEX_WINDOW_PIXELS; slot++)
+  {
+    guint k;
+    for (k=0; k<colorCount; k++)
+    {
+      guint i = slot*colorCount + k;
+      centered[i] = window->isPresent[slot] ? window->value[i] - index->mean[i] : 0;
+    }
+  }
+  // Compensate for missing pixels (the center is always missing)
+  fill = (gfloat) (CORPUS_INDEX_WINDOW_PIXELS - 1) / window->countPresent;
+  /*
+  Accumulate all components at once, the inner loop is across components.
+  Vectorizes without reordering float sums (unlike a dot product per component.)
+  */
+  for (i=0; i<index->windowLength; i++)
+    for (d=0; d<IMAGE_SYNTH_INDEX_DIMENSIONS; d++)
+      projection[d] += index->basis[i][d] * centered[i];
+  for (d=0; d<IMAGE_SYNTH_INDEX_DIMENSIONS; d++)
+    descriptor[d] = (gint8) MAX(-127, MIN(127, (gint) lrintf(projection[d] * fill * index->scale)));
+  return TRUE;
+}
+
+
+/*
+Principal components of a sample of complete corpus windows.
+Power iteration with deflation on the covariance matrix.
+Returns FALSE if no sample.
+*/
+static gboolean
+computePrincipalComponents(
+  TCorpusIndex *index,
+  TFormatIndices* indices,
+  Map* corpusMap,
+  pointVector corpusPoints
+  )
+{
+  guint n = index->windowLength;
+  guint stride = MAX(1, corpusPoints->len / IMAGE_SYNTH_INDEX_PCA_SAMPLES);
+  gdouble *covariance = g_new0(gdouble, n*n);
+  gdouble *sum = g_new0(gdouble, n);
+  gfloat maxProjection = 0;
+  guint countSamples = 0;
+  guint i;
+  guint j;
+  guint d;
+
+  // Mean and covariance of complete windows
+  for (i=0; i<corpusPoints->len; i+=stride)
+  {
+    TIndexWindow window;
+    corpusWindow(indices, corpusMap, g_array_index(corpusPoints, Coordinates, i), &window);
+    if (window.countPresent < CORPUS_INDEX_WINDOW_PIXELS - 1) continue;
+    for (j=0; j<n / CORPUS_INDEX_WINDOW_PIXELS; j++)  // Center is unused
+      window.value[windowSlot((Coordinates){0,0}) * (n / CORPUS_INDEX_WINDOW_PIXELS) + j] = 0;
+    for (j=0; j<n; j++)
+    {
+      guint k;
+      sum[j] += window.value[j];
+      for (k=j; k<n; k++)   // Upper triangle, symmetric
+        covariance[j*n + k] += (gdouble) window.value[j] * window.value[k];
+    }
+    countSamples++;
+  }
+  if ( ! countSamples)
+  {
+    g_free(covariance);
+    g_free(sum);
+    return FALSE;
+  }
+  for (j=0; j<n; j++)
+    index->mean[j] = sum[j] / countSamples;
+  for (j=0; j<n; j++)
+    for (i=j; i<n; i++)
+    {
+      covariance[j*n + i] = covariance[j*n + i] / countSamples - (gdouble) index->mean[j] * index->mean[i];
+      covariance[i*n + j] = covariance[j*n + i];
+    }
+
+  // Leading eigenvectors
+  for (d=0; d<IMAGE_SYNTH_INDEX_DIMENSIONS; d++)
+  {
+    gdouble vector[CORPUS_INDEX_MAX_WINDOW];
+    gdouble eigenvalue = 0;
+    guint iteration;
+
+    for (j=0; j<n; j++) vector[j] = 1.0 + (j % (d+2));   // Arbitrary start, not orthogonal to components
+    for (iteration=0; iteration<IMAGE_SYNTH_INDEX_PCA_ITERATIONS; iteration++)
+    {
+      gdouble product[CORPUS_INDEX_MAX_WINDOW];
+      gdouble norm = 0;
+      for (j=0; j<n; j++)
+      {
+        product[j] = 0;
+        for (i=0; i<n; i++)
+          product[j] += covariance[j*n + i] * vector[i];
+        norm += product[j] * product[j];
+      }
+      norm = sqrt(norm);
+      if (norm == 0) break;   // Rank exhausted, e.g. flat corpus
+      for (j=0; j<n; j++) vector[j] = product[j] / norm;
+      eigenvalue = norm;
+    }
+    for (j=0; j<n; j++) index->basis[j][d] = (gfloat) vector[j];
+    // Deflate
+    for (j=0; j<n; j++)
+      for (i=0; i<n; i++)
+        covariance[j*n + i] -= eigenvalue * vector[j] * vector[i];
+  }
+  g_free(covariance);
+  g_free(sum);
+
+  // Scale so projections of the sample fit in a signed byte
+  index->scale = 1;
+  for (i=0; i<corpusPoints->len; i+=stride)
+  {
+    TIndexWindow window;
+    corpusWindow(indices, corpusMap, g_array_index(corpusPoints, Coordinates, i), &window);
+    for (d=0; d<IMAGE_SYNTH_INDEX_DIMENSIONS; d++)
+    {
+      gfloat projection = 0;
+      for (j=0; j<n; j++)
+        if (window.isPresent[j / (n / CORPUS_INDEX_WINDOW_PIXELS)])
+          projection += index->basis[j][d] * (window.value[j] - index->mean[j]);
+      maxProjection = MAX(maxProjection, fabsf(projection));
+    }
+  }
+  index->scale = (maxProjection > 0) ? 127.0f / maxProjection : 1.0f;
+  return TRUE;
+}
+
+
+/*
+Partition entries [start, end) so entry mid has the median value in dimension.
+Quickselect.
+*/
+static void
+selectMedian(
+  TIndexEntry *entries,
+  guint start,
+  guint end,
+  guint mid,
+  guint dimension
+  )
+{
+  while (end - start > 1)
+  {
+    gint8 pivot = entries[start + (end - start) / 2].descriptor[dimension];
+    guint low = start;
+    guint high = end - 1;
+
+    while (low <= high)
+    {
+      while (entries[low].descriptor[dimension] < pivot) low++;
+      while (entries[high].descriptor[dimension] > pivot) high--;
+      if (low <= high)
+      {
+        TIndexEntry temp = entries[low];
+        entries[low] = entries[high];
+        entries[high] = temp;
+        low++;
+        if (high == 0) break;
+        high--;
+      }
+    }
+    // Now [start, high] <= pivot <= [low, end)
+    if (mid <= high) end = high + 1;
+    else if (mid >= low) start = low;
+    else return;
+  }
+}
+
+
+// Polls cancel per node: stops early, the caller tests isCanceled()
+static void
+buildIndexNode(
+  TCorpusIndex *index,
+  guint node,
+  guint level,
+  guint start,
+  guint end,
+  const int *cancelFlag
+  )
+{
+  guint mid = start + (end - start) / 2;
+  gint8 minimum[IMAGE_SYNTH_INDEX_DIMENSIONS];
+  gint8 maximum[IMAGE_SYNTH_INDEX_DIMENSIONS];
+  guint dimension = 0;
+  guint i;
+  guint d;
+
+  if (level >= index->depth) return;  // Leaf
+  if (isCanceled(cancelFlag)) return;
+
+  // Split the dimension of largest spread
+  for (d=0; d<IMAGE_SYNTH_INDEX_DIMENSIONS; d++) { minimum[d] = 127; maximum[d] = -127; }
+  for (i=start; i<end; i++)
+    for (d=0; d<IMAGE_SYNTH_INDEX_DIMENSIONS; d++)
+    {
+      minimum[d] = MIN(minimum[d], index->entries[i].descriptor[d]);
+      maximum[d] = MAX(maximum[d], index->entries[i].descriptor[d]);
+    }
+  for (d=1; d<IMAGE_SYNTH_INDEX_DIMENSIONS; d++)
+    if (maximum[d] - minimum[d] > maximum[dimension] - minimum[dimension]) dimension = d;
+
+  selectMedian(index->entries, start, end, mid, dimension);
+  index->nodes[node].splitDimension = dimension;
+  index->nodes[node].splitValue = index->entries[mid].descriptor[dimension];
+
+  buildIndexNode(index, 2*node + 1, level + 1, start, mid, cancelFlag);
+  buildIndexNode(index, 2*node + 2, level + 1, mid, end, cancelFlag);
+}
+
+
+/*
+Build an index of a corpus.
+Returns NULL if the corpus is empty or the format has no colors to index, or if canceled.
+Polls cancel: building takes seconds for a large corpus.
+*/
+static TCorpusIndex *
+buildCorpusIndex(
+  TFormatIndices* indices,
+  Map* corpusMap,
+  const int *cancelFlag
+  )
+{
+  clock_t startTime = clock();
+  TCorpusIndex *index;
+  pointVector corpusPoints;
+  guint colorCount = indices->colorEndBip - FIRST_PIXELEL_INDEX;
+  guint i;
+
+  if (colorCount < 1 || colorCount > 3) return NULL;
+  prepareCorpusPoints(indices, corpusMap, &corpusPoints, cancelFlag);
+  if ( ! corpusPoints->len || isCanceled(cancelFlag) )
+  {
+    g_array_free(corpusPoints, TRUE);
+    return NULL;
+  }
+
+  index = g_new0(TCorpusIndex, 1);
+  index->width = corpusMap->width;
+  index->height = corpusMap->height;
+  index->colorEndBip = indices->colorEndBip;
+  index->corpusHash = hashCorpus(corpusMap, indices->colorEndBip);
+  index->windowLength = CORPUS_INDEX_WINDOW_PIXELS * colorCount;
+
+  if ( ! computePrincipalComponents(index, indices, corpusMap, corpusPoints))
+  {
+    g_array_free(corpusPoints, TRUE);
+    g_free(index);
+    return NULL;
+  }
+
+  // Describe every corpus point
+  index->count = corpusPoints->len;
+  index->entries = g_new(TIndexEntry, index->count);
+  for (i=0; i<index->count && ! isCanceled(cancelFlag); i++)
+  {
+    Coordinates point = g_array_index(corpusPoints, Coordinates, i);
+    TIndexWindow window;
+
+    corpusWindow(indices, corpusMap, point, &window);
+    if ( ! describeWindow(index, colorCount, &window, index->entries[i].descriptor))
+      memset(index->entries[i].descriptor, 0, sizeof(index->entries[i].descriptor));  // Isolated point
+    index->entries[i].point = point.x + point.y * corpusMap->width;
+  }
+  g_array_free(corpusPoints, TRUE);
+
+  // Levels of internal nodes so leaves hold about IMAGE_SYNTH_INDEX_LEAF_SIZE entries
+  index->depth = 0;
+  while ((index->count >> index->depth) > IMAGE_SYNTH_INDEX_LEAF_SIZE) index->depth++;
+  index->nodes = g_new0(TIndexNode, (1u << index->depth));
+  buildIndexNode(index, 0, 0, 0, index->count, cancelFlag);
+  if (isCanceled(cancelFlag))
+  {
+    freeCorpusIndex(index);
+    return NULL;
+  }
+
+  index->bytes = sizeof(TCorpusIndex)
+    + index->count * sizeof(TIndexEntry)
+    + (1u << index->depth) * sizeof(TIndexNode);
+  index->buildSeconds = (gdouble) (clock() - startTime) / CLOCKS_PER_SEC;
+  return index;
+}
+
+
+// Outside an engine call: not cancelable
+TCorpusIndex *
+newCorpusIndex(
+  TFormatIndices* indices,
+  Map* corpusMap
+  )
+{
+  return buildCorpusIndex(indices, corpusMap, &neverCanceled);
+}
+
+
+void
+freeCorpusIndex(TCorpusIndex *index)
+{
+  if ( ! index) return;
+  g_free(index->entries);
+  g_free(index->nodes);
+  g_free(index);
+}
+
+
+void
+corpusIndexStats(
+  const TCorpusIndex *index,
+  double *buildSeconds,   // OUT processor seconds to build
+  size_t *bytes           // OUT memory held
+  )
+{
+  *buildSeconds = index->buildSeconds;
+  *bytes = index->bytes;
+}
+
+
+/*
+Whether the index was built from this corpus.
+Compares dimensions and format before hashing.
+*/
+static gboolean
+isCorpusIndexOf(
+  const TCorpusIndex *index,
+  TFormatIndices* indices,
+  Map* corpusMap
+  )
+{
+  return index
+    && index->width == corpusMap->width
+    && index->height == corpusMap->height
+    && index->colorEndBip == indices->colorEndBip
+    && index->corpusHash == hashCorpus(corpusMap, indices->colorEndBip);
+}
+
+
+
+// Best candidates of a query, ascending distance
+typedef struct IndexCandidatesStruct {
+  guint count;
+  guint leavesVisited;
+  guint distance[IMAGE_SYNTH_INDEX_CANDIDATES];
+  guint32 point[IMAGE_SYNTH_INDEX_CANDIDATES];
+} TIndexCandidates;
+
+
+static inline void
+searchIndexLeaf(
+  const TCorpusIndex *index,
+  const gint8 query[],
+  guint start,
+  guint end,
+  TIndexCandidates *candidates
+  )
+{
+  guint i;
+
+  for (i=start; i<end; i++)
+  {
+    guint distance = 0;
+    guint d;
+    guint j;
+
+    for (d=0; d<IMAGE_SYNTH_INDEX_DIMENSIONS; d++)
+    {
+      gint diff = query[d] - index->entries[i].descriptor[d];
+      distance += diff * diff;
+    }
+    if (candidates->count == IMAGE_SYNTH_INDEX_CANDIDATES
+        && distance >= candidates->distance[IMAGE_SYNTH_INDEX_CANDIDATES - 1]) continue;
+    // Insert in order
+    j = MIN(candidates->count, IMAGE_SYNTH_INDEX_CANDIDATES - 1);
+    while (j > 0 && candidates->distance[j-1] > distance)
+    {
+      candidates->distance[j] = candidates->distance[j-1];
+      candidates->point[j] = candidates->point[j-1];
+      j--;
+    }
+    candidates->distance[j] = distance;
+    candidates->point[j] = index->entries[i].point;
+    if (candidates->count < IMAGE_SYNTH_INDEX_CANDIDATES) candidates->count++;
+  }
+}
+
+
+static void
+searchIndexNode(
+  const TCorpusIndex *index,
+  const gint8 query[],
+  guint node,
+  guint level,
+  guint start,
+  guint end,
+  TIndexCandidates *candidates
+  )
+{
+  guint mid = start + (end - start) / 2;
+  gint diff;
+
+  if (level >= index->depth)
+  {
+    searchIndexLeaf(index, query, start, end, candidates);
+    candidates->leavesVisited++;
+    return;
+  }
+  diff = query[index->nodes[node].splitDimension] - index->nodes[node].splitValue;
+  // Near side first
+  if (diff < 0)
+    searchIndexNode(index, query, 2*node + 1, level + 1, start, mid, candidates);
+  else
+    searchIndexNode(index, query, 2*node + 2, level + 1, mid, end, candidates);
+  // Far side if it might be nearer, and budget remains
+  if (candidates->leavesVisited >= IMAGE_SYNTH_INDEX_MAX_LEAVES) return;
+  if (candidates->count == IMAGE_SYNTH_INDEX_CANDIDATES
+      && (guint) (diff * diff) >= candidates->distance[IMAGE_SYNTH_INDEX_CANDIDATES - 1]) return;
+  if (diff < 0)
+    searchIndexNode(index, query, 2*node + 2, level + 1, mid, end, candidates);
+  else
+    searchIndexNode(index, query, 2*node + 1, level + 1, start, mid, candidates);
+}
+
+
+/*
+Probe the corpus points whose patches are most like the target point's patch, by the index.
+The target's patch is its neighbors (with values) in the window.
+Returns FALSE with *isQueried FALSE if no neighbors in the window: caller should probe otherwise.
+Returns TRUE on perfect match.
+*/
+static gboolean
+probeIndexedCandidates(
+  const TCorpusIndex *index,
+  const TFormatIndices * const indices,
+  const Map * const corpusMap,
+  guint * const bestPatchDiff,  // IN/OUT
+  Coordinates * const bestMatchCorpusPoint, // IN/OUT
+  const guint countNeighbors,
+  const TNeighbor neighbors[],
+  const TNeighborVectors * const neighborVectors,
+  tBettermentKind* latestBettermentKind,
+  const TPixelelMetricFunc corpusTargetMetric,  // array pointers
+  const TMapPixelelMetricFunc mapsMetric,
+  const TBestFitKernel * const kernel,
+  TSynthCounters * const counters,  // IN/OUT
+  gboolean *isQueried   // OUT
+  )
+{
+  TIndexWindow window;
+  gint8 query[IMAGE_SYNTH_INDEX_DIMENSIONS];
+  TIndexCandidates candidates;
+  guint i;
+
+  memset(window.isPresent, 0, sizeof(window.isPresent));
+  window.countPresent = 0;
+  for (i=1; i<countNeighbors; i++)   // Not the target point itself
+    if (isInWindow(neighbors[i].offset))
+      setWindowPixel(&window, neighbors[i].offset, neighbors[i].pixel, (TFormatIndices*) indices);
+
+  *isQueried = describeWindow(index, indices->colorEndBip - FIRST_PIXELEL_INDEX, &window, query);
+  if ( ! *isQueried) return FALSE;
+
+  candidates.count = 0;
+  candidates.leavesVisited = 0;
+  searchIndexNode(index, query, 0, 0, 0, index->count, &candidates);
+
+  for (i=0; i<candidates.count; i++)
+  {
+    Coordinates point = {candidates.point[i] % index->width, candidates.point[i] / index->width};
+    if (probeCorpusPoint(point, indices, corpusMap,
+        bestPatchDiff, bestMatchCorpusPoint,
+        countNeighbors, neighbors, neighborVectors,
+        latestBettermentKind, INDEXED_CORPUS,
+        corpusTargetMetric, mapsMetric, kernel, counters
+        ))
+      return TRUE;
+  }
+  return FALSE;
+}
+
+
+#ifdef DEBUG
+static void
+print_corpus_index_stats(const TCorpusIndex *index)
+{
+  g_printf("Corpus index: %u points, %f seconds, %lu bytes\n",
+    index->count, index->buildSeconds, (unsigned long) index->bytes);
+}
+#else
+#define print_corpus_index_stats(a)
+#endif
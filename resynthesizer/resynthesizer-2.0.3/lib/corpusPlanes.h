@@ -0,0 +1,110 @@
+/*
+Planar copy of the corpus, for the portable kernel of computeBestFit() (bestFitSumPlanar in bestFitVectorized.h.)
+
+The corpus pixmap is interleaved: mask, colors, alpha and map pixelels of a pixel are adjacent,
+and a pixel is addressed by (x + y*width) * depth, with a variable depth.
+Here the corpus is split into planes by how often the kernel reads them:
+- a plane of words, one per pixel, packing the mask and the colors (at most 3),
+  read for every neighbor of every probe: one aligned load, no alpha.
+- a plane of bytes for each map pixelel, read only when matching maps.
+(A plane per color would cost a cache miss per color for a random probe, instead of one.)
+Rows are padded to a multiple of a cache line and planes are aligned to a cache line.
+A pixel is addressed by x + y*stride in every plane,
+so the offset of a neighbor (offset.x + offset.y*stride) is computed once per target point, not per probe.
+
+The corpus does not change during synthesis (only the target does),
+so the copy is made once per engine() call.
+The target stays interleaved: its pixels are copied once per target point into the neighbors,
+which the kernels already read as a structure of arrays (TNeighborVectors.)
+
+Included in bestFitVectorized.h, not compiled separately.
+
+  Copyright (C) 2010, 2011  Lloyd Konneker
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Alignment of planes and rows, in bytes: a cache line
+#define CORPUS_PLANE_ALIGN 64
+
+typedef struct corpusPlanesStruct {
+  guint stride;     // Pixels per row of a plane, at least width
+  Pixelel *block;   // One allocation for all planes, NULL if no planes
+  // Byte j of a word (value >> 8*j) is pixelel j: mask, then colors
+  const guint32 *pixels;
+  // Plane of each map pixelel, indexed by pixelel index less map_start_bip
+  const Pixelel *maps[MAX_IMAGE_SYNTH_BPP];
+} TCorpusPlanes;
+
+
+// Round up to a multiple of CORPUS_PLANE_ALIGN
+static inline gsize
+alignPlaneSize(gsize size)
+{
+  return (size + CORPUS_PLANE_ALIGN - 1) / CORPUS_PLANE_ALIGN * CORPUS_PLANE_ALIGN;
+}
+
+
+static void
+prepareCorpusPlanes(
+  TCorpusPlanes *planes,    // OUT
+  const TFormatIndices *indices,
+  const Map *corpusMap
+  )
+{
+  guint countMaps = indices->map_end_bip - indices->map_start_bip;
+  gsize pixelsSize;
+  gsize mapSize;
+  Pixelel *alignedBlock;
+  guint x;
+  guint y;
+  guint j;
+
+  g_assert(indices->colorEndBip <= sizeof(guint32));  // Mask and colors fit in a word
+
+  planes->stride = alignPlaneSize(corpusMap->width);
+  pixelsSize = alignPlaneSize((gsize) planes->stride * corpusMap->height * sizeof(guint32));
+  mapSize = alignPlaneSize((gsize) planes->stride * corpusMap->height);
+  planes->block = g_new0(Pixelel, pixelsSize + countMaps * mapSize + CORPUS_PLANE_ALIGN);
+  alignedBlock = (Pixelel *) alignPlaneSize((gsize) planes->block);
+
+  planes->pixels = (const guint32 *) alignedBlock;
+  for (j=0; j<countMaps; j++)
+    planes->maps[j] = alignedBlock + pixelsSize + j * mapSize;
+
+  // Deinterleave.  Row padding stays zero, i.e. unselected, but is never read: the kernel clips first.
+  for (y=0; y<corpusMap->height; y++)
+    for (x=0; x<corpusMap->width; x++)
+    {
+      Coordinates point = {x, y};
+      const Pixelel *pixel = pixmap_index(corpusMap, point);
+      guint address = x + y * planes->stride;
+      guint32 word = 0;
+
+      for (j=MASK_PIXELEL_INDEX; j<indices->colorEndBip; j++)
+        word |= (guint32) pixel[j] << (8 * j);
+      ((guint32 *) planes->pixels)[address] = word;
+      for (j=0; j<countMaps; j++)
+        ((Pixelel *) planes->maps[j])[address] = pixel[indices->map_start_bip + j];
+    }
+}
+
+
+static void
+freeCorpusPlanes(TCorpusPlanes *planes)
+{
+  g_free(planes->block);
+  planes->block = NULL;
+}
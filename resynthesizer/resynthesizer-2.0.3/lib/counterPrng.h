@@ -0,0 +1,101 @@
+/*
+Counter-based pseudo random number generator for synthesis.
+
+Formerly all threads drew from one shared GRand.
+Besides contention for the GRand (written on every draw), the sequence of numbers any target point got
+depended on the interleaving of threads, so threaded results differed from run to run.
+
+Here a generator is not a shared state but a pure function of (key, counter):
+the n-th number of a stream is a hash (the SplitMix64 finalizer) of the key plus n times a constant.
+A stream is keyed by the user's seed, the pass, and the index of the target point.
+So the random corpus points probed for a target point do not depend on
+which thread synthesizes it, or when.
+Each thread keeps its generator on its stack: no sharing, no contention.
+
+Given the same seed, results are repeatable when unthreaded.
+Threads also read neighbors that other threads are concurrently synthesizing:
+results with threads are repeatable (for any count of threads) only if parameter isDeterministic,
+see deterministicRounds.h.
+
+  Copyright (C) 2010, 2011  Lloyd Konneker
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Weyl sequence increment of SplitMix64: 2^64 / golden ratio
+#define PRNG_GOLDEN_GAMMA 0x9E3779B97F4A7C15ULL
+
+typedef struct CounterPrngStruct {
+  guint64 key;
+  guint64 counter;
+} TCounterPrng;
+
+
+// SplitMix64 finalizer: a bijective hash with good avalanche
+static inline guint64
+prngMix(guint64 z)
+{
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+
+/*
+Key for a sub stream of a key, e.g. for a pass of a seed, or for a target point of a pass.
+Distinct streams of the same key are (statistically) independent.
+*/
+static inline guint64
+prngSubKey(
+  guint64 key,
+  guint64 stream
+  )
+{
+  return prngMix(key ^ prngMix((stream + 1) * PRNG_GOLDEN_GAMMA));
+}
+
+
+static inline void
+prngInit(
+  TCounterPrng *prng,
+  guint64 key
+  )
+{
+  prng->key = key;
+  prng->counter = 0;
+}
+
+
+static inline guint32
+prngNext(TCounterPrng *prng)
+{
+  prng->counter++;
+  return (guint32) (prngMix(prng->key + prng->counter * PRNG_GOLDEN_GAMMA) >> 32);
+}
+
+
+/*
+Integer in [begin, end).
+Multiply and shift instead of modulo: nearly uniform (bias at most range/2^32) and no division.
+*/
+static inline gint
+prngIntRange(
+  TCounterPrng *prng,
+  gint begin,
+  gint end
+  )
+{
+  return begin + (gint) (((guint64) prngNext(prng) * (guint32) (end - begin)) >> 32);
+}
@@ -0,0 +1,91 @@
+/*
+Deterministic threaded passes (parameter isDeterministic.)
+
+With more than one thread, threads read the neighbors (hasValueMap, sourceOfMap) of their target points
+while other threads are writing them.  Whether a neighbor is read before or after it is synthesized
+depends on the timing of threads, so results differed from run to run.
+Heuristic 2 (recentProberMap) is also shared: whether a tag is still there when read depends on timing too.
+
+Here a pass is divided into rounds of consecutive target points (in the pass order.)
+Within a round, threads synthesize but do not write the shared maps:
+each target point's new source (or none) is kept in a TDeferredSources, by its index in the round.
+So every point of a round reads its neighbors as they were at the start of the round.
+At the end of the round (when the pool's threads are done) the refiner writes them, in order,
+see commitDeferredSources().
+Instead of recentProberMap, each target point keeps the corpus points it probed by heuristic 1.
+
+Which thread synthesizes which point no longer matters: given the same seed,
+results are the same from run to run, and for any count of threads, including one.
+(When built unthreaded, passes are not divided: results are as before, each point reading all prior points.)
+
+A round is at least IMAGE_SYNTH_ROUND_MIN points (enough to keep the threads busy)
+and at most 1/IMAGE_SYNTH_ROUND_FRACTION of the points of the pass before it.
+So a point misses at most that fraction of the points synthesized before it, and results are nearly as good.
+The cost is a barrier per round, and the writes done by one thread.
+
+Included in engine.c, not compiled separately.
+
+  Copyright (C) 2010, 2011  Lloyd Konneker
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// New sources of the target points of a round, written at the end of the round
+typedef struct deferredSourcesStruct {
+  guint startTargetIndex;   // Of the round, in the pass order
+  Coordinates *sources;     // Per target point of the round: its new source, or (-1,-1) if it keeps its source
+} TDeferredSources;
+
+
+// Longest round of a pass of at most countTargetPoints
+static inline guint
+maxRoundSize(guint countTargetPoints)
+{
+  return MAX(IMAGE_SYNTH_ROUND_MIN, countTargetPoints / IMAGE_SYNTH_ROUND_FRACTION);
+}
+
+
+// End (exclusive) of the round starting at startTargetIndex.  Does not depend on the count of threads.
+static inline guint
+roundEnd(
+  guint startTargetIndex,
+  guint endTargetIndex
+  )
+{
+  guint size = MAX(IMAGE_SYNTH_ROUND_MIN, startTargetIndex / IMAGE_SYNTH_ROUND_FRACTION);
+
+  return MIN(startTargetIndex + size, endTargetIndex);
+}
+
+
+#ifdef SYNTH_THREADED
+static void
+newDeferredSources(
+  TDeferredSources *deferred,
+  guint countTargetPoints
+  )
+{
+  deferred->startTargetIndex = 0;
+  deferred->sources = g_new(Coordinates, maxRoundSize(countTargetPoints));
+}
+
+
+static void
+freeDeferredSources(TDeferredSources *deferred)
+{
+  g_free(deferred->sources);
+  deferred->sources = NULL;
+}
+#endif
@@ -90,10 +90,11 @@ It doesn't make tiles in the target, it makes a target that is suitable as a til
   /*
   More proxy.  Redefine GRand routines
   On platform Linux, used Glib g_rand
-  On platform OSX (when using stdc but not Glib), proxy calls stdc rand()
+  On platform OSX (when using stdc but not Glib), proxy has its own generator per GRand, see glibProxy.h
   */
   #define g_rand_new_with_seed(s) s_rand_new_with_seed(s)
   #define g_rand_int_range(r,u,l) s_rand_int_range(r,u,l)
+  #define g_rand_free(r) s_rand_free(r)
 #endif
 
 /* Shared with resynth-gui, engine plugin, and engine */
@@ -117,6 +118,9 @@ Also, some functions are inlined.
 #include "mapOps.h"   // definitions for map.h
 #include "matchWeighting.h"
 #include "orderTarget.h"
+#include "counterPrng.h"
+#include "passes.h"
+#include "progress.h"   // isCanceled(), also polled by the preparations
 
 
 #ifdef STATS
@@ -149,22 +153,51 @@ Would require different wrapOrClipTarget().
 Might affect performance of cache or memory swapping
 */
 
+/*
+A bitmap: one bit per pixel, 32 pixels to a word.
+prepare_neighbors() reads it for many pixels around each target point, so small is fast.
+
+Threaded: written by one thread while other threads read it, without a lock.
+Other threads may be setting other bits of the same word: an atomic OR, not a store.
+Release after the store of the source (see setSourceOf),
+so a thread that sees hasValue for a target point also sees its source.
+*/
 static inline void
 setHasValue( Coordinates *coords, guchar value, Map* hasValueMap)
 {
-  *bytemap_index(hasValueMap, *coords) = value;
+  guint32 bit;
+  guint32 *word = bitmap_index(hasValueMap, *coords, &bit);
+  
+#ifdef SYNTH_THREADED
+  if (value)
+    __atomic_fetch_or(word, bit, __ATOMIC_RELEASE);
+  else
+    __atomic_fetch_and(word, ~bit, __ATOMIC_RELEASE);
+#else
+  if (value)
+    *word |= bit;
+  else
+    *word &= ~bit;
+#endif
 }
 
 static inline gboolean
 getHasValue(Coordinates coords, Map* hasValueMap)
 {
-  return (* bytemap_index(hasValueMap, coords));
+  guint32 bit;
+  guint32 *word = bitmap_index(hasValueMap, coords, &bit);
+  
+#ifdef SYNTH_THREADED
+  return (__atomic_load_n(word, __ATOMIC_ACQUIRE) & bit) != 0;
+#else
+  return (*word & bit) != 0;
+#endif
 }
 
 static inline void
 prepareHasValue(Map* targetMap, Map* hasValueMap)
 {
-  new_bytemap(hasValueMap, targetMap->width, targetMap->height);
+  new_bitmap(hasValueMap, targetMap->width, targetMap->height);
 }
 
 
@@ -179,27 +212,60 @@ of the target (context), whose source is always themselves.
 However, the extra memory is probably not a resource problem,
 and probably not a performance problem because it is only used in prepare_neighbors,
 the source are copied to a dense structure neighbor_sources for the inner search.
+
+A source is stored as its linear index in the corpus (x + y*corpusWidth), or SOURCE_NONE:
+4 bytes per pixel, not 8 for Coordinates.  Limits the corpus to G_MAXUINT pixels, see engineLevel().
+getSourceOf() returns Coordinates, (-1,-1) for none.
+
+Threaded: a source is one aligned word, read and written with atomic loads and stores.
+A source is also the version of the color of a target point: see new_neighbor() in synthesize.h.
 */
 
+#define SOURCE_NONE G_MAXUINT
+
+typedef struct sourceMapStruct {
+  Map map;            // intmap, a linear index per target pixel
+  guint corpusWidth;  // Of the corpus the indices are into
+} TSourceMap;
 
 static inline void
 setSourceOf (
   Coordinates target_point,
   Coordinates source_corpus_point,
-  Map* sourceOfMap
+  TSourceMap* sourceOfMap
   )
 {
-  *coordmap_index(sourceOfMap, target_point) = source_corpus_point;
+  guint source = (source_corpus_point.x == -1) ? SOURCE_NONE
+    : source_corpus_point.x + source_corpus_point.y * sourceOfMap->corpusWidth;
+  
+#ifdef SYNTH_THREADED
+  __atomic_store_n(intmap_index(&sourceOfMap->map, target_point), source, __ATOMIC_RELEASE);
+#else
+  *intmap_index(&sourceOfMap->map, target_point) = source;
+#endif
 }
   
 
 static inline Coordinates
 getSourceOf ( 
   Coordinates target_point,
-  Map* sourceOfMap
+  TSourceMap* sourceOfMap
   )
 {
-  return *coordmap_index(sourceOfMap, target_point);
+  Coordinates point = {-1, -1};
+  guint source;
+  
+#ifdef SYNTH_THREADED
+  source = __atomic_load_n(intmap_index(&sourceOfMap->map, target_point), __ATOMIC_ACQUIRE);
+#else
+  source = *intmap_index(&sourceOfMap->map, target_point);
+#endif
+  if (source != SOURCE_NONE)
+  {
+    point.x = source % sourceOfMap->corpusWidth;
+    point.y = source / sourceOfMap->corpusWidth;
+  }
+  return point;
 }
   
 
@@ -207,26 +273,33 @@ getSourceOf (
 static void
 prepare_target_sources(
   Map* targetMap,
-  Map* sourceOfMap)
+  Map* corpusMap,
+  TSourceMap* sourceOfMap)
 {
   guint x;
   guint y;
-  Coordinates null_coords = {-1, -1};
   
-  new_coordmap(sourceOfMap, targetMap->width, targetMap->height);
+  new_intmap(&sourceOfMap->map, targetMap->width, targetMap->height);
+  sourceOfMap->corpusWidth = corpusMap->width;
   
   for(y=0; y<targetMap->height; y++)
     for(x=0; x<targetMap->width; x++) 
       {
       Coordinates coords = {x,y}; 
-      setSourceOf(coords, null_coords, sourceOfMap);
+      *intmap_index(&sourceOfMap->map, coords) = SOURCE_NONE;
       }
 }
 
+static void
+freeSourceMap(TSourceMap* sourceOfMap)
+{
+  free_map(&sourceOfMap->map);
+}
+
 static inline gboolean
 has_source (
   Coordinates target_point,
-  Map* sourceOfMap
+  TSourceMap* sourceOfMap
   )
 {
   return (getSourceOf(target_point, sourceOfMap).x != -1) ;
@@ -310,22 +383,63 @@ Array of index of most recent target point that probed this corpus point
 (recentProberMap[corpus x,y] = target)
 !!! Larger than necessary if the corpus has holes in it.  TODO very minor.
 !!! Note recentProberMap is unsigned, -1 == 0xFFFFFF should not match any target index.
+
+With SYNTH_COMPACT_PROBER, not the index but a 16-bit tag of it, for half the memory:
+the low bits of the index xor its generation (the high bits.)
+Target points 2^16 or so apart can have the same tag, then heuristic 2 can skip a probe it should not.
+Rare, and only a probe, but results differ slightly from the full index.
 */
+#ifdef SYNTH_COMPACT_PROBER
+typedef gushort TProberTag;
+#else
+typedef guint TProberTag;
+#endif
+
+static inline TProberTag
+proberTag(guint targetIndex)
+{
+#ifdef SYNTH_COMPACT_PROBER
+  return (TProberTag) (targetIndex ^ (targetIndex >> 16));
+#else
+  return targetIndex;
+#endif
+}
+
+static inline TProberTag*
+recentProberIndex(Map* recentProberMap, Coordinates coords)
+{
+#ifdef SYNTH_COMPACT_PROBER
+  return shortmap_index(recentProberMap, coords);
+#else
+  return intmap_index(recentProberMap, coords);
+#endif
+}
+
 static void
-prepareRecentProber(Map* corpusMap, Map* recentProberMap)
+resetRecentProber(Map* recentProberMap)
 {
   guint x;
   guint y;
   
-  new_intmap(recentProberMap, corpusMap->width, corpusMap->height);
-  for(y=0; y< (guint) corpusMap->height; y++)
-    for(x=0; x< (guint) corpusMap->width; x++)
+  for(y=0; y< (guint) recentProberMap->height; y++)
+    for(x=0; x< (guint) recentProberMap->width; x++)
     {
       Coordinates coords = {x,y};
-      *intmap_index(recentProberMap, coords) = -1;
+      *recentProberIndex(recentProberMap, coords) = -1;
     } 
 }
 
+static void
+prepareRecentProber(Map* corpusMap, Map* recentProberMap)
+{
+#ifdef SYNTH_COMPACT_PROBER
+  new_shortmap(recentProberMap, corpusMap->width, corpusMap->height);
+#else
+  new_intmap(recentProberMap, corpusMap->width, corpusMap->height);
+#endif
+  resetRecentProber(recentProberMap);
+}
+
 
 /*
 Prepare target AND initialize hasValueMap.
@@ -334,6 +448,7 @@ and the context (the surroundings.)
 Both come from the target image.  But the *target* is not *target image*.
 Prepare a vector of target points.
 Initialize hasValueMap for all target points.
+Polls cancel per row: stops early, the caller tests isCanceled().
 */
 static void
 prepareTargetPoints( 
@@ -341,7 +456,8 @@ prepareTargetPoints(
   TFormatIndices* indices,
   Map* targetMap,
   Map* hasValueMap,
-  pointVector* targetPoints
+  pointVector* targetPoints,
+  const int *cancelFlag
   )
 {
   guint x;
@@ -349,7 +465,7 @@ prepareTargetPoints(
   
   /* Count selected pixels in the image, for sizing a vector */
   guint size = 0;
-  for(y=0; y<targetMap->height; y++)
+  for(y=0; y<targetMap->height && ! isCanceled(cancelFlag); y++)
     for(x=0; x<targetMap->width; x++)
       {
       Coordinates coords = {x,y};
@@ -361,7 +477,7 @@ prepareTargetPoints(
   
   prepareHasValue(targetMap, hasValueMap);  /* reserve, initialize to value: unknown */
   
-  for(y=0; y<targetMap->height; y++)
+  for(y=0; y<targetMap->height && ! isCanceled(cancelFlag); y++)
     for(x=0; x<targetMap->width; x++) 
     {
       Coordinates coords = {x,y};
@@ -396,12 +512,14 @@ prepareTargetPoints(
 /* 
 Scan corpus pixmap for selected && nottransparent pixels, create vector of coords.
 Used to sample corpus.
+Polls cancel per row: stops early, the caller tests isCanceled().
 */
 void
 prepareCorpusPoints (
   TFormatIndices* indices,
   Map* corpusMap,
-  pointVector* corpusPoints
+  pointVector* corpusPoints,
+  const int *cancelFlag
   ) 
 {
   /* Reserve size of pixmap, but excess, includes unselected. */
@@ -412,7 +530,7 @@ prepareCorpusPoints (
   guint x;
   guint y;
   
-  for(y=0; y<corpusMap->height; y++)
+  for(y=0; y<corpusMap->height && ! isCanceled(cancelFlag); y++)
     for(x=0; x<corpusMap->width; x++)
     {
       Coordinates coords = {x, y};
@@ -434,11 +552,11 @@ prepareCorpusPoints (
 static inline Coordinates
 randomCorpusPoint (
   pointVector corpusPoints,
-  GRand * prng
+  TCounterPrng * prng
   )
 {
   /* Was rand()%corpusPoints_size but thats not uniform. */
-  gint index = g_rand_int_range(prng, 0, corpusPoints->len);
+  gint index = prngIntRange(prng, 0, corpusPoints->len);
   return g_array_index(corpusPoints, Coordinates, index);
 }
 
@@ -461,39 +579,62 @@ Why?  So from one corner, the offsets will reach fully across.
 TODO, for uncropping, where the target surrounds the corpus,
 this might be vastly many more offsets than are needed for good synthesis.
 But at worst, if not used they get paged out from virtual memory.
+
+Sorted by a counting sort on the squared distance (the key of lessCartesian()),
+in the order g_array_sort() gave: lessCartesian() never answers equal, so its merge sort
+reversed the row major order of offsets at the same distance.
+Linear time: a sort of the millions of offsets of a large image took seconds, not cancelable.
+Polls cancel per row.  Returns FALSE, holding nothing, if canceled.
 */
-static void 
+static gboolean 
 prepareSortedOffsets(
   Map* targetMap,
   Map* corpusMap,
-  pointVector* sortedOffsets
+  pointVector* sortedOffsets,
+  const int *cancelFlag
   ) 
 {
   // Minimum().  Use smaller dimension of corpus and target.
   gint width = (corpusMap->width < targetMap->width ? corpusMap->width : targetMap->width);
   gint height = (corpusMap->height < targetMap->height ? corpusMap->height : targetMap->height);
   guint allocatedSize = (2*width-1)*(2*height-1);   // eg for width==3, [-2,-1,0,1,2], size==5
-  
-  *sortedOffsets = g_array_sized_new (FALSE, TRUE, sizeof(Coordinates), allocatedSize); //Reserve
-  
-  {
+  guint maxDistance = (width-1)*(width-1) + (height-1)*(height-1);  // Squared
+  guint *starts = g_new0(guint, maxDistance + 2);   // Per squared distance: index of its first offset
   gint x; // !!! Signed offsets
   gint y;
+  guint distance;
   
-  for(y=-height+1; y<height; y++)
+  // Count offsets at each distance, one further
+  for(y=-height+1; y<height && ! isCanceled(cancelFlag); y++)
     for(x=-width+1; x<width; x++) 
+      starts[x*x + y*y + 1]++;
+  // Sum counts: offsets nearer than each distance
+  for(distance=1; distance<=maxDistance; distance++)
+    starts[distance] += starts[distance-1];
+  
+  // Not cleared: every element is placed below, and touching hundreds of MB here is not cancelable
+  *sortedOffsets = g_array_sized_new (FALSE, FALSE, sizeof(Coordinates), 0);
+  g_array_set_size(*sortedOffsets, allocatedSize);
+  // Reverse row major order
+  for(y=height-1; y>-height && ! isCanceled(cancelFlag); y--)
+    for(x=width-1; x>-width; x--) 
       {
       Coordinates coords = {x,y};
-      g_array_append_val(*sortedOffsets, coords);
+      g_array_index(*sortedOffsets, Coordinates, starts[x*x + y*y]++) = coords;
       }
-  }
-  g_assert((*sortedOffsets)->len == allocatedSize);  // Completely filled
-  g_array_sort(*sortedOffsets, (gint (*)(const void*, const void*)) lessCartesian);
+  g_free(starts);
   
   /* lkk An experiment to sort the offsets in row major order for better memory 
   locality didn't help performance. 
   Apparently the cpu cache holds many rows of the corpus.
   */
+  if (isCanceled(cancelFlag))
+  {
+    g_array_free(*sortedOffsets, TRUE);
+    *sortedOffsets = NULL;
+    return FALSE;
+  }
+  return TRUE;
 }
 
 
@@ -520,8 +661,9 @@ clippedOrMaskedCorpus(
 // Included source (function declarations, not just definitions.)
 // Descending levels of the engine
 // imageSynth()->engine()->refiner()->synthesize
-#include "passes.h"
-#include "progress.h"
+#include "adaptivePasses.h"
+#include "synthStats.h"
+#include "deterministicRounds.h"
 #include "synthesize.h"
 // Both files define the same function refiner()
 #ifdef SYNTH_THREADED
@@ -529,19 +671,31 @@ clippedOrMaskedCorpus(
 #else
   #include "refiner.h"
 #endif
+#include "pyramid.h"
+#include "preparedCorpus.h"
 
 /*
-The engine.
-Independent of platform, calling app, and graphics libraries.
+The engine at one level of resolution.
 This is mostly preparation: real work done by refiner() and synthesize().
+
+If coarseSourceOfMap, the target starts from the sources found at a coarser level, see pyramid.h.
+If resultSourceOfMap, returns the sources found, for a finer level.  Caller must free it.
+If corpusIndex is an index of this corpus, the first pass uses it, see corpusIndex.h.
+Else if parameters.isCorpusIndexed, builds an index for this call only.
+If preparedCorpus (already checked to be of this corpus), uses it instead of preparing the corpus, see preparedCorpus.h.
 */
 
-int
-engine(
+static int
+engineLevel(
   TImageSynthParameters parameters,
   TFormatIndices* indices,
   Map* targetMap,
   Map* corpusMap,
+  TSourceMap* coarseSourceOfMap,  // IN or NULL
+  TSourceMap* resultSourceOfMap,  // OUT or NULL
+  TCorpusIndex* corpusIndex,  // IN or NULL
+  TPreparedCorpus* preparedCorpus,  // IN/OUT or NULL
+  gint64 deadline,  // Of the time budget, or 0
   void (*progressCallback)(int, void*),
   void *contextInfo,
   int *cancelFlag
@@ -550,14 +704,15 @@ engine(
   // Engine private data. On stack (and heap), not global, so engine is reentrant.
   
   /*
-  A map on the corpus yielding indexes of target points.
+  The corpus side, the caller's prepared corpus or prepared here:
+  corpusPoints (for sampling corpus randomly), sortedOffsets (offsets for finding neighbors),
+  lookup tables for quantized functions, the kernel for computeBestFit chosen for this CPU, and
+  recentProberMap: a map on the corpus yielding indexes of target points.
   For a point in the corpus, which target point (index!) most recently probed the corpus point.
-  recentProbe[coords corpus point] -> index of target_point that most recently probed corpus point
   Heuristic#2.
-  
-  2-D array of int, addressable by Coordinates.
-  */    
-  Map recentProberMap;
+  */
+  TPreparedCorpus ownCorpus;
+  TPreparedCorpus *corpus;
   
   /*
   Flags for state of synthesis of image pixels.
@@ -571,30 +726,39 @@ engine(
   Does this target pixel have a source yet: yields corpus coords. 
   (-1,-1) indicates no source.
   */
-  Map sourceOfMap;   
+  TSourceMap sourceOfMap;  
 
   /* 
   1-D array (vector) of Coordinates.
-  Subsets of image and corpus, subsetted by selection and alpha.
+  Subset of image, subsetted by selection and alpha.
   */
   pointVector targetPoints;   // For synthesizing target in an order (ie random)
-  pointVector corpusPoints;   // For sampling corpus randomly.
-  pointVector sortedOffsets;  // offsets (signed coordinates) for finding neighbors.
   
-  GRand *prng;  // pseudo random number generator
+  GRand *prng;  // pseudo random number generator for ordering target, single threaded
+  
+  // Count of passes over the target
+  guint passCount = MAX_PASSES;
   
-  // Arrays, lookup tables for quantized functions
-  TPixelelMetricFunc corpusTargetMetric;
-  TMapPixelelMetricFunc mapMetric;
+  // Index of corpus patches built by this call (not the caller's)
+  TCorpusIndex *ownCorpusIndex = NULL;
   
   // check parameters in range
   if ( parameters.patchSize > IMAGE_SYNTH_MAX_NEIGHBORS)
     return IMAGE_SYNTH_ERROR_PATCH_SIZE_EXCEEDED;
+  // A source is a linear index into the corpus, SOURCE_NONE excluded.  Use tiles, see tiles.h.
+  if ( (guint64) corpusMap->width * corpusMap->height >= SOURCE_NONE )
+    return IMAGE_SYNTH_ERROR_CORPUS_TOO_LARGE;
+  
+  /*
+  Preparations of a large image take seconds: they poll cancel as synthesis does,
+  and return IMAGE_SYNTH_ERROR_CANCELED, the target unchanged.
+  */
   
   // target prep
   prepareTargetPoints(parameters.matchContextType, indices, targetMap, 
     &hasValueMap, 
-    &targetPoints);
+    &targetPoints,
+    cancelFlag);
   #ifdef ANIMATE
   clear_target_pixels(indices->color_end_bip);  // For debugging, blacken so new colors sparkle
   #endif
@@ -602,51 +766,80 @@ engine(
   Rare user error: no target selected (mask empty.)
   This error NOT occur in GIMP if selection does not intersect, since then we use the whole drawable.
   */
-  if ( !targetPoints->len ) 
+  if ( !targetPoints->len || isCanceled(cancelFlag) ) 
   {
     g_array_free(targetPoints, TRUE);
     free_map(&hasValueMap);
-    return IMAGE_SYNTH_ERROR_EMPTY_TARGET;
+    return isCanceled(cancelFlag) ? IMAGE_SYNTH_ERROR_CANCELED : IMAGE_SYNTH_ERROR_EMPTY_TARGET;
   }
-  prepare_target_sources(targetMap, &sourceOfMap);
+  prepare_target_sources(targetMap, corpusMap, &sourceOfMap);
 
   
   // source prep
-  prepareCorpusPoints(indices, corpusMap, &corpusPoints);
+  if (preparedCorpus)
+    corpus = preparedCorpus;
   /* 
   Rare user error: all corpus pixels transparent or not selected (mask empty.) Which means we can't synthesize.
   This error NOT occur in GIMP if selection does not intersect, since then we use the whole drawable.
   */
-  if (!corpusPoints->len )
+  else if ( prepareCorpus(&ownCorpus, &parameters, indices, corpusMap, cancelFlag) )
+    corpus = &ownCorpus;
+  else
   {
     g_array_free(targetPoints, TRUE);
     free_map(&hasValueMap);
-    free_map(&sourceOfMap);
-    g_array_free(corpusPoints, TRUE);
-    return IMAGE_SYNTH_ERROR_EMPTY_CORPUS;
+    freeSourceMap(&sourceOfMap);
+    return isCanceled(cancelFlag) ? IMAGE_SYNTH_ERROR_CANCELED : IMAGE_SYNTH_ERROR_EMPTY_CORPUS;
+  }
+  if ( ! usePreparedCorpus(corpus, targetMap, corpusMap, cancelFlag) )
+  {
+    g_array_free(targetPoints, TRUE);
+    free_map(&hasValueMap);
+    freeSourceMap(&sourceOfMap);
+    if (corpus == &ownCorpus) releaseCorpus(&ownCorpus);
+    return IMAGE_SYNTH_ERROR_CANCELED;
   }
-  
-  // prep things not images
-  prepareSortedOffsets(targetMap, corpusMap, &sortedOffsets); // Depends on image size
-  quantizeMetricFuncs(
-    parameters.sensitivityToOutliers, 
-    parameters.mapWeight,
-    corpusTargetMetric,
-    mapMetric
-    );
  
   // Now we need a prng, before order_targetPoints
   /* Originally: srand(time(0));   But then testing is non-repeatable. 
-  TODO the seed should be a hash of the input or a user parameter.
-  Then it would be repeatable, but changeable by the user.
+  The seed is a user parameter: repeatable, but changeable by the user.
+  Synthesis itself uses counter based generators keyed by the same seed, see counterPrng.h
   */
-  prng = g_rand_new_with_seed(1198472);
+  prng = g_rand_new_with_seed(parameters.seed);
   
   int error = orderTargetPoints(&parameters, targetPoints, prng);
   // A programming error that we don't clean up.
   if (error) return error;
   
-  prepareRecentProber(corpusMap, &recentProberMap);  // Must follow prepare_corpus
+  if (coarseSourceOfMap)
+  {
+    // Target already nearly synthesized: only refine, with fewer passes and probes.
+    upsampleSources(indices, targetMap, corpusMap, &hasValueMap, &sourceOfMap, targetPoints, coarseSourceOfMap);
+    passCount = IMAGE_SYNTH_PYRAMID_PASSES;
+    parameters.maxProbeCount = MAX(1, parameters.maxProbeCount / IMAGE_SYNTH_PYRAMID_PROBE_DIVISOR);
+    corpusIndex = NULL;  // No first pass from scratch
+  }
+  else if ( ! isCorpusIndexOf(corpusIndex, indices, corpusMap) )
+  {
+    corpusIndex = NULL;
+    if (parameters.isCorpusIndexed)
+    {
+      // NULL if nothing to index (then random probes as usual) or canceled
+      ownCorpusIndex = buildCorpusIndex(indices, corpusMap, cancelFlag);
+      corpusIndex = ownCorpusIndex;
+      if (isCanceled(cancelFlag))
+      {
+        free_map(&hasValueMap);
+        freeSourceMap(&sourceOfMap);
+        g_array_free(targetPoints, TRUE);
+        freeCorpusIndex(ownCorpusIndex);
+        if (corpus == &ownCorpus) releaseCorpus(&ownCorpus);
+        g_rand_free(prng);
+        return IMAGE_SYNTH_ERROR_CANCELED;
+      }
+    }
+  }
+  if (corpusIndex) print_corpus_index_stats(corpusIndex);
   
   // Preparations done, begin actual synthesis
   print_processor_time();
@@ -658,15 +851,19 @@ engine(
     indices,
     targetMap,
     corpusMap,
-    &recentProberMap,
+    &corpus->recentProberMap,
     &hasValueMap,
     &sourceOfMap,
     targetPoints,
-    corpusPoints,
-    sortedOffsets,
-    prng,
-    corpusTargetMetric,
-    mapMetric,
+    corpus->corpusPoints,
+    corpus->sortedOffsets,
+    prngMix(parameters.seed),
+    corpus->corpusTargetMetric,
+    corpus->mapMetric,
+    &corpus->kernel,
+    corpusIndex,
+    passCount,
+    deadline,
     progressCallback,
     contextInfo,
     cancelFlag
@@ -674,19 +871,282 @@ engine(
     
   // Free internal mallocs.
   // Caller must free the IN pixmaps since the targetMap holds synthesis results
-  free_map(&recentProberMap);
   free_map(&hasValueMap);
-  free_map(&sourceOfMap);
+  if (resultSourceOfMap)
+    *resultSourceOfMap = sourceOfMap;  // Caller frees
+  else
+    freeSourceMap(&sourceOfMap);
   
   g_array_free(targetPoints, TRUE);
-  g_array_free(corpusPoints, TRUE);
-  g_array_free(sortedOffsets, TRUE);
+  freeCorpusIndex(ownCorpusIndex);
+  if (corpus == &ownCorpus) releaseCorpus(&ownCorpus);
   
-  #ifdef SYNTH_USE_GLIB
   g_rand_free(prng);
-  #endif
   
-  return 0; // Success, even if canceled
+  return 0; // Success, even if canceled during synthesis
 }
 
 
+/*
+Synthesize at half size (recursively), then refine at this size.
+See pyramid.h.
+levels counts this level.
+*/
+static int
+pyramidLevel(
+  TImageSynthParameters parameters,
+  TFormatIndices* indices,
+  Map* targetMap,
+  Map* corpusMap,
+  guint levels,
+  TSourceMap* resultSourceOfMap,  // OUT or NULL
+  TCorpusIndex* corpusIndex,  // IN or NULL
+  TPreparedCorpus* preparedCorpus,  // IN/OUT or NULL
+  gint64 deadline,
+  TPyramidProgress* progress,
+  int *cancelFlag
+  )
+{
+  Map coarseTargetMap;
+  Map coarseCorpusMap;
+  TSourceMap coarseSourceOfMap;
+  TPyramidProgress coarseProgress;
+  int error;
+  
+  if (levels <= 1 || ! isPyramidLevelUseful(targetMap, corpusMap))
+    return engineLevel(parameters, indices, targetMap, corpusMap, NULL, resultSourceOfMap, corpusIndex,
+      preparedCorpus, deadline, pyramidProgressCallback, progress, cancelFlag);
+  
+  downsamplePixmap(indices, targetMap, &coarseTargetMap, FALSE);
+  downsamplePixmap(indices, corpusMap, &coarseCorpusMap, TRUE);
+  
+  /*
+  Progress: the coarser levels get the first part.
+  The coarser level does full synthesis on a quarter of the pixels,
+  this level only refines, so split about evenly.
+  */
+  coarseProgress = *progress;
+  coarseProgress.percentSpan = progress->percentSpan / 2;
+  error = pyramidLevel(parameters, indices, &coarseTargetMap, &coarseCorpusMap, levels - 1,
+    &coarseSourceOfMap, NULL, NULL, deadline, &coarseProgress, cancelFlag);  // Caller's index is not of the coarse corpus
+  free_map(&coarseTargetMap);
+  free_map(&coarseCorpusMap);
+  
+  if (error == IMAGE_SYNTH_ERROR_EMPTY_TARGET || error == IMAGE_SYNTH_ERROR_EMPTY_CORPUS)
+    /*
+    The target or corpus vanished at the coarser level, e.g. a thin selection or a corpus full of holes.
+    Synthesize this level from scratch.
+    */
+    return engineLevel(parameters, indices, targetMap, corpusMap, NULL, resultSourceOfMap, corpusIndex,
+      preparedCorpus, deadline, pyramidProgressCallback, progress, cancelFlag);
+  if (error) return error;
+  if (isCanceled(cancelFlag))
+  {
+    freeSourceMap(&coarseSourceOfMap);
+    // Canceled is not an error: the caller still frees the sources, none found at this level
+    if (resultSourceOfMap) prepare_target_sources(targetMap, corpusMap, resultSourceOfMap);
+    return 0;
+  }
+  
+  {
+  TPyramidProgress fineProgress = *progress;
+  fineProgress.percentStart = progress->percentStart + coarseProgress.percentSpan;
+  fineProgress.percentSpan = progress->percentSpan - coarseProgress.percentSpan;
+  error = engineLevel(parameters, indices, targetMap, corpusMap, &coarseSourceOfMap, resultSourceOfMap, NULL,
+    preparedCorpus, deadline, pyramidProgressCallback, &fineProgress, cancelFlag);
+  }
+  freeSourceMap(&coarseSourceOfMap);
+  return error;
+}
+
+
+/*
+The engine on the whole of the given target and corpus: all levels of the pyramid, if any.
+If resultSourceOfMap, returns the sources found.  Caller must free it.
+*/
+static int
+engineLevels(
+  TImageSynthParameters parameters,
+  TFormatIndices* indices,
+  Map* targetMap,
+  Map* corpusMap,
+  TSourceMap* resultSourceOfMap,  // OUT or NULL
+  TCorpusIndex *corpusIndex,  // IN or NULL
+  TPreparedCorpus *preparedCorpus,  // IN/OUT or NULL
+  gint64 deadline,
+  void (*progressCallback)(int, void*),
+  void *contextInfo,
+  int *cancelFlag
+  )
+{
+  if (parameters.pyramidLevels > 1)
+  {
+    TPyramidProgress progress = {progressCallback, contextInfo, 0, 100};
+    
+    return pyramidLevel(parameters, indices, targetMap, corpusMap, parameters.pyramidLevels, resultSourceOfMap, corpusIndex,
+      preparedCorpus, deadline, &progress, cancelFlag);
+  }
+  return engineLevel(parameters, indices, targetMap, corpusMap, NULL, resultSourceOfMap, corpusIndex,
+    preparedCorpus, deadline, progressCallback, contextInfo, cancelFlag);
+}
+
+
+// Included here because it calls engineLevels()
+#include "tiles.h"
+#include "batch.h"
+
+
+/*
+The engine, using what the caller prepared of the corpus, if any.
+*/
+
+static int
+engineWithCorpus(
+  TImageSynthParameters parameters,
+  TFormatIndices* indices,
+  Map* targetMap,
+  Map* corpusMap,
+  TCorpusIndex *corpusIndex,  // IN or NULL
+  TPreparedCorpus *preparedCorpus,  // IN/OUT or NULL, of this corpus
+  TSourceMap* resultSourceOfMap,  // OUT or NULL
+  void (*progressCallback)(int, void*),
+  void *contextInfo,
+  int *cancelFlag
+  )
+{
+  TTiling tiling;
+  // Passes stop when the time budget is spent, see isPastDeadline()
+  gint64 deadline = parameters.timeBudget ? g_get_monotonic_time() + (gint64) parameters.timeBudget * 1000 : 0;
+  
+  resetEngineStats(parameters.stats);
+  if (isTiledSynthesis(&parameters, indices, targetMap, corpusMap, &tiling))
+    return engineTiles(parameters, indices, targetMap, corpusMap, &tiling, resultSourceOfMap,
+      deadline, progressCallback, contextInfo, cancelFlag);
+  return engineLevels(parameters, indices, targetMap, corpusMap, resultSourceOfMap, corpusIndex,
+    preparedCorpus, deadline, progressCallback, contextInfo, cancelFlag);
+}
+
+
+/*
+The engine, using a prebuilt index of corpus patches if it indexes this corpus.
+*/
+
+int
+engineWithCorpusIndex(
+  TImageSynthParameters parameters,
+  TFormatIndices* indices,
+  Map* targetMap,
+  Map* corpusMap,
+  TCorpusIndex *corpusIndex,
+  void (*progressCallback)(int, void*),
+  void *contextInfo,
+  int *cancelFlag
+  )
+{
+  return engineWithCorpus(parameters, indices, targetMap, corpusMap, corpusIndex, NULL, NULL,
+    progressCallback, contextInfo, cancelFlag);
+}
+
+
+/*
+The engine, using a prepared corpus if it is of this corpus, see preparedCorpus.h.
+*/
+
+int
+engineWithPreparedCorpus(
+  TImageSynthParameters parameters,
+  TFormatIndices* indices,
+  Map* targetMap,
+  Map* corpusMap,
+  TPreparedCorpus *preparedCorpus,
+  void (*progressCallback)(int, void*),
+  void *contextInfo,
+  int *cancelFlag
+  )
+{
+  if ( ! isPreparedCorpusOf(preparedCorpus, parameters, indices, corpusMap) )
+    return engineWithCorpus(parameters, indices, targetMap, corpusMap, NULL, NULL, NULL,
+      progressCallback, contextInfo, cancelFlag);
+  
+  // The index is of the corpus, but not every caller wants it
+  if (parameters.isCorpusIndexed && ! preparedCorpus->corpusIndex)
+  {
+    preparedCorpus->corpusIndex = buildCorpusIndex(indices, corpusMap, cancelFlag);
+    if (isCanceled(cancelFlag))
+      return IMAGE_SYNTH_ERROR_CANCELED;
+  }
+  return engineWithCorpus(parameters, indices, targetMap, corpusMap,
+    (parameters.isCorpusIndexed ? preparedCorpus->corpusIndex : NULL), preparedCorpus, NULL,
+    progressCallback, contextInfo, cancelFlag);
+}
+
+
+/*
+The engine.
+Independent of platform, calling app, and graphics libraries.
+*/
+
+int
+engine(
+  TImageSynthParameters parameters,
+  TFormatIndices* indices,
+  Map* targetMap,
+  Map* corpusMap,
+  void (*progressCallback)(int, void*),
+  void *contextInfo,
+  int *cancelFlag
+  )
+{
+  return engineWithCorpus(parameters, indices, targetMap, corpusMap, NULL, NULL, NULL,
+    progressCallback, contextInfo, cancelFlag);
+}
+
+
+/*
+engine() that also returns the source of each target pixel:
+the linear index (x + y * corpus width) of the corpus pixel whose colors it has,
+or G_MAXUINT for none (context, or not synthesized, e.g. when canceled.)
+For callers that keep pixels the engine does not, e.g. of greater depth, see imageSynthWide().
+*/
+
+int
+engineWithSources(
+  TImageSynthParameters parameters,
+  TFormatIndices* indices,
+  Map* targetMap,
+  Map* corpusMap,
+  Map* sourceMap,   // OUT intmap the size of the target.  Caller must free it, unless error.
+  void (*progressCallback)(int, void*),
+  void *contextInfo,
+  int *cancelFlag
+  )
+{
+  TSourceMap sourceOfMap;
+  int error;
+  
+  error = engineWithCorpus(parameters, indices, targetMap, corpusMap, NULL, NULL, &sourceOfMap,
+    progressCallback, contextInfo, cancelFlag);
+  if ( ! error ) *sourceMap = sourceOfMap.map;
+  return error;
+}
+
+
+/*
+The engine for many separate, small targets, e.g. spots, see batch.h.
+Each connected set of target points is synthesized in its own windows of the target and corpus.
+*/
+
+int
+engineBatch(
+  TImageSynthParameters parameters,
+  TFormatIndices* indices,
+  Map* targetMap,
+  Map* corpusMap,
+  void (*progressCallback)(int, void*),
+  void *contextInfo,
+  int *cancelFlag
+  )
+{
+  return engineBatchRegions(parameters, indices, targetMap, corpusMap,
+    progressCallback, contextInfo, cancelFlag);
+}
@@ -10,3 +10,130 @@ engine(
   void *contextInfo,
   int * cancelFlag
   );
+
+/*
+Index of corpus patches, see corpusIndex.h.
+Build once, use for many calls of engineWithCorpusIndex() on the same corpus.
+*/
+typedef struct CorpusIndexStruct TCorpusIndex;
+
+extern TCorpusIndex *
+newCorpusIndex(
+  TFormatIndices* indices,
+  Map* corpusMap
+  );
+
+extern void
+freeCorpusIndex(TCorpusIndex *index);
+
+extern void
+corpusIndexStats(
+  const TCorpusIndex *index,
+  double *buildSeconds,
+  size_t *bytes
+  );
+
+/*
+engine() using a prebuilt index, if it is an index of this corpus.
+Otherwise, as engine() (which builds an index if parameters.isCorpusIndexed.)
+*/
+extern int
+engineWithCorpusIndex(
+  TImageSynthParameters parameters,
+  TFormatIndices* indices,
+  Map* targetMap,
+  Map* corpusMap,
+  TCorpusIndex *corpusIndex,
+  void (*progressCallback)(int, void*),
+  void *contextInfo,
+  int * cancelFlag
+  );
+
+/*
+Corpus prepared for the engine, see preparedCorpus.h.
+Prepare once, use for many calls of engineWithPreparedCorpus() on the same corpus,
+e.g. filling many selections from one texture.
+key is the caller's, e.g. the ID of the corpus drawable, returned by preparedCorpusKey().
+NULL if the corpus is empty.
+*/
+typedef struct PreparedCorpusStruct TPreparedCorpus;
+
+extern TPreparedCorpus *
+newPreparedCorpus(
+  TImageSynthParameters parameters,
+  TFormatIndices* indices,
+  Map* corpusMap,
+  gint key
+  );
+
+extern void
+freePreparedCorpus(TPreparedCorpus *corpus);
+
+extern gint
+preparedCorpusKey(const TPreparedCorpus *corpus);
+
+// Whether the prepared corpus is of this corpus (its content, not its key) and these parameters
+extern gboolean
+isPreparedCorpusOf(
+  const TPreparedCorpus *corpus,
+  TImageSynthParameters parameters,
+  TFormatIndices* indices,
+  Map* corpusMap
+  );
+
+extern void
+preparedCorpusStats(
+  const TPreparedCorpus *corpus,
+  double *prepareSeconds,
+  size_t *bytes
+  );
+
+/*
+engine() using a prepared corpus, if it is of this corpus and parameters.
+Otherwise, as engine().
+Not by two calls at the same time with the same prepared corpus.
+*/
+extern int
+engineWithPreparedCorpus(
+  TImageSynthParameters parameters,
+  TFormatIndices* indices,
+  Map* targetMap,
+  Map* corpusMap,
+  TPreparedCorpus *preparedCorpus,
+  void (*progressCallback)(int, void*),
+  void *contextInfo,
+  int * cancelFlag
+  );
+
+/*
+engine() that also returns, for each target pixel, the corpus pixel its colors were copied from:
+an intmap the size of the target, of x + y * corpus width, or G_MAXUINT for none.
+Caller must free it (free_map()), unless an error is returned.
+*/
+extern int
+engineWithSources(
+  TImageSynthParameters parameters,
+  TFormatIndices* indices,
+  Map* targetMap,
+  Map* corpusMap,
+  Map* sourceMap,
+  void (*progressCallback)(int, void*),
+  void *contextInfo,
+  int * cancelFlag
+  );
+
+/*
+engine() for a target of many separate selections, e.g. spots to heal.
+Each connected set of target points is synthesized from the corpus near it, see batch.h.
+Time is about the healed area, not the count of selections times the image size.
+*/
+extern int
+engineBatch(
+  TImageSynthParameters parameters,
+  TFormatIndices* indices,
+  Map* targetMap,
+  Map* corpusMap,
+  void (*progressCallback)(int, void*),
+  void *contextInfo,
+  int * cancelFlag
+  );
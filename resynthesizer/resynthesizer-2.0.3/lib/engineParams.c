@@ -2,6 +2,7 @@
 Parameters of the engine.
 */
 
+#include <stddef.h>  // NULL
 #include "engineParams.h"
 
 
@@ -16,5 +17,20 @@ setDefaultParams(
   param->sensitivityToOutliers                = 0.117; // 30/256
   param->patchSize                            = 30;
   param->maxProbeCount                        = 200;
+  param->threadCount                          = 0;   // One per processor
+  param->seed                                 = 1198472;
+  param->pyramidLevels                        = 0;   // Full size only
+  param->searchStrategy                       = IMAGE_SYNTH_SEARCH_RANDOM;
+  param->isCorpusIndexed                      = FALSE;
+  param->tileSize                             = 0;   // Whole target at once
+  param->tileMemoryLimit                      = 0;   // No cap
+  param->isAdaptivePasses                     = FALSE;
+  param->isLocalTargetOrder                   = FALSE;
+  param->isDeterministic                      = TRUE;  // Repeatable with threads
+  param->terminateFraction                    = 0.1; // Was IMAGE_SYNTH_TERMINATE_FRACTION
+  param->timeBudget                           = 0;   // No limit
+  param->stats                                = NULL;  // No counts returned
+  param->passStatsCallback                    = NULL;
+  param->passStatsContext                     = NULL;
 }
 
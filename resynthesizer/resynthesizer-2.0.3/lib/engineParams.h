@@ -8,6 +8,9 @@ Also error return values of engine.
 #ifndef FALSE
   #define FALSE 0
 #endif
+#ifndef TRUE
+  #define TRUE 1
+#endif
 
 
 typedef enum  ImageSynthError 
@@ -22,12 +25,75 @@ typedef enum  ImageSynthError
   // IN data errors, user error in making selection? returned by inner engine
   IMAGE_SYNTH_ERROR_EMPTY_TARGET,
   IMAGE_SYNTH_ERROR_EMPTY_CORPUS,
+  // Corpus of G_MAXUINT pixels or more, returned by inner engine
+  IMAGE_SYNTH_ERROR_CORPUS_TOO_LARGE,
+  // Canceled while preparing, the target unchanged.  Canceled during synthesis is success, the target partly synthesized.
+  IMAGE_SYNTH_ERROR_CANCELED,
   // There are more errors returned by the GIMP adapter
   // There will be more errors returned by a future FullAPI adapter, similar to GIMP adapter errors
   // These are only pertinent for the FullAPI, when more than one image is passed
 } TImageSynthError;
 
 
+/*
+How synthesize() searches the corpus, after trying the continuations of neighbors' sources.
+*/
+typedef enum ImageSynthSearchStrategy
+{
+  IMAGE_SYNTH_SEARCH_RANDOM,      // maxProbeCount random corpus points (original)
+  IMAGE_SYNTH_SEARCH_PATCHMATCH   // shrinking random search around the best source, scanline passes
+} TImageSynthSearchStrategy;
+
+
+// Count of passes listed in TImageSynthStats
+#define IMAGE_SYNTH_STATS_MAX_PASSES 32
+// Count of neighbors (patch pixels) counted by TImageSynthStats.earlyOutsByNeighbor, at least the max patchSize
+#define IMAGE_SYNTH_STATS_NEIGHBORS 64
+
+/*
+Counts of the work done by one pass of the engine over the target.
+*/
+typedef struct ImageSynthPassStatsStruct {
+  unsigned int pass;          // Index of the pass, from 0, in its pyramid level
+  unsigned int targets;       // Target points of the pass
+  unsigned int betterments;   // Target points given a new, better source
+  /*
+  betterments over all target points (not just of this pass.)
+  The engine makes no more passes when less than parameter terminateFraction.
+  */
+  double bettermentFraction;
+  double seconds;             // Wall time
+  unsigned long long probes;  // Corpus patches compared to target patches
+  unsigned long long earlyOuts;           // Probes rejected, most before comparing all neighbors
+  unsigned long long boundRejects;        // Probes rejected by a lower bound, before comparing any neighbor
+  unsigned long long neighborsSourceHits; // Target points whose best source continues a neighbor's source (heuristic 1)
+  unsigned long long perfectMatches;      // Target points with a perfect match, which ends the search
+} TImageSynthPassStats;
+
+/*
+Counts of the work done by one call of the engine, for benchmarking and tuning.
+Filled in by the engine when parameters.stats points to one.
+Passes are listed in the order run: with pyramidLevels, the passes of the coarsest level first.
+*/
+typedef struct ImageSynthStatsStruct {
+  unsigned long long probes;          // Corpus patches compared to target patches, over all passes
+  unsigned long long targetAttempts;  // Target points synthesized, over all passes
+  unsigned long long earlyOuts;
+  unsigned long long boundRejects;    // Not in earlyOuts, see corpusBounds.h
+  /*
+  Probes rejected by neighbor index: the last neighbor compared (nearest first.)
+  A low index means the patch difference exceeded the best difference early, a cheap probe.
+  The index is the same for every kernel, scalar or SIMD, see TBestFitSumFunc in bestFitVectorized.h.
+  */
+  unsigned long long earlyOutsByNeighbor[IMAGE_SYNTH_STATS_NEIGHBORS];
+  unsigned long long neighborsSourceHits;
+  unsigned long long perfectMatches;
+  double seconds;                     // Wall time of all passes
+  unsigned int passCount;             // Passes run, may exceed IMAGE_SYNTH_STATS_MAX_PASSES
+  TImageSynthPassStats passes[IMAGE_SYNTH_STATS_MAX_PASSES];
+} TImageSynthStats;
+
+
 typedef struct ImageSynthParametersStruct {
   
   /*
@@ -83,6 +149,111 @@ typedef struct ImageSynthParametersStruct {
   Typically in the hundreds.
   */
   unsigned int maxProbeCount;
+  
+  /*
+  Count of threads to synthesize with, when the engine is built threaded.
+  Zero means one thread per online processor.
+  */
+  unsigned int threadCount;
+  
+  /*
+  Seed of the pseudo random number generators.
+  The same seed gives the same results, for any count of threads if isDeterministic.
+  (Else results with one thread differ from those with more threads,
+  which also depend slightly on the timing of threads.)
+  Change it to get a different, equally good result.
+  */
+  unsigned int seed;
+  
+  /*
+  Count of levels of coarse to fine synthesis.
+  0 or 1: synthesize only at full size.
+  n: first synthesize at 1/2^(n-1) size, then refine at each larger size.
+  Faster for large targets, and keeps large structures better.
+  Levels smaller than a minimum size are skipped.
+  */
+  unsigned int pyramidLevels;
+  
+  /*
+  A TImageSynthSearchStrategy.
+  PatchMatch needs far fewer probes on a large corpus, maxProbeCount is then moot.
+  */
+  int searchStrategy;
+  
+  /*
+  Whether the first pass probes candidates from an index of corpus patches, instead of random corpus points.
+  The index costs time to build (about a pass) and memory (about 12 bytes per corpus pixel.)
+  Worth it for a large corpus.  See corpusIndex.h.
+  */
+  int isCorpusIndexed;
+  
+  /*
+  Synthesize a large target in square tiles of this size (in pixels), one tile after another,
+  so the engine's memory is proportional to a tile, not to the image.  See tiles.h.
+  0: no tiles, unless tileMemoryLimit requires them.
+  Tiles are not seamlessly tileable: ignored if isMakeSeamlesslyTileable...
+  */
+  unsigned int tileSize;
+  
+  /*
+  Cap (in MiB) on the memory the engine allocates, or 0 for no cap.
+  Not counting the caller's target and corpus pixmaps.
+  If synthesizing the whole target at once would exceed it, the engine synthesizes in tiles,
+  smaller than tileSize if need be.
+  */
+  unsigned int tileMemoryLimit;
+  
+  /*
+  Boolean.  Whether passes after the first revisit only the target points that got a new source
+  in the previous pass, instead of a fixed schedule of passes over a shrinking part of the target.
+  Faster, for slightly different results.  See adaptivePasses.h.
+  */
+  int isAdaptivePasses;
+  
+  /*
+  Boolean.  Whether target points, after ordering by matchContextType, are grouped by small blocks of the target
+  within short spans of the order, so that target points synthesized one after another are near each other.
+  Fewer cache misses, and threads work on separate parts of the target.
+  Faster, for slightly different results.  See localizeTargetOrder() in orderTarget.h.
+  */
+  int isLocalTargetOrder;
+  
+  /*
+  Boolean.  Whether threaded synthesis gives the same results from run to run, and for any count of threads
+  (including one, e.g. on a machine with one processor.)
+  Threads then synthesize passes in rounds, each reading the target as it was at the start of the round.
+  A little slower, for results slightly different from those when not isDeterministic.  See deterministicRounds.h.
+  Moot when the engine is built unthreaded: passes are not divided, results are those of one thread.
+  */
+  int isDeterministic;
+  
+  /*
+  The engine makes no more passes when a pass gives new sources to less than this fraction of the target points.
+  Smaller is better quality but slower.  Typically 0.1
+  */
+  double terminateFraction;
+  
+  /*
+  Milliseconds of synthesis after which the engine makes no more passes, or 0 for no limit.
+  The first pass (of each tile) always completes, so the target is always fully synthesized.
+  */
+  unsigned int timeBudget;
+  
+  /*
+  OUT. Where the engine returns counts of its work, or NULL (the default) for none.
+  Always available, not only in a DEBUG build, and cheap.
+  E.g. probes per target point, or betterments per pass, to tune maxProbeCount.
+  */
+  TImageSynthStats *stats;
+  
+  /*
+  Called after each pass with the counts of the pass, or NULL (the default) for none.
+  For tracing, e.g. to watch how betterments fall, pass by pass, in production.
+  Called in the thread that called the engine, between passes.
+  passStatsContext is opaque to the engine, passed to the callback.
+  */
+  void (*passStatsCallback)(const TImageSynthPassStats *passStats, void *passStatsContext);
+  void *passStatsContext;
 } TImageSynthParameters;
 
 
@@ -110,6 +110,16 @@ moreInward(
   return to_invert_sort_result( lessInward(a,b) );
 }
 
+/* less in row major (scanline) order: by row, then by column */
+CompareResult
+lessRowMajor(
+  const Coordinates *a,
+  const Coordinates *b
+  )
+{
+  return to_sort_result((a->y < b->y) || (a->y == b->y && a->x < b->x));
+}
+
 /* less/more horizontal distance: from center for offsets */
 CompareResult 
 lessHorizontal(
@@ -10,6 +10,7 @@ This is not as robust as Glib: little checking is done.
 
 This is a limited subset: only what is used in imageSynth.
 */
+#define _POSIX_C_SOURCE 199309L   // clock_gettime
 #include "buildSwitches.h"
 
 // Certain configurations use glib defines of structs GRand and GArray
@@ -20,8 +21,22 @@ This is a limited subset: only what is used in imageSynth.
 
 #include <stdlib.h>   // size_t, calloc
 #include <string.h>   // memcpy
+#include <time.h>     // clock_gettime
 // Redefines some of glib if gimp.h included above
 #include "glibProxy.h"
+#include "counterPrng.h"
+
+/*
+Time
+*/
+gint64
+s_get_monotonic_time(void)
+{
+  struct timespec now;
+  
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (gint64) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
 
 /*
 PRNG
@@ -29,23 +44,28 @@ PRNG
 GRand *
 s_rand_new_with_seed(guint seed)
 {
-  srand(seed);
-  return (void*) NULL;  // not used
+  TCounterPrng *prng = malloc(sizeof(TCounterPrng));
+  
+  if (prng) prngInit(prng, prngMix(seed));
+  return (GRand*) prng;
 }
 
 guint
 s_rand_int_range(
-  GRand * prng,   // not used
+  GRand * prng,
   guint lowerBound, // Inclusive
   guint upperBound  // !!! Exclusive
   )
 {
-  if (upperBound<1) return 0; // Prevent division by zero when both bounds 0
+  if (upperBound<1) return 0; // Empty range when both bounds 0
   
-  // return rand() % upperBound;   // POOR not adequate if upperBound > RAND_MAX, and cyclical
-  upperBound -= 1; // Make it inclusive
-  // Conventional formula for random int in range [lowerBound, upperBound] inclusive
-  return lowerBound + rand() / (RAND_MAX / (upperBound - lowerBound + 1) + 1);
+  return (guint) prngIntRange((TCounterPrng*) prng, (gint) lowerBound, (gint) upperBound);
+}
+
+void
+s_rand_free(GRand * prng)
+{
+  free(prng);
 }
 
 /*
@@ -101,6 +121,42 @@ s_array_append_vals (
   return array;
 }
 
+/*
+As g_array_set_size, new elements cleared (arrays are always cleared, see s_array_sized_new.)
+*/
+GArray* 
+s_array_set_size (
+  GArray           *array,
+  guint             length
+  )
+{
+  GRealArray *rarray = (GRealArray*) array;
+  
+  if (length > rarray->alloc && ! array->len)
+  {
+    // Nothing to keep: calloc, whose pages of a large array cost nothing until touched
+    free(rarray->data);
+    rarray->data = calloc(length, rarray->elt_size);
+    rarray->alloc = length;
+  }
+  else
+  {
+    if (length > rarray->alloc)
+    {
+      rarray->data = realloc(rarray->data, (size_t) length * rarray->elt_size);
+      rarray->alloc = length;
+    }
+    if (length > array->len)
+      memset(
+        array->data + rarray->elt_size * array->len,
+        0,
+        (size_t) rarray->elt_size * (length - array->len)
+        );
+  }
+  array->len = length;
+  return array;
+}
+
 void
 s_array_sort (
   GArray *     array,
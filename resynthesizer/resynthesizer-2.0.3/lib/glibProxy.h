@@ -10,6 +10,9 @@ This is a limited subset: only what is used in synth.
 #define guint unsigned int
 #define gint int
 #define gint32 int
+#define guint32 unsigned int
+#define guint64 unsigned long long
+#define gint64 long long
 #define gushort short unsigned int
 #define gulong long unsigned int
 
@@ -17,8 +20,10 @@ This is a limited subset: only what is used in synth.
 #define gdouble double
 
 #define guint8 unsigned char
+#define gint8 signed char
 #define guchar unsigned char
 #define gchar char
+#define gsize size_t
 
 typedef const void *TConstPointer;
 typedef gint (*TCompareFunc) (TConstPointer  a, TConstPointer  b);
@@ -42,14 +47,27 @@ typedef gint (*TCompareFunc) (TConstPointer  a, TConstPointer  b);
 #include <assert.h>
 #define g_assert assert
 
+// Heap allocation.  Unlike glib, does not abort on failure.
+#include <stdlib.h>
+#define g_new(t,n)   ((t*) malloc(sizeof(t) * (n)))
+#define g_new0(t,n)  ((t*) calloc((n), sizeof(t)))
+#define g_free(p)    free(p)
+
+// Wall clock, microseconds, for timing passes
+#define g_get_monotonic_time() s_get_monotonic_time()
+
+gint64
+s_get_monotonic_time(void);
+
 #define MAX(a, b)  (((a) > (b)) ? (a) : (b))
 #define MIN(a, b)  (((a) < (b)) ? (a) : (b))
+#define ABS(a)     (((a) < 0) ? -(a) : (a))
 
 /*
 PRNG
-Using ANSI c rand().
-Note GRand type is passed, but not used,
-since rand() keeps its own internal data.
+Formerly ANSI c rand(), whose one hidden state all generators shared:
+engines running concurrently (e.g. regions of batch.h in threads) drew from each other's sequences.
+Now each GRand is its own counter-based generator (see counterPrng.h), keyed by its seed.
 */
 
 // When using this proxy with GIMP (for testing the proxy)
@@ -63,11 +81,14 @@ s_rand_new_with_seed(guint seed);
 
 guint
 s_rand_int_range(
-  GRand * prng,   // not used
+  GRand * prng,
   guint lowerBound,
   guint upperBound
   );
 
+void
+s_rand_free(GRand * prng);
+
 
 /*
 Dynamic 1D array (sequence, vector.)
@@ -112,6 +133,7 @@ typedef struct _GRealArray
 // Simple redirecting to our implementation
 #define g_array_sized_new(z,c,s,r)  s_array_sized_new (z,c,s,r)
 #define g_array_sort(a,f) s_array_sort (a,f)
+#define g_array_set_size(a,l) s_array_set_size (a,l)
 #define g_array_free(p,b) s_array_free(p,b)
 
 GArray* 
@@ -134,6 +156,12 @@ s_array_sort (
   TCompareFunc  compare_func
   );
 
+GArray* 
+s_array_set_size(
+  GArray           *array,
+  guint             length
+  );
+
 void
 s_array_free(
   GArray * array,
@@ -40,6 +40,18 @@ typedef enum  ImageFormat
   T_Gray,
   T_GrayA
 } TImageFormat;
+
+/*
+Type of the pixelels of in images, for imageSynthWide().
+The engine works on 8-bit pixelels: wider pixelels are matched quantized to 8 bits,
+but synthesized pixels are copied whole from the image.
+*/
+typedef enum  PixelelType
+{
+  T_UInt8,
+  T_UInt16,   // Native byte order
+  T_Float     // Nominally 0.0 to 1.0
+} TPixelelType;
   
 #endif /* __SYNTH_IMAGE_FORMAT_H__ */
 
@@ -35,6 +35,7 @@ To make:
   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 #include <stddef.h>  // size_t
+#include <string.h>  // memcpy
 
 // Non code defining, true headers: macros, declarations, and static inline functions
 #include "imageBuffer.h"
@@ -58,8 +59,20 @@ To make:
 
 
 
-extern int
-imageSynth(
+// Signature of engine() and engineBatch()
+typedef int (*TEngineFunc)(
+  TImageSynthParameters,
+  TFormatIndices*,
+  Map*,
+  Map*,
+  void (*)(int, void*),
+  void *,
+  int *
+  );
+
+static int
+imageSynthWithEngine(
+  TEngineFunc engineFunc,
   ImageBuffer * imageBuffer,  // IN/OUT RGBA four Pixelels
   ImageBuffer * mask,         // IN one mask Pixelel
   TImageFormat imageFormat,
@@ -95,7 +108,7 @@ imageSynth(
     countPixelelsPerPixelForFormat(imageFormat)
     );
   
-  error = engine(
+  error = engineFunc(
     *parameters,
     &formatIndices, 
     &targetMap, 
@@ -137,3 +150,178 @@ imageSynth(
 }
 
 
+extern int
+imageSynth(
+  ImageBuffer * imageBuffer,
+  ImageBuffer * mask,
+  TImageFormat imageFormat,
+  TImageSynthParameters* parameters,
+  void (*progressCallback)(int, void*),
+  void *contextInfo,
+  int *cancelFlag
+  )
+{
+  return imageSynthWithEngine(engine, imageBuffer, mask, imageFormat, parameters,
+    progressCallback, contextInfo, cancelFlag);
+}
+
+
+/*
+Heal many separate selections (e.g. dust and spots) in one call.
+Each connected part of the selection is healed from the image near it, see batch.h.
+*/
+extern int
+imageSynthBatch(
+  ImageBuffer * imageBuffer,
+  ImageBuffer * mask,
+  TImageFormat imageFormat,
+  TImageSynthParameters* parameters,
+  void (*progressCallback)(int, void*),
+  void *contextInfo,
+  int *cancelFlag
+  )
+{
+  return imageSynthWithEngine(engineBatch, imageBuffer, mask, imageFormat, parameters,
+    progressCallback, contextInfo, cancelFlag);
+}
+
+
+/*
+Pixels of 16-bit or float pixelels.
+
+The engine, its metric tables (see quantizeImageMetricFunc()) and its kernels are for 8-bit pixelels.
+But the engine only copies pixels: every synthesized pixel has a source, a pixel of the corpus.
+So here the engine runs on a copy of the image quantized to 8 bits,
+then the synthesized pixels are copied again from their sources, in the caller's (wide) image.
+Results keep the depth of the image: no synthesized pixelel is quantized.
+Only matching is quantized: patches that differ by less than a 255th match as equal.
+
+Costs over the 8-bit path: converting the image, a source (4 bytes) per pixel, and the final copy,
+all linear in the image, small beside synthesis.
+
+A (wide) alpha less than half a 255th is quantized to totally transparent, so is not in the corpus.
+*/
+static inline Pixelel
+quantizePixelel(
+  const unsigned char *pixelel,
+  TPixelelType pixelelType
+  )
+{
+  if (pixelelType == T_UInt16)
+  {
+    gushort value;
+    memcpy(&value, pixelel, sizeof(value));
+    return (Pixelel) ((value + 128) / 257);   // Rounded value * 255 / 65535
+  }
+  else
+  {
+    float value;
+    memcpy(&value, pixelel, sizeof(value));
+    if ( ! (value > 0.0f) ) return 0;   // Also NaN
+    if (value >= 1.0f) return 255;
+    return (Pixelel) (value * 255.0f + 0.5f);
+  }
+}
+
+
+extern int
+imageSynthWide(
+  ImageBuffer * imageBuffer,  // IN/OUT pixels of pixelelType
+  ImageBuffer * mask,         // IN one mask byte
+  TImageFormat imageFormat,
+  TPixelelType pixelelType,
+  TImageSynthParameters* parameters,  // or NULL to use defaults
+  void (*progressCallback)(int, void*),
+  void *contextInfo,
+  int *cancelFlag
+  )
+{
+  Map targetMap;
+  Map corpusMap;
+  Map sourceMap;
+  TFormatIndices formatIndices;
+  ImageBuffer quantized;
+  guint pixelelCount;
+  guint pixelelBytes;
+  guint x;
+  guint y;
+  TPixelelIndex k;
+  int error;
+  
+  if (pixelelType == T_UInt8)
+    return imageSynth(imageBuffer, mask, imageFormat, parameters, progressCallback, contextInfo, cancelFlag);
+  if (pixelelType != T_UInt16 && pixelelType != T_Float)
+    return IMAGE_SYNTH_ERROR_INVALID_IMAGE_FORMAT;
+  pixelelBytes = (pixelelType == T_UInt16) ? sizeof(gushort) : sizeof(float);
+  
+  if (imageBuffer->width != mask->width || imageBuffer->height != mask->height)
+    return IMAGE_SYNTH_ERROR_IMAGE_MASK_MISMATCH;
+  
+  if (!parameters) {
+    static TImageSynthParameters defaultParameters;
+    setDefaultParams(&defaultParameters);
+    parameters = &defaultParameters;
+    }
+  
+  error = prepareImageFormatIndicesFromFormatType(&formatIndices, imageFormat);
+  if ( error ) return error;
+  pixelelCount = countPixelelsPerPixelForFormat(imageFormat);
+  
+  // Quantize to an 8-bit image, not row padded, then adapt it as imageSynth() does
+  quantized.width = imageBuffer->width;
+  quantized.height = imageBuffer->height;
+  quantized.rowBytes = imageBuffer->width * pixelelCount;
+  quantized.data = malloc(quantized.rowBytes * quantized.height);
+  g_assert(quantized.data);
+  for (y=0; y<imageBuffer->height; y++)
+    for (x=0; x<imageBuffer->width; x++)
+      for (k=0; k<pixelelCount; k++)
+        quantized.data[y * quantized.rowBytes + x * pixelelCount + k] = quantizePixelel(
+          &imageBuffer->data[y * imageBuffer->rowBytes + (x * pixelelCount + k) * pixelelBytes], pixelelType);
+  adaptSimpleAPI(&quantized, mask, &targetMap, &corpusMap, pixelelCount);
+  free(quantized.data);
+  
+  error = engineWithSources(
+    *parameters,
+    &formatIndices, 
+    &targetMap, 
+    &corpusMap,
+    &sourceMap,
+    progressCallback,
+    contextInfo,
+    cancelFlag
+    );
+  
+  if (! error)
+  {
+    if (! (*cancelFlag))
+    {
+      /*
+      Copy the color pixelels of each synthesized pixel from its source, in the caller's image.
+      The corpus is the image outside the selection, so sources are never overwritten.
+      Alpha is not synthesized, see imageSynth().
+      */
+      gsize colorBytes = (formatIndices.colorEndBip - FIRST_PIXELEL_INDEX) * pixelelBytes;
+      
+      for (y=0; y<imageBuffer->height; y++)
+        for (x=0; x<imageBuffer->width; x++)
+        {
+          Coordinates coords = {x, y};
+          guint source = *intmap_index(&sourceMap, coords);
+          
+          if (source != G_MAXUINT)
+            memcpy(
+              &imageBuffer->data[y * imageBuffer->rowBytes + x * pixelelCount * pixelelBytes],
+              &imageBuffer->data[(source / corpusMap.width) * imageBuffer->rowBytes
+                + (source % corpusMap.width) * pixelelCount * pixelelBytes],
+              colorBytes);
+        }
+    }
+    free_map(&sourceMap);
+  }
+  
+  free_map(&targetMap);
+  free_map(&corpusMap);
+   
+  return error;
+}
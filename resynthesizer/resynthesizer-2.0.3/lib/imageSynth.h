@@ -27,7 +27,7 @@ Header for the simple API to libresynthesizer
 #include "imageFormat.h"
 #include "engineParams.h"
 
-// Signature of the only simple API function
+// Signature of the simple API function
 int
 imageSynth(
   ImageBuffer * imageBuffer,  // IN/OUT RGBA Pixels described by imageFormat
@@ -38,3 +38,35 @@ imageSynth(
   void *contextInfo,	// opaque to engine, passed in progressCallback
   int *cancelFlag		// polled by engine: engine quits if ever becomes True
   );
+
+/*
+Same, for pixelels of 16 bits or float.  The mask is still one byte per pixel.
+imageBuffer->rowBytes is in bytes.
+*/
+int
+imageSynthWide(
+  ImageBuffer * imageBuffer,  // IN/OUT Pixels described by imageFormat and pixelelType
+  ImageBuffer * mask,         // IN one mask byte
+  TImageFormat imageFormat,
+  TPixelelType pixelelType,
+  TImageSynthParameters* parameters,
+  void (*progressCallback)(int, void*),
+  void *contextInfo,
+  int *cancelFlag
+  );
+
+/*
+Same as imageSynth(), for a selection of many separate parts, e.g. spots of dust.
+Each connected part is healed from the image near it, in one pass over the image.
+Faster than a call of imageSynth() per part: time is about the healed area, not the image size times the count of parts.
+*/
+int
+imageSynthBatch(
+  ImageBuffer * imageBuffer,  // IN/OUT RGBA Pixels described by imageFormat
+  ImageBuffer * mask,         // IN one mask Pixelel
+  TImageFormat imageFormat,
+  TImageSynthParameters* parameters,
+  void (*progressCallback)(int, void*),
+  void *contextInfo,
+  int *cancelFlag
+  );
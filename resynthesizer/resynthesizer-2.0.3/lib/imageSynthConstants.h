@@ -85,6 +85,7 @@ for slightly better performance??
 /*
 The fraction of target points that must be bettered on a pass
 else terminate repeated passes over the target.
+The default of parameter terminateFraction.
 */
 #define IMAGE_SYNTH_TERMINATE_FRACTION 0.1
 
@@ -95,6 +96,64 @@ for banded randomization of target points.
 #define IMAGE_SYNTH_BAND_FRACTION 0.1
 
 
-// Count of target pixels synthesized per deep progress callback
-// !!! This must in binary all x lower bits ones i.e. 2^12-1
-#define IMAGE_SYNTH_CALLBACK_COUNT 4095
+/*
+Coarse to fine synthesis (parameter pyramidLevels, see pyramid.h.)
+A coarser level is only made if the images are at least twice this size after halving.
+At finer levels, the target is only refined:
+this count of passes, and maxProbeCount divided by the divisor.
+*/
+#define IMAGE_SYNTH_PYRAMID_MIN_SIZE 32
+#define IMAGE_SYNTH_PYRAMID_PASSES 2
+#define IMAGE_SYNTH_PYRAMID_PROBE_DIVISOR 4
+
+/*
+PatchMatch search (parameter searchStrategy, see patchMatch.h.)
+Count of random corpus points probed when no neighbor has a source to propagate.
+*/
+#define IMAGE_SYNTH_PATCHMATCH_SEED_PROBES 16
+
+/*
+Corpus index (parameter isCorpusIndexed, see corpusIndex.h.)
+A descriptor is the colors of a square window of this radius, projected to this many dimensions.
+Principal components from at most this many sample windows, by this many power iterations.
+A query visits at most this many kd-tree leaves (of about LEAF_SIZE points)
+and probes the nearest CANDIDATES corpus points found.
+*/
+#define IMAGE_SYNTH_INDEX_RADIUS 2
+#define IMAGE_SYNTH_INDEX_DIMENSIONS 8
+#define IMAGE_SYNTH_INDEX_PCA_SAMPLES 4096
+#define IMAGE_SYNTH_INDEX_PCA_ITERATIONS 32
+#define IMAGE_SYNTH_INDEX_LEAF_SIZE 8
+#define IMAGE_SYNTH_INDEX_MAX_LEAVES 8
+#define IMAGE_SYNTH_INDEX_CANDIDATES 8
+
+/*
+Tiled synthesis (parameters tileSize and tileMemoryLimit, see tiles.h.)
+Tiles overlap by a band of this width (in pixels), the context of a tile's border.
+Tiles are not made smaller than MIN_SIZE to meet the memory limit.
+*/
+#define IMAGE_SYNTH_TILE_BAND 32
+#define IMAGE_SYNTH_TILE_MIN_SIZE 64
+
+/*
+Count of target points in a chunk of work for a thread of the worker pool.
+Small enough that threads finish a pass at nearly the same time,
+large enough that taking a chunk (an atomic add) is rare.
+*/
+#define IMAGE_SYNTH_CHUNK_SIZE 256
+
+/*
+Rounds of deterministic threaded passes (parameter isDeterministic, see deterministicRounds.h.)
+A round is at least MIN target points, and at most 1/FRACTION of the target points before it in the pass.
+*/
+#define IMAGE_SYNTH_ROUND_MIN 64
+#define IMAGE_SYNTH_ROUND_FRACTION 16
+
+/*
+Local order of target points (parameter isLocalTargetOrder, see orderTarget.h.)
+The order is grouped by square blocks of this size (in pixels) within spans of this fraction
+( count of points in a span / total target points.)
+Half a band (IMAGE_SYNTH_BAND_FRACTION), so the banded orders keep their bands.
+*/
+#define IMAGE_SYNTH_LOCAL_BLOCK_SIZE 32
+#define IMAGE_SYNTH_LOCAL_SPAN_FRACTION 0.05
@@ -83,4 +83,29 @@ bytemap_index(
   return &g_array_index(map->data, guchar, index);
 }
 
+/* Return pointer to gushort at coordinates in map. */
+static inline gushort*
+shortmap_index(
+  Map* map,
+  const Coordinates coords
+  )
+{
+  guint index = coords.x + coords.y * map->width;
+  return &g_array_index(map->data, gushort, index);
+}
 
+/*
+Return pointer to the word holding the bit at coordinates in a bitmap,
+and the mask of the bit in the word.
+*/
+static inline guint32*
+bitmap_index(
+  Map* map,
+  const Coordinates coords,
+  guint32 *bit    // OUT
+  )
+{
+  guint index = coords.x + coords.y * map->width;
+  *bit = (guint32) 1 << (index % 32);
+  return &g_array_index(map->data, guint32, index / 32);
+}
@@ -32,6 +32,14 @@ Here, there are separate functions for creating and indexing each type of map.
 
 // Note, included, not compiled separately
 
+/*
+Count of extra pixels reserved after the last pixel of a pixmap.
+A SIMD gather (see bestFitVectorized.h) reads four bytes at a time at the start of a pixel
+or four pixelels into it, so a few bytes past the last pixelel.
+Never read as pixel values.
+*/
+#define IMAGE_SYNTH_PIXMAP_PAD 4
+
 void
 free_map (Map *map)
 {
@@ -58,7 +66,7 @@ new_pixmap(
    guint size = width * height * depth;
    map->data = g_array_sized_new (FALSE, TRUE, sizeof(Pixelel), size);
   */
-  map->data = g_array_sized_new (FALSE, TRUE, depth, width * height);
+  map->data = g_array_sized_new (FALSE, TRUE, depth, width * height + IMAGE_SYNTH_PIXMAP_PAD);
 }
 
 
@@ -102,6 +110,43 @@ new_bytemap(
   new_pixmap(map, width, height, 1);
 }
 
+/* Create dynamic 2-D array of gushort. */
+void
+new_shortmap(
+  Map * map,
+  guint width, 
+  guint height
+  )
+{
+  map->width = width;
+  map->height = height;
+  map->depth = sizeof(gushort);   // Not used
+  map->data = g_array_sized_new (FALSE, TRUE, sizeof(gushort), width * height);
+}
+
+/*
+Create dynamic 2-D array of bits, packed 32 to a word, all zero.
+An eighth the size of a bytemap, so more of it stays in cache.
+Address with bitmap_index().
+*/
+void
+new_bitmap(
+  Map * map,
+  guint width, 
+  guint height
+  )
+{
+  guint wordCount = (width * height + 31) / 32;
+  guint i;
+  
+  map->width = width;
+  map->height = height;
+  map->depth = sizeof(guint32);   // Not used
+  map->data = g_array_sized_new (FALSE, TRUE, sizeof(guint32), wordCount);
+  for (i=0; i<wordCount; i++)
+    g_array_index(map->data, guint32, i) = 0;
+}
+
 
 
 /* Misc operations on Map. */
@@ -8,6 +8,8 @@ Added methods of ordering by distance from center.
 
 TODO ordering by a thinning, or brushfire, algorithm, i.e. distance from context, not from center.
 
+Any ordering can then be made local (parameter isLocalTargetOrder, see localizeTargetOrder().)
+
   Copyright (C) 2010, 2011  Lloyd Konneker
 
   This program is free software; you can redistribute it and/or modify
@@ -26,6 +28,7 @@ TODO ordering by a thinning, or brushfire, algorithm, i.e. distance from context
 */
 
 
+#include <stdlib.h>  // qsort
 #include "brushfire.h"
 
 /*
@@ -261,9 +264,105 @@ static void orderTargetPointsRandomSqueeze(
   g_array_free(target_temp, TRUE);
 }
 
+typedef struct {
+  guint64 key;    // Rank of the point's block, then index in the span
+  Coordinates targetPoint;
+} TLocalSortElement;
+
+static gint
+lessLocalKey(
+  const void *a,
+  const void *b
+  )
+{
+  guint64 keyA = ((const TLocalSortElement *) a)->key;
+  guint64 keyB = ((const TLocalSortElement *) b)->key;
+
+  return (keyA > keyB) - (keyA < keyB);
+}
+
+
+/*
+Make an order local: within each span of the order (IMAGE_SYNTH_LOCAL_SPAN_FRACTION of the target points)
+group the points by square block of the target (IMAGE_SYNTH_LOCAL_BLOCK_SIZE),
+the blocks in a random order, the points of a block in their order.
+
+The orders above are random (overall, or within bands): consecutive target points are far apart.
+So each target point touches other rows of targetMap, hasValueMap, sourceOfMap and recentProberMap,
+mostly cache misses.  And threads (which take chunks of consecutive target points, see workerPool.h)
+write into the same cache lines, from all over the target.
+Grouped, consecutive target points are in one block, and a chunk of a thread is a few blocks.
+
+The order of spans is kept: a band order still sweeps in or out, span by span.
+Within a span, points are still a sparse random sample of the target (or band), only visited block by block.
+A target point has about as many neighbors synthesized before it as in the unlocalized order.
+Blocks are in random order, not along a curve (e.g. Hilbert):
+a sweep lets the sources of neighbors (heuristic 1) propagate in one direction,
+growing smeared copies as scanline order does.
+So the quality is about the same, but results differ.
+*/
+static void
+localizeTargetOrder(
+  pointVector targetPoints,
+  GRand *prng
+  )
+{
+  guint spanSize = MAX((guint) (targetPoints->len * IMAGE_SYNTH_LOCAL_SPAN_FRACTION), IMAGE_SYNTH_CHUNK_SIZE);
+  TLocalSortElement *sortArray;
+  guint32 *blockRanks;
+  gint minX = G_MAXINT;
+  gint minY = G_MAXINT;
+  gint maxX = 0;
+  gint maxY = 0;
+  guint blocksWide;
+  guint blockCount;
+  guint start;
+  guint i;
+
+  if ( ! targetPoints->len ) return;
+  for (i=0; i<targetPoints->len; i++)
+  {
+    Coordinates point = g_array_index(targetPoints, Coordinates, i);
+
+    minX = MIN(minX, point.x);
+    minY = MIN(minY, point.y);
+    maxX = MAX(maxX, point.x);
+    maxY = MAX(maxY, point.y);
+  }
+  blocksWide = (maxX - minX) / IMAGE_SYNTH_LOCAL_BLOCK_SIZE + 1;
+  blockCount = blocksWide * ((maxY - minY) / IMAGE_SYNTH_LOCAL_BLOCK_SIZE + 1);
+
+  sortArray = g_new(TLocalSortElement, spanSize);
+  blockRanks = g_new(guint32, blockCount);
+  for (start=0; start<targetPoints->len; start+=spanSize)
+  {
+    guint count = MIN(spanSize, targetPoints->len - start);
+
+    // Another order of blocks for each span
+    for (i=0; i<blockCount; i++)
+      blockRanks[i] = g_rand_int_range(prng, 0, G_MAXINT);
+    for (i=0; i<count; i++)
+    {
+      Coordinates point = g_array_index(targetPoints, Coordinates, start + i);
+      guint block = (point.y - minY) / IMAGE_SYNTH_LOCAL_BLOCK_SIZE * blocksWide
+        + (point.x - minX) / IMAGE_SYNTH_LOCAL_BLOCK_SIZE;
+
+      sortArray[i].targetPoint = point;
+      sortArray[i].key = ((guint64) blockRanks[block] << 32) | i;
+    }
+    qsort(sortArray, count, sizeof(TLocalSortElement), lessLocalKey);
+    for (i=0; i<count; i++)
+      g_array_index(targetPoints, Coordinates, start + i) = sortArray[i].targetPoint;
+  }
+  g_free(blockRanks);
+  g_free(sortArray);
+}
+
+
 /*
 Order the vector of target points in one of many ways
 specified by parameter use_border.
+Then, if parameter isLocalTargetOrder, make the order local.
 */
 int 
 orderTargetPoints(
@@ -339,6 +438,8 @@ orderTargetPoints(
         // return g_assert(FALSE);
         return IMAGE_SYNTH_ERROR_MATCH_CONTEXT_TYPE_RANGE;
   }
+  if (parameters->isLocalTargetOrder)
+    localizeTargetOrder(targetPoints, prng);
   return 0; // SUCCESS
 }
 
@@ -93,6 +93,23 @@ prepare_repetition_parameters(
 }
 
 
+/*
+Keep only the first passCount passes, e.g. when only refining an already synthesized target.
+Later passes synthesize no points (and are not counted in progress.)
+*/
+static inline void
+truncate_repetition_parameters(
+  TRepetionParameters repetition_params,
+  guint passCount
+  )
+{
+  guint i;
+  
+  for (i=passCount; i<MAX_PASSES; i++)
+    repetition_params[i][1] = 0;
+}
+
+
 #ifdef ORIGINAL_PASSES
 /* 
 Each pass synthesizes more target points than previous.
@@ -0,0 +1,169 @@
+/*
+PatchMatch style search, an alternative to probing random corpus points.
+Selected by parameter searchStrategy == IMAGE_SYNTH_SEARCH_PATCHMATCH.
+
+The original search (after heuristic 1) probes maxProbeCount corpus points uniformly at random.
+On a large corpus, most of those probes are wasted: a random patch rarely matches.
+
+PatchMatch (Barnes et al. 2009) instead relies on coherence:
+1) propagation: a good source for a neighbor, offset, is probably a good source for this point.
+   That is already heuristic 1 of synthesize(), over all neighbors having sources,
+   starting with this point's own source from the previous pass (in sourceOfMap.)
+   For propagation to carry good sources across the whole target in few passes,
+   passes after the first alternate scanline order: forward (top-left to bottom-right) then reverse.
+2) random search: probe random corpus points around the best source so far,
+   in a window that starts as large as the corpus and halves until it is one pixel.
+   About log2(corpus size) probes per target point instead of maxProbeCount.
+
+The first pass keeps the order given by matchContextType (e.g. inward from the context)
+since it fills a target with no sources yet.
+Where propagation finds nothing (early in the first pass), a few random corpus points seed the search.
+
+  Copyright (C) 2010, 2011  Lloyd Konneker
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+/*
+Random search around the best source so far.
+Returns TRUE on perfect match.
+*/
+static gboolean
+patchMatchSearch(
+  const TFormatIndices * const indices,
+  const Map * const corpusMap,
+  pointVector corpusPoints,
+  TCounterPrng *prng,
+  guint * const bestPatchDiff,  // IN/OUT
+  Coordinates * const bestMatchCorpusPoint, // IN/OUT
+  const guint countNeighbors,
+  const TNeighbor neighbors[],
+  const TNeighborVectors * const neighborVectors,
+  tBettermentKind* latestBettermentKind,
+  const TPixelelMetricFunc corpusTargetMetric,  // array pointers
+  const TMapPixelelMetricFunc mapsMetric,
+  const TBestFitKernel * const kernel,
+  TSynthCounters * const counters  // IN/OUT
+  )
+{
+  gint radius;
+
+  // Seed: no source from propagation
+  if (*latestBettermentKind == NO_BETTERMENT)
+  {
+    guint j;
+    for (j=0; j<IMAGE_SYNTH_PATCHMATCH_SEED_PROBES; j++)
+      if (probeCorpusPoint(randomCorpusPoint(corpusPoints, prng),
+          indices, corpusMap,
+          bestPatchDiff, bestMatchCorpusPoint,
+          countNeighbors, neighbors, neighborVectors,
+          latestBettermentKind, RANDOM_CORPUS,
+          corpusTargetMetric, mapsMetric, kernel, counters
+          ))
+        return TRUE;
+  }
+
+  // Exponentially shrinking window around the best (which moves as it betters)
+  for (radius = MAX(corpusMap->width, corpusMap->height); radius >= 1; radius /= 2)
+  {
+    Coordinates candidate;
+
+    candidate.x = bestMatchCorpusPoint->x + prngIntRange(prng, -radius, radius + 1);
+    candidate.y = bestMatchCorpusPoint->y + prngIntRange(prng, -radius, radius + 1);
+    if (clippedOrMaskedCorpus(candidate, corpusMap)) continue;
+    if (probeCorpusPoint(candidate,
+        indices, corpusMap,
+        bestPatchDiff, bestMatchCorpusPoint,
+        countNeighbors, neighbors, neighborVectors,
+        latestBettermentKind, RANDOM_SEARCH,
+        corpusTargetMetric, mapsMetric, kernel, counters
+        ))
+      return TRUE;
+  }
+  return FALSE;
+}
+
+
+/*
+Target points in scanline order, forward and reverse, for passes after the first.
+*/
+typedef struct ScanlineOrderStruct {
+  pointVector forward;
+  pointVector reverse;
+} TScanlineOrder;
+
+
+static void
+prepareScanlineOrder(
+  pointVector targetPoints,
+  TScanlineOrder *scanlineOrder
+  )
+{
+  guint i;
+  guint count = targetPoints->len;
+
+  scanlineOrder->forward = g_array_sized_new(FALSE, TRUE, sizeof(Coordinates), count);
+  scanlineOrder->reverse = g_array_sized_new(FALSE, TRUE, sizeof(Coordinates), count);
+  for (i=0; i<count; i++)
+    g_array_append_val(scanlineOrder->forward, g_array_index(targetPoints, Coordinates, i));
+  g_array_sort(scanlineOrder->forward, (gint (*)(const void*, const void*)) lessRowMajor);
+  for (i=count; i>0; i--)
+    g_array_append_val(scanlineOrder->reverse, g_array_index(scanlineOrder->forward, Coordinates, i-1));
+}
+
+
+static void
+free_scanline_order(TScanlineOrder *scanlineOrder)
+{
+  g_array_free(scanlineOrder->forward, TRUE);
+  g_array_free(scanlineOrder->reverse, TRUE);
+}
+
+
+/*
+Target points for a pass.
+The first pass in the order given by matchContextType, then alternating scanline order.
+*/
+static pointVector
+patchMatchPassPoints(
+  guint pass,
+  pointVector targetPoints,
+  TScanlineOrder *scanlineOrder
+  )
+{
+  if (pass == 0) return targetPoints;
+  return (pass % 2) ? scanlineOrder->forward : scanlineOrder->reverse;
+}
+
+
+/*
+Every pass over the whole target: a prefix of a scanline order would refine only the top (or bottom.)
+Passes are cheap, and still end early when few target points are bettered.
+*/
+static void
+patchMatchRepetitionParameters(
+  TRepetionParameters repetition_params,
+  guint countTargetPoints
+  )
+{
+  guint i;
+
+  for (i=0; i<MAX_PASSES; i++)
+  {
+    repetition_params[i][0] = 0;
+    repetition_params[i][1] = countTargetPoints;
+  }
+}
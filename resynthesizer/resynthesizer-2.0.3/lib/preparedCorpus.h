@@ -0,0 +1,273 @@
+/*
+Prepared corpus: the work of engineLevel() that depends only on the corpus (and a few parameters),
+kept for many calls of the engine on the same corpus.
+
+The plugin scripts (fill pattern, map style, heal selection) call the engine repeatedly
+with the same corpus, e.g. filling many selections from one texture.
+Each call prepares the same corpus again:
+the vector of corpus points, the quantized metrics, the kernel and its tables
+(corpus planes, see corpusPlanes.h, and bounds, see corpusBounds.h), the map of recent probers,
+and the sorted offsets.  Together, often more time than synthesizing a small selection.
+
+A caller builds a prepared corpus once (newPreparedCorpus()) and passes it to engineWithPreparedCorpus().
+The caller gives it a key, e.g. the ID of the corpus drawable, to find it again (preparedCorpusKey().)
+The key is only for the caller: the engine checks the prepared corpus against the corpus of each call
+(dimensions, pixel format, a hash of all pixelels including maps, and the parameters of the metrics)
+and if they differ, ignores it and prepares the corpus as usual.
+So a stale prepared corpus (the drawable changed since) is slower, but not wrong.
+Results are the same as without a prepared corpus.
+
+What else it keeps:
+- the index of corpus patches (see corpusIndex.h), built on first use if parameters.isCorpusIndexed
+- the sorted offsets, which also depend on the size of the target: rebuilt if a call's target differs in size
+
+The map of recent probers is state of synthesis, not of the corpus:
+it is cleared (not reallocated) at the start of each call.
+So a prepared corpus is used by one call at a time (threads of that call share it as usual.)
+
+Only the top level of the pyramid (see pyramid.h) uses it: coarser levels have their own, smaller corpus.
+Tiled synthesis (see tiles.h) does not use it: tiles have their own corpus.
+
+Preparation time and memory are reported by preparedCorpusStats().
+
+Included in engine.c, not compiled separately.
+
+  Copyright (C) 2010, 2011  Lloyd Konneker
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdlib.h>   // posix_memalign
+#include <time.h>     // clock()
+
+struct PreparedCorpusStruct {
+  // Kernel first: it is aligned, see newPreparedCorpus()
+  TBestFitKernel kernel;
+
+  // Identity of the prepared corpus, see isPreparedCorpusOf()
+  gint key;             // The caller's, not checked by the engine
+  guint width;
+  guint height;
+  TFormatIndices indices;
+  guint64 corpusHash;
+  double sensitivityToOutliers;
+  double mapWeight;
+
+  // Prepared as in engineLevel()
+  pointVector corpusPoints;
+  TPixelelMetricFunc corpusTargetMetric;
+  TMapPixelelMetricFunc mapMetric;
+  Map recentProberMap;
+  gboolean isProbed;    // recentProberMap must be cleared before use
+  pointVector sortedOffsets;  // NULL until first use
+  guint offsetsWidth;   // Smaller dimensions of target and corpus, of sortedOffsets
+  guint offsetsHeight;
+  TCorpusIndex *corpusIndex;  // NULL until first use with parameters.isCorpusIndexed
+
+  // Report
+  gdouble prepareSeconds;
+  gsize bytes;
+};
+
+
+static gboolean
+isSameFormat(
+  const TFormatIndices *a,
+  const TFormatIndices *b
+  )
+{
+  return a->colorEndBip == b->colorEndBip
+    && a->alpha_bip == b->alpha_bip
+    && a->map_start_bip == b->map_start_bip
+    && a->map_end_bip == b->map_end_bip
+    && a->img_match_bpp == b->img_match_bpp
+    && a->map_match_bpp == b->map_match_bpp
+    && a->total_bpp == b->total_bpp
+    && a->isAlphaSource == b->isAlphaSource;
+}
+
+
+/*
+Prepare everything but the sorted offsets.
+Returns FALSE, holding nothing, if the corpus is empty (no selected, not transparent pixels)
+or if canceled while scanning it (the caller tests isCanceled().)
+*/
+static gboolean
+prepareCorpus(
+  TPreparedCorpus *corpus,  // OUT
+  const TImageSynthParameters *parameters,
+  TFormatIndices* indices,
+  Map* corpusMap,
+  const int *cancelFlag
+  )
+{
+  clock_t startTime = clock();
+
+  corpus->key = 0;
+  corpus->width = corpusMap->width;
+  corpus->height = corpusMap->height;
+  corpus->indices = *indices;
+  corpus->corpusHash = 0;   // Only computed for a caller's prepared corpus, see newPreparedCorpus()
+  corpus->sensitivityToOutliers = parameters->sensitivityToOutliers;
+  corpus->mapWeight = parameters->mapWeight;
+
+  prepareCorpusPoints(indices, corpusMap, &corpus->corpusPoints, cancelFlag);
+  if ( ! corpus->corpusPoints->len || isCanceled(cancelFlag) )
+  {
+    g_array_free(corpus->corpusPoints, TRUE);
+    return FALSE;
+  }
+  quantizeMetricFuncs(
+    parameters->sensitivityToOutliers,
+    parameters->mapWeight,
+    corpus->corpusTargetMetric,
+    corpus->mapMetric
+    );
+  prepareBestFitKernel(&corpus->kernel, indices, corpusMap, corpus->corpusTargetMetric, corpus->mapMetric);
+  prepareRecentProber(corpusMap, &corpus->recentProberMap);
+  corpus->isProbed = FALSE;
+  corpus->sortedOffsets = NULL;
+  corpus->offsetsWidth = 0;
+  corpus->offsetsHeight = 0;
+  corpus->corpusIndex = NULL;
+
+  corpus->bytes = sizeof(TPreparedCorpus)
+    + corpus->corpusPoints->len * sizeof(Coordinates)
+    + (gsize) corpusMap->width * corpusMap->height * sizeof(TProberTag);
+  if (corpus->kernel.planes.block)
+    corpus->bytes += (gsize) corpus->kernel.planes.stride * corpusMap->height
+      * (sizeof(guint32) + indices->map_end_bip - indices->map_start_bip);
+  if (corpus->kernel.bounds.block)
+    corpus->bytes += (gsize) CORPUS_BOUNDS_LEVELS * 2 * corpus->kernel.bounds.pixelelCount * corpus->kernel.bounds.cellsWide
+      * ((corpusMap->height + (1 << CORPUS_BOUNDS_CELL_SHIFT) - 1) >> CORPUS_BOUNDS_CELL_SHIFT);
+  corpus->prepareSeconds = (gdouble) (clock() - startTime) / CLOCKS_PER_SEC;
+  return TRUE;
+}
+
+
+// Free what prepareCorpus() and later calls allocated, not the struct
+static void
+releaseCorpus(TPreparedCorpus *corpus)
+{
+  g_array_free(corpus->corpusPoints, TRUE);
+  freeBestFitKernel(&corpus->kernel);
+  free_map(&corpus->recentProberMap);
+  if (corpus->sortedOffsets) g_array_free(corpus->sortedOffsets, TRUE);
+  freeCorpusIndex(corpus->corpusIndex);
+}
+
+
+/*
+Ready a prepared corpus for synthesis of this target.
+Clears the recent probers of a previous call, and sorts offsets if the target's size needs other offsets.
+Returns FALSE if canceled while sorting: the corpus then has no offsets, sorted again by the next use.
+*/
+static gboolean
+usePreparedCorpus(
+  TPreparedCorpus *corpus,
+  Map* targetMap,
+  Map* corpusMap,
+  const int *cancelFlag
+  )
+{
+  guint width = MIN(corpusMap->width, targetMap->width);
+  guint height = MIN(corpusMap->height, targetMap->height);
+
+  if (corpus->isProbed) resetRecentProber(&corpus->recentProberMap);
+  corpus->isProbed = TRUE;
+
+  if ( ! corpus->sortedOffsets || corpus->offsetsWidth != width || corpus->offsetsHeight != height )
+  {
+    if (corpus->sortedOffsets) g_array_free(corpus->sortedOffsets, TRUE);
+    // Depends on image size
+    if ( ! prepareSortedOffsets(targetMap, corpusMap, &corpus->sortedOffsets, cancelFlag) )
+      return FALSE;
+    corpus->offsetsWidth = width;
+    corpus->offsetsHeight = height;
+  }
+  return TRUE;
+}
+
+
+TPreparedCorpus *
+newPreparedCorpus(
+  TImageSynthParameters parameters,
+  TFormatIndices* indices,
+  Map* corpusMap,
+  gint key
+  )
+{
+  clock_t startTime = clock();
+  TPreparedCorpus *corpus;
+
+  // TBestFitKernel is aligned for vector loads
+  if (posix_memalign((void **) &corpus, __alignof__(TPreparedCorpus), sizeof(TPreparedCorpus)))
+    return NULL;
+  if ( ! prepareCorpus(corpus, &parameters, indices, corpusMap, &neverCanceled) )
+  {
+    free(corpus);
+    return NULL;
+  }
+  corpus->key = key;
+  corpus->corpusHash = hashCorpus(corpusMap, indices->map_end_bip);
+  corpus->prepareSeconds = (gdouble) (clock() - startTime) / CLOCKS_PER_SEC;
+  return corpus;
+}
+
+
+void
+freePreparedCorpus(TPreparedCorpus *corpus)
+{
+  if ( ! corpus) return;
+  releaseCorpus(corpus);
+  free(corpus);
+}
+
+
+gint
+preparedCorpusKey(const TPreparedCorpus *corpus)
+{
+  return corpus->key;
+}
+
+
+void
+preparedCorpusStats(
+  const TPreparedCorpus *corpus,
+  double *prepareSeconds,  // OUT processor seconds to prepare
+  size_t *bytes            // OUT memory held, not counting a corpus index
+  )
+{
+  *prepareSeconds = corpus->prepareSeconds;
+  *bytes = corpus->bytes;
+}
+
+
+gboolean
+isPreparedCorpusOf(
+  const TPreparedCorpus *corpus,
+  TImageSynthParameters parameters,
+  TFormatIndices* indices,
+  Map* corpusMap
+  )
+{
+  return corpus
+    && corpus->width == corpusMap->width
+    && corpus->height == corpusMap->height
+    && isSameFormat(&corpus->indices, indices)
+    && corpus->sensitivityToOutliers == parameters.sensitivityToOutliers
+    && corpus->mapWeight == parameters.mapWeight
+    && corpus->corpusHash == hashCorpus(corpusMap, indices->map_end_bip);
+}
@@ -11,6 +11,11 @@
   #include <glib.h>
 #endif
 
+#ifdef USE_GLIB_PROXY
+  #include <stddef.h>   // size_t
+  #include "glibProxy.h"  // Redefines the glib types used here
+#endif
+
 
 #include "imageSynthConstants.h"
 #include "progress.h"
@@ -34,7 +39,8 @@ initializeProgressRecord(
 
 /*
  * Intermediate between deeper engine and calling app's progress callback.
- * Called from inside synthesis() every 4k target pixels i.e. with raw progress increments.
+ * Called after each chunk of target points (see workerPool.h), not from inside synthesize():
+ * the loop over target points has no branch and no call for progress.
  * Knows how to convert accumlated raw progress to a percent progress.
  * Percent progress is ratio of accumulate raw progress to estimated total pixels to synthesis.
  * Callback's to invoking process every 1 percent.
@@ -46,75 +52,34 @@ initializeProgressRecord(
  * Here the same result (the context of the call is known to the progress callback)
  * is implemented by putting all the progress data (including the app's callback and parameters (context) for that call)
  * into a ProgressRecord
- * and passing both a callback function and its parameters (the ProgressRecord) to synthesize()
+ * and passing the ProgressRecord to the chunks.
+ *
+ * Threaded, every thread adds its chunks to completedPixelCount with a relaxed atomic add
+ * (a count, ordering nothing else, so no fence.)
+ * Only the thread of threadIndex zero calls back: the caller's callback (to libgimp, gdk, gtk,
+ * which are thread aware but not thread safe) is never called by two threads at once,
+ * without the mutex formerly taken by each thread.
+ * Every pool has a thread zero, and it takes chunks until the pass is done, so the reports are as frequent.
+ * Unthreaded, the only thread is zero.
  */
 void
-deepProgressCallback(ProgressRecordT * progressRecord)
+progressChunkDone(
+  ProgressRecordT * progressRecord,
+  guint count,        // Count of target points in the chunk
+  guint threadIndex
+  )
 {
+ guint completedPixelCount = __atomic_add_fetch(&progressRecord->completedPixelCount, count, __ATOMIC_RELAXED);
+ guint percentComplete;
+ 
+ if (threadIndex != 0) return;
+ 
  // !!! Note if estimatedPixelCountToCompletion is small
  // this calls back once for each pass with a percentComplete greater than 100.
- progressRecord->completedPixelCount += IMAGE_SYNTH_CALLBACK_COUNT;
- guint percentComplete = ((float)progressRecord->completedPixelCount/progressRecord->estimatedPixelCountToCompletion)*100;
+ percentComplete = ((float)completedPixelCount/progressRecord->estimatedPixelCountToCompletion)*100;
  if ( percentComplete > progressRecord->priorReportedPercentComplete )
  {
    progressRecord->progressCallback((int) percentComplete, progressRecord->context);  // Forward callback to calling process
    progressRecord->priorReportedPercentComplete = percentComplete;
  }
 }
-
-
-#ifdef SYNTH_THREADED
-
-void 
-initializeThreadedProgressRecord(
-     ProgressRecordT* progressRecord,
-     TRepetionParameters repetitionParams,
-     void (*progressCallback)(int, void*),
-     void * contextInfo,
-     GMutex *mutexProgress)
-{
-    // init fields common to unthreaded and threaded
-    initializeProgressRecord(progressRecord, repetitionParams, progressCallback, contextInfo);
-
-    // also init additional field for thread safety
-    progressRecord->mutexProgress = mutexProgress;
-}
-
-
-/*
-  Threaded version.
-   
-  This function has local variables that are threadsafe, 
-  but progressRecord is in the parent thread and must be synchronized.
-  */
-  void
-  deepProgressCallbackThreaded(ProgressRecordT * progressRecord)
-  {
-    guint percentComplete;
-    
-    // Thread-safe increment completedPixelCount
-    (void)__sync_add_and_fetch(&progressRecord->completedPixelCount, IMAGE_SYNTH_CALLBACK_COUNT);
-
-    percentComplete = ((float)progressRecord->completedPixelCount/progressRecord->estimatedPixelCountToCompletion)*100;
-    if ( percentComplete > progressRecord->priorReportedPercentComplete )
-    {
-      // mutex lock for two reasons:
-      // 1) calls (in progressCallback()) to libgmp, gdk, gtk which are thread aware but not thread safe
-      // 2) thread-safe incrementing global variable priorReportedPercentComplete
-      // Note threads can still underreport percent complete but it is inconsequential.
-
-      // pass pointer to mutex
-      g_mutex_lock(progressRecord->mutexProgress);       
-      // Alternatively, use gdk_thread_enter()
-
-      // Forward deep progress callback to calling process
-      progressRecord->progressCallback(
-        (int) percentComplete, 
-        progressRecord->context);
-
-      progressRecord->priorReportedPercentComplete = percentComplete;
-      g_mutex_unlock(progressRecord->mutexProgress);
-    }
-  }
-
-#endif
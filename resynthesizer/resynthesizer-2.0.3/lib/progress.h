@@ -1,4 +1,3 @@
-
 /*
 Types for GUI progress callbacks.
 */
@@ -8,22 +7,16 @@ Types for GUI progress callbacks.
 
 struct ProgressRecord {
   guint estimatedPixelCountToCompletion;
-  guint completedPixelCount;
+  guint completedPixelCount;  // Threaded: relaxed atomic adds, see progressChunkDone()
   guint priorReportedPercentComplete;
 
   void (*progressCallback)(int, void*);    // callback upstream to caller
   void * context;                          // opaque data params to caller
-
-#ifdef SYNTH_THREADED
-  // mutually exclude threads over certain other fields of struct
-  GMutex *mutexProgress;
-#endif
 };
 
 typedef struct ProgressRecord ProgressRecordT;
 
-void deepProgressCallback(ProgressRecordT*);
-void deepProgressCallbackThreaded(ProgressRecordT*);
+void progressChunkDone(ProgressRecordT*, guint, guint);
 
 void initializeProgressRecord(
      ProgressRecordT* progressRecord,
@@ -31,12 +24,17 @@ void initializeProgressRecord(
      void (*progressCallback)(int, void*),
      void * contextInfo);
 
-void initializeThreadedProgressRecord(
-     ProgressRecordT* progressRecord,
-     TRepetionParameters repetitionParams,
-     void (*progressCallback)(int, void*),
-     void * contextInfo,
-     GMutex *mutexProgress
-);
-     
 
+/*
+Whether the caller has canceled, polled at chunk boundaries (not per target point.)
+The caller sets the flag from another thread (e.g. the GUI) and never clears it during a call.
+A relaxed load suffices: it orders nothing, it must only not be hoisted out of the loop.
+*/
+static inline gboolean
+isCanceled(const int *cancelFlag)
+{
+  return __atomic_load_n(cancelFlag, __ATOMIC_RELAXED) != 0;
+}
+
+// Flag of preparations outside an engine call, which no caller can cancel, e.g. newPreparedCorpus()
+static const int neverCanceled = 0;
@@ -0,0 +1,226 @@
+/*
+Coarse to fine (image pyramid) synthesis.
+
+Synthesis cost is the count of target points times the count of probes.
+On the first pass the patches are shotgun patterns and probing is mostly random,
+so a large target is both slow and, for large structures (bigger than a patch), poorly organized.
+
+Here the engine first synthesizes half size copies of the target and corpus (recursively, to a few levels.)
+At each finer level, the sources found at the coarser level are scaled up
+(a coarse source (x,y) yields fine sources (2x,2y), (2x+1,2y), etc.)
+and the target is initialized with colors from those sources.
+Then the engine only refines, with fewer passes and fewer random probes.
+Most points get a perfect or good match from the sources of their neighbors (heuristic 1 of synthesize().)
+
+The halving is a binomial (approximately Gaussian) filter [1 3 3 1]/8 then decimation.
+Only pixels that are valid contribute: for the corpus, pixels in the corpus;
+for the target image, pixels in the context (not the target, whose colors are meaningless.)
+A coarse pixel is in the target if any of its fine pixels are,
+and in the corpus only if all of its fine pixels are, so coarse sources scale to valid fine sources.
+
+  Copyright (C) 2010, 2011  Lloyd Konneker
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+/*
+Whether a pixel of a fine pixmap contributes its color to the coarse pixmap.
+*/
+static inline gboolean
+isValidPyramidPixel(
+  const Pixelel *pixel,
+  TFormatIndices* indices,
+  gboolean isCorpus,
+  gboolean isAlpha
+  )
+{
+  if (isAlpha && pixel[indices->alpha_bip] == ALPHA_TOTAL_TRANSPARENCY) return FALSE;
+  if (isCorpus)
+    return pixel[MASK_PIXELEL_INDEX] == MASK_TOTALLY_SELECTED;
+  else
+    return pixel[MASK_PIXELEL_INDEX] == MASK_UNSELECTED;  // context
+}
+
+
+/*
+Make a half size pixmap of a target or corpus pixmap.
+*/
+static void
+downsamplePixmap(
+  TFormatIndices* indices,
+  Map *fineMap,
+  Map *coarseMap,     // OUT
+  gboolean isCorpus   // Else target
+  )
+{
+  static const guint binomial[4] = {1, 3, 3, 1};
+  gboolean isAlpha = isCorpus ? indices->isAlphaSource : indices->isAlphaTarget;
+  guint x;
+  guint y;
+
+  new_pixmap(coarseMap, (fineMap->width + 1) / 2, (fineMap->height + 1) / 2, fineMap->depth);
+
+  for (y=0; y<coarseMap->height; y++)
+    for (x=0; x<coarseMap->width; x++)
+    {
+      Coordinates coarsePoint = {x, y};
+      Pixelel *coarsePixel = pixmap_index(coarseMap, coarsePoint);
+      guint sum[MAX_IMAGE_SYNTH_BPP] = {0};
+      guint weightSum = 0;
+      // Mask and alpha of the 2x2 fine block under the coarse pixel
+      Pixelel maskExtreme = isCorpus ? MASK_TOTALLY_SELECTED : MASK_UNSELECTED;
+      Pixelel alphaExtreme = isCorpus ? 255 : ALPHA_TOTAL_TRANSPARENCY;
+      guint i;
+      guint j;
+      TPixelelIndex k;
+
+      // 4x4 fine taps centered on the 2x2 block, clamped at edges
+      for (j=0; j<4; j++)
+        for (i=0; i<4; i++)
+        {
+          gint fx = MAX(0, MIN((gint) (2*x + i) - 1, (gint) fineMap->width - 1));
+          gint fy = MAX(0, MIN((gint) (2*y + j) - 1, (gint) fineMap->height - 1));
+          Coordinates finePoint = {fx, fy};
+          const Pixelel *finePixel = pixmap_index(fineMap, finePoint);
+
+          if (i==1 || i==2)
+            if (j==1 || j==2)
+            {
+              // In the 2x2 block.  (At the right or bottom edge, clamped: the block repeats a pixel.)
+              if (isCorpus)
+              {
+                maskExtreme = MIN(maskExtreme, finePixel[MASK_PIXELEL_INDEX]);
+                if (isAlpha) alphaExtreme = MIN(alphaExtreme, finePixel[indices->alpha_bip]);
+              }
+              else
+              {
+                maskExtreme = MAX(maskExtreme, finePixel[MASK_PIXELEL_INDEX]);
+                if (isAlpha) alphaExtreme = MAX(alphaExtreme, finePixel[indices->alpha_bip]);
+              }
+            }
+
+          if (isValidPyramidPixel(finePixel, indices, isCorpus, isAlpha))
+          {
+            guint weight = binomial[i] * binomial[j];
+
+            for (k=FIRST_PIXELEL_INDEX; k<indices->colorEndBip; k++)
+              sum[k] += weight * finePixel[k];
+            for (k=indices->map_start_bip; k<indices->map_end_bip; k++)
+              sum[k] += weight * finePixel[k];
+            weightSum += weight;
+          }
+        }
+
+      // Start with a copy of the pixel nearest the center, then overwrite what is filtered
+      {
+      Coordinates finePoint = {MIN(2*x, fineMap->width - 1), MIN(2*y, fineMap->height - 1)};
+      for (k=0; k<indices->total_bpp; k++)
+        coarsePixel[k] = pixmap_index(fineMap, finePoint)[k];
+      }
+      if (weightSum)
+      {
+        for (k=FIRST_PIXELEL_INDEX; k<indices->colorEndBip; k++)
+          coarsePixel[k] = (Pixelel) ((sum[k] + weightSum/2) / weightSum);
+        for (k=indices->map_start_bip; k<indices->map_end_bip; k++)
+          coarsePixel[k] = (Pixelel) ((sum[k] + weightSum/2) / weightSum);
+      }
+      coarsePixel[MASK_PIXELEL_INDEX] = maskExtreme;
+      if (isAlpha) coarsePixel[indices->alpha_bip] = alphaExtreme;
+    }
+}
+
+
+/*
+Whether it is worth synthesizing at a coarser level first:
+both images must still be large compared to a patch after halving.
+*/
+static gboolean
+isPyramidLevelUseful(
+  Map *targetMap,
+  Map *corpusMap
+  )
+{
+  return MIN(targetMap->width, targetMap->height) >= 2 * IMAGE_SYNTH_PYRAMID_MIN_SIZE
+      && MIN(corpusMap->width, corpusMap->height) >= 2 * IMAGE_SYNTH_PYRAMID_MIN_SIZE;
+}
+
+
+/*
+Initialize target points from the sources found at the coarser level.
+A target point whose scaled source is not in the corpus is left unsynthesized.
+Returns count of target points initialized.
+*/
+static guint
+upsampleSources(
+  TFormatIndices* indices,
+  Map* targetMap,
+  Map* corpusMap,
+  Map* hasValueMap,
+  TSourceMap* sourceOfMap,
+  pointVector targetPoints,
+  TSourceMap* coarseSourceOfMap
+  )
+{
+  guint count = 0;
+  guint i;
+
+  for (i=0; i<targetPoints->len; i++)
+  {
+    Coordinates position = g_array_index(targetPoints, Coordinates, i);
+    Coordinates coarsePoint = {position.x / 2, position.y / 2};
+    Coordinates coarseSource;
+    Coordinates source;
+
+    if ( coarsePoint.x >= (gint) coarseSourceOfMap->map.width || coarsePoint.y >= (gint) coarseSourceOfMap->map.height) continue;
+    coarseSource = getSourceOf(coarsePoint, coarseSourceOfMap);
+    if (coarseSource.x == -1) continue;  // Not synthesized at coarse level, e.g. canceled
+    // Same position within the 2x2 block of the source as of the target
+    source.x = 2 * coarseSource.x + (position.x & 1);
+    source.y = 2 * coarseSource.y + (position.y & 1);
+    if (clippedOrMaskedCorpus(source, corpusMap)) continue;
+
+    setColor(indices, targetMap, position, corpusMap, source);
+    setSourceOf(position, source, sourceOfMap);
+    setHasValue(&position, TRUE, hasValueMap);
+    count++;
+  }
+  return count;
+}
+
+
+/*
+Progress of one level of the pyramid, as a share of the whole.
+Forwards to the caller's progress callback.
+*/
+typedef struct PyramidProgressStruct {
+  void (*progressCallback)(int, void*);
+  void *contextInfo;
+  int percentStart;   // Percent of the whole at start of this level
+  int percentSpan;    // Percent of the whole for this level
+} TPyramidProgress;
+
+static void
+pyramidProgressCallback(
+  int percent,
+  void *uncastProgress
+  )
+{
+  TPyramidProgress *progress = (TPyramidProgress *) uncastProgress;
+
+  progress->progressCallback(
+    progress->percentStart + MIN(percent, 100) * progress->percentSpan / 100,
+    progress->contextInfo);
+}
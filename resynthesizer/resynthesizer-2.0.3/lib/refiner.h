@@ -47,13 +47,17 @@ refiner(
   Map* corpusMap,
   Map* recentProberMap,
   Map* hasValueMap,
-  Map* sourceOfMap,
+  TSourceMap* sourceOfMap,
   pointVector targetPoints,
   pointVector corpusPoints,
   pointVector sortedOffsets,
-  GRand *prng,
+  guint64 prngKey,
   TPixelelMetricFunc corpusTargetMetric,  // array pointers
   TMapPixelelMetricFunc mapsMetric,
+  const TBestFitKernel *kernel,
+  const TCorpusIndex *corpusIndex,  // IN or NULL
+  guint passCount,    // At most MAX_PASSES
+  gint64 deadline,    // Of the time budget, or 0, see isPastDeadline()
   void (*progressCallback)(int, void*),
   void *contextInfo,
   int* cancelFlag
@@ -62,9 +66,30 @@ refiner(
   guint pass;
   TRepetionParameters repetition_params;
   
+  // PatchMatch passes after the first alternate scanline order
+  gboolean isPatchMatch = (parameters.searchStrategy == IMAGE_SYNTH_SEARCH_PATCHMATCH);
+  TScanlineOrder scanlineOrder = {NULL, NULL};  // Prepared only if isPatchMatch
+  
   ProgressRecordT progressRecord;
-
-  prepare_repetition_parameters(repetition_params, targetPoints->len);
+  
+  // Counts of the pass, see synthStats.h
+  TSynthCounters counters;
+  gint64 passStartTime;
+  
+  // Adaptive passes, see adaptivePasses.h
+  Map changedMap;
+  pointVector changedPoints = NULL;
+
+  if (isPatchMatch)
+  {
+    patchMatchRepetitionParameters(repetition_params, targetPoints->len);
+    prepareScanlineOrder(targetPoints, &scanlineOrder);
+  }
+  else
+    prepare_repetition_parameters(repetition_params, targetPoints->len);
+  truncate_repetition_parameters(repetition_params, passCount);
+  if (parameters.isAdaptivePasses)
+    new_bitmap(&changedMap, targetMap->width, targetMap->height);
 
   initializeProgressRecord(
     &progressRecord,
@@ -72,51 +97,95 @@ refiner(
     progressCallback,
     contextInfo);
 
-  for (pass=0; pass<MAX_PASSES; pass++)
+  for (pass=0; pass<passCount; pass++)
   { 
     guint endTargetIndex = repetition_params[pass][1];
     gulong betters = 0; // gulong so can be cast to void *
+    pointVector passTargetPoints = isPatchMatch ? 
+      patchMatchPassPoints(pass, targetPoints, &scanlineOrder) : targetPoints;
     
-    betters = synthesize(
+    if (parameters.isAdaptivePasses && pass > 0)
+    {
+      if (changedPoints) g_array_free(changedPoints, TRUE);
+      changedPoints = changedPassPoints(passTargetPoints, &changedMap);
+      passTargetPoints = changedPoints;
+      endTargetIndex = changedPoints->len;
+      if ( ! endTargetIndex )
+        break;  // Converged: no neighborhood changed
+    }
+    
+    passStartTime = startPassStats(&counters, 1);
+    /*
+    In chunks, as by the threads of refinerThreaded.h.
+    Between chunks (not per target point), report progress and poll for cancel.
+    */
+    {
+    guint startTargetIndex;
+    
+    for (startTargetIndex=0; 
+        startTargetIndex<endTargetIndex && ! isCanceled(cancelFlag); 
+        startTargetIndex+=IMAGE_SYNTH_CHUNK_SIZE)
+    {
+      guint endChunkIndex = MIN(startTargetIndex + IMAGE_SYNTH_CHUNK_SIZE, endTargetIndex);
+      
+      betters += synthesize(
         &parameters,
         0,      // Unthreaded synthesis is threadIndex 0
-        0,      // Unthreaded synthesis startTargetIndex is 0
-        endTargetIndex,
+        startTargetIndex,
+        endChunkIndex,
         indices,
         targetMap,
         corpusMap,
         recentProberMap,
         hasValueMap,
         sourceOfMap,
-        targetPoints,
+        parameters.isAdaptivePasses ? &changedMap : NULL,
+        passTargetPoints,
         corpusPoints,
         sortedOffsets,
-        prng,
+        prngSubKey(prngKey, pass), // Random streams differ by pass
         corpusTargetMetric,
         mapsMetric,
-        deepProgressCallback,
-	&progressRecord,	// parameters to progress callback.  progressRecord is on stack.
-        cancelFlag
+        kernel,
+        (pass == 0) ? corpusIndex : NULL, // Index only for the first pass
+        NULL,   // Unthreaded: write the maps at once, results are deterministic
+        &counters
         );
+      #ifdef DEEP_PROGRESS
+      progressChunkDone(&progressRecord, endChunkIndex - startTargetIndex, 0);  // progressRecord is on stack.
+      #endif
+    }
+    }
 
+    endPassStats(&parameters, &counters, 1, pass, endTargetIndex, betters, targetPoints->len,
+      passStartTime);
     // nil unless DEBUG
-    print_pass_stats(pass, repetition_params[pass][1], betters);
+    print_pass_stats(pass, endTargetIndex, betters);
     // printf("Pass %d betters %ld\n", pass, betters);
     
+    if (isCanceled(cancelFlag))
+      break;
+    
     /* Break if a small fraction of target is bettered
     This is a fraction of total target points, 
     not the possibly smaller count of target attempts this pass.
     Or break on small integral change: if ( targetPoints_size / integralColorChange < 10 ) {
     */
-    if ( (float) betters / targetPoints->len < (IMAGE_SYNTH_TERMINATE_FRACTION) ) 
+    if ( (float) betters / targetPoints->len < parameters.terminateFraction ) 
     {
       // printf("Quitting early after %d passes. Betters %ld\n", pass+1, betters);
       break;
     }
+    if (isPastDeadline(deadline))
+      break;
     
     // Simple progress: percent of passes complete.
     // This is not ideal, a maximum of MAX_PASSES callbacks, typically six.
     // And the later passes are much shorter than earlier passes.
     // progressCallback( (int) ((pass+1.0)/(MAX_PASSES+1)*100), contextInfo);
   } // end pass
+  
+  if (isPatchMatch) free_scanline_order(&scanlineOrder);
+  if (changedPoints) g_array_free(changedPoints, TRUE);
+  if (parameters.isAdaptivePasses) free_map(&changedMap);
 }
@@ -38,6 +38,8 @@ Alternative 1:
 Each pass divides targetPoints among threads and rejoins before the next pass.
 Here, one thread may be reading pixels that another thread is synthesizing,
 but no two threads are synthesizing the same pixel.
+The threads are a pool started once per call to the engine, see workerPool.h.
+Threads take chunks of contiguous targetPoints, stealing chunks from other threads when they run out.
 
 Alternative 2:
 one thread is started for each pass, with each thread working on a prefix of the same targetPoints.
@@ -54,6 +56,8 @@ Sept. 2011.  One experiment shows it is no faster, and produces different, grain
   #include <pthread.h>
 #endif
 
+#include "workerPool.h"
+
 
 // When synthesize() is threaded, it needs a single argument.
 // Wrapper struct for single arg to synthesize
@@ -67,16 +71,20 @@ typedef struct synthArgsStruct {
   Map* corpusMap;       // IN
   Map* recentProberMap; // IN/OUT
   Map* hasValueMap;     // IN/OUT
-  Map* sourceOfMap;     // IN/OUT
+  TSourceMap* sourceOfMap; // IN/OUT
+  Map* changedMap;      // IN/OUT or NULL, see adaptivePasses.h
   pointVector targetPoints; // IN
   pointVector corpusPoints; // IN
   pointVector sortedOffsets; // IN
-  GRand *prng;
+  guint64 prngKey;      // IN key of random streams of the pass, see counterPrng.h
   gushort * corpusTargetMetric;   // array pointers TPixelelMetricFunc
   guint * mapsMetric;             // TMapPixelelMetricFunc
-  void (*deepProgressCallback)();         // void func(void)
-  ProgressRecordT *progressRecord;
-  int* cancelFlag;  // flag set when canceled
+  const TBestFitKernel * kernel;
+  const TCorpusIndex * corpusIndex;  // IN or NULL, first pass only, see corpusIndex.h
+  TDeferredSources * deferred;  // OUT or NULL, see deterministicRounds.h
+  TSynthCounters * counters;  // IN/OUT, one per thread, indexed by threadIndex, see synthStats.h
+  ProgressRecordT *progressRecord;   // Reported after each chunk, see progressChunkDone()
+  int* cancelFlag;  // flag set when canceled, polled before each chunk
 } SynthArgs;
 
 
@@ -95,14 +103,17 @@ newSynthesisArgs(
   Map* corpusMap,       // IN
   Map* recentProberMap, // IN/OUT
   Map* hasValueMap,     // IN/OUT
-  Map* sourceOfMap,     // IN/OUT
+  TSourceMap* sourceOfMap, // IN/OUT
+  Map* changedMap,      // IN/OUT or NULL
   pointVector targetPoints, // IN
   pointVector corpusPoints, // IN
   pointVector sortedOffsets, // IN
-  GRand *prng,
+  guint64 prngKey,
   TPixelelMetricFunc corpusTargetMetric,  // array pointers
   TMapPixelelMetricFunc mapsMetric,
-  void (*deepProgressCallback)(),
+  const TBestFitKernel *kernel,
+  const TCorpusIndex *corpusIndex,
+  TSynthCounters *counters,
   ProgressRecordT* progressRecord,
   int* cancelFlag
   )
@@ -117,19 +128,80 @@ newSynthesisArgs(
   args->recentProberMap = recentProberMap;
   args->hasValueMap = hasValueMap;
   args->sourceOfMap = sourceOfMap;
+  args->changedMap = changedMap;
   args->targetPoints = targetPoints;
   args->corpusPoints = corpusPoints;
   args->sortedOffsets = sortedOffsets;
-  args->prng = prng;
+  args->prngKey = prngKey;
   args->corpusTargetMetric = corpusTargetMetric;
   args->mapsMetric = mapsMetric;
-  args->deepProgressCallback = deepProgressCallback;
+  args->kernel = kernel;
+  args->corpusIndex = corpusIndex;
+  args->deferred = NULL;  // Set per pass, see refiner()
+  args->counters = counters;
   args->progressRecord = progressRecord;
   args->cancelFlag = cancelFlag;
 }
 
 
 
+/*
+Job for the worker pool: synthesize one chunk of targetPoints.
+The args are the same for all threads and chunks, except threadIndex and the chunk.
+The chunk is of the pass, or when deferred, of the round (from args->deferred->startTargetIndex.)
+*/
+static gulong
+synthesisChunk(
+  void * uncastArgs,
+  guint threadIndex,
+  guint startTargetIndex,
+  guint endTargetIndex
+  )
+{
+  SynthArgs* args = (SynthArgs *) uncastArgs;
+  gulong betters;
+
+  if (isCanceled(args->cancelFlag)) return 0;  // Let the pass drain quickly
+
+  if (args->deferred)
+  {
+    startTargetIndex += args->deferred->startTargetIndex;
+    endTargetIndex += args->deferred->startTargetIndex;
+  }
+  betters = synthesize(
+      args->parameters,
+      threadIndex,
+      startTargetIndex,
+      endTargetIndex,
+      args->indices,
+      args->targetMap,
+      args->corpusMap,
+      args->recentProberMap,
+      args->hasValueMap,
+      args->sourceOfMap,
+      args->changedMap,
+      args->targetPoints,
+      args->corpusPoints,
+      args->sortedOffsets,
+      args->prngKey,
+      args->corpusTargetMetric,
+      args->mapsMetric,
+      args->kernel,
+      args->corpusIndex,
+      args->deferred,
+      &args->counters[threadIndex]
+      );
+  #ifdef DEEP_PROGRESS
+  // progressRecord is in stack frame of refiner()
+  progressChunkDone(args->progressRecord, endTargetIndex - startTargetIndex, threadIndex);
+  #endif
+  return betters;
+}
+
+
+#ifdef SYNTH_THREADED2
+// Alternative 2 still starts a thread per pass
+
 static void *
 synthesisThread(void * uncastArgs)
 {
@@ -145,16 +217,17 @@ synthesisThread(void * uncastArgs)
   Map* corpusMap                      = args->corpusMap;      
   Map* recentProberMap                = args->recentProberMap;
   Map* hasValueMap                    = args->hasValueMap;
-  Map* sourceOfMap                    = args->sourceOfMap;
+  TSourceMap* sourceOfMap             = args->sourceOfMap;
+  Map* changedMap                     = args->changedMap;
   pointVector targetPoints            = args->targetPoints;      
   pointVector corpusPoints            = args->corpusPoints;
   pointVector sortedOffsets           = args->sortedOffsets;
-  GRand *prng                         = args->prng;
+  guint64 prngKey                     = args->prngKey;
   gushort * corpusTargetMetric        = args->corpusTargetMetric; // array pointers TPixelelMetricFunc
   guint * mapsMetric                  = args->mapsMetric;
-  void (*deepProgressCallback)()      = args->deepProgressCallback;
-  ProgressRecordT * progressRecord    = args->progressRecord;
-  int* cancelFlag                     = args->cancelFlag;
+  const TBestFitKernel * kernel       = args->kernel;
+  const TCorpusIndex * corpusIndex   = args->corpusIndex;
+  TSynthCounters * counters           = &args->counters[threadIndex];
 
   
   gulong betters = synthesize(  // gulong so can be cast to void *
@@ -168,15 +241,17 @@ synthesisThread(void * uncastArgs)
       recentProberMap,
       hasValueMap,
       sourceOfMap,
+      changedMap,
       targetPoints,
       corpusPoints,
       sortedOffsets,
-      prng,
+      prngKey,
       corpusTargetMetric, 
       mapsMetric,
-      deepProgressCallback,
-      progressRecord,	// parameters to progress callback.  progressRecord is in stack frame of refinerThreaded().
-      cancelFlag
+      kernel,
+      corpusIndex,
+      NULL,     // Alternative 2 is not deterministic
+      counters
       );
   return (void*) betters;
 }
@@ -198,15 +273,16 @@ startThread(
   Map* corpusMap,
   Map* recentProberMap,
   Map* hasValueMap,
-  Map* sourceOfMap,
+  TSourceMap* sourceOfMap,
   pointVector targetPoints,
   pointVector corpusPoints,
   pointVector sortedOffsets,
-  GRand *prng,
+  guint64 prngKey,
   TPixelelMetricFunc corpusTargetMetric,  // array pointers
   TMapPixelelMetricFunc mapsMetric,
-  void (*deepProgressCallback)(),
-  ProgressRecordT *progressRecord,
+  const TBestFitKernel *kernel,
+  const TCorpusIndex *corpusIndex,
+  TSynthCounters *counters,
   int* cancelFlag
   )
 {
@@ -222,14 +298,17 @@ startThread(
     recentProberMap,
     hasValueMap,
     sourceOfMap,
+    NULL,       // changedMap: alternative 2 passes overlap, not adaptive
     targetPoints,
     corpusPoints,
     sortedOffsets,
-    prng,
+    prngKey,
     corpusTargetMetric, 
     mapsMetric,
-    deepProgressCallback,
-    progressRecord,
+    kernel,
+    corpusIndex,
+    counters,
+    NULL,       // progressRecord: alternative 2 does not report progress
     cancelFlag
     );
 
@@ -249,13 +328,54 @@ startThread(
     pthread_create(thread, NULL, synthesisThread, (void * __restrict__) args);
 #endif
 }
-
+#endif
 
 
 
 
 // Alternative 1
 
+/*
+Synthesize one pass in rounds, see deterministicRounds.h.
+Each round is done by the pool, then its deferred sources are written by this thread.
+Returns the sum of betterments.
+*/
+static gulong
+runRounds(
+  TWorkerPool *pool,
+  SynthArgs *synthArgs,   // synthArgs->deferred not NULL
+  guint endTargetIndex
+  )
+{
+  TDeferredSources *deferred = synthArgs->deferred;
+  gulong betters = 0;
+  guint start = 0;
+
+  while (start < endTargetIndex && ! isCanceled(synthArgs->cancelFlag))
+  {
+    guint end = roundEnd(start, endTargetIndex);
+
+    deferred->startTargetIndex = start;
+    if (pool->threadCount)
+    {
+      // Rounds can be smaller than a chunk of a pass: about four chunks per thread
+      guint chunkSize = MAX(1, MIN(IMAGE_SYNTH_CHUNK_SIZE, (end - start) / (4 * pool->threadCount)));
+      
+      betters += runWorkerPool(pool, synthesisChunk, synthArgs, end - start, chunkSize);
+    }
+    else
+      // Could not start threads, synthesize the round in this thread
+      betters += synthesisChunk(synthArgs, 0, 0, end - start);
+    if (isCanceled(synthArgs->cancelFlag))
+      break;  // Chunks of the round were skipped: drop it
+    commitDeferredSources(deferred, end, synthArgs->indices, synthArgs->targetMap, synthArgs->corpusMap,
+      synthArgs->hasValueMap, synthArgs->sourceOfMap, synthArgs->changedMap, synthArgs->targetPoints);
+    start = end;
+  }
+  return betters;
+}
+
+
 static void 
 refiner(
   TImageSynthParameters parameters,
@@ -264,13 +384,17 @@ refiner(
   Map* corpusMap,
   Map* recentProberMap,
   Map* hasValueMap,
-  Map* sourceOfMap,
+  TSourceMap* sourceOfMap,
   pointVector targetPoints,
   pointVector corpusPoints,
   pointVector sortedOffsets,
-  GRand *prng,
+  guint64 prngKey,
   TPixelelMetricFunc corpusTargetMetric,  // array pointers
   TMapPixelelMetricFunc mapsMetric,
+  const TBestFitKernel *kernel,
+  const TCorpusIndex *corpusIndex,  // IN or NULL
+  guint passCount,    // At most MAX_PASSES
+  gint64 deadline,    // Of the time budget, or 0, see isPastDeadline()
   void (*progressCallback)(int, void*),
   void *contextInfo,
   int* cancelFlag
@@ -278,101 +402,155 @@ refiner(
 {
   guint pass;
   TRepetionParameters repetition_params;
+  
+  // PatchMatch passes after the first alternate scanline order
+  gboolean isPatchMatch = (parameters.searchStrategy == IMAGE_SYNTH_SEARCH_PATCHMATCH);
+  TScanlineOrder scanlineOrder = {NULL, NULL};  // Prepared only if isPatchMatch
 
-  // Threaded: use atomic add and mutexProgress when updating progress
-  // !!! This is owned by parent, updated by child threads executing callback function deepProgressCallback.
+  // Threaded: updated by the pool's threads after each chunk, see progressChunkDone()
+  // !!! This is owned by parent
   ProgressRecordT progressRecord;
   
 
-  // Synthesize in threads.  Note proxies in glibProxy.h for POSIX threads
-#ifdef SYNTH_USE_GLIB_THREADS
-  GThread* threads[THREAD_LIMIT];
-#else
-  pthread_t threads[THREAD_LIMIT];
-#endif
-  // If not using glib proxied to pthread by glibProxy.h
-  g_mutex_init(&mutex);  // defined in synthesize.h
-
-  static GMutex mutexProgress;
-  g_mutex_init(&mutexProgress);
+  // Synthesize in a pool of threads.  Note proxies in glibProxy.h for POSIX threads
+  TWorkerPool pool;
+  guint threadCount;
 
+  // Args are the same for all threads, threadIndex and target range come per chunk from the pool
+  SynthArgs synthArgs;
 
-  SynthArgs synthArgs[THREAD_LIMIT];
+  // Counts of the pass, one per thread of the pool, see synthStats.h
+  TSynthCounters *counters;
+  void *countersBlock;
+  gint64 passStartTime;
+  
+  // Adaptive passes, see adaptivePasses.h
+  Map changedMap;
+  pointVector changedPoints = NULL;
+  
+  // Deterministic passes, see deterministicRounds.h
+  TDeferredSources deferred;
 
-  prepare_repetition_parameters(repetition_params, targetPoints->len);
+  if (isPatchMatch)
+  {
+    patchMatchRepetitionParameters(repetition_params, targetPoints->len);
+    prepareScanlineOrder(targetPoints, &scanlineOrder);
+  }
+  else
+    prepare_repetition_parameters(repetition_params, targetPoints->len);
+  truncate_repetition_parameters(repetition_params, passCount);
+  if (parameters.isAdaptivePasses)
+    new_bitmap(&changedMap, targetMap->width, targetMap->height);
 
-  initializeThreadedProgressRecord(
+  initializeProgressRecord(
     &progressRecord,
     repetition_params,
     progressCallback,
-    contextInfo,
-    &mutexProgress);
+    contextInfo);
+
+  newSynthesisArgs(
+    &synthArgs,
+    &parameters,
+    0, 0, 0,    // threadIndex, startTargetIndex, endTargetIndex: per chunk
+    indices,
+    targetMap,
+    corpusMap,
+    recentProberMap,
+    hasValueMap,
+    sourceOfMap,
+    parameters.isAdaptivePasses ? &changedMap : NULL,
+    targetPoints,
+    corpusPoints,
+    sortedOffsets,
+    prngKey,
+    corpusTargetMetric, mapsMetric,
+    kernel,
+    corpusIndex,
+    NULL,       // counters: when the count of threads is known
+    &progressRecord,
+    cancelFlag
+    );
 
   // Assert threading system is init at startup time, after glib 2.32
+  // Start threads once, for all passes
+  threadCount = newWorkerPool(&pool, 
+    workerPoolThreadCount(parameters.threadCount, targetPoints->len, IMAGE_SYNTH_CHUNK_SIZE));
+  counters = newSynthCounters(MAX(threadCount, 1), &countersBlock);
+  synthArgs.counters = counters;
+  // Rounds for any count of threads, so results do not depend on it
+  if (parameters.isDeterministic)
+  {
+    newDeferredSources(&deferred, targetPoints->len);
+    synthArgs.deferred = &deferred;
+    synthArgs.recentProberMap = NULL;  // Shared, see deterministicRounds.h
+  }
   
-  for (pass=0; pass<MAX_PASSES; pass++)
+  for (pass=0; pass<passCount; pass++)
   { 
     guint endTargetIndex = repetition_params[pass][1];
-    gulong betters = 0;
+    gulong betters;
 
-    guint threadIndex;
-    for (threadIndex=0; threadIndex<THREAD_LIMIT; threadIndex++)
+    synthArgs.prngKey = prngSubKey(prngKey, pass); // Random streams differ by pass
+    synthArgs.corpusIndex = (pass == 0) ? corpusIndex : NULL;
+    if (isPatchMatch)
+      synthArgs.targetPoints = patchMatchPassPoints(pass, targetPoints, &scanlineOrder);
+    if (parameters.isAdaptivePasses && pass > 0)
     {
-      startThread(
-        &synthArgs[threadIndex], &threads[threadIndex], threadIndex, // thread specific
-        0, endTargetIndex,      // Every thread works on a prefix of targetPoints, splits it modulo threadIndex
-        &parameters,
-        indices,
-        targetMap,
-        corpusMap,
-        recentProberMap,
-        hasValueMap,
-        sourceOfMap,
-        targetPoints,
-        corpusPoints,
-        sortedOffsets,
-        prng,
-        corpusTargetMetric, mapsMetric,
-        deepProgressCallback,
-        &progressRecord,
-        cancelFlag
-        );
-   }
-
-   // Wait for threads to complete; rejoin them
-   for (threadIndex=0; threadIndex<THREAD_LIMIT; threadIndex++)
-   {
-     gulong temp;
-
-#ifdef SYNTH_USE_GLIB_THREADS
-     temp = (gulong) g_thread_join(threads[threadIndex]);       // cast return value from gpointer to gulong
-#else
-     pthread_join(threads[threadIndex], (void**)&temp);
-#endif
-     betters += temp;
-   }
-
+      pointVector passTargetPoints = isPatchMatch ? synthArgs.targetPoints : targetPoints;
+      
+      // The pool's threads are waiting, none is marking changedMap
+      if (changedPoints) g_array_free(changedPoints, TRUE);
+      changedPoints = changedPassPoints(passTargetPoints, &changedMap);
+      synthArgs.targetPoints = changedPoints;
+      endTargetIndex = changedPoints->len;
+      if ( ! endTargetIndex )
+        break;  // Converged: no neighborhood changed
+    }
     
+    passStartTime = startPassStats(counters, MAX(threadCount, 1));
+    if (synthArgs.deferred)
+      betters = runRounds(&pool, &synthArgs, endTargetIndex);
+    else if (threadCount)
+      // Returns after all threads are done with the pass
+      betters = runWorkerPool(&pool, synthesisChunk, &synthArgs, endTargetIndex, IMAGE_SYNTH_CHUNK_SIZE);
+    else
+      // Could not start threads, synthesize in this thread
+      betters = synthesisChunk(&synthArgs, 0, 0, endTargetIndex);
+
+    endPassStats(&parameters, counters, MAX(threadCount, 1), pass, endTargetIndex, betters,
+      targetPoints->len, passStartTime);
     // nil unless DEBUG
-    print_pass_stats(pass, repetition_params[pass][1], betters);
+    print_pass_stats(pass, endTargetIndex, betters);
     // printf("Pass %d betters %ld\n", pass, betters);
     
+    if (isCanceled(cancelFlag))
+      break;
+    
     /* Break if a small fraction of target is bettered
     This is a fraction of total target points, 
     not the possibly smaller count of target attempts this pass.
     Or break on small integral change: if ( targetPoints_size / integralColorChange < 10 ) {
     */
-    if ( (float) betters / targetPoints->len < (IMAGE_SYNTH_TERMINATE_FRACTION) ) 
+    if ( (float) betters / targetPoints->len < parameters.terminateFraction ) 
     {
       // printf("Quitting early after %d passes. Betters %ld\n", pass+1, betters);
       break;
     }
+    if (isPastDeadline(deadline))
+      break;
     
     // Simple progress: percent of passes complete.
     // This is not ideal, a maximum of MAX_PASSES callbacks, typically six.
     // And the later passes are much shorter than earlier passes.
     // progressCallback( (int) ((pass+1.0)/(MAX_PASSES+1)*100), contextInfo);
   }
+  
+  freeWorkerPool(&pool);
+  g_free(countersBlock);
+  if (synthArgs.deferred) freeDeferredSources(&deferred);
+  if (isPatchMatch) free_scanline_order(&scanlineOrder);
+  if (changedPoints) g_array_free(changedPoints, TRUE);
+  if (parameters.isAdaptivePasses) free_map(&changedMap);
 }
 
 
@@ -395,13 +573,17 @@ refiner(
   Map* corpusMap,
   Map* recentProberMap,
   Map* hasValueMap,
-  Map* sourceOfMap,
+  TSourceMap* sourceOfMap,
   pointVector targetPoints,
   pointVector corpusPoints,
   pointVector sortedOffsets,
-  GRand *prng,
+  guint64 prngKey,
   TPixelelMetricFunc corpusTargetMetric,  // array pointers
   TMapPixelelMetricFunc mapsMetric,
+  const TBestFitKernel *kernel,
+  const TCorpusIndex *corpusIndex,
+  guint passCount,    // At most MAX_PASSES
+  gint64 deadline,    // Of the time budget, or 0, see isPastDeadline()
   void (*progressCallback)(int, void*),
   void *contextInfo,
   int* cancelFlag
@@ -416,50 +598,23 @@ refiner(
 #else
   pthread_t threads[THREAD_LIMIT];
 #endif
-  // If not using glib proxied to pthread by glibProxy.h
-  GMutex mutexProgress;
-  g_mutex_init(&mutex);  // defined in synthesize.h
-  g_mutex_init(&mutexProgress);
-
-
   SynthArgs synthArgs[THREAD_LIMIT];
 
+  // Counts of each thread i.e. pass, reported as one pass since the passes overlap
+  TSynthCounters counters[MAX_PASSES];
+  gint64 startTime;
 
-  // For progress
-  guint estimatedPixelCountToCompletion;
-  guint completedPixelCount = 0;
-  guint priorReportedPercentComplete = 0;
-
-  /*
-   * Nested function is gcc extension.
-   * Called from inside synthesize() every 4k target pixels.
-   * Convert to a percent of estimated total pixels to synthesis.
-   * Callback invoking process every 1 percent.
-   * Note synthesis may quit early: then progress makes a large jump.
-   */
-  void
-  deepProgressCallback()
-  {
-    completedPixelCount += IMAGE_SYNTH_CALLBACK_COUNT;
-    guint percentComplete = ((float)completedPixelCount/estimatedPixelCountToCompletion)*100;
-    if ( percentComplete > priorReportedPercentComplete )
-    {
-      g_mutex_lock(&mutexProgress);       // mutex calls to GUI i.e. gdk, gtk which are thread aware but not thread safe
-      // Alternatively, use gdk_thread_enter()
-      progressCallback((int) percentComplete, contextInfo);  // Forward deep progress callback to calling process
-      g_mutex_unlock(&mutexProgress);
-      priorReportedPercentComplete = percentComplete;
-    }
-  }
+  // Alternative 2 does not report progress: the passes overlap
 
   prepare_repetition_parameters(repetition_params, targetPoints->len);
-  estimatedPixelCountToCompletion = estimatePixelsToSynth(repetition_params);
+  truncate_repetition_parameters(repetition_params, passCount);
 
   // Start one thread for what were formerly passes
   g_assert(THREAD_LIMIT > MAX_PASSES);
 
   gulong betters = 0;
   guint threadIndex;
+  startTime = startPassStats(counters, MAX_PASSES);
   for (threadIndex=0; threadIndex<MAX_PASSES; threadIndex++)
   {
     startThread(
@@ -476,9 +631,11 @@ refiner(
       targetPoints,
       corpusPoints,
       sortedOffsets,
-      prng,
+      prngSubKey(prngKey, threadIndex), // Random streams differ by pass
       corpusTargetMetric, mapsMetric,
-      deepProgressCallback,
+      kernel,
+      threadIndex ? NULL : corpusIndex,  // Index only for the first pass
+      counters,
       cancelFlag
       );
   }
@@ -495,5 +652,6 @@ refiner(
   #endif
      betters += temp;
   }
+  endPassStats(&parameters, counters, MAX_PASSES, 0, targetPoints->len, betters, targetPoints->len, startTime);
 }
 #endif
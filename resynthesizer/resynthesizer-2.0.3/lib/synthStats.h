@@ -0,0 +1,150 @@
+/*
+Counts of the work done by the engine, for benchmarking and tuning.
+Returned to the caller in a TImageSynthStats (see engineParams.h) if parameters.stats is not NULL.
+
+Also passed to the caller's passStatsCallback after each pass, for tracing.
+
+Unlike the counters of stats.h (compiled only if DEBUG or STATS, global, not thread safe)
+these are always compiled, and cheap:
+each thread counts into its own TSynthCounters (no atomic operations, no shared cache lines),
+and the refiner merges the counters of all threads at the end of each pass,
+when the threads are waiting for the next pass.
+
+  Copyright (C) 2010, 2011  Lloyd Konneker
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <string.h>  // memset
+
+#if IMAGE_SYNTH_STATS_NEIGHBORS < IMAGE_SYNTH_MAX_NEIGHBORS
+  #error "TImageSynthStats.earlyOutsByNeighbor must count every neighbor"
+#endif
+
+/*
+Counts of one thread in one pass.
+Aligned so that the counters of different threads (in an array) are not in the same cache line.
+*/
+typedef struct SynthCountersStruct {
+  guint64 probes;   // Corpus points probed: computeBestFit() or a kernel
+  guint64 targets;  // Target points attempted
+  guint64 boundRejects;
+  guint64 neighborsSourceHits;
+  guint64 perfectMatches;
+  guint64 earlyOutsByNeighbor[IMAGE_SYNTH_MAX_NEIGHBORS];
+} __attribute__((aligned(64))) TSynthCounters;
+
+
+static void
+resetEngineStats(TImageSynthStats *stats)
+{
+  if ( ! stats ) return;
+  memset(stats, 0, sizeof(TImageSynthStats));
+}
+
+
+#ifdef SYNTH_THREADED
+/*
+Counters for each thread, allocated by the threaded refiner.
+Allocated with room to align them, as malloc does not align to a cache line.
+*/
+static TSynthCounters *
+newSynthCounters(
+  guint threadCount,
+  void **block   // OUT to free
+  )
+{
+  *block = g_new0(gchar, (threadCount + 1) * sizeof(TSynthCounters));
+  return (TSynthCounters *) (((gsize) *block + sizeof(TSynthCounters) - 1)
+    / sizeof(TSynthCounters) * sizeof(TSynthCounters));
+}
+#endif
+
+
+// Time of the start of the pass
+static gint64
+startPassStats(
+  TSynthCounters counters[],
+  guint threadCount
+  )
+{
+  memset(counters, 0, threadCount * sizeof(TSynthCounters));
+  return g_get_monotonic_time();
+}
+
+
+/*
+Merge the counters of all threads for a pass into the caller's stats, and call the caller's callback.
+In the refiner's thread, after all threads are done with the pass.
+*/
+static void
+endPassStats(
+  const TImageSynthParameters *parameters,
+  const TSynthCounters counters[],
+  guint threadCount,
+  guint pass,
+  guint targets,            // Target points of the pass
+  gulong betters,
+  guint countTargetPoints,  // All target points
+  gint64 startTime
+  )
+{
+  TImageSynthStats *stats = parameters->stats;
+  TImageSynthPassStats passStats;
+  guint64 targetAttempts = 0;
+  guint threadIndex;
+  guint i;
+
+  if ( ! stats && ! parameters->passStatsCallback ) return;
+
+  memset(&passStats, 0, sizeof(passStats));
+  passStats.pass = pass;
+  passStats.targets = targets;
+  passStats.betterments = betters;
+  passStats.bettermentFraction = (double) betters / countTargetPoints;
+  passStats.seconds = (g_get_monotonic_time() - startTime) / 1e6;
+  for (threadIndex=0; threadIndex<threadCount; threadIndex++)
+  {
+    const TSynthCounters *threadCounters = &counters[threadIndex];
+
+    passStats.probes += threadCounters->probes;
+    passStats.boundRejects += threadCounters->boundRejects;
+    passStats.neighborsSourceHits += threadCounters->neighborsSourceHits;
+    passStats.perfectMatches += threadCounters->perfectMatches;
+    targetAttempts += threadCounters->targets;
+    for (i=0; i<IMAGE_SYNTH_MAX_NEIGHBORS; i++)
+    {
+      passStats.earlyOuts += threadCounters->earlyOutsByNeighbor[i];
+      if (stats) stats->earlyOutsByNeighbor[i] += threadCounters->earlyOutsByNeighbor[i];
+    }
+  }
+
+  if (stats)
+  {
+    stats->probes += passStats.probes;
+    stats->targetAttempts += targetAttempts;
+    stats->earlyOuts += passStats.earlyOuts;
+    stats->boundRejects += passStats.boundRejects;
+    stats->neighborsSourceHits += passStats.neighborsSourceHits;
+    stats->perfectMatches += passStats.perfectMatches;
+    stats->seconds += passStats.seconds;
+    // Passes beyond IMAGE_SYNTH_STATS_MAX_PASSES (with many pyramid levels) are counted but not listed
+    if (stats->passCount < IMAGE_SYNTH_STATS_MAX_PASSES)
+      stats->passes[stats->passCount] = passStats;
+    stats->passCount++;
+  }
+  if (parameters->passStatsCallback)
+    parameters->passStatsCallback(&passStats, parameters->passStatsContext);
+}
@@ -23,30 +23,21 @@ Innermost routines of image synthesis.
 #include <mmintrin.h> // intrinsics for assembly language MMX op codes, for sse2 xmmintrin.h
 #endif
 
-#ifdef SYNTH_THREADED
-   /*
-   * Threaded synthesis uses mutex on read and write to certain shared data among threads.
-   * You COULD use threads without mutex.
-   * Then there is a very small chance that color will be scrambled, resulting in a color not found in corpus.
-   * Also, if integer writes are not atomic, there is a small chance that sourceOf will be scrambled,
-   * resulting in soft errors.
-   * And since mutex locking is fast in Linux, we use mutex rather than risk soft errors.
+/*
+   * Threaded synthesis shares the target (colors), sourceOfMap, and hasValueMap among threads.
+   * Formerly a mutex guarded reading and writing a color with its source,
+   * since without it there is a small chance that a color is read while being written (scrambled),
+   * i.e. a color not found in the corpus.
+   * But all threads contended for the one mutex, twice per neighbor.
+   *
+   * Now no lock: the color of a synthesized target point is always the color of its source in the corpus.
+   * A source is written and read atomically (one word, see setSourceOf() in engine.c),
+   * and a reader takes the color from the corpus (which no thread writes) at the source it read,
+   * never from the target pixel that another thread might be writing.
+   * So a neighbor's color and source always agree, and every color is from the corpus.
+   * Points without a source (the context) are never written during synthesis.
    */
 
-  #ifdef SYNTH_USE_GLIB_THREADS
-    static GMutex mutex;
-  #else
-    // Use POSIX instead
-    #include <pthread.h>
-    pthread_mutex_t mutex;
-    // proxies for glib mutex functions are in glibProxy.c, .h
-  #endif
-
-#else   // No threads: redefine mutex functions to nil
-  #define g_mutex_lock(A)
-  #define g_mutex_unlock(A)
-#endif
-
 
 // Match result kind
 typedef enum  BettermentKindEnum 
@@ -56,6 +47,8 @@ typedef enum  BettermentKindEnum
   GENERIC_BETTERMENT,
   NEIGHBORS_SOURCE,
   RANDOM_CORPUS,
+  RANDOM_SEARCH,  // PatchMatch search near best, see patchMatch.h
+  INDEXED_CORPUS, // Candidate from the corpus index, see corpusIndex.h
   MAX_BETTERMENT_KIND
 } tBettermentKind;
 
@@ -141,12 +134,33 @@ has_source_neighbor (
 }
 
 
+/*
+Whether heuristic 1 already probed corpus point for this target point.
+Heuristic 2 without the shared recentProberMap, see deterministicRounds.h.
+At most one per neighbor: a linear search is cheaper than a probe.
+*/
+static inline gboolean
+isProbed (
+  Coordinates point,
+  const Coordinates probed[],
+  guint countProbed
+  )
+{
+  guint i;
+
+  for (i=0; i<countProbed; i++)
+    if (equal_points(probed[i], point))
+      return TRUE;
+  return FALSE;
+}
+
+
 /* Copy the source of a neighbor point into the neighbor array. */
 static inline void
 set_neighbor_state (
   guint n_neighbour,          // index in neighbors
   Coordinates neighbor_point,  // coords in image (context or target)
-  Map* sourceOfMap,
+  TSourceMap* sourceOfMap,
   TNeighbor neighbors[]
   ) 
 {
@@ -162,19 +176,25 @@ new_neighbor(
   Coordinates neighbor_point,
   TFormatIndices* indices,
   Map* targetMap,
-  Map* sourceOfMap,
+  Map* corpusMap,
+  TSourceMap* sourceOfMap,
   TNeighbor neighbors[]
   )
 {
-  neighbors[index].offset = offset;
-  g_mutex_lock(&mutex);  // Read color and source atomically
-  set_neighbor_state(index, neighbor_point, sourceOfMap, neighbors);
-  {
   TPixelelIndex k;
+  
+  neighbors[index].offset = offset;
+  set_neighbor_state(index, neighbor_point, sourceOfMap, neighbors);  // Atomic read of source
   for (k=0; k<indices->total_bpp; k++)  // !!! Copy whole Pixel, all pixelels
     neighbors[index].pixel[k] = pixmap_index(targetMap, neighbor_point)[k];
-  }
-  g_mutex_unlock(&mutex);
+  /*
+  Colors of a synthesized point from its source, not from the target, which another thread might be writing.
+  Same values: setColor() copied them from the source.
+  Mask, alpha and map pixelels of the target are never written during synthesis.
+  */
+  if (has_source_neighbor(index, neighbors))
+    for (k=FIRST_PIXELEL_INDEX; k<indices->colorEndBip; k++)
+      neighbors[index].pixel[k] = pixmap_index(corpusMap, neighbors[index].sourceOf)[k];
 }
 
 
@@ -192,8 +212,9 @@ prepare_neighbors(
   TImageSynthParameters *parameters, // IN
   TFormatIndices* indices,
   Map* targetMap,
+  Map* corpusMap,
   Map* hasValueMap,
-  Map* sourceOfMap,
+  TSourceMap* sourceOfMap,
   pointVector sortedOffsets,
   TNeighbor neighbors[]
   ) 
@@ -205,7 +226,7 @@ prepare_neighbors(
   
   // Target point is always its own first neighbor, even though on startup and first pass it doesn't have a value.
   offset = g_array_index(sortedOffsets, Coordinates, 0);
-  new_neighbor(count, offset, position, indices, targetMap, sourceOfMap, neighbors);
+  new_neighbor(count, offset, position, indices, targetMap, corpusMap, sourceOfMap, neighbors);
   count++;
     
   for(j=1; j<sortedOffsets->len; j++) // !!! Start at 1
@@ -219,7 +240,7 @@ prepare_neighbors(
           // AND ( is neighbor outside target (context) OR inside target with already synthed value )
       ) 
     {
-      new_neighbor(count, offset, neighbor_point, indices, targetMap, sourceOfMap, neighbors);
+      new_neighbor(count, offset, neighbor_point, indices, targetMap, corpusMap, sourceOfMap, neighbors);
       count++;
       if (count >= (guint) parameters->patchSize) break;
     }
@@ -275,7 +296,8 @@ computeBestFit(
   tBettermentKind* latestBettermentKind,
   const tBettermentKind bettermentKind,
   const TPixelelMetricFunc corpusTargetMetric,  // array pointers
-  const TMapPixelelMetricFunc mapsMetric
+  const TMapPixelelMetricFunc mapsMetric,
+  TSynthCounters * const counters  // IN/OUT
   ) 
 {
   guint sum = 0;
@@ -379,7 +401,11 @@ computeBestFit(
     ??? Study how many different but equal sources are found.  
     Are different source in later repeats closer distance?
     */
-    if (sum >= *bestPatchDiff) return FALSE;  // !!! Short circuit for neighbors
+    if (sum >= *bestPatchDiff)  // !!! Short circuit for neighbors
+    {
+      counters->earlyOutsByNeighbor[i]++;
+      return FALSE;
+    }
   }
 
   // Assert sum strictly < bestPatchDiff
@@ -400,6 +426,73 @@ computeBestFit(
 }
 
 
+/*
+SIMD alternative to computeBestFit().
+The kernel computes the patch difference, this does the same bookkeeping as computeBestFit().
+*/
+#include "bestFitVectorized.h"
+
+/*
+Try one corpus point: with a SIMD kernel if one was chosen at runtime, else with computeBestFit().
+Same results either way.
+*/
+static inline gboolean
+probeCorpusPoint(
+  const Coordinates point,
+  const TFormatIndices * const indices,
+  const Map * const corpusMap,
+  guint * const bestPatchDiff,  // OUT
+  Coordinates * const bestMatchCorpusPoint, // OUT
+  const guint countNeighbors,
+  const TNeighbor neighbors[],
+  const TNeighborVectors * const neighborVectors,
+  tBettermentKind* latestBettermentKind,
+  const tBettermentKind bettermentKind,
+  const TPixelelMetricFunc corpusTargetMetric,  // array pointers
+  const TMapPixelelMetricFunc mapsMetric,
+  const TBestFitKernel * const kernel,
+  TSynthCounters * const counters  // IN/OUT
+  )
+{
+  guint sum;
+  guint rejectedAt;
+  
+  counters->probes++;
+  if ( ! kernel->sum )
+    return computeBestFit(point, indices, corpusMap, bestPatchDiff, bestMatchCorpusPoint,
+      countNeighbors, neighbors, latestBettermentKind, bettermentKind,
+      corpusTargetMetric, mapsMetric, counters);
+  
+#ifdef STATS
+  countSourceTries++;
+#endif
+  sum = kernel->sum(kernel, neighborVectors, indices, corpusMap, point, *bestPatchDiff, &rejectedAt);
+  if (sum >= *bestPatchDiff)
+  {
+    counters->earlyOutsByNeighbor[rejectedAt]++;
+    return FALSE;
+  }
+  
+  *bestPatchDiff = sum;
+  *latestBettermentKind = bettermentKind;
+  *bestMatchCorpusPoint = point;
+  if (sum <=0) 
+  {
+#ifdef STATS
+    bettermentStats[PERFECT_MATCH]+=1;
+#endif
+    return TRUE;  // PERFECT_MATCH
+  }
+  else 
+    return FALSE; // GENERIC_BETTERMENT;
+}
+
+
+// Alternative to random probes, uses probeCorpusPoint()
+#include "patchMatch.h"
+#include "corpusIndex.h"
+
+
 static inline void
 setColor(
   TFormatIndices* indices,
@@ -432,18 +525,20 @@ synthesize(
   TFormatIndices* indices, // IN
   Map * targetMap,      // IN/OUT
   Map* corpusMap,       // IN
-  Map* recentProberMap, // IN/OUT
+  Map* recentProberMap, // IN/OUT, or NULL when deferred
   Map* hasValueMap,     // IN/OUT
-  Map* sourceOfMap,     // IN/OUT
+  TSourceMap* sourceOfMap, // IN/OUT
+  Map* changedMap,      // IN/OUT or NULL if not adaptive passes, see adaptivePasses.h
   pointVector targetPoints, // IN
   pointVector corpusPoints, // IN
   pointVector sortedOffsets, // IN
-  GRand *prng,
+  guint64 prngKey,
   TPixelelMetricFunc corpusTargetMetric,  // array pointers
   TMapPixelelMetricFunc mapsMetric,
-  void (*deepProgressCallback)(ProgressRecordT*),
-  ProgressRecordT * progressCallbackParams,
-  int *cancelFlag
+  const TBestFitKernel *kernel,
+  const TCorpusIndex *corpusIndex,  // IN or NULL
+  TDeferredSources *deferred,  // OUT, or NULL to write the maps at once, see deterministicRounds.h
+  TSynthCounters *counters  // IN/OUT of this thread, see synthStats.h
   )
 {
   guint target_index;
@@ -452,6 +547,7 @@ synthesize(
   
   tBettermentKind latestBettermentKind; // matchResult;
   gboolean isPerfectMatch = FALSE;
+  gboolean isQueried;  // Whether the corpus index proposed candidates
   
   // Best match in this pass search for a matching patch.
   guint bestPatchDiff;   
@@ -464,6 +560,14 @@ synthesize(
   // TODO this is large and allocated on the stack
   TNeighbor neighbors[IMAGE_SYNTH_MAX_NEIGHBORS];
   guint countNeighbors = 0;
+  // Same patch, repacked for a SIMD kernel
+  TNeighborVectors neighborVectors;
+  
+  TCounterPrng prng;  // Private to this thread
+  
+  // Corpus points probed by heuristic 1 for this target point, instead of recentProberMap when deferred
+  Coordinates probed[IMAGE_SYNTH_MAX_NEIGHBORS];
+  guint countProbed;
   
   /* ALT: count progress once at start of pass countTargetTries += repetition_params[pass][1]; */
   reset_color_change();
@@ -475,29 +579,26 @@ synthesize(
         target_index += 1)
 #endif
 
-  // Each thread works on a slice of targetPoints.  Starting at the threadIndex, incremented by count of threads.
-  // If there is no threads or only one thread, starts at startTargetIndex, increments by 1
-  for(target_index=startTargetIndex + threadIndex % THREAD_LIMIT;
+  // Each call works on a contiguous slice of targetPoints.
+  // If threaded, the slice is a chunk given to this thread by the worker pool, see workerPool.h
+  for(target_index=startTargetIndex;
       target_index<endTargetIndex;
-      target_index += THREAD_LIMIT)
+      target_index += 1)
   {
 #ifdef STATS
     countTargetTries += 1;
 #endif
+    counters->targets++;
     
-    #ifdef DEEP_PROGRESS
-    // Callback to the level which calculates percent and forwards to the ultimate calling process.
-    // Modulo is the intuitive way to do this.
-    // But here, we are testing for x lower bits all 1, say 4095, 1111111111.
-    // Don't AND with an arbitrary single bit, say 4096, since one bit is often set.
-    if ((target_index&IMAGE_SYNTH_CALLBACK_COUNT) == 0)
-    {
-      deepProgressCallback(progressCallbackParams);
-      if (*cancelFlag) break; // for each target pixel
-    }
-    #endif
+    /*
+    No progress callback and no test for cancel here, per target point.
+    The caller does both between chunks of target points, see progressChunkDone().
+    */
     
     position = g_array_index(targetPoints, Coordinates, target_index);
+    
+    // Random stream of this target point this pass, the same whichever thread synthesizes it
+    prngInit(&prng, prngSubKey(prngKey, target_index));
      
     /*
     In the original algorithm, here we called setHasValue(&position, TRUE, hasValueMap);
@@ -509,9 +610,12 @@ synthesize(
     */
     
     countNeighbors = prepare_neighbors(position, parameters, indices, 
-      targetMap, hasValueMap, sourceOfMap, sortedOffsets,
+      targetMap, corpusMap, hasValueMap, sourceOfMap, sortedOffsets,
       neighbors
       );
+    if ( kernel->sum )
+      prepareNeighborVectors(neighbors, countNeighbors, indices, corpusMap, kernel, &neighborVectors);
+    preparePatchBound(&kernel->bounds, neighbors, countNeighbors, &neighborVectors.bound);
     
     /*
     Repeat a pixel even if found an exact match last pass, because neighbors might have changed.
@@ -537,6 +641,7 @@ synthesize(
     {
     guint neighbor_index;
     
+    countProbed = 0;
     // TODO check for zero here is redundant
     for(neighbor_index=0; neighbor_index<countNeighbors && bestPatchDiff != 0; neighbor_index++)
       // If the neighbor is in the target (not the context) and has a source in the corpus (already synthesized.)
@@ -553,12 +658,16 @@ synthesize(
         
         /* !!! Must clip corpus_point before further use, its only potentially in the corpus. */
         if (clippedOrMaskedCorpus(corpus_point, corpusMap)) continue;
-        if (*intmap_index(recentProberMap, corpus_point) == target_index) continue; // Heuristic 2
-        isPerfectMatch = computeBestFit(corpus_point, indices, corpusMap,
+        if (recentProberMap)
+        {
+          if (*recentProberIndex(recentProberMap, corpus_point) == proberTag(target_index)) continue; // Heuristic 2
+        }
+        else if (isProbed(corpus_point, probed, countProbed)) continue;
+        isPerfectMatch = probeCorpusPoint(corpus_point, indices, corpusMap,
           &bestPatchDiff, &bestMatchCorpusPoint,
-          countNeighbors, neighbors, 
+          countNeighbors, neighbors, &neighborVectors,
           &latestBettermentKind, NEIGHBORS_SOURCE,
-          corpusTargetMetric, mapsMetric
+          corpusTargetMetric, mapsMetric, kernel, counters
           );
         // TODO stats: if bettered, is kind NEIGHBORS_SOURCE 
         // if ( matchResult == PERFECT_MATCH ) break;  // Break neighbors loop
@@ -574,27 +683,63 @@ synthesize(
          * At most, it would reduce the value of heuristic2.
          * Different threads are probably working in different continuations and not contending.
          */
-        *intmap_index(recentProberMap, corpus_point) = target_index;
+        if (recentProberMap)
+          *recentProberIndex(recentProberMap, corpus_point) = proberTag(target_index);
+        else
+          probed[countProbed++] = corpus_point;
       }
       // Else the neighbor is not in the target (has no source) so we can't use the heuristic 1.
     }
       
+    /*
+    With a corpus index (first pass only), probe the corpus points whose patches look like this patch,
+    instead of random corpus points.
+    Without neighbors in the index window (isolated target point), fall back to random probes.
+    */
+    isQueried = FALSE;
+    if ( ! isPerfectMatch && corpusIndex )
+      isPerfectMatch = probeIndexedCandidates(corpusIndex, indices, corpusMap,
+        &bestPatchDiff, &bestMatchCorpusPoint,
+        countNeighbors, neighbors, &neighborVectors,
+        &latestBettermentKind,
+        corpusTargetMetric, mapsMetric, kernel, counters,
+        &isQueried
+        );
+      
     // if ( matchResult != PERFECT_MATCH )
-    if ( ! isPerfectMatch )
+    if ( ! isPerfectMatch && parameters->searchStrategy == IMAGE_SYNTH_SEARCH_PATCHMATCH )
+      isPerfectMatch = patchMatchSearch(indices, corpusMap, corpusPoints, &prng,
+        &bestPatchDiff, &bestMatchCorpusPoint,
+        countNeighbors, neighbors, &neighborVectors,
+        &latestBettermentKind,
+        corpusTargetMetric, mapsMetric, kernel, counters
+        );
+    else if ( ! isPerfectMatch && ! isQueried )
     {
       /* 
       Match patches at random source points from the corpus.
       In later passes, many will be earlyouts.
       */
       gint j;
+      // Reject hopeless corpus points without comparing patches, while that pays, see corpusBounds.h
+      TBoundTrial boundTrial;
+      
+      startBoundTrial(&neighborVectors.bound, &boundTrial);
       for(j=0; j<parameters->maxProbeCount; j++)
       {
-        isPerfectMatch = computeBestFit(randomCorpusPoint(corpusPoints, prng), 
+        Coordinates corpus_point = randomCorpusPoint(corpusPoints, &prng);
+        
+        if (isBoundRejected(&kernel->bounds, &neighborVectors.bound, corpus_point, bestPatchDiff, &boundTrial))
+        {
+          counters->boundRejects++;
+          continue;
+        }
+        isPerfectMatch = probeCorpusPoint(corpus_point, 
           indices, corpusMap,
           &bestPatchDiff, &bestMatchCorpusPoint,
-          countNeighbors, neighbors,
+          countNeighbors, neighbors, &neighborVectors,
           &latestBettermentKind, RANDOM_CORPUS,
-          corpusTargetMetric, mapsMetric
+          corpusTargetMetric, mapsMetric, kernel, counters
           );
         if ( isPerfectMatch ) break;  /* Break loop over random corpus points */
         // if ( matchResult == PERFECT_MATCH ) break;  /* Break loop over random corpus points */
@@ -603,6 +748,8 @@ synthesize(
       }
     }
     
+    if (isPerfectMatch) counters->perfectMatches++;
+    if (latestBettermentKind == NEIGHBORS_SOURCE) counters->neighborsSourceHits++;
     store_betterment_stats(matchResult);
     /* DEBUG dump_target_resynthesis(position); */
     
@@ -617,6 +764,9 @@ synthesize(
     We distinguish some of these cases: only store a better matching, new source.
     */
     // if (matchResult != NO_BETTERMENT )
+    if (deferred)
+      // No new source unless set below
+      deferred->sources[target_index - deferred->startTargetIndex].x = -1;
     if (latestBettermentKind != NO_BETTERMENT )
     {
       /* if source different from previous pass */
@@ -624,20 +774,66 @@ synthesize(
       {
         repeatCountBetters++;   /* feedback for termination. */
         integrate_color_change(position); // Must be before we store the new color values.
-
-        g_mutex_lock(&mutex);    // Atomic write to color and sourceOf
+        
+        if (deferred)
+          // Written at the end of the round, see commitDeferredSources()
+          deferred->sources[target_index - deferred->startTargetIndex] = bestMatchCorpusPoint;
+        else
+        {
         // Save the new color values (!!! not the alpha) for this target point
+        // Not read by other threads, they read colors from the source, see new_neighbor()
         setColor( indices, targetMap, position, corpusMap, bestMatchCorpusPoint);
-        setSourceOf(position, bestMatchCorpusPoint, sourceOfMap); /* Remember new source */
+        setSourceOf(position, bestMatchCorpusPoint, sourceOfMap); /* Remember new source, atomic */
+        if (changedMap)
+          markChanged(position, changedMap);  // Revisit next pass
         // printf("Position %d %d source %d %d\n", position.x, position.y, bestMatchCorpusPoint.x, bestMatchCorpusPoint.y);
-        g_mutex_unlock(&mutex);
+        }
 
       } /* else same source for target */
     } /* else match is same or worse */
 
-    // Shared, but no mutex lock because all writers are setting to the same value, TRUE
-    setHasValue(&position, TRUE, hasValueMap);
+    // Shared, but no lock because all writers are setting to the same value, TRUE.  After the source, see setHasValue()
+    if ( ! deferred )
+      setHasValue(&position, TRUE, hasValueMap);
   } /* end for each target pixel */
   return repeatCountBetters;
 }
 
+
+#ifdef SYNTH_THREADED
+/*
+Write what synthesize() deferred for the target points of a round, in their order, as synthesize() would have.
+Called by the refiner when no thread is synthesizing.
+*/
+static void
+commitDeferredSources(
+  const TDeferredSources *deferred,
+  guint endTargetIndex,   // Of the round
+  TFormatIndices* indices,
+  Map* targetMap,
+  Map* corpusMap,
+  Map* hasValueMap,
+  TSourceMap* sourceOfMap,
+  Map* changedMap,
+  pointVector targetPoints
+  )
+{
+  guint target_index;
+  
+  for (target_index=deferred->startTargetIndex; target_index<endTargetIndex; target_index++)
+  {
+    Coordinates position = g_array_index(targetPoints, Coordinates, target_index);
+    Coordinates source = deferred->sources[target_index - deferred->startTargetIndex];
+    
+    if (source.x != -1)
+    {
+      setColor(indices, targetMap, position, corpusMap, source);
+      setSourceOf(position, source, sourceOfMap);
+      if (changedMap)
+        markChanged(position, changedMap);
+    }
+    setHasValue(&position, TRUE, hasValueMap);
+  }
+}
+#endif
+
@@ -0,0 +1,503 @@
+/*
+Tiled synthesis: a large target in bounded memory.
+
+The engine allocates for each pixel of the target image a flag (hasValueMap) and a source (sourceOfMap),
+for each pixel of the corpus a target index (recentProberMap), a point (corpusPoints) and a planar copy,
+and offsets spanning twice the smaller image (sortedOffsets.)
+Tens of bytes per pixel: too much for a panorama of hundreds of megapixels.
+
+Here the target (the bounding box of the target points) is split into square tiles,
+synthesized one after another in row major order, each by the usual engine on small pixmaps (windows):
+- the target window: the tile and a band (IMAGE_SYNTH_TILE_BAND) around it, copied from the target image.
+- the corpus window: around the tile's position in the corpus (scaled, if the corpus is not the size of the target),
+  grown until it has as many corpus points as the tile has target points, or is the whole corpus.
+Only the tile's own target points are copied back into the target image.
+
+Seams: tiles overlap by the band.
+In the band, the target points of earlier tiles are already synthesized: they are context of this tile,
+so this tile matches them.
+The target points of later tiles are synthesized too, but not copied back:
+only so that this tile's border has a guess at its surroundings, instead of a hole.
+The later tile then matches this tile.
+
+Memory: the engine's memory is then for the windows, not the images, see estimateEngineBytes().
+The caller's pixmaps are still whole images.
+
+Limitations:
+- The target points of earlier tiles are context, so when matchContextType is 0 (don't match the context)
+  the tiles match the context anyway, else they would not match each other.
+- Not seamlessly tileable (the engine wraps around the target image, not a window):
+  isMakeSeamlesslyTileable... disables tiles.
+- The caller's corpusIndex is of the whole corpus, not of a window: not used with tiles.
+  With isCorpusIndexed, each tile indexes its corpus window.
+
+  Copyright (C) 2010, 2011  Lloyd Konneker
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <string.h>  // memcpy
+
+// A rectangle of pixels of a map
+typedef struct tileRectStruct {
+  gint x;
+  gint y;
+  guint width;
+  guint height;
+} TTileRect;
+
+// How the target is split into tiles, see isTiledSynthesis()
+typedef struct tilingStruct {
+  TTileRect bounds;   // Of the target points
+  guint tileSize;
+} TTiling;
+
+
+// Grown by margin on all sides, clipped to the map
+static TTileRect
+growTileRect(
+  const TTileRect *rect,
+  guint margin,
+  const Map *map
+  )
+{
+  TTileRect grown;
+  gint right = MIN(rect->x + (gint) (rect->width + margin), (gint) map->width);
+  gint bottom = MIN(rect->y + (gint) (rect->height + margin), (gint) map->height);
+
+  grown.x = MAX(rect->x - (gint) margin, 0);
+  grown.y = MAX(rect->y - (gint) margin, 0);
+  grown.width = right - grown.x;
+  grown.height = bottom - grown.y;
+  return grown;
+}
+
+
+/*
+Bounding box of the target points.
+Returns count of target points.
+*/
+static guint
+prepareTargetBounds(
+  Map *targetMap,
+  TTileRect *bounds   // OUT
+  )
+{
+  gint minX = targetMap->width;
+  gint minY = targetMap->height;
+  gint maxX = -1;
+  gint maxY = -1;
+  guint count = 0;
+  guint x;
+  guint y;
+
+  for (y=0; y<targetMap->height; y++)
+    for (x=0; x<targetMap->width; x++)
+    {
+      Coordinates coords = {x, y};
+      if (isSelectedTarget(coords, targetMap))
+      {
+        minX = MIN(minX, (gint) x);
+        minY = MIN(minY, (gint) y);
+        maxX = MAX(maxX, (gint) x);
+        maxY = MAX(maxY, (gint) y);
+        count++;
+      }
+    }
+  bounds->x = count ? minX : 0;
+  bounds->y = count ? minY : 0;
+  bounds->width = count ? maxX - minX + 1 : 0;
+  bounds->height = count ? maxY - minY + 1 : 0;
+  return count;
+}
+
+
+static guint
+countTargetPointsIn(
+  Map *targetMap,
+  const TTileRect *rect
+  )
+{
+  guint count = 0;
+  guint x;
+  guint y;
+
+  for (y=0; y<rect->height; y++)
+    for (x=0; x<rect->width; x++)
+    {
+      Coordinates coords = {rect->x + x, rect->y + y};
+      if (isSelectedTarget(coords, targetMap)) count++;
+    }
+  return count;
+}
+
+
+// Same test as prepareCorpusPoints()
+static guint
+countCorpusPointsIn(
+  TFormatIndices* indices,
+  Map *corpusMap,
+  const TTileRect *rect
+  )
+{
+  guint count = 0;
+  guint x;
+  guint y;
+
+  for (y=0; y<rect->height; y++)
+    for (x=0; x<rect->width; x++)
+    {
+      Coordinates coords = {rect->x + x, rect->y + y};
+      if (isSelectedCorpus(coords, corpusMap) && not_transparent_corpus(coords, indices, corpusMap))
+        count++;
+    }
+  return count;
+}
+
+
+static void
+copyPixmapWindow(
+  const Map *map,
+  const TTileRect *window,
+  Map *windowMap    // OUT
+  )
+{
+  guint y;
+
+  new_pixmap(windowMap, window->width, window->height, map->depth);
+  for (y=0; y<window->height; y++)
+  {
+    Coordinates from = {window->x, window->y + y};
+    Coordinates to = {0, y};
+    memcpy(pixmap_index(windowMap, to), pixmap_index(map, from), window->width * map->depth);
+  }
+}
+
+
+/*
+Estimate of the memory allocated by the engine (engineLevel() and what it calls)
+for a target image of targetArea pixels and a corpus of corpusArea pixels.
+If isWindowed, including the copies of the windows.
+Not exact: e.g. targetPoints and corpusPoints are counted at their largest,
+and sortedOffsets as if both images were square.
+*/
+static guint64
+estimateEngineBytes(
+  TFormatIndices* indices,
+  const TImageSynthParameters *parameters,
+  guint64 targetArea,
+  guint64 corpusArea,
+  gboolean isWindowed
+  )
+{
+  guint64 pixmapBytes = isWindowed ? indices->total_bpp : 0;
+  // sourceOfMap, targetPoints, hasValueMap (a bit per pixel)
+  guint64 targetBytes = targetArea * (pixmapBytes + sizeof(guint) + sizeof(Coordinates)) + targetArea / 8;
+  // recentProberMap, corpusPoints, corpus planes (see corpusPlanes.h), index (see corpusIndex.h)
+  guint64 corpusBytes = corpusArea * (pixmapBytes + sizeof(guint) + sizeof(Coordinates) + sizeof(guint32)
+    + (indices->map_end_bip - indices->map_start_bip) + (parameters->isCorpusIndexed ? 12 : 0));
+  // sortedOffsets span twice the smaller image, in both dimensions
+  guint64 offsetBytes = 4 * MIN(targetArea, corpusArea) * sizeof(Coordinates);
+  guint64 bytes = targetBytes + corpusBytes + offsetBytes;
+
+  // Coarser levels of the pyramid are a quarter the size, and mostly freed before the finer level
+  if (parameters->pyramidLevels > 1) bytes += bytes / 3;
+  return bytes;
+}
+
+
+// Margin of the corpus window around a tile, before growing
+static inline guint
+tileCorpusMargin(guint tileSize)
+{
+  return MAX(tileSize / 2, IMAGE_SYNTH_TILE_BAND);
+}
+
+
+static guint64
+estimateTileBytes(
+  TFormatIndices* indices,
+  const TImageSynthParameters *parameters,
+  Map *targetMap,
+  Map *corpusMap,
+  guint tileSize
+  )
+{
+  guint64 targetSide = tileSize + 2 * IMAGE_SYNTH_TILE_BAND;
+  guint64 corpusSide = tileSize + 2 * tileCorpusMargin(tileSize);
+
+  return estimateEngineBytes(indices, parameters,
+    MIN(targetSide, targetMap->width) * MIN(targetSide, targetMap->height),
+    MIN(corpusSide, corpusMap->width) * MIN(corpusSide, corpusMap->height),
+    TRUE);
+}
+
+
+/*
+Whether to synthesize in tiles, and the size of the tiles.
+Only if the parameters ask for tiles (or the memory limit requires them) and the target is larger than a tile.
+*/
+static gboolean
+isTiledSynthesis(
+  const TImageSynthParameters *parameters,
+  TFormatIndices* indices,
+  Map *targetMap,
+  Map *corpusMap,
+  TTiling *tiling   // OUT
+  )
+{
+  guint64 limit = (guint64) parameters->tileMemoryLimit << 20;  // MiB
+  guint span;
+
+  if ( ! parameters->tileSize && ! limit ) return FALSE;
+  if ( parameters->isMakeSeamlesslyTileableHorizontally || parameters->isMakeSeamlesslyTileableVertically )
+    return FALSE;
+  if ( ! prepareTargetBounds(targetMap, &tiling->bounds) ) return FALSE;  // The engine returns the error
+  span = MAX(tiling->bounds.width, tiling->bounds.height);
+
+  if ( ! parameters->tileSize
+    && estimateEngineBytes(indices, parameters,
+      (guint64) targetMap->width * targetMap->height,
+      (guint64) corpusMap->width * corpusMap->height,
+      FALSE) <= limit )
+    return FALSE;  // The whole target at once is within the limit
+
+  tiling->tileSize = parameters->tileSize ? parameters->tileSize : span;
+  if (limit)
+    while ( tiling->tileSize > IMAGE_SYNTH_TILE_MIN_SIZE
+      && estimateTileBytes(indices, parameters, targetMap, corpusMap, tiling->tileSize) > limit )
+      tiling->tileSize = MAX(tiling->tileSize / 2, IMAGE_SYNTH_TILE_MIN_SIZE);
+  return tiling->tileSize < span;
+}
+
+
+/*
+Target window of a tile, with the target points of earlier tiles made context.
+*/
+static void
+prepareTileTarget(
+  const TTiling *tiling,
+  Map *targetMap,
+  guint tileX,
+  guint tileY,
+  const TTileRect *window,
+  Map *tileMap    // OUT
+  )
+{
+  guint x;
+  guint y;
+
+  copyPixmapWindow(targetMap, window, tileMap);
+  for (y=0; y<window->height; y++)
+    for (x=0; x<window->width; x++)
+    {
+      Coordinates point = {window->x + x, window->y + y};
+      Coordinates tilePoint = {x, y};
+
+      if (isSelectedTarget(point, targetMap))
+      {
+        guint pointTileX = (point.x - tiling->bounds.x) / tiling->tileSize;
+        guint pointTileY = (point.y - tiling->bounds.y) / tiling->tileSize;
+
+        if ( pointTileY < tileY || (pointTileY == tileY && pointTileX < tileX) )
+          pixmap_index(tileMap, tilePoint)[MASK_PIXELEL_INDEX] = MASK_UNSELECTED;
+      }
+    }
+}
+
+
+// Copy the colors synthesized for the tile's own target points back to the target image
+static void
+pasteTileTarget(
+  TFormatIndices* indices,
+  Map *targetMap,
+  const TTileRect *tile,
+  Map *tileMap,
+  const TTileRect *window
+  )
+{
+  guint x;
+  guint y;
+  TPixelelIndex k;
+
+  for (y=0; y<tile->height; y++)
+    for (x=0; x<tile->width; x++)
+    {
+      Coordinates point = {tile->x + x, tile->y + y};
+      Coordinates tilePoint = {point.x - window->x, point.y - window->y};
+
+      if (isSelectedTarget(point, targetMap))
+        for (k=FIRST_PIXELEL_INDEX; k<indices->colorEndBip; k++)
+          pixmap_index(targetMap, point)[k] = pixmap_index(tileMap, tilePoint)[k];
+    }
+}
+
+
+// Same, for the sources: from points of the corpus window to points of the corpus
+static void
+pasteTileSources(
+  Map *targetMap,
+  TSourceMap *sourceOfMap,
+  const TTileRect *tile,
+  TSourceMap *tileSourceOfMap,
+  const TTileRect *window,
+  const TTileRect *corpusWindow
+  )
+{
+  guint x;
+  guint y;
+
+  for (y=0; y<tile->height; y++)
+    for (x=0; x<tile->width; x++)
+    {
+      Coordinates point = {tile->x + x, tile->y + y};
+      Coordinates tilePoint = {point.x - window->x, point.y - window->y};
+      Coordinates source = getSourceOf(tilePoint, tileSourceOfMap);
+
+      if (isSelectedTarget(point, targetMap) && source.x != -1)
+      {
+        source.x += corpusWindow->x;
+        source.y += corpusWindow->y;
+        setSourceOf(point, source, sourceOfMap);
+      }
+    }
+}
+
+
+/*
+Corpus window of a tile: around the tile's position scaled to the corpus,
+grown until it holds at least minCount corpus points, or is the whole corpus.
+Returns count of corpus points in it, 0 only if the corpus is empty.
+*/
+static guint
+prepareTileCorpusWindow(
+  TFormatIndices* indices,
+  Map *targetMap,
+  Map *corpusMap,
+  guint tileSize,
+  const TTileRect *tile,
+  guint minCount,
+  TTileRect *window   // OUT
+  )
+{
+  TTileRect scaledTile;
+  guint margin = tileCorpusMargin(tileSize);
+
+  scaledTile.x = (gint) ((guint64) tile->x * corpusMap->width / targetMap->width);
+  scaledTile.y = (gint) ((guint64) tile->y * corpusMap->height / targetMap->height);
+  scaledTile.width = MAX(1, (guint) ((guint64) tile->width * corpusMap->width / targetMap->width));
+  scaledTile.height = MAX(1, (guint) ((guint64) tile->height * corpusMap->height / targetMap->height));
+  for (;;)
+  {
+    guint count;
+
+    *window = growTileRect(&scaledTile, margin, corpusMap);
+    count = countCorpusPointsIn(indices, corpusMap, window);
+    if ( count >= minCount || (window->width == corpusMap->width && window->height == corpusMap->height) )
+      return count;
+    margin *= 2;
+  }
+}
+
+
+/*
+Synthesize the target tile by tile.
+Progress: each tile gets an equal share.
+If resultSourceOfMap, returns the sources of the whole target, as engineLevels().  Caller must free it.
+*/
+static int
+engineTiles(
+  TImageSynthParameters parameters,
+  TFormatIndices* indices,
+  Map* targetMap,
+  Map* corpusMap,
+  const TTiling *tiling,
+  TSourceMap* resultSourceOfMap,  // OUT or NULL
+  gint64 deadline,  // Of the time budget for all tiles, or 0
+  void (*progressCallback)(int, void*),
+  void *contextInfo,
+  int *cancelFlag
+  )
+{
+  guint tileSize = tiling->tileSize;
+  guint tilesAcross = (tiling->bounds.width + tileSize - 1) / tileSize;
+  guint tilesDown = (tiling->bounds.height + tileSize - 1) / tileSize;
+  guint tileCount = tilesAcross * tilesDown;
+  guint tileX;
+  guint tileY;
+
+  // The target points of earlier tiles are context, which tiles must match
+  if (parameters.matchContextType == 0) parameters.matchContextType = 1;
+  if (resultSourceOfMap) prepare_target_sources(targetMap, corpusMap, resultSourceOfMap);
+
+  for (tileY=0; tileY<tilesDown; tileY++)
+    for (tileX=0; tileX<tilesAcross; tileX++)
+    {
+      guint tileIndex = tileY * tilesAcross + tileX;
+      TImageSynthParameters tileParameters = parameters;
+      TPyramidProgress progress = {progressCallback, contextInfo,
+        tileIndex * 100 / tileCount, (tileIndex + 1) * 100 / tileCount - tileIndex * 100 / tileCount};
+      TTileRect tile;
+      TTileRect targetWindow;
+      TTileRect corpusWindow;
+      Map tileTargetMap;
+      Map tileCorpusMap;
+      TSourceMap tileSourceOfMap;
+      guint targetCount;
+      int error;
+
+      if (isCanceled(cancelFlag)) return 0;  // The caller frees resultSourceOfMap, as when done
+
+      tile.x = tiling->bounds.x + tileX * tileSize;
+      tile.y = tiling->bounds.y + tileY * tileSize;
+      tile.width = MIN(tileSize, tiling->bounds.width - tileX * tileSize);
+      tile.height = MIN(tileSize, tiling->bounds.height - tileY * tileSize);
+      targetCount = countTargetPointsIn(targetMap, &tile);
+      if ( ! targetCount ) continue;  // E.g. a tile inside a ring shaped target
+
+      if ( ! prepareTileCorpusWindow(indices, targetMap, corpusMap, tileSize, &tile, targetCount, &corpusWindow) )
+      {
+        if (resultSourceOfMap) freeSourceMap(resultSourceOfMap);
+        return IMAGE_SYNTH_ERROR_EMPTY_CORPUS;
+      }
+      targetWindow = growTileRect(&tile, IMAGE_SYNTH_TILE_BAND, targetMap);
+      prepareTileTarget(tiling, targetMap, tileX, tileY, &targetWindow, &tileTargetMap);
+      copyPixmapWindow(corpusMap, &corpusWindow, &tileCorpusMap);
+
+      // Different random streams for each tile, else tiles of similar surroundings repeat each other
+      tileParameters.seed = parameters.seed + tileIndex;
+      error = engineLevels(tileParameters, indices, &tileTargetMap, &tileCorpusMap,
+        (resultSourceOfMap ? &tileSourceOfMap : NULL), NULL, NULL,
+        deadline, pyramidProgressCallback, &progress, cancelFlag);
+      if ( ! error )
+      {
+        pasteTileTarget(indices, targetMap, &tile, &tileTargetMap, &targetWindow);
+        if (resultSourceOfMap)
+        {
+          pasteTileSources(targetMap, resultSourceOfMap, &tile, &tileSourceOfMap, &targetWindow, &corpusWindow);
+          freeSourceMap(&tileSourceOfMap);
+        }
+      }
+      free_map(&tileTargetMap);
+      free_map(&tileCorpusMap);
+      if (error == IMAGE_SYNTH_ERROR_CANCELED) return 0;  // While preparing the tile: as above
+      if (error)
+      {
+        if (resultSourceOfMap) freeSourceMap(resultSourceOfMap);
+        return error;
+      }
+    }
+  return 0;
+}
@@ -0,0 +1,348 @@
+/*
+Pool of worker threads for the threaded refiner.
+
+Formerly refiner() started THREAD_LIMIT threads for each pass and joined them at the end of the pass,
+each thread synthesizing every THREAD_LIMIT'th target point.
+Starting threads is not free: for small targets (e.g. batch healing of many small selections)
+a large share of the wall time was thread startup.
+And a fixed count of threads leaves many cores idle on larger machines.
+
+Here the threads are started once per call to the engine and live for all passes.
+Between passes, workers wait at a barrier (the pass is not done until all workers are done.)
+Within a pass, targetPoints is divided into chunks (of contiguous target points.)
+Each worker owns a contiguous range of chunks and takes chunks from the front of its range.
+When its range is empty, a worker steals chunks from the ranges of other workers.
+So a worker that gets easy chunks (e.g. many perfect matches) does not sit idle.
+
+A chunk is taken by an atomic increment of the index of the next chunk in a range,
+by the owner or a thief alike.  No locks on the work itself.
+The mutex and conditions are only for starting and ending passes.
+
+  Copyright (C) 2010, 2011  Lloyd Konneker
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdlib.h>   // posix_memalign
+
+#ifdef SYNTH_USE_GLIB_THREADS
+  typedef GMutex TPoolMutex;
+  typedef GCond TPoolCond;
+  #define poolMutexInit(m)    g_mutex_init(m)
+  #define poolMutexClear(m)   g_mutex_clear(m)
+  #define poolMutexLock(m)    g_mutex_lock(m)
+  #define poolMutexUnlock(m)  g_mutex_unlock(m)
+  #define poolCondInit(c)     g_cond_init(c)
+  #define poolCondClear(c)    g_cond_clear(c)
+  #define poolCondWait(c, m)  g_cond_wait(c, m)
+  #define poolCondSignal(c)   g_cond_signal(c)
+  #define poolCondBroadcast(c) g_cond_broadcast(c)
+#else
+  #include <pthread.h>
+  #include <unistd.h> // sysconf
+  // glibProxy.h has no GMutex or GCond: use POSIX directly
+  typedef pthread_mutex_t TPoolMutex;
+  typedef pthread_cond_t TPoolCond;
+  #define poolMutexInit(m)    pthread_mutex_init(m, NULL)
+  #define poolMutexClear(m)   pthread_mutex_destroy(m)
+  #define poolMutexLock(m)    pthread_mutex_lock(m)
+  #define poolMutexUnlock(m)  pthread_mutex_unlock(m)
+  #define poolCondInit(c)     pthread_cond_init(c, NULL)
+  #define poolCondClear(c)    pthread_cond_destroy(c)
+  #define poolCondWait(c, m)  pthread_cond_wait(c, m)
+  #define poolCondSignal(c)   pthread_cond_signal(c)
+  #define poolCondBroadcast(c) pthread_cond_broadcast(c)
+#endif
+
+
+/*
+Work function of the pool: synthesize target points [startTargetIndex, endTargetIndex).
+Returns count of betterments.
+*/
+typedef gulong (*TWorkerJob)(void *jobArgs, guint threadIndex, guint startTargetIndex, guint endTargetIndex);
+
+struct WorkerPoolStruct;
+
+// What each worker thread knows
+typedef struct WorkerStruct {
+  struct WorkerPoolStruct *pool;
+  guint threadIndex;
+
+  // Range of chunks owned by this worker in the current pass. Taken from the front by owner and thieves.
+  volatile gint nextChunk;
+  gint endChunk;
+
+  gulong betters;   // Result of this worker for the current pass
+
+#ifdef SYNTH_USE_GLIB_THREADS
+  GThread* thread;
+#else
+  pthread_t thread;
+#endif
+} __attribute__((aligned(64))) TWorker;   // Own cache line, since nextChunk is written by other threads
+
+
+typedef struct WorkerPoolStruct {
+  guint threadCount;
+  TWorker *workers;
+
+  // The current pass
+  TWorkerJob job;
+  void *jobArgs;
+  guint endTargetIndex;
+  guint chunkSize;
+
+  // Barrier between passes
+  TPoolMutex mutex;
+  TPoolCond passStart;    // signaled when a pass (or quitting) begins
+  TPoolCond passDone;     // signaled when the last worker finishes a pass
+  guint passGeneration; // incremented for each pass
+  guint countRunning;   // count of workers not yet done with the current pass
+  gboolean isQuitting;
+} TWorkerPool;
+
+
+
+/*
+Count of threads in the pool.
+The parameter if nonzero, else the count of online processors.
+Not more than the count of chunks in the first (largest) pass: more threads would have nothing to do.
+chunkSize is IMAGE_SYNTH_CHUNK_SIZE for target points, 1 for larger jobs (e.g. regions, see batch.h.)
+*/
+static guint
+workerPoolThreadCount(
+  guint requestedThreadCount,
+  guint countTargetPoints,
+  guint chunkSize
+  )
+{
+  guint threadCount = requestedThreadCount;
+  guint countChunks = (countTargetPoints + chunkSize - 1) / chunkSize;
+
+  if ( ! threadCount )
+  {
+#ifdef SYNTH_USE_GLIB_THREADS
+    threadCount = g_get_num_processors();
+#else
+    long onlineCount = sysconf(_SC_NPROCESSORS_ONLN);
+    threadCount = (onlineCount > 0) ? (guint) onlineCount : 1;
+#endif
+  }
+  if (threadCount > THREAD_LIMIT) threadCount = THREAD_LIMIT;
+  if (threadCount > countChunks) threadCount = countChunks;
+  if (threadCount < 1) threadCount = 1;
+  return threadCount;
+}
+
+
+/*
+Take the next chunk: from own range, else steal from another worker's range.
+Returns FALSE when no chunks remain in any range.
+*/
+static gboolean
+takeChunk(
+  TWorkerPool *pool,
+  TWorker *self,
+  guint *startTargetIndex,
+  guint *endTargetIndex
+  )
+{
+  guint i;
+
+  for (i=0; i<pool->threadCount; i++)
+  {
+    // Start with own range, then the next worker's, etc.
+    TWorker *victim = &pool->workers[(self->threadIndex + i) % pool->threadCount];
+    gint chunk;
+
+    if (victim->nextChunk >= victim->endChunk) continue;  // Cheap test without atomic write
+    chunk = __sync_fetch_and_add(&victim->nextChunk, 1);
+    if (chunk < victim->endChunk)
+    {
+      *startTargetIndex = (guint) chunk * pool->chunkSize;
+      *endTargetIndex = MIN(*startTargetIndex + pool->chunkSize, pool->endTargetIndex);
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+
+static void *
+workerThread(void * uncastWorker)
+{
+  TWorker *self = (TWorker *) uncastWorker;
+  TWorkerPool *pool = self->pool;
+  guint seenGeneration = 0;
+
+  for (;;)
+  {
+    guint start;
+    guint end;
+    gulong betters = 0;
+
+    // Wait for a pass to begin
+    poolMutexLock(&pool->mutex);
+    while ( pool->passGeneration == seenGeneration && ! pool->isQuitting )
+      poolCondWait(&pool->passStart, &pool->mutex);
+    if (pool->isQuitting)
+    {
+      poolMutexUnlock(&pool->mutex);
+      break;
+    }
+    seenGeneration = pool->passGeneration;
+    poolMutexUnlock(&pool->mutex);
+
+    while (takeChunk(pool, self, &start, &end))
+      betters += pool->job(pool->jobArgs, self->threadIndex, start, end);
+    self->betters = betters;
+
+    // Barrier: the last worker done wakes the refiner
+    poolMutexLock(&pool->mutex);
+    if (--pool->countRunning == 0)
+      poolCondSignal(&pool->passDone);
+    poolMutexUnlock(&pool->mutex);
+  }
+  return NULL;
+}
+
+
+/*
+Start threads.  They wait for passes.
+Returns count of threads started; zero means threads could not be started.
+*/
+static guint
+newWorkerPool(
+  TWorkerPool *pool,
+  guint threadCount
+  )
+{
+  guint i;
+
+  pool->threadCount = 0;
+  pool->passGeneration = 0;
+  pool->countRunning = 0;
+  pool->isQuitting = FALSE;
+  poolMutexInit(&pool->mutex);
+  poolCondInit(&pool->passStart);
+  poolCondInit(&pool->passDone);
+
+  // Aligned for the cache line alignment of TWorker
+  if (posix_memalign((void **) &pool->workers, 64, threadCount * sizeof(TWorker)))
+  {
+    pool->workers = NULL;
+    return 0;
+  }
+
+  for (i=0; i<threadCount; i++)
+  {
+    TWorker *worker = &pool->workers[i];
+
+    worker->pool = pool;
+    worker->threadIndex = i;
+    worker->nextChunk = 0;
+    worker->endChunk = 0;
+    worker->betters = 0;
+#ifdef SYNTH_USE_GLIB_THREADS
+    {
+    GError* error = NULL;
+
+    worker->thread = g_thread_try_new(NULL, workerThread, (void * __restrict__) worker, &error);
+    if (error != NULL)
+    {
+      printf("Error creating thread: %s\n", error->message);
+      g_error_free(error);
+      break;  // Use the threads already started
+    }
+    }
+#else
+    if (pthread_create(&worker->thread, NULL, workerThread, (void * __restrict__) worker))
+      break;
+#endif
+    pool->threadCount++;
+  }
+  return pool->threadCount;
+}
+
+
+/*
+Do one pass over targetPoints [0, endTargetIndex) using all workers, in chunks of chunkSize.
+Returns when all workers are done (the barrier between passes.)
+Returns the sum of betterments.
+*/
+static gulong
+runWorkerPool(
+  TWorkerPool *pool,
+  TWorkerJob job,
+  void *jobArgs,
+  guint endTargetIndex,
+  guint chunkSize
+  )
+{
+  guint countChunks = (endTargetIndex + chunkSize - 1) / chunkSize;
+  gulong betters = 0;
+  guint i;
+
+  pool->job = job;
+  pool->jobArgs = jobArgs;
+  pool->endTargetIndex = endTargetIndex;
+  pool->chunkSize = chunkSize;
+
+  // Deal each worker an equal, contiguous range of chunks
+  for (i=0; i<pool->threadCount; i++)
+  {
+    pool->workers[i].nextChunk = (gint) (((guint64) countChunks * i) / pool->threadCount);
+    pool->workers[i].endChunk  = (gint) (((guint64) countChunks * (i+1)) / pool->threadCount);
+    pool->workers[i].betters = 0;
+  }
+
+  // Mutex also publishes the above to the workers
+  poolMutexLock(&pool->mutex);
+  pool->countRunning = pool->threadCount;
+  pool->passGeneration++;
+  poolCondBroadcast(&pool->passStart);
+  while (pool->countRunning > 0)
+    poolCondWait(&pool->passDone, &pool->mutex);
+  poolMutexUnlock(&pool->mutex);
+
+  for (i=0; i<pool->threadCount; i++)
+    betters += pool->workers[i].betters;
+  return betters;
+}
+
+
+static void
+freeWorkerPool(TWorkerPool *pool)
+{
+  guint i;
+
+  poolMutexLock(&pool->mutex);
+  pool->isQuitting = TRUE;
+  poolCondBroadcast(&pool->passStart);
+  poolMutexUnlock(&pool->mutex);
+
+  for (i=0; i<pool->threadCount; i++)
+  {
+#ifdef SYNTH_USE_GLIB_THREADS
+    g_thread_join(pool->workers[i].thread);
+#else
+    pthread_join(pool->workers[i].thread, NULL);
+#endif
+  }
+  free(pool->workers);
+  poolCondClear(&pool->passStart);
+  poolCondClear(&pool->passDone);
+  poolMutexClear(&pool->mutex);
+}
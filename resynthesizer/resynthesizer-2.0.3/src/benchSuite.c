@@ -0,0 +1,495 @@
+/*
+Benchmark suite of libresynthesizer, headless (no GIMP.)
+
+Runs the engine on the PNG files in Test/in_images, for the kinds of use of the GIMP plugins:
+- heal: imageSynth() (the SimpleAPI) heals a rectangle from its surroundings, as Test/testResynth.py does
+- texture: engine() renders a texture twice the size of a corpus, without context
+- map: engine() transfers a texture (the corpus) onto a target, matching color maps (map style)
+
+Sweeps patchSize, maxProbeCount, threadCount, isAdaptivePasses and isLocalTargetOrder (every combination)
+and writes one JSON array to stdout, one object per run:
+wall seconds, probes (patch comparisons i.e. calls of computeBestFit or a SIMD kernel) per second,
+probes per target pixel, early outs (probes rejected before comparing every neighbor) by neighbor index,
+probes rejected by a lower bound (see corpusBounds.h),
+hits of heuristic 1 (neighbors' sources), perfect matches,
+counts of each pass (see TImageSynthStats in engineParams.h), peak resident memory,
+and cache misses of the engine (all its threads), where the processor's counters are readable (Linux perf events),
+else null.
+
+Each run is in a child process, so its peak resident memory is its own.
+
+Usage: benchSuite [-d imageDirectory] [-c cases] [-p patchSizes] [-m maxProbeCounts] [-t threadCounts] [-a adaptives] [-l locals]
+Lists are comma separated, e.g. benchSuite -c heal,map -p 16,30 -m 200,500 -t 1,2,4 -a 0,1 -l 0,1 > bench.json
+Defaults: -d ../Test/in_images -c heal,texture,map -p 16,30 -m 200,500 -t 1,<online processors> -a 0 -l 0
+
+Build: make -f Makefile.synth benchSuite (requires libpng)
+*/
+#define _POSIX_C_SOURCE 200112L   // clock_gettime, fork, getrusage
+#define _DEFAULT_SOURCE           // syscall
+#include <stddef.h>  // size_t
+#include <stdio.h>	// printf
+#include <stdlib.h>  // malloc
+#include <string.h>  // strcmp
+#include <time.h>    // clock_gettime
+#include <unistd.h>  // fork, pipe, sysconf
+#include <sys/resource.h>  // getrusage
+#include <sys/wait.h>      // waitpid
+#ifdef __linux__
+  #include <sys/ioctl.h>
+  #include <sys/syscall.h>
+  #include <linux/perf_event.h>
+#endif
+#include <png.h>
+
+// Redefine parts of glib that we use
+#include "glibProxy.h"  // glibProxy.c
+#include "imageSynthConstants.h"
+#include "imageSynth.h"  // includes engineParams.h
+#include "imageFormatIndicies.h"
+#include "map.h"
+#include "engine.h"
+
+#define BENCH_MAX_VALUES 16
+#define BENCH_RESULT_SIZE 16384
+
+typedef enum BenchKindEnum
+{
+  BENCH_HEAL,
+  BENCH_TEXTURE,
+  BENCH_MAP
+} TBenchKind;
+
+typedef struct BenchCaseStruct {
+  TBenchKind kind;
+  const char *target;   // File name less .png.  For heal also the corpus.
+  const char *corpus;   // For texture and map
+  unsigned int select[4];  // For heal: x, y, width, height of the rectangle healed
+} TBenchCase;
+
+// Selections are those of Test/testResynth.py
+static const TBenchCase benchCases[] = {
+  { BENCH_HEAL, "brick", NULL, {100, 90, 100, 50} },
+  { BENCH_HEAL, "ufo-input", NULL, {100, 90, 100, 50} },
+  { BENCH_HEAL, "donkey_original", NULL, {90, 175, 135, 100} },
+  { BENCH_TEXTURE, "grass-input", "grass-input", {0, 0, 0, 0} },
+  { BENCH_MAP, "angel_target", "angel_texture", {0, 0, 0, 0} },
+  { BENCH_MAP, "ufo-input", "grass-input", {0, 0, 0, 0} }
+};
+
+static const char * const benchKindNames[] = { "heal", "texture", "map" };
+
+typedef struct BenchListStruct {
+  unsigned int count;
+  unsigned int value[BENCH_MAX_VALUES];
+} TBenchList;
+
+typedef struct BenchImageStruct {
+  unsigned char *data;  // RGB, not row padded
+  unsigned int width;
+  unsigned int height;
+} TBenchImage;
+
+
+static double
+wallSeconds(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Any PNG (gray, alpha, palette, 16-bit) as 8-bit RGB.  Returns 0 on success.
+static int
+loadImage(
+  const char *directory,
+  const char *name,
+  TBenchImage *image    // OUT
+  )
+{
+  char path[1024];
+  png_image png;
+
+  snprintf(path, sizeof(path), "%s/%s.png", directory, name);
+  memset(&png, 0, sizeof(png));
+  png.version = PNG_IMAGE_VERSION;
+  if ( ! png_image_begin_read_from_file(&png, path) ) return 1;
+  png.format = PNG_FORMAT_RGB;
+  image->data = malloc(PNG_IMAGE_SIZE(png));
+  if ( ! image->data )
+  {
+    png_image_free(&png);
+    return 1;
+  }
+  if ( ! png_image_finish_read(&png, NULL, image->data, 0, NULL) )
+  {
+    free(image->data);
+    return 1;
+  }
+  image->width = png.width;
+  image->height = png.height;
+  return 0;
+}
+
+// Parse a comma separated list of unsigned ints
+static void
+parseList(
+  const char *text,
+  TBenchList *list    // OUT
+  )
+{
+  list->count = 0;
+  while ( *text && list->count < BENCH_MAX_VALUES )
+  {
+    char *end;
+    unsigned long value = strtoul(text, &end, 10);
+
+    if ( end == text ) break;  // Not a number
+    list->value[list->count++] = (unsigned int) value;
+    text = (*end == ',') ? end + 1 : end;
+  }
+}
+
+static gboolean
+isCaseSelected(
+  const char *cases,
+  TBenchKind kind
+  )
+{
+  return strstr(cases, benchKindNames[kind]) != NULL;
+}
+
+
+/*
+Start counting cache misses of this process and threads it starts later.
+Returns a counter to pass to readCacheMisses(), or -1 if counters are not readable
+(not Linux, no hardware counters e.g. in some virtual machines, or not permitted by perf_event_paranoid.)
+*/
+static int
+startCacheMisses(void)
+{
+#ifdef __linux__
+  struct perf_event_attr attributes;
+  int counter;
+
+  memset(&attributes, 0, sizeof(attributes));
+  attributes.type = PERF_TYPE_HARDWARE;
+  attributes.size = sizeof(attributes);
+  attributes.config = PERF_COUNT_HW_CACHE_MISSES;  // Usually of the last level cache
+  attributes.disabled = 1;
+  attributes.inherit = 1;         // Also the engine's threads
+  attributes.exclude_kernel = 1;
+  attributes.exclude_hv = 1;
+  counter = (int) syscall(__NR_perf_event_open, &attributes, 0, -1, -1, 0);
+  if ( counter >= 0 )
+  {
+    ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+    ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  return counter;
+#else
+  return -1;
+#endif
+}
+
+// Returns count since startCacheMisses(), or -1.  Closes the counter.
+static long long
+readCacheMisses(int counter)
+{
+  long long count = -1;
+
+#ifdef __linux__
+  if ( counter < 0 ) return -1;
+  ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+  if ( read(counter, &count, sizeof(count)) != sizeof(count) ) count = -1;
+  close(counter);
+#endif
+  return count;
+}
+
+
+static void
+progressCallback(int percent, void * context)
+{
+  ;
+}
+
+
+/*
+Fill an engine pixmap: mask pixelel, RGB (or none for a blank target), and optionally an RGB map.
+Pixel layout as given by indices, see prepareImageFormatIndices().
+*/
+static void
+fillPixmap(
+  Map *pixmap,          // OUT
+  TFormatIndices *indices,
+  unsigned int width,
+  unsigned int height,
+  const unsigned char *colors,  // IN RGB or NULL
+  const unsigned char *map      // IN RGB or NULL
+  )
+{
+  unsigned int i;
+  TPixelelIndex k;
+
+  new_pixmap(pixmap, width, height, indices->total_bpp);
+  for (i=0; i<width*height; i++)
+  {
+    Pixelel *pixel = &g_array_index(pixmap->data, Pixelel, i*indices->total_bpp);
+
+    pixel[MASK_PIXELEL_INDEX] = MASK_TOTALLY_SELECTED;  // All target, or all corpus
+    for (k=FIRST_PIXELEL_INDEX; k<indices->colorEndBip; k++)
+      pixel[k] = colors ? colors[i*3 + k - FIRST_PIXELEL_INDEX] : 0;
+    for (k=indices->map_start_bip; k<indices->map_end_bip; k++)
+      pixel[k] = map[i*3 + k - indices->map_start_bip];
+  }
+}
+
+
+/*
+One run.  In the child process.
+Returns error, sets countTarget.
+*/
+static int
+runCase(
+  const char *directory,
+  const TBenchCase *benchCase,
+  TImageSynthParameters *parameters,
+  unsigned int *countTarget,  // OUT
+  double *seconds,            // OUT
+  long long *cacheMisses      // OUT or -1
+  )
+{
+  TBenchImage target;
+  TBenchImage corpus;
+  int cancelFlag = 0;
+  int error;
+  double start;
+  int counter;
+
+  if ( loadImage(directory, benchCase->target, &target) ) return -1;
+
+  if ( benchCase->kind == BENCH_HEAL )
+  {
+    ImageBuffer imageBuffer = { target.data, target.width, target.height, target.width * 3 };
+    ImageBuffer mask = { calloc(target.width * target.height, 1), target.width, target.height, target.width };
+    unsigned int x;
+    unsigned int y;
+
+    *countTarget = 0;
+    for (y=benchCase->select[1]; y<benchCase->select[1] + benchCase->select[3] && y<target.height; y++)
+      for (x=benchCase->select[0]; x<benchCase->select[0] + benchCase->select[2] && x<target.width; x++)
+      {
+        mask.data[y*target.width + x] = 0xFF;
+        (*countTarget)++;
+      }
+    counter = startCacheMisses();
+    start = wallSeconds();
+    error = imageSynth(&imageBuffer, &mask, T_RGB, parameters, progressCallback, (void*) 0, &cancelFlag);
+    *seconds = wallSeconds() - start;
+    *cacheMisses = readCacheMisses(counter);
+    free(mask.data);
+  }
+  else
+  {
+    TFormatIndices indices;
+    Map targetMap;
+    Map corpusMap;
+    gboolean isMap = (benchCase->kind == BENCH_MAP);
+    // Texture: twice the size of the corpus.  Map: the size of the target image, which is its map.
+    unsigned int width;
+    unsigned int height;
+
+    if ( loadImage(directory, benchCase->corpus, &corpus) ) return -1;
+    width = isMap ? target.width : 2 * corpus.width;
+    height = isMap ? target.height : 2 * corpus.height;
+    *countTarget = width * height;
+
+    prepareImageFormatIndices(&indices, 3, isMap ? 3 : 0, FALSE, FALSE, isMap);
+    fillPixmap(&targetMap, &indices, width, height, NULL, isMap ? target.data : NULL);
+    fillPixmap(&corpusMap, &indices, corpus.width, corpus.height, corpus.data, isMap ? corpus.data : NULL);
+    parameters->matchContextType = 0;   // No context
+    counter = startCacheMisses();
+    start = wallSeconds();
+    error = engine(*parameters, &indices, &targetMap, &corpusMap, progressCallback, (void*) 0, &cancelFlag);
+    *seconds = wallSeconds() - start;
+    *cacheMisses = readCacheMisses(counter);
+    free_map(&targetMap);
+    free_map(&corpusMap);
+    free(corpus.data);
+  }
+  free(target.data);
+  return error;
+}
+
+
+/*
+Run a case in a child process, print its result as a JSON object.
+*/
+static void
+benchmarkCase(
+  const char *directory,
+  const TBenchCase *benchCase,
+  unsigned int patchSize,
+  unsigned int maxProbeCount,
+  unsigned int threadCount,
+  unsigned int isAdaptivePasses,
+  unsigned int isLocalTargetOrder
+  )
+{
+  int channel[2];
+  pid_t child;
+  char result[BENCH_RESULT_SIZE];
+  size_t length = 0;
+  ssize_t count;
+  int status;
+
+  printf("  {\"case\": \"%s\", \"target\": \"%s\", \"corpus\": \"%s\", "
+    "\"patchSize\": %u, \"maxProbeCount\": %u, \"threads\": %u, \"adaptivePasses\": %u, \"localTargetOrder\": %u, ",
+    benchKindNames[benchCase->kind], benchCase->target, benchCase->corpus ? benchCase->corpus : benchCase->target,
+    patchSize, maxProbeCount, threadCount, isAdaptivePasses, isLocalTargetOrder);
+  fflush(stdout);
+
+  if ( pipe(channel) )
+  {
+    printf("\"error\": \"pipe\"}");
+    return;
+  }
+  child = fork();
+  if ( child == 0 )
+  {
+    TImageSynthParameters parameters;
+    TImageSynthStats stats;
+    struct rusage usage;
+    unsigned int countTarget = 0;
+    double seconds = 0;
+    long long cacheMisses = -1;
+    char cacheMissesText[32] = "null";
+    int error;
+    unsigned int pass;
+    unsigned int i;
+
+    setDefaultParams(&parameters);
+    parameters.patchSize = patchSize;
+    parameters.maxProbeCount = maxProbeCount;
+    parameters.threadCount = threadCount;
+    parameters.isAdaptivePasses = isAdaptivePasses;
+    parameters.isLocalTargetOrder = isLocalTargetOrder;
+    parameters.stats = &stats;
+    error = runCase(directory, benchCase, &parameters, &countTarget, &seconds, &cacheMisses);
+    getrusage(RUSAGE_SELF, &usage);
+    if ( ! error && cacheMisses >= 0 )
+      snprintf(cacheMissesText, sizeof(cacheMissesText), "%lld", cacheMisses);
+
+    length = snprintf(result, sizeof(result),
+      "\"error\": %d, \"targetPixels\": %u, \"seconds\": %.4f, \"probes\": %llu, "
+      "\"probesPerSecond\": %.0f, \"probesPerTargetPixel\": %.1f, \"targetAttempts\": %llu, "
+      "\"earlyOuts\": %llu, \"boundRejects\": %llu, \"neighborsSourceHits\": %llu, \"perfectMatches\": %llu, "
+      "\"peakRSSKiB\": %ld, \"cacheMisses\": %s, \"earlyOutsByNeighbor\": [",
+      error, countTarget, seconds, error ? 0 : stats.probes,
+      (error || seconds <= 0) ? 0 : stats.probes / seconds,
+      (error || ! countTarget) ? 0 : (double) stats.probes / countTarget,
+      error ? 0 : stats.targetAttempts,
+      error ? 0 : stats.earlyOuts,
+      error ? 0 : stats.boundRejects,
+      error ? 0 : stats.neighborsSourceHits,
+      error ? 0 : stats.perfectMatches,
+      usage.ru_maxrss,    // KiB on Linux
+      cacheMissesText);
+    // patchSize is the count of neighbors
+    for (i=0; ! error && i<IMAGE_SYNTH_STATS_NEIGHBORS && i<patchSize; i++)
+      length += snprintf(result + length, sizeof(result) - length, "%s%llu", i ? ", " : "",
+        stats.earlyOutsByNeighbor[i]);
+    length += snprintf(result + length, sizeof(result) - length, "], \"passes\": [");
+    for (pass=0; ! error && pass<stats.passCount && pass<IMAGE_SYNTH_STATS_MAX_PASSES; pass++)
+    {
+      const TImageSynthPassStats *passStats = &stats.passes[pass];
+
+      length += snprintf(result + length, sizeof(result) - length,
+        "%s{\"targets\": %u, \"betterments\": %u, \"bettermentFraction\": %.4f, \"seconds\": %.4f, "
+        "\"probes\": %llu, \"earlyOuts\": %llu, \"boundRejects\": %llu, \"neighborsSourceHits\": %llu, "
+        "\"perfectMatches\": %llu}",
+        pass ? ", " : "",
+        passStats->targets, passStats->betterments, passStats->bettermentFraction, passStats->seconds,
+        passStats->probes, passStats->earlyOuts, passStats->boundRejects, passStats->neighborsSourceHits, passStats->perfectMatches);
+    }
+    length += snprintf(result + length, sizeof(result) - length, "]}");
+    if ( write(channel[1], result, length) < 0 ) _exit(1);
+    _exit(0);
+  }
+
+  close(channel[1]);
+  while ( length < sizeof(result) - 1 && (count = read(channel[0], result + length, sizeof(result) - 1 - length)) > 0 )
+    length += count;
+  close(channel[0]);
+  waitpid(child, &status, 0);
+  result[length] = 0;
+  if ( child < 0 || ! length )
+    printf("\"error\": \"crashed\"}");  // Or could not fork
+  else
+    printf("%s", result);
+}
+
+
+int main(
+  int argc,
+  char *argv[]
+	)
+{
+  const char *directory = "../Test/in_images";
+  const char *cases = "heal,texture,map";
+  TBenchList patchSizes = { 2, {16, 30} };
+  TBenchList probeCounts = { 2, {200, 500} };
+  TBenchList threadCounts = { 1, {1} };
+  TBenchList adaptives = { 1, {0} };
+  TBenchList locals = { 1, {0} };
+  long processors = sysconf(_SC_NPROCESSORS_ONLN);
+  gboolean isFirst = TRUE;
+  unsigned int i;
+  int arg;
+
+  if ( processors > 1 )
+    threadCounts.value[threadCounts.count++] = (unsigned int) processors;
+
+  for (arg=1; arg+1<argc; arg+=2)
+  {
+    if ( ! strcmp(argv[arg], "-d") ) directory = argv[arg+1];
+    else if ( ! strcmp(argv[arg], "-c") ) cases = argv[arg+1];
+    else if ( ! strcmp(argv[arg], "-p") ) parseList(argv[arg+1], &patchSizes);
+    else if ( ! strcmp(argv[arg], "-m") ) parseList(argv[arg+1], &probeCounts);
+    else if ( ! strcmp(argv[arg], "-t") ) parseList(argv[arg+1], &threadCounts);
+    else if ( ! strcmp(argv[arg], "-a") ) parseList(argv[arg+1], &adaptives);
+    else if ( ! strcmp(argv[arg], "-l") ) parseList(argv[arg+1], &locals);
+    else break;
+  }
+  if ( arg < argc )
+  {
+    fprintf(stderr, "Usage: %s [-d imageDirectory] [-c heal,texture,map] [-p patchSizes] [-m maxProbeCounts] [-t threadCounts] [-a 0,1] [-l 0,1]\n", argv[0]);
+    return(1);
+  }
+
+  printf("[\n");
+  for (i=0; i<sizeof(benchCases)/sizeof(benchCases[0]); i++)
+  {
+    unsigned int p;
+    unsigned int m;
+    unsigned int t;
+    unsigned int a;
+    unsigned int l;
+
+    if ( ! isCaseSelected(cases, benchCases[i].kind) ) continue;
+    for (p=0; p<patchSizes.count; p++)
+      for (m=0; m<probeCounts.count; m++)
+        for (t=0; t<threadCounts.count; t++)
+          for (a=0; a<adaptives.count; a++)
+            for (l=0; l<locals.count; l++)
+            {
+              if ( ! isFirst ) printf(",\n");
+              isFirst = FALSE;
+              benchmarkCase(directory, &benchCases[i],
+                patchSizes.value[p], probeCounts.value[m], threadCounts.value[t], adaptives.value[a], locals.value[l]);
+            }
+  }
+  printf("\n]\n");
+	return(0);
+}
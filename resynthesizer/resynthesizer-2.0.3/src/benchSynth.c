@@ -0,0 +1,184 @@
+/*
+Benchmark of libresynthesizer: scaling of threaded synthesis from 1 to N threads.
+
+Heals a hole in a generated texture (no image files or libraries needed)
+with threadCount 1, 2, ... N and reports wall time and speedup over one thread.
+Also counts synthesized pixels whose color is not in the image outside the hole.
+There should be none: the engine only copies colors from the corpus,
+even when threads read and write the target concurrently.
+
+Usage: benchSynth [maxThreads [size]]
+maxThreads defaults to the count of online processors, size (of the square image) to 512.
+
+Build: make -f Makefile.synth benchSynth
+*/
+#define _POSIX_C_SOURCE 199309L   // clock_gettime
+#include <stddef.h>  // size_t
+#include <stdio.h>	// printf
+#include <stdlib.h>  // atoi, malloc
+#include <string.h>  // memcpy
+#include <time.h>    // clock_gettime
+#include <unistd.h>  // sysconf
+
+// Redefine parts of glib that we use
+#include "glibProxy.h"  // glibProxy.c
+#include "imageSynth.h"  // includes engineParams.h
+
+// Texture colors are on a lattice of 16 levels per channel, 4096 colors
+#define BENCH_LEVELS 16
+
+static unsigned char
+benchLevel(unsigned int value)
+{
+  return (unsigned char) ((value % BENCH_LEVELS) * (255 / (BENCH_LEVELS - 1)));
+}
+
+static unsigned int
+benchColorIndex(const unsigned char *pixel)
+{
+  unsigned int scale = 255 / (BENCH_LEVELS - 1);
+  return ((pixel[0] / scale) * BENCH_LEVELS + pixel[1] / scale) * BENCH_LEVELS + pixel[2] / scale;
+}
+
+/*
+RGB texture: bricks of varying color with mortar, and some noise,
+so the patches are varied but the structure is synthesizable.
+*/
+static void
+makeTexture(
+  unsigned char *data,
+  unsigned int size
+  )
+{
+  unsigned int x;
+  unsigned int y;
+  unsigned int noise = 12345;
+
+  for (y=0; y<size; y++)
+    for (x=0; x<size; x++)
+    {
+      unsigned char *pixel = &data[(y*size + x) * 3];
+      unsigned int row = y / 12;
+      unsigned int column = (x + (row % 2) * 16) / 32;
+      unsigned int brick = row * 131 + column * 71;
+
+      noise = noise * 1103515245 + 12345;
+      if ( y % 12 == 0 || (x + (row % 2) * 16) % 32 == 0 )
+      {
+        // Mortar
+        pixel[0] = pixel[1] = pixel[2] = benchLevel(12 + (noise >> 16) % 2);
+      }
+      else
+      {
+        pixel[0] = benchLevel(8 + brick % 5 + (noise >> 16) % 2);
+        pixel[1] = benchLevel(3 + brick % 3 + (noise >> 20) % 2);
+        pixel[2] = benchLevel(2 + brick % 2);
+      }
+    }
+}
+
+// Mask: a centered square hole, a quarter of the image area
+static void
+makeMask(
+  unsigned char *mask,
+  unsigned int size
+  )
+{
+  unsigned int x;
+  unsigned int y;
+
+  for (y=0; y<size; y++)
+    for (x=0; x<size; x++)
+      mask[y*size + x] = ( x >= size/4 && x < 3*size/4 && y >= size/4 && y < 3*size/4 ) ? 0xFF : 0;
+}
+
+static double
+wallSeconds(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Count of pixels in the hole whose color is not outside the hole
+static unsigned int
+countForeignColors(
+  const unsigned char *data,
+  const unsigned char *mask,
+  unsigned int size
+  )
+{
+  unsigned char isContextColor[BENCH_LEVELS * BENCH_LEVELS * BENCH_LEVELS] = {0};
+  unsigned int count = 0;
+  unsigned int i;
+
+  for (i=0; i<size*size; i++)
+    if ( ! mask[i] )
+      isContextColor[benchColorIndex(&data[i*3])] = 1;
+  for (i=0; i<size*size; i++)
+    if ( mask[i] && ! isContextColor[benchColorIndex(&data[i*3])] )
+      count++;
+  return count;
+}
+
+static void
+progressCallback(int percent, void * context)
+{
+  ;
+}
+
+
+int main(
+  int argc,
+  char *argv[]
+	)
+{
+  unsigned int maxThreads = (argc > 1) ? (unsigned int) atoi(argv[1]) : (unsigned int) sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned int size = (argc > 2) ? (unsigned int) atoi(argv[2]) : 512;
+  unsigned char *texture = malloc(size * size * 3);
+  unsigned char *image = malloc(size * size * 3);
+  unsigned char *maskData = malloc(size * size);
+  double oneThreadSeconds = 0;
+  unsigned int threads;
+
+	// !!! Note width, height, rowBytes in that order
+  ImageBuffer imageBuffer = { image, size, size, size * 3 };
+  ImageBuffer mask = { maskData, size, size, size };
+  TImageSynthParameters parameters;
+
+  if ( maxThreads < 1 ) maxThreads = 1;
+  makeTexture(texture, size);
+  makeMask(maskData, size);
+  setDefaultParams(&parameters);
+
+  printf("Healing %ux%u hole in %ux%u texture, patchSize %d, maxProbeCount %u\n",
+    size/2, size/2, size, size, parameters.patchSize, parameters.maxProbeCount);
+  printf("threads  seconds  speedup  foreignColors\n");
+  for (threads=1; threads<=maxThreads; threads++)
+  {
+    int cancelFlag = 0;
+    int error;
+    double start;
+    double seconds;
+
+    memcpy(image, texture, size * size * 3);
+    parameters.threadCount = threads;
+    start = wallSeconds();
+    error = imageSynth(&imageBuffer, &mask, T_RGB, &parameters, progressCallback, (void*) 0, &cancelFlag);
+    seconds = wallSeconds() - start;
+    if (error)
+    {
+      printf("!!!! imageSynth returned error: %d\n", error);
+      return(1);
+    }
+    if ( threads == 1 ) oneThreadSeconds = seconds;
+    printf("%7u  %7.3f  %7.2f  %13u\n", threads, seconds, oneThreadSeconds / seconds,
+      countForeignColors(image, maskData, size));
+  }
+
+  free(texture);
+  free(image);
+  free(maskData);
+	return(0);
+}
@@ -24,145 +24,199 @@ Functions to read and write pixmaps and bytemaps from and to Gimp.
 
 
 /*
-Blit (copy a sub-rect) of source map to destination map.
-Here, the entire pixel element of the map is copied.
-
-original c++ code, which only copied a byte:
-    for(gint y=0;y<temp_mask.height;y++)
-      for(gint x=0;x<temp_mask.width;x++)
-        mask.at(x+drawable_relative_x, y+drawable_relative_y)[0] = 
-          temp_mask.at(x,y)[0]; // Only one channel (byte)
+Pixels are moved between Gimp and our pixmaps tile by tile (gimp_pixel_rgns_register()),
+directly into (or from) the pixmap, at the pixmap's depth and the Pixelel offset.
+
+Formerly a whole rect was moved with gimp_pixel_rgn_get_rect() into a temporary buffer,
+copied again into the pixmap, and the mask went through two more bytemaps (temp_mask, then mask)
+before being interleaved into the pixmap.
+For a large drawable, that is several copies of the image, and a long wait before synthesis starts.
+Tile by tile, each Pixelel is copied once, and the only memory is the pixmap and Gimp's tile cache.
 */
-void
-blit_map(
-  Map* dest_map,
-  Map* source_map,
-  gint offset_x,
-  gint offset_y
+
+
+/*
+Copy SOME channels of a rect of GimpDrawable to a rect of pixmap, possibly offsetting them in the Pixel.
+(Usually called many times, for image, then mask, then other drawables,
+to interleave many drawables into one pixmap.)
+x,y are in drawable coords; map_x, map_y is where the rect goes in the pixmap.
+*/
+static void
+pixmap_from_drawable_rect(
+  Map *map,
+  gint map_x,                   /* origin in pixmap */
+  gint map_y,
+  GimpDrawable *drawable,
+  gint x,                       /* origin of rect to copy. */
+  gint y,
+  guint width,
+  guint height,
+  guint pixelel_offset,         /* Which pixelels to copy to. */
+  guint pixelel_count_to_copy   /* Count of pixels to copy, might omit the alpha. */
   )
 {
-  guint y;
-  guint x;
+  GimpPixelRgn region;
+  gpointer tile_iterator;
+
+  g_assert(width * height > 0);
+  /* Will fit in our Pixel */
+  g_assert( pixelel_count_to_copy + pixelel_offset <= map->depth );
+  /* Drawable has enough to copy */
+  g_assert( pixelel_count_to_copy <= drawable->bpp );
+  /* Rect fits in pixmap */
+  g_assert( map_x + width <= map->width && map_y + height <= map->height );
+  
+  gimp_pixel_rgn_init(&region, drawable, x,y, width, height, FALSE,FALSE);
   
-  for(y=0;y<source_map->height;y++)
-    for(x=0;x<source_map->width;x++)
+  /* 
+  Each iteration, region is one tile (or the part of it in the rect.)
+  Note region.x, region.y are in drawable coords.
+  The drawable may be offset from the canvas and other drawables.
+  */
+  for (tile_iterator = gimp_pixel_rgns_register(1, &region);
+       tile_iterator != NULL;
+       tile_iterator = gimp_pixel_rgns_process(tile_iterator))
+  {
+    guint row;
+    
+    for (row=0; row<region.h; row++)
     {
-      Coordinates coords = {x,y};
-      Coordinates dest_coords = {x+offset_x, y+offset_y};
+      const guchar *source = region.data + row * region.rowstride;
+      Coordinates coords = {map_x + region.x - x, map_y + region.y - y + row};
+      Pixelel *dest = pixmap_index(map, coords) + pixelel_offset;
+      guint column;
+      guint j;
       
-      *pixmap_index(dest_map, dest_coords) = *pixmap_index(source_map, coords);
+      for (column=0; column<region.w; column++)
+      {
+        for(j=0; j<pixelel_count_to_copy; j++)  /* Count can be different from strides. */
+          dest[j] = source[j];
+        source += region.bpp;   /* Stride is bpp */
+        dest += map->depth;     /* Stride is depth of pixmap. */
+      }
     }
+  }
+}
+
+
+/*
+Copy SOME channels of a drawable the size of the pixmap to the pixmap.
+*/
+static void 
+pixmap_from_drawable(
+  Map *map,
+  GimpDrawable *drawable,
+  guint pixelel_offset,         /* Which pixelels to copy to. */
+  guint pixelel_count_to_copy   /* Count of pixels to copy, might omit the alpha. */
+  )
+{
+  /* !!! Note our pixmap is same width, height as drawable, but depths may differ. */
+  pixmap_from_drawable_rect(map, 0, 0, drawable, 0, 0, map->width, map->height, 
+    pixelel_offset, pixelel_count_to_copy);
 }
 
 
 /* 
-Copy some channels of pixmap to GimpDrawable.
+Copy some channels of a rect of pixmap to the same rect of GimpDrawable.
 (Usually just the color and alpha channels, omitting the map channel and other channels.)
 
 Unlike the original code:
 - C instead of C++
-- the origin is fixed at 0,0
 - the Pixelel offset is fixed at 0.
+- only a rect, e.g. the bounds of the target: pixels outside it are unchanged.
 The count of Pixelels moved is what drawable specifies, might be less than in pixmap.
 That is, copy a slice of pixmap to drawable.
 */
 void 
 pixmap_to_drawable(
-  Map map,
+  Map *map,
   GimpDrawable *drawable, 
+  gint x,
+  gint y,
+  guint width,
+  guint height,
   guint pixelel_offset  // Index of starting Pixelel (channel) within Pixel sequence to move
   )
 {
   GimpPixelRgn region;
-  guchar *img;
-
-  /* Create a new, non-sparse sequence of Pixelels for Gimp. */
-  guint width = map.width;
-  guint height = map.height;
+  gpointer tile_iterator;
   /* Count Pixelels to copy, whatever drawable wants, we have optional alpha Pixelel in our Pixel. */
   guint pixelel_count = drawable->bpp;  
-  gint size = width * height * pixelel_count;  // !!! Size of drawable, not the pixmap
   
-  g_assert( pixelel_offset + pixelel_count <= map.depth ); // Pixmap has more pixelels than offset + count
-  
-  gimp_pixel_rgn_init(&region, drawable, 0,0, width, height, TRUE, TRUE);
-  img = g_malloc(size);
+  g_assert( pixelel_offset + pixelel_count <= map->depth ); // Pixmap has more pixelels than offset + count
   
+  gimp_pixel_rgn_init(&region, drawable, x,y, width, height, TRUE, TRUE);
+  for (tile_iterator = gimp_pixel_rgns_register(1, &region);
+       tile_iterator != NULL;
+       tile_iterator = gimp_pixel_rgns_process(tile_iterator))
   {
-  guint i;
-  guint j;
-  
-  for(i=0; i<width*height; i++)  // Iterate over map as a sequence
-    for(j=0; j<pixelel_count; j++)  // Iterate over Pixelels
-      img[i*pixelel_count+j] = 
-        g_array_index(map.data, Pixelel, i*map.depth+pixelel_offset+j);
+    guint row;
+    
+    for (row=0; row<region.h; row++)
+    {
+      guchar *dest = region.data + row * region.rowstride;
+      Coordinates coords = {region.x, region.y + row};
+      const Pixelel *source = pixmap_index(map, coords) + pixelel_offset;
+      guint column;
+      guint j;
+      
+      for (column=0; column<region.w; column++)
+      {
+        for(j=0; j<pixelel_count; j++)  // Iterate over Pixelels
+          dest[j] = source[j];
+        dest += region.bpp;
+        source += map->depth;
+      }
+    }
   }
-        
-  /* Send seq of Pixelels to Gimp. */
-  gimp_pixel_rgn_set_rect(&region, img, 0,0, width, height);
-  g_free(img);
 }
 
 
 /*
-Copy SOME channels of GimpDrawable to pixmap, possibly offsetting them in the Pixel.
-(Usually called many times, for image, then mask, then other drawables,
-to interleave many drawables into one pixmap.)
-Copy a sub-rect from the drawable.
+Bounds of the selected pixels (the target) of pixmap, from the mask Pixelels.
+Returns FALSE if none.
 */
-static void 
-pixmap_from_drawable(
-  Map map,
-  GimpDrawable *drawable,
-  gint x,                       /* origin of rect to copy. */
-  gint y,
-  gint pixelel_offset,          /* Which pixelels to copy to. */
-  guint pixelel_count_to_copy   /* Count of pixels to copy, might omit the alpha. */
+static gboolean
+target_bounds(
+  Map *map,
+  gint *x,        // OUT
+  gint *y,
+  guint *width,
+  guint *height
   )
 {
-  GimpPixelRgn region;
-  guchar *img;
-  
-  /* !!! Note our pixmap is same width, height as drawable, but depths may differ. */
-  guint width = map.width;
-  guint height = map.height;
-  guint drawable_size = width * height * drawable->bpp;
-
-  g_assert(drawable_size > 0);
-  /* Will fit in our Pixel */
-  g_assert( pixelel_count_to_copy + pixelel_offset <= map.depth );
-  /* Drawable has enough to copy */
-  g_assert( pixelel_count_to_copy <= drawable->bpp );
-  
-  gimp_pixel_rgn_init(&region, drawable, x,y, map.width, map.height, FALSE,FALSE);
-
-  img = g_malloc(drawable_size);
-  
-  /* 
-  Get all the pixelels from drawable into img sequence.
-  Note x1,y1 are in drawable coords i.e. relative to drawable
-  The drawable may be offset from the canvas and other drawables.
-  */
-  gimp_pixel_rgn_get_rect(&region, img, x,y, width,height);
-
-  {
+  guint min_x = map->width;
+  guint min_y = map->height;
+  guint max_x = 0;
+  guint max_y = 0;
   guint i;
   guint j;
   
-  /* Copy SOME of the pixels from img sequence to our pixmap, OFFSET them. */
-  for(i=0; i<width*height; i++)
-    for(j=0; j<pixelel_count_to_copy; j++)  /* Count can be different from strides. */
-        g_array_index(map.data, Pixelel, i*map.depth+pixelel_offset+j)  /* Stride is depth of pixmap. */
-          = img[i*drawable->bpp+j];   /* Stride is bpp */
-  }
-  
-  g_free(img);
+  for(j=0; j<map->height; j++)
+    for(i=0; i<map->width; i++)
+    {
+      Coordinates coords = {i, j};
+      
+      if (pixmap_index(map, coords)[MASK_PIXELEL_INDEX] != MASK_UNSELECTED)
+      {
+        min_x = MIN(min_x, i);
+        min_y = MIN(min_y, j);
+        max_x = MAX(max_x, i);
+        max_y = MAX(max_y, j);
+      }
+    }
+  if (min_x > max_x)
+    return FALSE;
+  *x = min_x;
+  *y = min_y;
+  *width = max_x - min_x + 1;
+  *height = max_y - min_y + 1;
+  return TRUE;
 }
 
 
-
 /*
-Get drawable and a selection mask for it from GIMP.
+Get a selection mask for a drawable from GIMP, into the mask Pixelel of our pixmap.
 
 May 2010 lkk Heavily revised:
  - to fix handling of selection
@@ -177,7 +231,7 @@ or create one if no selection exists or selection exists but does not intersect
 static void
 fetch_mask(
   GimpDrawable *drawable,
-  Map *mask,
+  Map *pixmap,
   Pixelel default_mask_value
   ) 
 {
@@ -186,9 +240,9 @@ fetch_mask(
   
   gboolean is_selection;
   gboolean is_selection_intersect;
+  Pixelel mask_value;
+  guint i;
 
-  new_bytemap(mask, drawable->width, drawable->height);
-  
   /* Bug: original code did this:
   has_selection = gimp_drawable_mask_bounds(drawable->drawable_id,&x1,&y1,&x2,&y2);
   but that returns True if there is a selection that does not intersect.
@@ -208,51 +262,45 @@ fetch_mask(
       &drawable_relative_x, &drawable_relative_y, &width, &height);
       
   if ( ! is_selection || ! is_selection_intersect) {
-    set_bytemap(mask, default_mask_value);
+    mask_value = default_mask_value;
     /* This is confusing enough to users and programmers that it deserves a debug message. 
     On all platforms, this only prints if a console is already open.
     */
     g_debug("Drawable without intersecting selection, using entire drawable.");
   }
-  else /* Is a selection and it intersects drawable. */
+  else
+    /* Unselected where the selection channel doesn't intersect. */
+    mask_value = MASK_UNSELECTED;
+  
+  for (i=0; i<pixmap->width * pixmap->height; i++)
+    g_array_index(pixmap->data, Pixelel, i*pixmap->depth + MASK_PIXELEL_INDEX) = mask_value;
+  
+  if (is_selection && is_selection_intersect) /* Is a selection and it intersects drawable. */
   {
-    Map temp_mask;
     GimpDrawable *mask_drawable;
     gint xoff,yoff;
     
-    /* Build a mask that is unselected where the selection channel doesn't intersect,
-    and having the value of the selection channel where it does intersect.
-    */
-    
-    /* Initially Unselect full mask */
-    set_bytemap(mask, MASK_UNSELECTED);
-    
-    /* Get the selection intersection's bytemap into temp_mask */
-    new_bytemap(&temp_mask, width, height);
-    
     /* Get Gimp drawable for selection channel.  It is in image coords, i.e. anchored at 0,0 image */
     mask_drawable = gimp_drawable_get(gimp_image_get_selection(gimp_drawable_get_image(drawable->drawable_id)));
     gimp_drawable_offsets(drawable->drawable_id, &xoff, &yoff); // Offset of layer in image
 
     /* 
-    Copy selection intersection bytemap from Gimp to our temp_mask bytemap.
+    Copy the selection intersection from Gimp into the mask Pixelel of our pixmap,
+    having the value of the selection channel where it does intersect.
     
-    Destination is the first channel.  Assert only one channel in the drawable.
+    Assert only one channel in the drawable.
     
     Since mask_drawable is image size, in image coords, calculate coords of intersection in image coords =
     (offset of drawable plus drawable relative coords of selection)
+    The pixmap is only layer size, not image size: the intersection goes to drawable relative coords.
     */
     g_assert(mask_drawable->bpp == 1);   /* Masks have one channel. */
-    pixmap_from_drawable(temp_mask, mask_drawable, 
-      drawable_relative_x+xoff, drawable_relative_y+yoff, MASK_PIXELEL_INDEX, mask_drawable->bpp);
+    pixmap_from_drawable_rect(pixmap, drawable_relative_x, drawable_relative_y,
+      mask_drawable, drawable_relative_x+xoff, drawable_relative_y+yoff, width, height,
+      MASK_PIXELEL_INDEX, mask_drawable->bpp);
     
     gimp_drawable_detach(mask_drawable);
-
-    /* Blit the selection intersection onto our mask, which is only layer size, not image size. */
-    blit_map(mask, &temp_mask, drawable_relative_x, drawable_relative_y);
-    
-    free_map(&temp_mask);
-    }
+  }
 }
 
 
@@ -262,18 +310,28 @@ fetch_image_and_mask(
   GimpDrawable *drawable, // IN
   Map *pixmap,            // OUT our color pixmap of drawable
   guint pixelel_count,    // IN total count mask+image+map Pixelels in our Pixel
-  Map *mask,              // OUT our selection bytemap (only one channel ie byte ie depth)
+  Map *mask,              // OUT our selection bytemap (only one channel ie byte ie depth), or NULL
   Pixelel default_mask_value  // IN default value for any created mask
   ) 
 {
    
-  /* Both OUT pixmaps same 2D dimensions.  Depth pixelel_count includes a mask byte. */
+  /* Depth pixelel_count includes a mask byte. */
   new_pixmap(pixmap, drawable->width, drawable->height, pixelel_count);
   
   /* Get color, alpha channels */
-  pixmap_from_drawable(*pixmap, drawable, 0,0, FIRST_PIXELEL_INDEX, drawable->bpp);  
-  fetch_mask(drawable, mask, default_mask_value); /* Get mask channel */
-  interleave_mask(pixmap, mask);  /* Insert mask byte into our Pixels */
+  pixmap_from_drawable(pixmap, drawable, FIRST_PIXELEL_INDEX, drawable->bpp);  
+  fetch_mask(drawable, pixmap, default_mask_value); /* Get mask channel, into our Pixels */
+  
+  /* Separate copy of the mask only if the caller wants it, e.g. to adapt to the SimpleAPI. */
+  if (mask)
+  {
+    guint i;
+    
+    new_bytemap(mask, drawable->width, drawable->height);
+    for (i=0; i < pixmap->width * pixmap->height; i++)
+      g_array_index(mask->data, Pixelel, i) =
+        g_array_index(pixmap->data, Pixelel, i*pixmap->depth + MASK_PIXELEL_INDEX);
+  }
 }
 
 
@@ -296,7 +354,7 @@ fetch_image_mask_map(
   GimpDrawable *image_drawable,     // IN image: target or corpus drawable
   Map          *pixmap,             // OUT our pixmap of drawable
   guint        pixelel_count,       // IN count channels in image + map
-  Map          *mask,               // OUT our selection bytemap (only one channel ie byte ie depth)
+  Map          *mask,               // OUT our selection bytemap (only one channel ie byte ie depth), or NULL
   Pixelel      default_mask_value,  // IN default value for any created mask
   GimpDrawable *map_drawable,       // IN map drawable, target or corpus
   guint        map_offset          // IN index in our Pixel to first map Pixelel
@@ -317,7 +375,7 @@ fetch_image_mask_map(
     guint pixelels_to_copy = map_drawable->bpp;
     if ( gimp_drawable_has_alpha(map_drawable->drawable_id) )
       pixelels_to_copy--;
-    pixmap_from_drawable(*pixmap, map_drawable, 0,0, map_offset, pixelels_to_copy);
+    pixmap_from_drawable(pixmap, map_drawable, map_offset, pixelels_to_copy);
   }
 }
 
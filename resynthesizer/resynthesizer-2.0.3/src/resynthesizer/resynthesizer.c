@@ -245,15 +245,45 @@ post_results_to_gimp(
   GimpDrawable *drawable,
   Map targetMap) 
 {
-  pixmap_to_drawable(targetMap, drawable, FIRST_PIXELEL_INDEX);   // our pixels to region
+  gint x, y;
+  guint width, height;
+  
+  /* 
+  Only the target (selected pixels) is synthesized: write back only its bounds.
+  Gimp then copies, merges and redraws only those tiles, not the whole drawable.
+  */
+  if ( ! target_bounds(&targetMap, &x, &y, &width, &height) )
+    return;
+  pixmap_to_drawable(&targetMap, drawable, x, y, width, height, FIRST_PIXELEL_INDEX);   // our pixels to region
   gimp_drawable_flush(drawable);    // regions back to core
   gimp_drawable_merge_shadow(drawable->drawable_id,TRUE);   // temp buffers merged
-  gimp_drawable_update(drawable->drawable_id,0,0,targetMap.width,targetMap.height);
+  gimp_drawable_update(drawable->drawable_id, x, y, width, height);
   gimp_displays_flush();
 }
 
 
 
+/*
+Prepare the corpus (see preparedCorpus.h) in another thread, while the main thread fetches the target from Gimp.
+Preparation uses only our corpus pixmap, no libgimp calls (libgimp is not thread safe.)
+*/
+typedef struct {
+  TImageSynthParameters *parameters;
+  TFormatIndices *indices;
+  Map *corpusMap;
+  gint key;
+} TPrepareCorpusArgs;
+
+static gpointer
+prepare_corpus_thread(gpointer data)
+{
+  TPrepareCorpusArgs *args = (TPrepareCorpusArgs *) data;
+  
+  return newPreparedCorpus(*args->parameters, args->indices, args->corpusMap, args->key);
+}
+
+
+
 static void
 detach_drawables(
   GimpDrawable * out,
@@ -307,8 +337,7 @@ static void run(
   */
   Map targetMap;
   Map corpusMap;
-  Map targetMaskMap;
-  Map corpusMaskMap;
+  TPreparedCorpus *preparedCorpus = NULL;
   
   int cancelFlag = 0;
   
@@ -470,27 +499,36 @@ static void run(
     
   #else
     g_printf("Gimp adaption\n");
+    adaptPluginToLibraryParameters(&pluginParameters, &engineParameters);
+    
+    /*  
+    Corpus adaption first, so the corpus can be prepared while the target is fetched.
+    Whether the corpus is prepared in this thread or another, results are the same.
+    */
+    fetch_image_mask_map(corpus_drawable, &corpusMap, formatIndices.total_bpp, 
+      NULL,
+      MASK_TOTALLY_SELECTED, 
+      map_in_drawable, formatIndices.map_start_bip);
+    
+    {
+    TPrepareCorpusArgs prepareArgs = {&engineParameters, &formatIndices, &corpusMap, corpus_drawable->drawable_id};
+    GThread *prepareThread = g_thread_try_new(NULL, prepare_corpus_thread, &prepareArgs, NULL);
+    
     /* target/context adaption */
     fetch_image_mask_map(drawable, &targetMap, formatIndices.total_bpp, 
-      &targetMaskMap, 
+      NULL, 
       MASK_TOTALLY_SELECTED, 
       map_out_drawable, formatIndices.map_start_bip);
     
       #ifdef ANIMATE
       clear_target_pixels(formatIndices.colorEndBip);  // For debugging, blacken so new colors sparkle
       #endif
-  
-    /*  corpus adaption */
-    fetch_image_mask_map(corpus_drawable, &corpusMap, formatIndices.total_bpp, 
-      &corpusMaskMap,
-      MASK_TOTALLY_SELECTED, 
-      map_in_drawable, formatIndices.map_start_bip);
-      
-    // TODO These are artifacts of earlier design, not used.
-    free_map(&corpusMaskMap);
-    free_map(&targetMaskMap);
     
-    adaptPluginToLibraryParameters(&pluginParameters, &engineParameters);
+    if (prepareThread)
+      preparedCorpus = (TPreparedCorpus *) g_thread_join(prepareThread);
+    else  // No thread, prepare in this one
+      preparedCorpus = prepare_corpus_thread(&prepareArgs);
+    }
     
   #endif
   
@@ -502,15 +540,21 @@ static void run(
   // Begin real work
   progressStart("synthesizing...");
   
-  int result = engine(
+  /* 
+  Without a prepared corpus (empty corpus, or ADAPT_SIMPLE), the same as engine(),
+  which also reports an empty corpus.
+  */
+  int result = engineWithPreparedCorpus(
     engineParameters, 
     &formatIndices, 
     &targetMap, 
     &corpusMap,
+    preparedCorpus,
     progressUpdate,
     (void *) 0,
     &cancelFlag
     );
+  freePreparedCorpus(preparedCorpus);
   
   if (result == IMAGE_SYNTH_ERROR_EMPTY_CORPUS)
   {
@@ -520,6 +564,10 @@ static void run(
   {
     ERROR_RETURN(_("The output layer is empty. Does any selection have visible pixels in the active layer?"));
   }
+  else if  (result == IMAGE_SYNTH_ERROR_CORPUS_TOO_LARGE )
+  {
+    ERROR_RETURN(_("The texture source is too large. Select a smaller part of it."));
+  }
   
   // Normal post-process adaption follows
 
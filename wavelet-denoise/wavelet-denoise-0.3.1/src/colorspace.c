@@ -15,270 +15,317 @@
 
 #include "plugin.h"
 
-void
-srgb2ycbcr (float ** fimg, int size)
+/* Rows of 8-bit pixels are converted to the planes of the colour model in
+ * one pass (row2model), and back in one pass (model2row). The arithmetic of
+ * each pixel is the one of the former conversions of whole planes, the
+ * power functions are replaced by tables giving the same values:
+ * - a byte to [0,1] and to linear, by its value
+ * - linear to sRGB and to a byte, by the least float of each byte
+ * - the cube root of Lab by Halley steps in double, the same float as
+ *   pow (x, 1 / 3.0) for all floats of the range */
+
+/* gamma_byte () starts from a table of the bits of the float above
+ * GAMMA_SHIFT, for floats below GAMMA_LIMIT (0x40000000 are its bits) */
+#define GAMMA_SHIFT 16
+#define GAMMA_LIMIT 2.0f
+
+static float unit[256];		/* byte / 255.0 */
+static float linear[256];	/* pow (byte / 255.0, 2.2) */
+static float gamma_bound[256];	/* least float of each byte, from 1 */
+static guchar gamma_start[0x40000000 >> GAMMA_SHIFT];
+
+/* float [0,1] to byte, as the values were clipped and rounded before */
+static inline guchar
+pack (float value)
 {
-  /* using JPEG conversion here - expecting all channels to be
-   * in [0:255] range */
-  int i;
-  float y, cb, cr;
+  value = CLIP (value * 255.0, 0, 255);
+  /* avoiding rounding errors !!! */
+  return (guchar) (value + 0.5);
+}
 
-  for (i = 0; i < size; i++) {
-    y =   0.2990 * fimg[0][i] + 0.5870 * fimg[1][i] + 0.1140 * fimg[2][i];
-    cb = -0.1687 * fimg[0][i] - 0.3313 * fimg[1][i] + 0.5000 * fimg[2][i]
-         + 0.5;
-    cr =  0.5000 * fimg[0][i] - 0.4187 * fimg[1][i] - 0.0813 * fimg[2][i]
-         + 0.5;
-    fimg[0][i] = y;
-    fimg[1][i] = cb;
-    fimg[2][i] = cr;
-  }
+/* gamma correction (approximate) of a linear value, to a byte */
+static guchar
+gamma_exact (float value)
+{
+  return pack (pow (value, 1.0 / 2.2));
 }
 
-void
-ycbcr2srgb (float **fimg, int size, int pc)
+static inline guchar
+gamma_byte (float value)
 {
-  /* using JPEG conversion here - expecting all channels to be
-   * in [0:255] range */
-  int i;
-  static float r, g, b;
-
-  if (pc > 3) { /* single channel, colour */
-    pc -= 4;
-    for (i = 0; i < size; i++) {
-      fimg[(pc + 1) % 3][i] = 0.5;
-      fimg[(pc + 2) % 3][i] = 0.5;
-    }
-  } else if (pc > 0) { /* single channel, gray */
-    pc -= 1;
-    for (i = 0; i < size; i++) {
-      fimg[(pc + 1) % 3][i] = fimg[pc][i];
-      fimg[(pc + 2) % 3][i] = fimg[pc][i];
-    }
-    return;
-  }
+  union
+  {
+    float f;
+    guint32 i;
+  } bits;
+  int k;
 
-  for (i = 0; i < size; i++) {
-    r = fimg[0][i] + 1.40200 * (fimg[2][i] - 0.5);
-    g = fimg[0][i] - 0.34414 * (fimg[1][i] - 0.5)
-        - 0.71414 * (fimg[2][i] - 0.5);
-    b = fimg[0][i] + 1.77200 * (fimg[1][i] - 0.5);
-    fimg[0][i] = r;
-    fimg[1][i] = g;
-    fimg[2][i] = b;
-  }
+  if (!(value > 0 && value < GAMMA_LIMIT))
+    return gamma_exact (value);
+  bits.f = value;
+  k = gamma_start[bits.i >> GAMMA_SHIFT];
+  while (k < 255 && value >= gamma_bound[k + 1])
+    k++;
+  return k;
 }
 
-void
-srgb2xyz (float **fimg, int size)
+/* pow (x, 1 / 3.0) for 216 / 24389.0 < x <= 4: a first guess from the bits
+ * of x, then two Halley steps */
+static inline float
+cube_root (float x)
 {
-  /* fimg in [0:1], sRGB */
-  int i;
-  float x, y, z;
-
-  for (i = 0; i < size; i++) {
-    /* scaling and gamma correction (approximate) */
-    fimg[0][i] = pow(fimg[0][i], 2.2);
-    fimg[1][i] = pow(fimg[1][i], 2.2);
-    fimg[2][i] = pow(fimg[2][i], 2.2);
- 
-
-    /* matrix RGB -> XYZ, with D65 reference white (www.brucelindbloom.com) */
-    x = 0.412424 * fimg[0][i] + 0.357579 * fimg[1][i] + 0.180464 * fimg[2][i];
-    y = 0.212656 * fimg[0][i] + 0.715158 * fimg[1][i] + 0.0721856 * fimg[2][i];
-    z = 0.0193324 * fimg[0][i] + 0.119193 * fimg[1][i] + 0.950444 * fimg[2][i];
-
-    /*
-    x = 0.412424 * fimg[0][i] + 0.212656 * fimg[1][i] + 0.0193324 * fimg[2][i];
-    y = 0.357579 * fimg[0][i] + 0.715158 * fimg[1][i] + 0.119193  * fimg[2][i];
-    z = 0.180464 * fimg[0][i] + 0.0721856 * fimg[1][i] + 0.950444 * fimg[2][i];
-    */
-
-    fimg[0][i] = x;
-    fimg[1][i] = y;
-    fimg[2][i] = z;
-  }
+  union
+  {
+    double d;
+    guint64 i;
+  } bits;
+  double y, y3;
+
+  if (x > 4)
+    return pow (x, 1 / 3.0);
+  bits.d = x;
+  bits.i = bits.i / 3 + G_GUINT64_CONSTANT (0x2a9f7893782da1ce);
+  y = bits.d;
+  y3 = y * y * y;
+  y = y * (y3 + 2 * x) / (2 * y3 + x);
+  y3 = y * y * y;
+  y = y * (y3 + 2 * x) / (2 * y3 + x);
+  return y;
 }
 
 void
-xyz2srgb (float **fimg, int size, int pc)
+colorspace_init (void)
 {
-  int i;
-  float r, g, b;
+  static gboolean ready = FALSE;
+  union
+  {
+    float f;
+    guint32 i;
+  } bits;
+  guint32 low, high, mid, i;
+  int k;
 
-  if (pc > 3) { /* single channel, colour */
-    pc -= 4;
-    for (i = 0; i < size; i++) {
-      fimg[(pc + 1) % 3][i] = 0.0;
-      fimg[(pc + 2) % 3][i] = 0.0;
-    }
-  } else if (pc > 0) { /* single channel, gray */
-    pc -= 1;
-    for (i = 0; i < size; i++) {
-      fimg[pc][i] = pow(fimg[pc][i], 1 / 2.2);
-      fimg[(pc + 1) % 3][i] = fimg[pc][i];
-      fimg[(pc + 2) % 3][i] = fimg[pc][i];
-    }
+  if (ready)
     return;
+  for (k = 0; k < 256; k++) {
+    unit[k] = k / 255.0;
+    linear[k] = pow (unit[k], 2.2);
   }
 
-  for (i = 0; i < size; i++) {
-    /* matrix RGB -> XYZ, with D65 reference white (www.brucelindbloom.com) */
-    r = 3.24071 * fimg[0][i] - 1.53726 * fimg[1][i] - 0.498571 * fimg[2][i];
-    g = -0.969258 * fimg[0][i] + 1.87599 * fimg[1][i] + 0.0415557 * fimg[2][i];
-    b = 0.0556352 * fimg[0][i] - 0.203996 * fimg[1][i] + 1.05707 * fimg[2][i];
-
-    /*
-    r =  3.24071  * fimg[0][i] - 0.969258  * fimg[1][i]
-      + 0.0556352 * fimg[2][i];
-    g = -1.53726  * fimg[0][i] + 1.87599   * fimg[1][i]
-      - 0.203996  * fimg[2][i];
-    b = -0.498571 * fimg[0][i] + 0.0415557 * fimg[1][i]
-      + 1.05707   * fimg[2][i];
-    */
-  
-    /* scaling and gamma correction (approximate) */
-    r = r < 0 ? 0 : pow(r, 1.0 / 2.2);
-    g = g < 0 ? 0 : pow(g, 1.0 / 2.2);
-    b = b < 0 ? 0 : pow(b, 1.0 / 2.2);
-  
-    fimg[0][i] = r;
-    fimg[1][i] = g;
-    fimg[2][i] = b;
+  /* bisect the bits of the positive floats for the least of each byte */
+  for (k = 1; k < 256; k++) {
+    bits.f = 0;
+    low = bits.i;
+    bits.f = GAMMA_LIMIT;
+    high = bits.i;
+    while (high - low > 1) {
+      mid = low + (high - low) / 2;
+      bits.i = mid;
+      if (gamma_exact (bits.f) >= k)
+	high = mid;
+      else
+	low = mid;
+    }
+    bits.i = high;
+    gamma_bound[k] = bits.f;
   }
+  for (i = 0, k = 0; i < G_N_ELEMENTS (gamma_start); i++) {
+    bits.i = i << GAMMA_SHIFT;
+    while (k < 255 && bits.f >= gamma_bound[k + 1])
+      k++;
+    gamma_start[i] = k;
+  }
+  ready = TRUE;
 }
 
-void lab2srgb (float **fimg, int size, int pc)
+static inline void
+srgb2ycbcr (float *p)
 {
-  int i;
-  float x, y, z;
-  float neutral [] = {0.5, 0.5, 0.5};
-
-  if (pc > 3) { /* single channel, colour */
-    pc -= 4;
-    for (i = 0; i < size; i++) {
-      fimg[(pc + 1) % 3][i] = neutral[(pc + 1) % 3];
-      fimg[(pc + 2) % 3][i] = neutral[(pc + 2) % 3];
-    }
-  } else if (pc > 0) { /* single channel, gray */
-    pc -= 1;
-    for (i = 0; i < size; i++) {
-      fimg[pc][i] = pow(fimg[pc][i], 1 / 2.2);
-      fimg[(pc + 1) % 3][i] = fimg[pc][i];
-      fimg[(pc + 2) % 3][i] = fimg[pc][i];
-    }
-    return;
-  }
+  /* using JPEG conversion here - expecting all channels to be
+   * in [0:255] range */
+  float y, cb, cr;
 
-  for (i = 0; i < size; i++) {
-    /* convert back to normal LAB */
-    fimg[0][i] = (fimg[0][i] - 0 * 16 * 27 / 24389.0) * 116;
-    fimg[1][i] = (fimg[1][i] - 0.5) * 500 * 2;
-    fimg[2][i] = (fimg[2][i] - 0.5) * 200 * 2.2;
+  y =   0.2990 * p[0] + 0.5870 * p[1] + 0.1140 * p[2];
+  cb = -0.1687 * p[0] - 0.3313 * p[1] + 0.5000 * p[2] + 0.5;
+  cr =  0.5000 * p[0] - 0.4187 * p[1] - 0.0813 * p[2] + 0.5;
+  p[0] = y;
+  p[1] = cb;
+  p[2] = cr;
+}
 
-    /* matrix */
-    y = (fimg[0][i] + 16) / 116;
-    z = y - fimg[2][i] / 200.0;
-    x = fimg[1][i] / 500.0 + y;
+static inline void
+ycbcr2srgb (float *p)
+{
+  /* using JPEG conversion here - expecting all channels to be
+   * in [0:255] range */
+  float r, g, b;
 
-    /* scale */
-    if (x * x * x > 216 / 24389.0)
-      x = x * x * x;
-    else
-      x = (116 * x - 16) * 27 / 24389.0;
-    if (fimg[0][i] > 216 / 27.0)
-      y = y * y * y;
-    else
-      //y = fimg[0][i] * 27 / 24389.0;
-      y = (116 * y - 16) * 27 / 24389.0;
-    if (z * z * z > 216 / 24389.0)
-      z = z * z * z;
-    else
-      z = (116 * z - 16) * 27 / 24389.0;
+  r = p[0] + 1.40200 * (p[2] - 0.5);
+  g = p[0] - 0.34414 * (p[1] - 0.5) - 0.71414 * (p[2] - 0.5);
+  b = p[0] + 1.77200 * (p[1] - 0.5);
+  p[0] = r;
+  p[1] = g;
+  p[2] = b;
+}
+
+/* from the bytes of an sRGB pixel */
+static inline void
+srgb2lab (float *p, const guchar *pixel)
+{
+  float x, y, z, l, a, b;
+  int c;
+
+  /* scaling and gamma correction (approximate) */
+  p[0] = linear[pixel[0]];
+  p[1] = linear[pixel[1]];
+  p[2] = linear[pixel[2]];
 
-    /* white reference */
-    fimg[0][i] = x * 0.95047;
-    fimg[1][i] = y;
-    fimg[2][i] = z * 1.08883;
+  /* matrix RGB -> XYZ, with D65 reference white (www.brucelindbloom.com) */
+  x = 0.412424 * p[0] + 0.357579 * p[1] + 0.180464 * p[2];
+  y = 0.212656 * p[0] + 0.715158 * p[1] + 0.0721856 * p[2];
+  z = 0.0193324 * p[0] + 0.119193 * p[1] + 0.950444 * p[2];
+
+  /* reference white */
+  p[0] = x / 0.95047;
+  p[1] = y;
+  p[2] = z / 1.08883;
+
+  /* scale */
+  for (c = 0; c < 3; c++) {
+    if (p[c] > 216 / 24389.0)
+      p[c] = cube_root (p[c]);
+    else
+      p[c] = (24389 * p[c] / 27.0 + 16) / 116.0;
   }
-  xyz2srgb(fimg, size, 0);
+
+  l = 116 * p[1] - 16;
+  a = 500 * (p[0] - p[1]);
+  b = 200 * (p[1] - p[2]);
+  p[0] = l / 116.0; // + 16 * 27 / 24389.0;
+  p[1] = a / 500.0 / 2.0 + 0.5;
+  p[2] = b / 200.0 / 2.2 + 0.5;
+  if (p[0] < 0)
+    p[0] = 0;
 }
 
-void srgb2lab (float **fimg, int size)
+/* to the bytes of an sRGB pixel */
+static inline void
+lab2srgb (guchar *pixel, float *p)
 {
-  int i;
-  float l, a, b;
-  srgb2xyz(fimg, size);
-  for (i = 0; i < size; i++) {
-    /* reference white */
-    fimg[0][i] /= 0.95047;
-    /* (just for completeness)
-    fimg[1][i] /= 1.00000; */
-    fimg[2][i] /= 1.08883;
-
-    /* scale */
-    if (fimg[0][i] > 216 / 24389.0) {
-      fimg[0][i] = pow(fimg[0][i], 1 / 3.0);
-    } else {
-      fimg[0][i] = (24389 * fimg[0][i] / 27.0 + 16) / 116.0;
-    }
-    if (fimg[1][i] > 216 / 24389.0) {
-      fimg[1][i] = pow(fimg[1][i], 1 / 3.0);
-    } else {
-      fimg[1][i] = (24389 * fimg[1][i] / 27.0 + 16) / 116.0;
-    }
-    if (fimg[2][i] > 216 / 24389.0) {
-      fimg[2][i] = pow(fimg[2][i], 1 / 3.0);
-    } else {
-      fimg[2][i] = (24389 * fimg[2][i] / 27.0 + 16) / 116.0;
-    }
+  float x, y, z, r, g, b;
 
-    l = 116 * fimg[1][i] - 16;
-    a = 500 * (fimg[0][i] - fimg[1][i]);
-    b = 200 * (fimg[1][i] - fimg[2][i]);
-    fimg[0][i] = l / 116.0; // + 16 * 27 / 24389.0;
-    fimg[1][i] = a / 500.0 / 2.0 + 0.5;
-    fimg[2][i] = b / 200.0 / 2.2 + 0.5;
-    if (fimg[0][i] < 0)
-      fimg[0][i] = 0;
-  }
+  /* convert back to normal LAB */
+  p[0] = (p[0] - 0 * 16 * 27 / 24389.0) * 116;
+  p[1] = (p[1] - 0.5) * 500 * 2;
+  p[2] = (p[2] - 0.5) * 200 * 2.2;
+
+  /* matrix */
+  y = (p[0] + 16) / 116;
+  z = y - p[2] / 200.0;
+  x = p[1] / 500.0 + y;
+
+  /* scale */
+  if (x * x * x > 216 / 24389.0)
+    x = x * x * x;
+  else
+    x = (116 * x - 16) * 27 / 24389.0;
+  if (p[0] > 216 / 27.0)
+    y = y * y * y;
+  else
+    //y = p[0] * 27 / 24389.0;
+    y = (116 * y - 16) * 27 / 24389.0;
+  if (z * z * z > 216 / 24389.0)
+    z = z * z * z;
+  else
+    z = (116 * z - 16) * 27 / 24389.0;
+
+  /* white reference */
+  p[0] = x * 0.95047;
+  p[1] = y;
+  p[2] = z * 1.08883;
+
+  /* matrix XYZ -> RGB, with D65 reference white (www.brucelindbloom.com) */
+  r = 3.24071 * p[0] - 1.53726 * p[1] - 0.498571 * p[2];
+  g = -0.969258 * p[0] + 1.87599 * p[1] + 0.0415557 * p[2];
+  b = 0.0556352 * p[0] - 0.203996 * p[1] + 1.05707 * p[2];
+
+  /* scaling and gamma correction (approximate) */
+  pixel[0] = r < 0 ? 0 : gamma_byte (r);
+  pixel[1] = g < 0 ? 0 : gamma_byte (g);
+  pixel[2] = b < 0 ? 0 : gamma_byte (b);
 }
 
-void srgb2rgb(float **fimg, int size)
+/* a row of bytes of an sRGB (or gray) image to rows of the planes fimg of
+ * the colour model */
+void
+row2model (float **fimg, const guchar *line, int width, int channels,
+	   int mode)
 {
-  /*int i;
-  for (i = 0; i < size; i++)
-    {
-      fimg[0][i] = pow(fimg[0][i], 1.1);
-      fimg[0][i] = pow(fimg[1][i], 1.1);
-      fimg[0][i] = pow(fimg[2][i], 1.1);
-    }*/
+  const guchar *pixel;
+  float p[3];
+  int x, c;
+
+  for (x = 0; x < width; x++) {
+    pixel = line + x * channels;
+    for (c = 0; c < channels; c++)
+      fimg[c][x] = unit[pixel[c]];
+    if (channels < 3 || mode == MODE_RGB)
+      continue;
+    if (mode == MODE_YCBCR) {
+      p[0] = fimg[0][x];
+      p[1] = fimg[1][x];
+      p[2] = fimg[2][x];
+      srgb2ycbcr (p);
+    } else if (mode == MODE_LAB) {
+      srgb2lab (p, pixel);
+    } else
+      continue;
+    fimg[0][x] = p[0];
+    fimg[1][x] = p[1];
+    fimg[2][x] = p[2];
+  }
 }
 
+/* rows of the planes fimg of the colour model back to a row of bytes of
+ * sRGB, clipped. The preview shows a single channel as gray (pc 1 to 3) or
+ * with the other channels neutral (pc 4 to 6). */
 void
-rgb2srgb (float **fimg, int size, int pc)
+model2row (guchar *line, float **fimg, int width, int channels, int mode,
+	   int pc)
 {
-  int i;
+  guchar *pixel;
+  float p[3], neutral;
+  int x, c;
 
-  if (pc > 3) { /* single channel, colour */
-    pc -= 4;
-    for (i = 0; i < size; i++) {
-      fimg[(pc + 1) % 3][i] = 0.0;
-      fimg[(pc + 2) % 3][i] = 0.0;
+  neutral = mode == MODE_RGB ? 0.0 : 0.5;
+  for (x = 0; x < width; x++) {
+    pixel = line + x * channels;
+    for (c = 0; c < channels; c++)
+      pixel[c] = pack (fimg[c][x]);
+    if (channels < 3)
+      continue;
+
+    if (pc > 0 && pc < 4) { /* single channel, gray */
+      if (mode == MODE_LAB)
+	pixel[pc - 1] = gamma_byte (fimg[pc - 1][x]);
+      pixel[pc % 3] = pixel[(pc + 1) % 3] = pixel[pc - 1];
+      continue;
     }
-  } else if (pc > 0) { /* single channel, gray */
-    pc -= 1;
-    for (i = 0; i < size; i++) {
-      /* fimg[pc][i] = pow(fimg[pc][i], 1 / 1.1); */
-      fimg[(pc + 1) % 3][i] = fimg[pc][i];
-      fimg[(pc + 2) % 3][i] = fimg[pc][i];
+    p[0] = fimg[0][x];
+    p[1] = fimg[1][x];
+    p[2] = fimg[2][x];
+    if (pc > 3) { /* single channel, colour */
+      p[(pc - 3) % 3] = neutral;
+      p[(pc - 2) % 3] = neutral;
     }
-    return;
+    if (mode == MODE_YCBCR) {
+      ycbcr2srgb (p);
+    } else if (mode == MODE_LAB) {
+      lab2srgb (pixel, p);
+      continue;
+    }
+    pixel[0] = pack (p[0]);
+    pixel[1] = pack (p[1]);
+    pixel[2] = pack (p[2]);
   }
-
-  /*for (i = 0; i < size; i++) {
-    fimg[0][i] = pow(fimg[0][i], 1 / 1.1);
-    fimg[1][i] = pow(fimg[1][i], 1 / 1.1);
-    fimg[2][i] = pow(fimg[2][i], 1 / 1.1);
-  }*/
 }
@@ -14,15 +14,106 @@
  */
 
 #include "plugin.h"
+#include <string.h>
+
+/* The channels to denoise, taken in turn by the channel threads. The
+ * channels are independent after the colour model conversion, so they are
+ * denoised at the same time, each with its own scratch planes. Progress of
+ * all threads is one counter of rows, see denoise(). */
+typedef struct
+{
+  gint next;			/* index of the next channel to take */
+  gint count;
+  gint channel[4];
+  float threshold[4];
+  double low[4];
+  wavelet_stats stats[4];	/* noise of each channel, of all strips */
+  gboolean statistics;		/* only sum the noise of the strip */
+  gboolean tiled;		/* denoise with the noise of all strips */
+  unsigned int width, height;	/* of the planes */
+  unsigned int first, rows;	/* of the strip in the planes */
+  int threads;			/* threads of each wavelet_denoise () */
+  gint progress;		/* rows done, of all stages */
+  gint running;			/* channel threads not yet done */
+  GMutex lock;			/* guards running, for done */
+  GCond done;			/* signalled when a channel thread ends */
+} channel_queue;
+
+typedef struct
+{
+  channel_queue *queue;
+  float *buffer[3];		/* the channel, then two scratch planes */
+} channel_worker;
+
+static gpointer
+denoise_channels (gpointer data)
+{
+  channel_worker *worker = data;
+  channel_queue *queue = worker->queue;
+  gint i;
+
+  while ((i = g_atomic_int_add (&queue->next, 1)) < queue->count)
+    {
+      worker->buffer[0] = fimg[queue->channel[i]];
+      if (queue->statistics)
+	wavelet_statistics (worker->buffer, queue->width, queue->height,
+			    queue->first, queue->rows, &queue->stats[i],
+			    queue->threads, &queue->progress);
+      else
+	wavelet_denoise (worker->buffer, queue->width, queue->height,
+			 queue->threshold[i], queue->low[i],
+			 queue->tiled ? &queue->stats[i] : NULL,
+			 queue->threads, &queue->progress);
+    }
+  g_mutex_lock (&queue->lock);
+  queue->running--;
+  g_cond_signal (&queue->done);
+  g_mutex_unlock (&queue->lock);
+  return NULL;
+}
+
+/* denoise the channels of the planes, as many at a time as there are
+ * workers (each with its own scratch planes), sharing the processors among
+ * them */
+static void
+run_channels (channel_queue * queue, channel_worker * worker, int workers,
+	      GimpPreview * preview, double total)
+{
+  GThread *thread[4];
+  int i;
+
+  queue->next = 0;
+  queue->running = workers;
+  for (i = 0; i < workers; i++)
+    thread[i] = g_thread_new (NULL, denoise_channels, &worker[i]);
+  /* GIMP is only called from this thread: update the progress bar 20 times
+   * a second until the last channel thread is done */
+  g_mutex_lock (&queue->lock);
+  while (queue->running > 0)
+    {
+      if (!preview)
+	gimp_progress_update (g_atomic_int_get (&queue->progress) / total);
+      g_cond_wait_until (&queue->done, &queue->lock,
+			 g_get_monotonic_time () + G_USEC_PER_SEC / 20);
+    }
+  g_mutex_unlock (&queue->lock);
+  for (i = 0; i < workers; i++)
+    g_thread_join (thread[i]);
+}
 
 void
 denoise (GimpDrawable * drawable, GimpPreview * preview)
 {
   GimpPixelRgn rgn_in, rgn_out;
   gint i, x1, y1, x2, y2, width, height, x, c;
+  gint y, rows, top, bottom, strip, planes, pass, passes, pc;
   guchar *line;
-  float times[3], totaltime;
-  int channels_denoised;
+  float *row[4];
+  double total, read;
+  channel_queue queue;
+  channel_worker worker[4];
+  int workers, processors;
+  gint64 plane_bytes;
 
   if (preview)
     {
@@ -46,158 +137,160 @@ denoise (GimpDrawable * drawable, GimpPreview * preview)
   /* cache some tiles to make reading/writing faster */
   gimp_tile_cache_ntiles (drawable->width / gimp_tile_width () + 1);
 
-  totaltime = settings.times[0];
-  totaltime += settings.times[2];
-  for (i = 0; i < channels; i++)
-    {
-      if (channels > 2 && settings.colour_thresholds[i] > 0)
-	totaltime += settings.times[1];
-      else if (channels < 3 && settings.gray_thresholds[i] > 0)
-	totaltime += settings.times[1];
-    }
-
-  /* FIXME: replace by GIMP functions */
-  line = (guchar *) malloc (channels * width * sizeof (guchar));
-
-  /* read the full image from GIMP */
-  if (!preview)
-    /* TRANSLATORS: This is the message displayed while denoising is in
-       progress */
-    gimp_progress_init (_("Wavelet denoising..."));
-  times[0] = g_timer_elapsed (timer, NULL);
-  for (i = 0; i < y2 - y1; i++)
-    {
-      if (!preview && i % 10 == 0)
-	gimp_progress_update (settings.times[0] * i
-			      / (double) height / totaltime);
-      gimp_pixel_rgn_get_row (&rgn_in, line, x1, i + y1, width);
-
-      /* convert pixel values to float [0,1] */
-      for (c = 0; c < channels; c++)
-	{
-	  for (x = 0; x < width; x++)
-	    fimg[c][i * width + x] = line[x * channels + c] / 255.0;
-	}
-    }
-  times[0] = g_timer_elapsed (timer, NULL) - times[0];
-
-  /* do colour model conversion sRGB[0,1] -> whatever */
-  if (channels > 2) {
-    if (settings.colour_mode == MODE_YCBCR) {
-      srgb2ycbcr(fimg, width * height);
-    } else if (settings.colour_mode == MODE_LAB) {
-      srgb2lab(fimg, width * height);
-    } else if (settings.colour_mode == MODE_RGB) {
-      srgb2rgb(fimg, width * height);
-    }
-  }
-
-  /* denoise the channels individually */
-  times[1] = g_timer_elapsed (timer, NULL);
-  /* FIXME: variable abuse (x) */
-  channels_denoised = 0;
+  /* the channels to denoise */
+  queue.next = 0;
+  queue.count = 0;
   for (c = 0; c < channels; c++)
     {
-      double a, b;
       /* in preview mode only process the displayed channel */
       if (preview && settings.preview_mode > 0 &&
 	  settings.preview_channel != c)
 	continue;
-      buffer[0] = fimg[c];
-      b = preview ? 0.0 : settings.times[1] / totaltime;
-      a = settings.times[0] + channels_denoised * settings.times[1];
-      a /= totaltime;
       if (channels > 2 && settings.colour_thresholds[c] > 0)
 	{
-	  wavelet_denoise (buffer, width, height, (float)
-			   settings.colour_thresholds[c],
-			   settings.colour_low[c], a, b);
-	  channels_denoised++;
+	  queue.threshold[queue.count] = settings.colour_thresholds[c];
+	  queue.low[queue.count] = settings.colour_low[c];
+	  queue.channel[queue.count++] = c;
 	}
       if (channels < 3 && settings.gray_thresholds[c] > 0)
 	{
-	  wavelet_denoise (buffer, width, height, (float)
-			   settings.gray_thresholds[c], settings.gray_low[c],
-			   a, b);
-	  channels_denoised++;
+	  queue.threshold[queue.count] = settings.gray_thresholds[c];
+	  queue.low[queue.count] = settings.gray_low[c];
+	  queue.channel[queue.count++] = c;
 	}
     }
-  times[1] = g_timer_elapsed (timer, NULL) - times[1];
-  times[1] /= channels_denoised;
-
-  /* retransform the image data */
-  if (channels > 2) {
-    int pc = 0;
-    if (preview && settings.preview_mode == 1)
-      pc = settings.preview_channel + 1;
-    else if (preview && settings.preview_mode == 2)
-      pc = settings.preview_channel + 4;
-
-    if (settings.colour_mode == MODE_YCBCR) {
-      ycbcr2srgb(fimg, width * height, pc);
-    } else if (settings.colour_mode == MODE_LAB) {
-      lab2srgb(fimg, width * height, pc);
-    } else if (settings.colour_mode == MODE_RGB) {
-      rgb2srgb(fimg, width * height, pc);
-    }
-  }
+  memset (queue.stats, 0, sizeof (queue.stats));
+  queue.progress = 0;
 
-  /* if alpha channel preview */
-  if (preview && channels % 2 == 0 && settings.preview_channel == channels - 1 && settings.preview_mode != 0)
-    for (c = 0; c < channels - 1; c++) {
-      for (i = 0; i < width * height; i++) {
-        fimg[c][i] = fimg[channels - 1][i];
-      }
-    }
+  /* as many channels at a time as there are processors, the processors
+   * left over shared by the transform of each */
+  processors = MAX2 (g_get_num_processors (), 1);
+  workers = MIN2 (queue.count, processors);
+  queue.threads = MAX2 (processors / MAX2 (workers, 1), 1);
 
-  /* set alpha to full opacity in preview mode */
-  if (preview && channels % 2 == 0 && !(settings.preview_channel == channels - 1 && settings.preview_mode == 0))
-    for (i = 0; i < width * height; i++)
-      fimg[channels - 1][i] = 1.0;
+  /* An image too large for its planes in TILE_MEMORY is done in strips of
+   * rows, with TILE_APRON rows around each so that the rows of the strip
+   * are transformed as in the full image. The noise is then estimated from
+   * all strips in a first pass, summed in the order of the full image, so
+   * the result is the same. Strips cost that pass, so any image that fits
+   * is done in one piece. The preview is small, and writes over the rows
+   * it reads, so it is done in one strip. */
+  plane_bytes = (gint64) width * sizeof (float) * (channels + 2 * workers);
+  strip = height;
+  if (!preview && plane_bytes * height > TILE_MEMORY)
+    strip = MAX2 (TILE_MEMORY / plane_bytes - 2 * TILE_APRON, TILE_APRON);
+  passes = (strip < height && queue.count > 0) ? 2 : 1;
+  if (passes == 1)
+    strip = height;
+  planes = MIN2 (strip + 2 * TILE_APRON, height);
+  queue.width = width;
+  queue.tiled = passes == 2;
 
-  /* clip the values */
+  /* Progress is counted in rows: reading and WAVELET_STEPS passes over each
+   * channel to denoise (and WAVELET_STATISTICS_STEPS for the first pass),
+   * counting the rows around the strips, and writing. */
+  read = 0;
+  for (y = 0; y < height; y += strip)
+    read += MIN2 (y + strip + TILE_APRON, height) - MAX2 (y - TILE_APRON, 0);
+  total = read * (1 + WAVELET_STEPS * queue.count) + height;
+  if (passes == 2)
+    total += read * (1 + WAVELET_STATISTICS_STEPS * queue.count);
+
+  /* FIXME: replace by GIMP functions */
+  line = (guchar *) malloc (channels * width * sizeof (guchar));
   for (c = 0; c < channels; c++)
-    {
-      for (i = 0; i < width * height; i++)
-	{
-	  fimg[c][i] = CLIP (fimg[c][i] * 255.0, 0, 255);
-	}
-    }
+    fimg[c] = (float *) malloc (width * planes * sizeof (float));
 
-  /* write the image back to GIMP */
-  times[2] = g_timer_elapsed (timer, NULL);
-  for (i = 0; i < height; i++)
+  g_mutex_init (&queue.lock);
+  g_cond_init (&queue.done);
+  for (i = 0; i < workers; i++)
     {
-      if (!preview)
-	gimp_progress_update ((settings.times[0] + channels_denoised
-			       * settings.times[1] + settings.times[2]
-			       * i / (double) height) / totaltime);
-
-      /* scale and convert back to guchar */
-      for (c = 0; c < channels; c++)
-	{
-	  for (x = 0; x < width; x++)
-	    {
-	      /* avoiding rounding errors !!! */
-	      line[x * channels + c] =
-		(guchar) (fimg[c][i * width + x] + 0.5);
-	    }
-	}
-      gimp_pixel_rgn_set_row (&rgn_out, line, x1, i + y1, width);
+      /* FIXME: replace by GIMP functions */
+      worker[i].queue = &queue;
+      worker[i].buffer[1] = (float *) malloc (width * planes * sizeof (float));
+      worker[i].buffer[2] = (float *) malloc (width * planes * sizeof (float));
     }
-  times[2] = g_timer_elapsed (timer, NULL) - times[2];
+
+  /* the channel shown by the preview, as gray (pc 1 to 3) or in colour (pc
+   * 4 to 6) */
+  pc = 0;
+  if (preview && settings.preview_mode == 1)
+    pc = settings.preview_channel + 1;
+  else if (preview && settings.preview_mode == 2)
+    pc = settings.preview_channel + 4;
+  colorspace_init ();
 
   if (!preview)
-    {
-      settings.times[0] = times[0];
-      if (channels_denoised > 0)
-	settings.times[1] = times[1];
-      settings.times[2] = times[2];
-      g_print("%f, %f, %f\n", times[0], times[1], times[2]);
-    }
+    /* TRANSLATORS: This is the message displayed while denoising is in
+       progress */
+    gimp_progress_init (_("Wavelet denoising..."));
+
+  for (pass = 2 - passes; pass < 2; pass++)
+    for (y = 0; y < height; y += strip)
+      {
+	rows = MIN2 (strip, height - y);
+	top = MAX2 (y - TILE_APRON, 0);
+	bottom = MIN2 (y + rows + TILE_APRON, height);
+
+	/* read the strip from GIMP, converting to float [0,1] and to the
+	 * colour model row by row */
+	for (i = 0; i < bottom - top; i++)
+	  {
+	    if (!preview && queue.progress % 10 == 0)
+	      gimp_progress_update (queue.progress / total);
+	    gimp_pixel_rgn_get_row (&rgn_in, line, x1, top + i + y1, width);
+	    for (c = 0; c < channels; c++)
+	      row[c] = fimg[c] + i * width;
+	    row2model (row, line, width, channels, settings.colour_mode);
+	    queue.progress++;
+	  }
+
+	/* the first pass only sums the noise of the rows of the strip */
+	queue.statistics = pass == 0;
+	queue.height = bottom - top;
+	queue.first = y - top;
+	queue.rows = rows;
+	run_channels (&queue, worker, workers, preview, total);
+	if (pass == 0)
+	  continue;
+
+	/* write the rows of the strip back to GIMP, without the rows around
+	 * it, converting back to sRGB and to guchar row by row */
+	for (i = 0; i < rows; i++)
+	  {
+	    if (!preview && queue.progress % 10 == 0)
+	      gimp_progress_update (queue.progress / total);
+	    for (c = 0; c < channels; c++)
+	      row[c] = fimg[c] + (y - top + i) * width;
+	    model2row (line, row, width, channels, settings.colour_mode, pc);
+
+	    /* if alpha channel preview */
+	    if (preview && channels % 2 == 0 && settings.preview_channel == channels - 1 && settings.preview_mode != 0)
+	      for (x = 0; x < width; x++)
+		for (c = 0; c < channels - 1; c++)
+		  line[x * channels + c] = line[x * channels + channels - 1];
+
+	    /* set alpha to full opacity in preview mode */
+	    if (preview && channels % 2 == 0 && !(settings.preview_channel == channels - 1 && settings.preview_mode == 0))
+	      for (x = 0; x < width; x++)
+		line[x * channels + channels - 1] = 255;
+
+	    gimp_pixel_rgn_set_row (&rgn_out, line, x1, y + i + y1, width);
+	    queue.progress++;
+	  }
+      }
 
   /* FIXME: replace by gimp functions */
+  for (i = 0; i < workers; i++)
+    {
+      free (worker[i].buffer[1]);
+      free (worker[i].buffer[2]);
+    }
+  for (c = 0; c < channels; c++)
+    free (fimg[c]);
   free (line);
+  g_mutex_clear (&queue.lock);
+  g_cond_clear (&queue.done);
 
   if (preview)
     {
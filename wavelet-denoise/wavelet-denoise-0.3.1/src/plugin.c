@@ -72,14 +72,11 @@ run (const gchar * name, gint nparams, const GimpParam * param,
   static GimpParam values[1];
   GimpRunMode run_mode;
   GimpDrawable *drawable;
-  gint i;
 
   bindtextdomain("gimp20-wavelet-denoise-plug-in", LOCALEDIR);
   textdomain("gimp20-wavelet-denoise-plug-in");
   bind_textdomain_codeset("gimp20-wavelet-denoise-plug-in", "UTF-8");
 
-  timer = g_timer_new ();
-
   /* Setting mandatory output values */
   *nreturn_vals = 1;
   *return_vals = values;
@@ -95,18 +92,6 @@ run (const gchar * name, gint nparams, const GimpParam * param,
   if (settings.preview_channel > channels - 1)
     settings.preview_channel = 0;
 
-  /* allocate buffers */
-  /* FIXME: replace by GIMP funcitons */
-  for (i = 0; i < channels; i++)
-    {
-      fimg[i] = (float *) malloc (drawable->width * drawable->height
-				  * sizeof (float));
-    }
-  buffer[1] = (float *) malloc (drawable->width * drawable->height
-				* sizeof (float));
-  buffer[2] = (float *) malloc (drawable->width * drawable->height
-				* sizeof (float));
-
   /* run GUI if in interactiv mode */
   run_mode = param[0].data.d_int32;
   if (run_mode == GIMP_RUN_INTERACTIVE)
@@ -121,15 +106,6 @@ run (const gchar * name, gint nparams, const GimpParam * param,
 
   denoise (drawable, NULL);
 
-  /* free buffers */
-  /* FIXME: replace by GIMP functions */
-  for (i = 0; i < channels; i++)
-    {
-      free (fimg[i]);
-    }
-  free (buffer[1]);
-  free (buffer[2]);
-
   gimp_displays_flush ();
   gimp_drawable_detach (drawable);
 
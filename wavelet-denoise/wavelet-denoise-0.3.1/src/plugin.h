@@ -34,6 +34,20 @@
 #define MIN2(x,y) ((x) < (y) ? (x) : (y))
 #define CLIP(x,min,max) MAX2((min), MIN2((x), (max)))
 
+/* most threads used for one transform */
+#define MAX_THREADS 64
+/* passes over the rows of a plane counted as progress by wavelet_denoise ()
+ * and wavelet_statistics () */
+#define WAVELET_STEPS 20
+#define WAVELET_STATISTICS_STEPS 15
+
+/* Images whose float planes (of each channel and of each worker) would
+ * take more than TILE_MEMORY bytes are denoised in strips of rows that fit
+ * in it, with TILE_APRON rows above and below: the five levels of the
+ * transform reach 1 + 2 + 4 + 8 + 16 = 31 rows away. */
+#define TILE_MEMORY ((gint64) 1 << 30)
+#define TILE_APRON 32
+
 #define TIMER_READ (1.0 / 10)
 #define TIMER_WRITE (1.0 / 7)
 #define TIMER_PROCESS (1.0 - TIMER_READ - TIMER_WRITE)
@@ -42,12 +56,25 @@
 #define MODE_RGB 1
 #define MODE_LAB 2
 
+/* noise of the small wavelet coefficients of each level, in each band of
+ * intensity */
+typedef struct
+{
+  double sum[5][5];		/* of squares, [level][band] */
+  unsigned int samples[5][5];
+} wavelet_stats;
+
 void query (void);
 void run (const gchar * name, gint nparams, const GimpParam * param,
 		 gint * nreturn_vals, GimpParam ** return_vals);
 void wavelet_denoise (float *fimg[3], unsigned int width,
 			     unsigned int height, float threshold, double low,
-			     float a, float b);
+			     const wavelet_stats * stats, int max_threads,
+			     gint * progress);
+void wavelet_statistics (float *fimg[3], unsigned int width,
+			 unsigned int height, unsigned int first,
+			 unsigned int rows, wavelet_stats * stats,
+			 int max_threads, gint * progress);
 void denoise (GimpDrawable * drawable, GimpPreview * preview);
 void set_rgb_mode (GtkWidget * w, gpointer data);
 void set_lab_mode (GtkWidget * w, gpointer data);
@@ -61,14 +88,11 @@ void reset_channel (GtkWidget * w, gpointer data);
 void reset_all (GtkWidget * w, gpointer data);
 void temporarily_reset (GtkWidget * w, gpointer data);
 
-void srgb2rgb (float **fimg, int size);
-void rgb2srgb (float **fimg, int size, int pc);
-void srgb2ycbcr (float **fimg, int size);
-void ycbcr2srgb (float **fimg, int size, int pc);
-void srgb2lab (float **fimg, int size);
-void lab2srgb (float **fimg, int size, int pc);
-void srgb2xyz (float **fimg, int size);
-void xyz2srgb (float **fimg, int size, int pc);
+void colorspace_init (void);
+void row2model (float **fimg, const guchar * line, int width, int channels,
+		int mode);
+void model2row (guchar * line, float **fimg, int width, int channels,
+		int mode, int pc);
 
 extern GimpPlugInInfo PLUG_IN_INFO;
 
@@ -82,7 +106,7 @@ typedef struct
   gint preview_channel;
   gboolean preview_mode;
   gboolean preview;
-  float times[3];
+  float times[3];		/* unused, kept for the layout of saved settings */
   gint winxsize, winysize;
 } wavelet_settings;
 
@@ -94,9 +118,6 @@ extern char *names_gray[];
 extern char *names_lab[];
 
 float *fimg[4];
-float *buffer[3];
 gint channels;
 
-GTimer *timer;
-
 #endif /* __PLUGIN_H__ */
@@ -16,135 +16,548 @@
  */
 
 #include "plugin.h"
+#include <string.h>
 
-/* code copied from UFRaw (which originates from dcraw) */
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+/* number of columns transformed at once in the column pass: one cache line
+ * of floats, so every row touched is read as a whole line */
+#define COLUMN_BLOCK 16
+
+/* The hat transform of UFRaw (from dcraw) is
+ *   temp[i] = 2 * base[i] + base[i - sc] + base[i + sc]
+ * mirrored at the borders, then scaled by 0.25. Here it is split into the
+ * index of the two neighbours of i (mirrored as in the original) and a
+ * kernel over many lines at once. The sums are done in the same order and
+ * in float, and the scaling by 0.25 is exact, so the results are the same
+ * bit for bit. */
+static inline unsigned int
+hat_low (unsigned int i, unsigned int sc)
+{
+  return i < sc ? sc - i : i - sc;
+}
+
+static inline unsigned int
+hat_high (unsigned int i, unsigned int size, unsigned int sc)
+{
+  return (i < sc || i + sc < size) ? i + sc : 2 * size - 2 - (i + sc);
+}
+
+/* out[j] = (2 * mid[j] + low[j] + high[j]) * 0.25 for j < n */
 static void
-hat_transform (float *temp, float *base, int st, int size, int sc)
+hat_kernel (float *out, const float *mid, const float *low,
+	    const float *high, unsigned int n)
 {
-  int i;
-  for (i = 0; i < sc; i++)
-    temp[i] = 2 * base[st * i] + base[st * (sc - i)] + base[st * (i + sc)];
-  for (; i + sc < size; i++)
-    temp[i] = 2 * base[st * i] + base[st * (i - sc)] + base[st * (i + sc)];
-  for (; i < size; i++)
-    temp[i] = 2 * base[st * i] + base[st * (i - sc)]
-      + base[st * (2 * size - 2 - (i + sc))];
+  unsigned int j = 0;
+#if defined(__AVX__)
+  const __m256 two8 = _mm256_set1_ps (2.0f), quarter8 = _mm256_set1_ps (0.25f);
+  for (; j + 8 <= n; j += 8)
+    {
+      __m256 sum = _mm256_mul_ps (two8, _mm256_loadu_ps (mid + j));
+      sum = _mm256_add_ps (sum, _mm256_loadu_ps (low + j));
+      sum = _mm256_add_ps (sum, _mm256_loadu_ps (high + j));
+      _mm256_storeu_ps (out + j, _mm256_mul_ps (sum, quarter8));
+    }
+#endif
+#if defined(__SSE__)
+  const __m128 two = _mm_set1_ps (2.0f), quarter = _mm_set1_ps (0.25f);
+  for (; j + 4 <= n; j += 4)
+    {
+      __m128 sum = _mm_mul_ps (two, _mm_loadu_ps (mid + j));
+      sum = _mm_add_ps (sum, _mm_loadu_ps (low + j));
+      sum = _mm_add_ps (sum, _mm_loadu_ps (high + j));
+      _mm_storeu_ps (out + j, _mm_mul_ps (sum, quarter));
+    }
+#endif
+  for (; j < n; j++)
+    out[j] = (2 * mid[j] + low[j] + high[j]) * 0.25f;
 }
 
-/* actual denoising algorithm. code copied from UFRaw (originates from dcraw) */
-void
-wavelet_denoise (float *fimg[3], unsigned int width,
-		 unsigned int height, float threshold, double low, float a,
-		 float b)
+/* hat transform of rows [start, end) of in, into out */
+static void
+hat_rows (float *out, float *in, unsigned int width, unsigned int sc,
+	  unsigned int start, unsigned int end)
+{
+  unsigned int row, col, interior;
+
+  /* the neighbours of the columns in [sc, width - sc) are not mirrored */
+  interior = width > 2 * sc ? width - 2 * sc : 0;
+  for (row = start; row < end; row++)
+    {
+      float *base = in + row * width, *temp = out + row * width;
+      for (col = 0; col < sc && col < width; col++)
+	temp[col] = (2 * base[col] + base[hat_low (col, sc)]
+		     + base[hat_high (col, width, sc)]) * 0.25f;
+      if (interior)
+	hat_kernel (temp + sc, base + sc, base, base + 2 * sc, interior);
+      for (col = MAX2 (sc, sc + interior); col < width; col++)
+	temp[col] = (2 * base[col] + base[hat_low (col, sc)]
+		     + base[hat_high (col, width, sc)]) * 0.25f;
+    }
+}
+
+/* hat transform of columns [start, end) of img, in place, COLUMN_BLOCK
+ * columns at a time through temp (height * COLUMN_BLOCK floats) */
+static void
+hat_columns (float *img, unsigned int width, unsigned int height,
+	     unsigned int sc, unsigned int start, unsigned int end,
+	     float *temp)
+{
+  unsigned int col, row, n;
+
+  for (col = start; col < end; col += n)
+    {
+      n = MIN2 (COLUMN_BLOCK, end - col);
+      for (row = 0; row < height; row++)
+	hat_kernel (temp + row * COLUMN_BLOCK, img + row * width + col,
+		    img + hat_low (row, sc) * width + col,
+		    img + hat_high (row, height, sc) * width + col, n);
+      for (row = 0; row < height; row++)
+	memcpy (img + row * width + col, temp + row * COLUMN_BLOCK,
+		n * sizeof (float));
+    }
+}
+
+/* Noise sums are added per row, each row in NOISE_LANES interleaved partial
+ * sums, then the rows in order. This order does not depend on the number of
+ * threads, nor on the strips an image is done in, and the lanes are summed
+ * side by side. */
+#define NOISE_LANES 4
+
+/* band of intensity of a low pass value, the noise of each is estimated
+ * separately: the number of the bounds 0.2, 0.4, 0.6, 0.8 it is above. Each
+ * float bound is the nearest float above the double one, so this is the
+ * same as comparing the value to the double bounds. */
+static inline int
+intensity_band (float value)
+{
+  return (value >= 0.2f) + (value >= 0.4f) + (value >= 0.6f)
+    + (value >= 0.8f);
+}
+
+#if defined(__SSE2__)
+/* masks of the bands of intensity of four low pass values, as
+ * intensity_band () */
+static inline void
+band_masks (__m128 value, __m128 mask[5])
+{
+  __m128 ge2 = _mm_cmpge_ps (value, _mm_set1_ps (0.2f));
+  __m128 ge4 = _mm_cmpge_ps (value, _mm_set1_ps (0.4f));
+  __m128 ge6 = _mm_cmpge_ps (value, _mm_set1_ps (0.6f));
+  __m128 ge8 = _mm_cmpge_ps (value, _mm_set1_ps (0.8f));
+
+  mask[0] = _mm_andnot_ps (ge2, _mm_castsi128_ps (_mm_set1_epi32 (-1)));
+  mask[1] = _mm_andnot_ps (ge4, ge2);
+  mask[2] = _mm_andnot_ps (ge6, ge4);
+  mask[3] = _mm_andnot_ps (ge8, ge6);
+  mask[4] = ge8;
+}
+#endif
+
+/* hpass -= lpass over a row; if sum is not NULL, the squares of the
+ * coefficients below limit are summed in each band */
+static void
+noise_row (float *hpass, const float *lpass, unsigned int width, float limit,
+	   double sum[5], unsigned int samples[5])
+{
+  double acc[5][NOISE_LANES];
+  unsigned int count[5][NOISE_LANES];
+  unsigned int i = 0, k;
+  int band;
+
+  if (!sum)
+    {
+      for (i = 0; i < width; i++)
+	hpass[i] -= lpass[i];
+      return;
+    }
+  memset (acc, 0, sizeof (acc));
+  memset (count, 0, sizeof (count));
+#if defined(__SSE2__)
+  {
+    /* the lanes are the four floats of a vector, the double sums of lanes
+     * 0, 1 in low and of lanes 2, 3 in high */
+    const __m128 above = _mm_set1_ps (limit), below = _mm_set1_ps (-limit);
+    __m128d low[5], high[5];
+    __m128i n[5];
+
+    for (band = 0; band < 5; band++)
+      {
+	low[band] = high[band] = _mm_setzero_pd ();
+	n[band] = _mm_setzero_si128 ();
+      }
+    for (; i + 4 <= width; i += 4)
+      {
+	__m128 l = _mm_loadu_ps (lpass + i), mask[5];
+	__m128 h = _mm_sub_ps (_mm_loadu_ps (hpass + i), l);
+	__m128 small = _mm_and_ps (_mm_cmplt_ps (h, above),
+				   _mm_cmpgt_ps (h, below));
+	__m128 e = _mm_and_ps (_mm_mul_ps (h, h), small);
+
+	_mm_storeu_ps (hpass + i, h);
+	band_masks (l, mask);
+	for (band = 0; band < 5; band++)
+	  {
+	    __m128 eb = _mm_and_ps (e, mask[band]);
+	    low[band] = _mm_add_pd (low[band], _mm_cvtps_pd (eb));
+	    high[band] = _mm_add_pd (high[band],
+				     _mm_cvtps_pd (_mm_movehl_ps (eb, eb)));
+	    /* masks are -1 */
+	    n[band] = _mm_sub_epi32 (n[band], _mm_castps_si128
+				     (_mm_and_ps (small, mask[band])));
+	  }
+      }
+    for (band = 0; band < 5; band++)
+      {
+	_mm_storeu_pd (acc[band], low[band]);
+	_mm_storeu_pd (acc[band] + 2, high[band]);
+	_mm_storeu_si128 ((__m128i *) count[band], n[band]);
+      }
+  }
+#endif
+  for (; i < width; i++)
+    {
+      float h = hpass[i] - lpass[i];
+      int small = h < limit && h > -limit;
+
+      hpass[i] = h;
+      /* the square as before, in float */
+      if (small)
+	{
+	  band = intensity_band (lpass[i]);
+	  acc[band][i % NOISE_LANES] += h * h;
+	  count[band][i % NOISE_LANES]++;
+	}
+    }
+  for (band = 0; band < 5; band++)
+    {
+      sum[band] = 0.0;
+      samples[band] = 0;
+      for (k = 0; k < NOISE_LANES; k++)
+	{
+	  sum[band] += acc[band][k];
+	  samples[band] += count[band][k];
+	}
+    }
+}
+
+/* Thresholds the coefficients of a row with the threshold (thold) and
+ * shrinking (shrink) of the band of each; adds them to plane if not NULL,
+ * then add if not NULL. As before, the arithmetic of a coefficient is done
+ * in double. */
+static void
+threshold_row (float *hpass, const float *lpass, float *plane,
+	       const float *add, unsigned int width, const float thold[5],
+	       const double shrink[5], double low)
+{
+  unsigned int i = 0;
+
+#if defined(__SSE2__)
+  const __m128d factor = _mm_set1_pd (low);
+  __m128 t_band[5];
+  __m128d s_band[5];
+  int band;
+
+  for (band = 0; band < 5; band++)
+    {
+      t_band[band] = _mm_set1_ps (thold[band]);
+      s_band[band] = _mm_set1_pd (shrink[band]);
+    }
+  for (; i + 4 <= width; i += 4)
+    {
+      __m128 h = _mm_loadu_ps (hpass + i), mask[5], t, neg, pos;
+      __m128d d[2], s[2], r[2], lane[2];
+      int half;
+
+      /* select the threshold and shrinking of each lane by its band */
+      band_masks (_mm_loadu_ps (lpass + i), mask);
+      t = _mm_setzero_ps ();
+      s[0] = s[1] = _mm_setzero_pd ();
+      for (band = 0; band < 5; band++)
+	{
+	  t = _mm_or_ps (t, _mm_and_ps (mask[band], t_band[band]));
+	  lane[0] = _mm_castps_pd (_mm_unpacklo_ps (mask[band], mask[band]));
+	  lane[1] = _mm_castps_pd (_mm_unpackhi_ps (mask[band], mask[band]));
+	  s[0] = _mm_or_pd (s[0], _mm_and_pd (lane[0], s_band[band]));
+	  s[1] = _mm_or_pd (s[1], _mm_and_pd (lane[1], s_band[band]));
+	}
+      neg = _mm_cmplt_ps (h, _mm_sub_ps (_mm_setzero_ps (), t));
+      pos = _mm_cmpgt_ps (h, t);
+      d[0] = _mm_cvtps_pd (h);
+      d[1] = _mm_cvtps_pd (_mm_movehl_ps (h, h));
+      for (half = 0; half < 2; half++)
+	{
+	  __m128d n = _mm_castps_pd (half ? _mm_unpackhi_ps (neg, neg)
+				     : _mm_unpacklo_ps (neg, neg));
+	  __m128d p = _mm_castps_pd (half ? _mm_unpackhi_ps (pos, pos)
+				     : _mm_unpacklo_ps (pos, pos));
+	  r[half] = _mm_or_pd (_mm_and_pd (n, _mm_add_pd (d[half], s[half])),
+			       _mm_and_pd (p, _mm_sub_pd (d[half], s[half])));
+	  r[half] = _mm_or_pd (r[half],
+			       _mm_andnot_pd (_mm_or_pd (n, p),
+					      _mm_mul_pd (d[half], factor)));
+	}
+      h = _mm_movelh_ps (_mm_cvtpd_ps (r[0]), _mm_cvtpd_ps (r[1]));
+      _mm_storeu_ps (hpass + i, h);
+      if (plane)
+	{
+	  __m128 p = _mm_add_ps (_mm_loadu_ps (plane + i), h);
+	  if (add)
+	    p = _mm_add_ps (p, _mm_loadu_ps (add + i));
+	  _mm_storeu_ps (plane + i, p);
+	}
+    }
+#endif
+  for (; i < width; i++)
+    {
+      float h = hpass[i], t = thold[intensity_band (lpass[i])];
+      double s = shrink[intensity_band (lpass[i])];
+
+      if (h < -t)
+	h += s;
+      else if (h > t)
+	h -= s;
+      else
+	h *= low;
+      hpass[i] = h;
+      if (plane)
+	plane[i] += h;
+      if (add)
+	plane[i] = plane[i] + add[i];
+    }
+}
+
+/* a share of one pass of the transform, for one thread */
+typedef struct
+{
+  float *out, *in, *temp;
+  unsigned int width, height, sc, start, end;
+  /* passes over the coefficients: hpass is in, lpass out */
+  float *plane, *add, limit, thold[5];
+  double shrink[5], low, (*sum)[5];
+  unsigned int (*samples)[5];
+} pass_job;
+
+static gpointer
+hat_rows_thread (gpointer data)
+{
+  pass_job *job = data;
+  hat_rows (job->out, job->in, job->width, job->sc, job->start, job->end);
+  return NULL;
+}
+
+static gpointer
+hat_columns_thread (gpointer data)
+{
+  pass_job *job = data;
+  hat_columns (job->out, job->width, job->height, job->sc, job->start,
+	       job->end, job->temp);
+  return NULL;
+}
+
+static gpointer
+noise_thread (gpointer data)
+{
+  pass_job *job = data;
+  unsigned int row;
+
+  for (row = job->start; row < job->end; row++)
+    noise_row (job->in + row * job->width, job->out + row * job->width,
+	       job->width, job->limit, job->sum ? job->sum[row] : NULL,
+	       job->samples ? job->samples[row] : NULL);
+  return NULL;
+}
+
+static gpointer
+threshold_thread (gpointer data)
+{
+  pass_job *job = data;
+  unsigned int row, offset;
+
+  for (row = job->start; row < job->end; row++)
+    {
+      offset = row * job->width;
+      threshold_row (job->in + offset, job->out + offset,
+		     job->plane ? job->plane + offset : NULL,
+		     job->add ? job->add + offset : NULL, job->width,
+		     job->thold, job->shrink, job->low);
+    }
+  return NULL;
+}
+
+/* run one pass (rows or columns, count of them) in threads threads, the
+ * calling thread taking the first share */
+static void
+run_pass (GThreadFunc func, pass_job * jobs, int threads, unsigned int count,
+	  unsigned int align)
+{
+  GThread *thread[MAX_THREADS];
+  int t;
+
+  for (t = 0; t < threads; t++)
+    {
+      /* shares are aligned to whole column blocks */
+      jobs[t].start = (guint64) count * t / threads / align * align;
+      jobs[t].end = (guint64) count * (t + 1) / threads / align * align;
+    }
+  jobs[threads - 1].end = count;
+  for (t = 1; t < threads; t++)
+    thread[t] = g_thread_new (NULL, func, &jobs[t]);
+  func (&jobs[0]);
+  for (t = 1; t < threads; t++)
+    g_thread_join (thread[t]);
+}
+
+/* actual denoising algorithm. code copied from UFRaw (originates from dcraw)
+ * fimg[0] is the plane, fimg[1] and fimg[2] scratch planes of its size.
+ * If sums is not NULL, the small coefficients of rows [first, first + rows)
+ * are added to it. If stats is not NULL, the coefficients are thresholded
+ * with the noise estimated from it and the plane is rebuilt, else the plane
+ * is left undefined. Runs in up to max_threads threads, adds height to
+ * *progress (if not NULL) after each step of each of the five levels. Does
+ * not call GIMP, so it may run in any thread. */
+static void
+wavelet_transform (float *fimg[3], unsigned int width, unsigned int height,
+		   float threshold, double low, wavelet_stats * sums,
+		   unsigned int first, unsigned int rows,
+		   const wavelet_stats * stats, int max_threads,
+		   gint * progress)
 {
   float *temp, thold;
-  unsigned int i, lev, lpass, hpass, size, col, row;
-  double stdev[5];
-  unsigned int samples[5];
+  unsigned int row, lev, lpass, hpass;
+  double stdev, (*row_sum)[5];
+  unsigned int (*row_samples)[5];
+  pass_job jobs[MAX_THREADS];
+  int t, threads, band;
 
-  size = width * height;
+  /* not more threads than there are column blocks */
+  threads = CLAMP (max_threads, 1, MAX_THREADS);
+  threads = MIN2 (threads, (int) ((width + COLUMN_BLOCK - 1) / COLUMN_BLOCK));
+  threads = MAX2 (threads, 1);
 
   /* FIXME: replace by GIMP functions */
-  temp = (float *) malloc (MAX2 (width, height) * sizeof (float));
+  temp = (float *) malloc (threads * height * COLUMN_BLOCK * sizeof (float));
+  row_sum = sums ? malloc (height * sizeof (*row_sum)) : NULL;
+  row_samples = sums ? malloc (height * sizeof (*row_samples)) : NULL;
+  for (t = 0; t < threads; t++)
+    {
+      jobs[t].temp = temp + t * height * COLUMN_BLOCK;
+      jobs[t].width = width;
+      jobs[t].height = height;
+      jobs[t].low = low;
+    }
 
-  hpass = 0;
+  hpass = lpass = 0;
   for (lev = 0; lev < 5; lev++)
     {
-      if (b != 0)
-	gimp_progress_update (a + b * lev / 5.0);
       lpass = ((lev & 1) + 1);
-      for (row = 0; row < height; row++)
+      for (t = 0; t < threads; t++)
 	{
-	  hat_transform (temp, fimg[hpass] + row * width, 1, width, 1 << lev);
-	  for (col = 0; col < width; col++)
-	    {
-	      fimg[lpass][row * width + col] = temp[col] * 0.25;
-	    }
+	  jobs[t].out = fimg[lpass];
+	  jobs[t].in = fimg[hpass];
+	  jobs[t].sc = 1 << lev;
 	}
-      if (b != 0)
-	gimp_progress_update (a + b * (lev + 0.25) / 5.0);
-      for (col = 0; col < width; col++)
-	{
-	  hat_transform (temp, fimg[lpass] + col, width, height, 1 << lev);
-	  for (row = 0; row < height; row++)
-	    {
-	      fimg[lpass][row * width + col] = temp[row] * 0.25;
-	    }
-	}
-      if (b != 0)
-	gimp_progress_update (a + b * (lev + 0.5) / 5.0);
+      run_pass (hat_rows_thread, jobs, threads, height, 1);
+      if (progress)
+	g_atomic_int_add (progress, height);
+      run_pass (hat_columns_thread, jobs, threads, width, COLUMN_BLOCK);
+      if (progress)
+	g_atomic_int_add (progress, height);
 
+      /* the coefficients, and their noise in the rows to sum */
       thold =
 	5.0 / (1 << 6) * exp (-2.6 * sqrt (lev + 1)) * 0.8002 / exp (-2.6);
+      for (t = 0; t < threads; t++)
+	{
+	  jobs[t].limit = thold;
+	  jobs[t].sum = row_sum;
+	  jobs[t].samples = row_samples;
+	}
+      run_pass (noise_thread, jobs, threads, height, 1);
+      if (sums)
+	for (row = first; row < first + rows; row++)
+	  for (band = 0; band < 5; band++)
+	    {
+	      sums->sum[lev][band] += row_sum[row][band];
+	      sums->samples[lev][band] += row_samples[row][band];
+	    }
+      if (progress)
+	g_atomic_int_add (progress, height);
 
-      /* initialize stdev values for all intensities */
-      stdev[0] = stdev[1] = stdev[2] = stdev[3] = stdev[4] = 0.0;
-      samples[0] = samples[1] = samples[2] = samples[3] = samples[4] = 0;
+      if (!stats)
+	{
+	  hpass = lpass;
+	  continue;
+	}
 
-      /* calculate stdevs for all intensities */
-      for (i = 0; i < size; i++)
+      /* do thresholding, with the stdevs of all intensities */
+      for (band = 0; band < 5; band++)
 	{
-	  fimg[hpass][i] -= fimg[lpass][i];
-	  if (fimg[hpass][i] < thold && fimg[hpass][i] > -thold)
+	  stdev = sqrt (stats->sum[lev][band]
+			/ (stats->samples[lev][band] + 1));
+	  thold = threshold * stdev;
+	  for (t = 0; t < threads; t++)
 	    {
-	      if (fimg[lpass][i] > 0.8) {
-	        stdev[4] += fimg[hpass][i] * fimg[hpass][i];
-	        samples[4]++;
-	      } else if (fimg[lpass][i] > 0.6) {
-	        stdev[3] += fimg[hpass][i] * fimg[hpass][i];
-	        samples[3]++;
-	      }	else if (fimg[lpass][i] > 0.4) {
-	        stdev[2] += fimg[hpass][i] * fimg[hpass][i];
-	        samples[2]++;
-	      }	else if (fimg[lpass][i] > 0.2) {
-	        stdev[1] += fimg[hpass][i] * fimg[hpass][i];
-	        samples[1]++;
-	      } else {
-	        stdev[0] += fimg[hpass][i] * fimg[hpass][i];
-	        samples[0]++;
-	      }
+	      jobs[t].thold[band] = thold;
+	      jobs[t].shrink[band] = thold - thold * low;
 	    }
 	}
-      stdev[0] = sqrt (stdev[0] / (samples[0] + 1));
-      stdev[1] = sqrt (stdev[1] / (samples[1] + 1));
-      stdev[2] = sqrt (stdev[2] / (samples[2] + 1));
-      stdev[3] = sqrt (stdev[3] / (samples[3] + 1));
-      stdev[4] = sqrt (stdev[4] / (samples[4] + 1));
-
-      if (b != 0)
-	gimp_progress_update (a + b * (lev + 0.75) / 5.0);
-
-      /* do thresholding */
-      for (i = 0; i < size; i++)
+      for (t = 0; t < threads; t++)
 	{
-	  if (fimg[lpass][i] > 0.8) {
-	    thold = threshold * stdev[4];
-	  } else if (fimg[lpass][i] > 0.6) {
-	    thold = threshold * stdev[3];
-	  } else if (fimg[lpass][i] > 0.4) {
-	    thold = threshold * stdev[2];
-	  } else if (fimg[lpass][i] > 0.2) {
-	    thold = threshold * stdev[1];
-	  } else {
-	    thold = threshold * stdev[0];
-	  }
-
-	  if (fimg[hpass][i] < -thold)
-	    fimg[hpass][i] += thold - thold * low;
-	  else if (fimg[hpass][i] > thold)
-	    fimg[hpass][i] -= thold - thold * low;
-	  else
-	    fimg[hpass][i] *= low;
-
-	  if (hpass)
-	    fimg[0][i] += fimg[hpass][i];
+	  jobs[t].plane = hpass ? fimg[0] : NULL;
+	  /* the last low pass is added to the plane with the coefficients */
+	  jobs[t].add = lev == 4 ? fimg[lpass] : NULL;
 	}
+      run_pass (threshold_thread, jobs, threads, height, 1);
+      if (progress)
+	g_atomic_int_add (progress, height);
       hpass = lpass;
     }
 
-  for (i = 0; i < size; i++)
-    fimg[0][i] = fimg[0][i] + fimg[lpass][i];
-
   /* FIXME: replace by GIMP functions */
+  free (row_sum);
+  free (row_samples);
   free (temp);
 }
+
+/* Denoise the plane fimg[0] (fimg[1], fimg[2] are scratch planes of its
+ * size), with the noise of each level estimated from stats, or from the
+ * plane itself if stats is NULL. Adds height to *progress WAVELET_STEPS
+ * times. */
+void
+wavelet_denoise (float *fimg[3], unsigned int width, unsigned int height,
+		 float threshold, double low, const wavelet_stats * stats,
+		 int max_threads, gint * progress)
+{
+  wavelet_stats own;
+
+  if (stats)
+    {
+      wavelet_transform (fimg, width, height, threshold, low, NULL, 0, 0,
+			 stats, max_threads, progress);
+      return;
+    }
+  /* the sums of each level are complete before its thresholding */
+  memset (&own, 0, sizeof (own));
+  wavelet_transform (fimg, width, height, threshold, low, &own, 0, height,
+		     &own, max_threads, progress);
+}
+
+/* Add the noise of rows [first, first + rows) of the plane fimg[0] to
+ * stats, for wavelet_denoise () of a plane too large to be transformed at
+ * once. The planes are left undefined. Adds height to *progress
+ * WAVELET_STATISTICS_STEPS times. */
+void
+wavelet_statistics (float *fimg[3], unsigned int width, unsigned int height,
+		    unsigned int first, unsigned int rows,
+		    wavelet_stats * stats, int max_threads, gint * progress)
+{
+  wavelet_transform (fimg, width, height, 0, 0, stats, first, rows, NULL,
+		     max_threads, progress);
+}